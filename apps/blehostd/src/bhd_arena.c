@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include "syscfg/syscfg.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_util.h"
+#include "bhd_arena.h"
+
+/**
+ * Bump-pointer arena for short-lived allocations, such as the cJSON trees
+ * that are built while a request is decoded.  Individual allocations are
+ * never released; the whole arena is reset once the message has been
+ * processed.  When the arena is exhausted, allocations are served from the
+ * heap instead.
+ *
+ * The arena is not thread safe; it must only be used from the blehostd task.
+ */
+
+#define BHD_ARENA_ALIGN     8
+#define BHD_ARENA_SZ                                                    \
+    ((MYNEWT_VAL(BLEHOSTD_ARENA_SIZE) + BHD_ARENA_ALIGN - 1) &           \
+     ~(BHD_ARENA_ALIGN - 1))
+
+static uint64_t bhd_arena_buf[BHD_ARENA_SZ / sizeof (uint64_t)];
+
+/** Offset of the next free byte. */
+static int bhd_arena_off;
+
+/** Greatest offset reached since startup. */
+static int bhd_arena_hwm;
+
+/** High-water mark most recently written to the log. */
+static int bhd_arena_hwm_logged;
+
+/** Number of heap allocations since the last reset. */
+static int bhd_arena_num_heap;
+
+static int
+bhd_arena_owns(const void *ptr)
+{
+    const uint8_t *u8p;
+
+    u8p = ptr;
+    return u8p >= (const uint8_t *)bhd_arena_buf &&
+           u8p < (const uint8_t *)bhd_arena_buf + BHD_ARENA_SZ;
+}
+
+/**
+ * Allocates memory from the arena, or from the heap if the arena does not
+ * have enough space left.  This function does not fail.
+ */
+void *
+bhd_arena_alloc(size_t num_bytes)
+{
+    size_t padded_len;
+    void *v;
+
+    padded_len = (num_bytes + BHD_ARENA_ALIGN - 1) & ~(BHD_ARENA_ALIGN - 1);
+
+    if (padded_len > BHD_ARENA_SZ - bhd_arena_off) {
+        bhd_arena_num_heap++;
+        return malloc_success(num_bytes);
+    }
+
+    v = (uint8_t *)bhd_arena_buf + bhd_arena_off;
+    bhd_arena_off += padded_len;
+
+    if (bhd_arena_off > bhd_arena_hwm) {
+        bhd_arena_hwm = bhd_arena_off;
+    }
+
+    return v;
+}
+
+/**
+ * Frees memory allocated with bhd_arena_alloc().  Memory belonging to the
+ * arena is only reclaimed when the arena is reset; memory that was allocated
+ * from the heap is freed immediately.
+ */
+void
+bhd_arena_free(void *ptr)
+{
+    if (ptr != NULL && !bhd_arena_owns(ptr)) {
+        free(ptr);
+    }
+}
+
+/**
+ * Releases all memory allocated from the arena.  Any pointers into the arena
+ * become invalid.
+ */
+void
+bhd_arena_reset(void)
+{
+    if (bhd_arena_hwm > bhd_arena_hwm_logged) {
+        BHD_LOG(DEBUG, "arena high-water mark: %d/%d bytes\n",
+                bhd_arena_hwm, BHD_ARENA_SZ);
+        bhd_arena_hwm_logged = bhd_arena_hwm;
+    }
+
+    if (bhd_arena_num_heap > 0) {
+        BHD_LOG(DEBUG, "arena exhausted; heap_allocs=%d arena_sz=%d\n",
+                bhd_arena_num_heap, BHD_ARENA_SZ);
+    }
+
+    bhd_arena_off = 0;
+    bhd_arena_num_heap = 0;
+}
+
+/**
+ * Retrieves the greatest number of arena bytes that have been in use at
+ * once since startup.
+ */
+int
+bhd_arena_high_water(void)
+{
+    return bhd_arena_hwm;
+}
@@ -0,0 +1,11 @@
+#ifndef H_BHD_ARENA_
+#define H_BHD_ARENA_
+
+#include <stddef.h>
+
+void *bhd_arena_alloc(size_t num_bytes);
+void bhd_arena_free(void *ptr);
+void bhd_arena_reset(void);
+int bhd_arena_high_water(void);
+
+#endif
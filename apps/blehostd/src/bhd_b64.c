@@ -0,0 +1,156 @@
+#include <string.h>
+#include "defs/error.h"
+#include "bhd_b64.h"
+
+/**
+ * Base64 codec (RFC 4648, standard alphabet) for byte string fields.
+ */
+
+static const char bhd_b64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/** Value of each base64 digit character; -1 for non-digits. */
+static const int8_t bhd_b64_vals[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/**
+ * Encodes a byte array as padded base64.  The destination must have room for
+ * BHD_B64_ENC_LEN(src_len) characters; the result is not null-terminated.
+ *
+ * @return                      The length of the encoded string.
+ */
+int
+bhd_b64_enc(char *dst, const uint8_t *src, int src_len)
+{
+    uint32_t u24;
+    int off;
+    int i;
+
+    off = 0;
+    for (i = 0; i + 3 <= src_len; i += 3) {
+        u24 = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+        dst[off++] = bhd_b64_digits[(u24 >> 18) & 0x3f];
+        dst[off++] = bhd_b64_digits[(u24 >> 12) & 0x3f];
+        dst[off++] = bhd_b64_digits[(u24 >> 6) & 0x3f];
+        dst[off++] = bhd_b64_digits[u24 & 0x3f];
+    }
+
+    switch (src_len - i) {
+    case 1:
+        u24 = src[i] << 16;
+        dst[off++] = bhd_b64_digits[(u24 >> 18) & 0x3f];
+        dst[off++] = bhd_b64_digits[(u24 >> 12) & 0x3f];
+        dst[off++] = '=';
+        dst[off++] = '=';
+        break;
+
+    case 2:
+        u24 = (src[i] << 16) | (src[i + 1] << 8);
+        dst[off++] = bhd_b64_digits[(u24 >> 18) & 0x3f];
+        dst[off++] = bhd_b64_digits[(u24 >> 12) & 0x3f];
+        dst[off++] = bhd_b64_digits[(u24 >> 6) & 0x3f];
+        dst[off++] = '=';
+        break;
+
+    default:
+        break;
+    }
+
+    return off;
+}
+
+/**
+ * Decodes a base64 string.  Padding is optional.  The destination may be the
+ * source string itself.
+ *
+ * @return                      0 on success;
+ *                              SYS_EINVAL if the string contains more than
+ *                                  max_len bytes;
+ *                              SYS_ERANGE if the string is malformed.
+ */
+int
+bhd_b64_dec(const char *src, int max_len, uint8_t *dst, int *out_len)
+{
+    const uint8_t *u8p;
+    uint32_t u24;
+    int src_len;
+    int len;
+    int rem;
+    int val;
+    int i;
+
+    src_len = strlen(src);
+
+    /* Strip padding. */
+    if (src_len % 4 == 0 && src_len > 0 && src[src_len - 1] == '=') {
+        src_len--;
+        if (src[src_len - 1] == '=') {
+            src_len--;
+        }
+    }
+
+    rem = src_len % 4;
+    if (rem == 1) {
+        return SYS_ERANGE;
+    }
+
+    len = src_len / 4 * 3 + (rem == 0 ? 0 : rem - 1);
+    if (len > max_len) {
+        return SYS_EINVAL;
+    }
+
+    /* Validate before writing anything, in case dst overlaps src. */
+    u8p = (const uint8_t *)src;
+    for (i = 0; i < src_len; i++) {
+        if (bhd_b64_vals[u8p[i]] == -1) {
+            return SYS_ERANGE;
+        }
+    }
+
+    /* Three bytes are written for every four characters read, so the output
+     * never overtakes the input.
+     */
+    len = 0;
+    for (i = 0; i + 4 <= src_len; i += 4) {
+        u24 = (bhd_b64_vals[u8p[i]] << 18) |
+              (bhd_b64_vals[u8p[i + 1]] << 12) |
+              (bhd_b64_vals[u8p[i + 2]] << 6) |
+              bhd_b64_vals[u8p[i + 3]];
+        dst[len++] = u24 >> 16;
+        dst[len++] = u24 >> 8;
+        dst[len++] = u24;
+    }
+
+    if (rem > 0) {
+        u24 = 0;
+        for (; i < src_len; i++) {
+            val = bhd_b64_vals[u8p[i]];
+            u24 = (u24 << 6) | val;
+        }
+        u24 <<= 6 * (4 - rem);
+
+        dst[len++] = u24 >> 16;
+        if (rem == 3) {
+            dst[len++] = u24 >> 8;
+        }
+    }
+
+    *out_len = len;
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef H_BHD_B64_
+#define H_BHD_B64_
+
+#include <inttypes.h>
+
+/** Number of characters needed to encode n bytes, including padding. */
+#define BHD_B64_ENC_LEN(n)          ((((n) + 2) / 3) * 4)
+
+int bhd_b64_enc(char *dst, const uint8_t *src, int src_len);
+int bhd_b64_dec(const char *src, int max_len, uint8_t *dst, int *out_len);
+
+#endif
@@ -0,0 +1,558 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "os/os.h"
+#include "defs/error.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_util.h"
+#include "bhd_cbor.h"
+
+/**
+ * Minimal CBOR (RFC 7049) decoder.  Requests are converted to cJSON trees so
+ * that the request decoders are shared with the JSON wire format.  Outgoing
+ * CBOR messages are produced by the streaming encoder (bhd_enc.c).
+ *
+ * Byte strings are converted to the "0xaa:0xbb" hex string notation accepted
+ * by the JSON accessors, tags are ignored, and undefined is treated as null.
+ */
+
+#define BHD_CBOR_MAX_DEPTH          16
+
+struct bhd_cbor_reader {
+    const uint8_t *buf;
+    int len;
+    int off;
+};
+
+static int bhd_cbor_dec_item(struct bhd_cbor_reader *rdr, int depth,
+                             cJSON **out_item);
+
+static int
+bhd_cbor_read_u8(struct bhd_cbor_reader *rdr, uint8_t *out_u8)
+{
+    if (rdr->off >= rdr->len) {
+        return SYS_ERANGE;
+    }
+
+    *out_u8 = rdr->buf[rdr->off++];
+    return 0;
+}
+
+/**
+ * Reads the initial byte of a data item and its argument.  For indefinite
+ * length items, *out_indef is set and *out_val is left at 0.
+ */
+static int
+bhd_cbor_read_hdr(struct bhd_cbor_reader *rdr, uint8_t *out_major,
+                  uint8_t *out_ai, uint64_t *out_val, int *out_indef)
+{
+    uint8_t ib;
+    int num_bytes;
+    int rc;
+    int i;
+
+    rc = bhd_cbor_read_u8(rdr, &ib);
+    if (rc != 0) {
+        return rc;
+    }
+
+    *out_major = ib >> 5;
+    *out_ai = ib & 0x1f;
+    *out_val = 0;
+    *out_indef = 0;
+
+    if (*out_ai < BHD_CBOR_AI_UINT8) {
+        *out_val = *out_ai;
+        return 0;
+    }
+
+    switch (*out_ai) {
+    case BHD_CBOR_AI_UINT8:
+        num_bytes = 1;
+        break;
+
+    case BHD_CBOR_AI_UINT16:
+        num_bytes = 2;
+        break;
+
+    case BHD_CBOR_AI_UINT32:
+        num_bytes = 4;
+        break;
+
+    case BHD_CBOR_AI_UINT64:
+        num_bytes = 8;
+        break;
+
+    case BHD_CBOR_AI_INDEF:
+        *out_indef = 1;
+        return 0;
+
+    default:
+        return SYS_ERANGE;
+    }
+
+    if (rdr->len - rdr->off < num_bytes) {
+        return SYS_ERANGE;
+    }
+
+    for (i = 0; i < num_bytes; i++) {
+        *out_val = (*out_val << 8) | rdr->buf[rdr->off++];
+    }
+
+    return 0;
+}
+
+static double
+bhd_cbor_half_to_double(uint16_t half)
+{
+    double mant;
+    int exp;
+    double d;
+
+    exp = (half >> 10) & 0x1f;
+    mant = half & 0x3ff;
+
+    if (exp == 0) {
+        /* Subnormal. */
+        d = mant / (1 << 24);
+    } else if (exp != 31) {
+        d = (mant + 1024) * (exp >= 25 ? (double)(1 << (exp - 25)) :
+                                         1.0 / (1 << (25 - exp)));
+    } else {
+        /* Infinity and NaN have no JSON representation. */
+        d = 0;
+    }
+
+    return half & 0x8000 ? -d : d;
+}
+
+/**
+ * Copies a definite length string out of the input buffer, ensuring it is
+ * null terminated.  The caller must free the result.
+ */
+static char *
+bhd_cbor_read_str(struct bhd_cbor_reader *rdr, uint64_t len, int *rc)
+{
+    char *s;
+
+    if (len > rdr->len - rdr->off) {
+        *rc = SYS_ERANGE;
+        return NULL;
+    }
+
+    s = malloc_success(len + 1);
+    memcpy(s, rdr->buf + rdr->off, len);
+    s[len] = '\0';
+    rdr->off += len;
+
+    *rc = 0;
+    return s;
+}
+
+static cJSON *
+bhd_cbor_dec_bytes(struct bhd_cbor_reader *rdr, uint64_t len, int *rc)
+{
+    cJSON *item;
+
+    if (len > rdr->len - rdr->off) {
+        *rc = SYS_ERANGE;
+        return NULL;
+    }
+
+    item = bhd_json_create_byte_string(rdr->buf + rdr->off, len);
+    if (item == NULL) {
+        *rc = SYS_ENOMEM;
+        return NULL;
+    }
+    rdr->off += len;
+
+    *rc = 0;
+    return item;
+}
+
+static int
+bhd_cbor_at_break(struct bhd_cbor_reader *rdr)
+{
+    if (rdr->off < rdr->len && rdr->buf[rdr->off] == BHD_CBOR_BREAK) {
+        rdr->off++;
+        return 1;
+    }
+
+    return 0;
+}
+
+static cJSON *
+bhd_cbor_dec_arr(struct bhd_cbor_reader *rdr, int depth, uint64_t count,
+                 int indef, int *rc)
+{
+    cJSON *child;
+    cJSON *arr;
+
+    /* Every element occupies at least one byte. */
+    if (!indef && count > rdr->len - rdr->off) {
+        *rc = SYS_ERANGE;
+        return NULL;
+    }
+
+    arr = cJSON_CreateArray();
+    if (arr == NULL) {
+        *rc = SYS_ENOMEM;
+        return NULL;
+    }
+
+    while (indef ? !bhd_cbor_at_break(rdr) : count-- > 0) {
+        *rc = bhd_cbor_dec_item(rdr, depth + 1, &child);
+        if (*rc != 0) {
+            cJSON_Delete(arr);
+            return NULL;
+        }
+        cJSON_AddItemToArray(arr, child);
+    }
+
+    *rc = 0;
+    return arr;
+}
+
+static cJSON *
+bhd_cbor_dec_map(struct bhd_cbor_reader *rdr, int depth, uint64_t count,
+                 int indef, int *rc)
+{
+    uint64_t key_len;
+    uint8_t major;
+    cJSON *child;
+    cJSON *obj;
+    uint8_t ai;
+    char *key;
+    int key_indef;
+
+    /* Every entry occupies at least two bytes. */
+    if (!indef && count > (rdr->len - rdr->off) / 2) {
+        *rc = SYS_ERANGE;
+        return NULL;
+    }
+
+    obj = cJSON_CreateObject();
+    if (obj == NULL) {
+        *rc = SYS_ENOMEM;
+        return NULL;
+    }
+
+    while (indef ? !bhd_cbor_at_break(rdr) : count-- > 0) {
+        /* Only text string keys are supported. */
+        *rc = bhd_cbor_read_hdr(rdr, &major, &ai, &key_len, &key_indef);
+        if (*rc == 0 && (major != BHD_CBOR_MT_TEXT || key_indef)) {
+            *rc = SYS_ERANGE;
+        }
+        if (*rc != 0) {
+            goto err;
+        }
+
+        key = bhd_cbor_read_str(rdr, key_len, rc);
+        if (*rc != 0) {
+            goto err;
+        }
+
+        *rc = bhd_cbor_dec_item(rdr, depth + 1, &child);
+        if (*rc != 0) {
+            free(key);
+            goto err;
+        }
+
+        cJSON_AddItemToObject(obj, key, child);
+        free(key);
+    }
+
+    *rc = 0;
+    return obj;
+
+err:
+    cJSON_Delete(obj);
+    return NULL;
+}
+
+static cJSON *
+bhd_cbor_dec_simple(uint8_t ai, uint64_t val, int *rc)
+{
+    uint64_t u64;
+    uint32_t u32;
+    float f;
+    double d;
+
+    *rc = 0;
+
+    switch (ai) {
+    case BHD_CBOR_SIMPLE_FALSE:
+        return cJSON_CreateFalse();
+
+    case BHD_CBOR_SIMPLE_TRUE:
+        return cJSON_CreateTrue();
+
+    case BHD_CBOR_SIMPLE_NULL:
+    case BHD_CBOR_SIMPLE_UNDEF:
+        return cJSON_CreateNull();
+
+    case BHD_CBOR_AI_UINT16:
+        return cJSON_CreateNumber(bhd_cbor_half_to_double(val));
+
+    case BHD_CBOR_AI_UINT32:
+        u32 = val;
+        memcpy(&f, &u32, sizeof f);
+        return cJSON_CreateNumber(f);
+
+    case BHD_CBOR_AI_UINT64:
+        u64 = val;
+        memcpy(&d, &u64, sizeof d);
+        return cJSON_CreateNumber(d);
+
+    default:
+        *rc = SYS_ERANGE;
+        return NULL;
+    }
+}
+
+static int
+bhd_cbor_dec_item(struct bhd_cbor_reader *rdr, int depth, cJSON **out_item)
+{
+    cJSON *item;
+    uint8_t major;
+    uint64_t val;
+    uint8_t ai;
+    char *s;
+    int indef;
+    int rc;
+
+    if (depth > BHD_CBOR_MAX_DEPTH) {
+        return SYS_ERANGE;
+    }
+
+    rc = bhd_cbor_read_hdr(rdr, &major, &ai, &val, &indef);
+    if (rc != 0) {
+        return rc;
+    }
+
+    /* Indefinite length strings are not supported. */
+    if (indef && major != BHD_CBOR_MT_ARR && major != BHD_CBOR_MT_MAP) {
+        return SYS_ERANGE;
+    }
+
+    switch (major) {
+    case BHD_CBOR_MT_UINT:
+        item = cJSON_CreateNumber(val);
+        break;
+
+    case BHD_CBOR_MT_NINT:
+        item = cJSON_CreateNumber(-1.0 - val);
+        break;
+
+    case BHD_CBOR_MT_BYTES:
+        item = bhd_cbor_dec_bytes(rdr, val, &rc);
+        break;
+
+    case BHD_CBOR_MT_TEXT:
+        s = bhd_cbor_read_str(rdr, val, &rc);
+        if (rc != 0) {
+            return rc;
+        }
+        item = cJSON_CreateString(s);
+        free(s);
+        break;
+
+    case BHD_CBOR_MT_ARR:
+        item = bhd_cbor_dec_arr(rdr, depth, val, indef, &rc);
+        break;
+
+    case BHD_CBOR_MT_MAP:
+        item = bhd_cbor_dec_map(rdr, depth, val, indef, &rc);
+        break;
+
+    case BHD_CBOR_MT_TAG:
+        /* Ignore the tag; decode the item it applies to. */
+        return bhd_cbor_dec_item(rdr, depth + 1, out_item);
+
+    default:
+        item = bhd_cbor_dec_simple(ai, val, &rc);
+        break;
+    }
+
+    if (rc != 0) {
+        return rc;
+    }
+    if (item == NULL) {
+        return SYS_ENOMEM;
+    }
+
+    *out_item = item;
+    return 0;
+}
+
+/**
+ * Decodes a single CBOR data item into a newly allocated cJSON tree.  The
+ * item must occupy the entire buffer.
+ *
+ * @return                      0 on success; SYS_E[...] error on failure.
+ */
+int
+bhd_cbor_dec(const uint8_t *buf, int len, cJSON **out_root)
+{
+    struct bhd_cbor_reader rdr;
+    cJSON *root;
+    int rc;
+
+    rdr.buf = buf;
+    rdr.len = len;
+    rdr.off = 0;
+
+    rc = bhd_cbor_dec_item(&rdr, 0, &root);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (rdr.off != rdr.len) {
+        cJSON_Delete(root);
+        return SYS_ERANGE;
+    }
+
+    *out_root = root;
+    return 0;
+}
+
+/**
+ * Advances past a single data item without decoding it.
+ */
+static int
+bhd_cbor_skip_item(struct bhd_cbor_reader *rdr, int depth)
+{
+    uint8_t major;
+    uint64_t val;
+    uint8_t ai;
+    int indef;
+    int rc;
+
+    if (depth > BHD_CBOR_MAX_DEPTH) {
+        return SYS_ERANGE;
+    }
+
+    rc = bhd_cbor_read_hdr(rdr, &major, &ai, &val, &indef);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (indef && major != BHD_CBOR_MT_ARR && major != BHD_CBOR_MT_MAP) {
+        return SYS_ERANGE;
+    }
+
+    switch (major) {
+    case BHD_CBOR_MT_BYTES:
+    case BHD_CBOR_MT_TEXT:
+        if (val > rdr->len - rdr->off) {
+            return SYS_ERANGE;
+        }
+        rdr->off += val;
+        return 0;
+
+    case BHD_CBOR_MT_ARR:
+    case BHD_CBOR_MT_MAP:
+        if (major == BHD_CBOR_MT_MAP && !indef) {
+            if (val > (rdr->len - rdr->off) / 2) {
+                return SYS_ERANGE;
+            }
+            val *= 2;
+        }
+
+        while (indef ? !bhd_cbor_at_break(rdr) : val-- > 0) {
+            rc = bhd_cbor_skip_item(rdr, depth + 1);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        return 0;
+
+    case BHD_CBOR_MT_TAG:
+        return bhd_cbor_skip_item(rdr, depth + 1);
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Looks up a text string member of a top-level CBOR map without decoding
+ * the rest of the message.  This is much cheaper than bhd_cbor_dec(), and
+ * is intended for inspecting a message before it is queued.
+ *
+ * @param key                   The key of the member to look up.
+ * @param dst                   On success, the null-terminated value gets
+ *                                  written here.
+ * @param max_len               The size of dst, including the terminator.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if the map has no such member;
+ *                              SYS_ERANGE if the message is malformed, or
+ *                                  the value is not a string that fits in
+ *                                  dst.
+ */
+int
+bhd_cbor_find_text(const uint8_t *buf, int len, const char *key,
+                   char *dst, int max_len)
+{
+    struct bhd_cbor_reader rdr;
+    uint64_t count;
+    uint64_t val;
+    uint8_t major;
+    uint8_t ai;
+    int map_indef;
+    int key_len;
+    int indef;
+    int rc;
+
+    rdr.buf = buf;
+    rdr.len = len;
+    rdr.off = 0;
+
+    rc = bhd_cbor_read_hdr(&rdr, &major, &ai, &count, &map_indef);
+    if (rc != 0) {
+        return rc;
+    }
+    if (major != BHD_CBOR_MT_MAP) {
+        return SYS_ERANGE;
+    }
+
+    key_len = strlen(key);
+
+    while (map_indef ? !bhd_cbor_at_break(&rdr) : count-- > 0) {
+        rc = bhd_cbor_read_hdr(&rdr, &major, &ai, &val, &indef);
+        if (rc == 0 && (major != BHD_CBOR_MT_TEXT || indef ||
+                        val > rdr.len - rdr.off)) {
+            rc = SYS_ERANGE;
+        }
+        if (rc != 0) {
+            return rc;
+        }
+
+        if (val == key_len && memcmp(rdr.buf + rdr.off, key, key_len) == 0) {
+            rdr.off += val;
+
+            rc = bhd_cbor_read_hdr(&rdr, &major, &ai, &val, &indef);
+            if (rc == 0 && (major != BHD_CBOR_MT_TEXT || indef ||
+                            val >= max_len || val > rdr.len - rdr.off)) {
+                rc = SYS_ERANGE;
+            }
+            if (rc != 0) {
+                return rc;
+            }
+
+            memcpy(dst, rdr.buf + rdr.off, val);
+            dst[val] = '\0';
+            return 0;
+        }
+        rdr.off += val;
+
+        rc = bhd_cbor_skip_item(&rdr, 1);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return SYS_ENOENT;
+}
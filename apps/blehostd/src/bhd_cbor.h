@@ -0,0 +1,37 @@
+#ifndef H_BHD_CBOR_
+#define H_BHD_CBOR_
+
+#include <inttypes.h>
+#include "cjson/cJSON.h"
+
+#define BHD_CBOR_MT_UINT            0
+#define BHD_CBOR_MT_NINT            1
+#define BHD_CBOR_MT_BYTES           2
+#define BHD_CBOR_MT_TEXT            3
+#define BHD_CBOR_MT_ARR             4
+#define BHD_CBOR_MT_MAP             5
+#define BHD_CBOR_MT_TAG             6
+#define BHD_CBOR_MT_SIMPLE          7
+
+#define BHD_CBOR_AI_UINT8           24
+#define BHD_CBOR_AI_UINT16          25
+#define BHD_CBOR_AI_UINT32          26
+#define BHD_CBOR_AI_UINT64          27
+#define BHD_CBOR_AI_INDEF           31
+
+#define BHD_CBOR_FALSE              0xf4
+#define BHD_CBOR_TRUE               0xf5
+#define BHD_CBOR_NULL               0xf6
+#define BHD_CBOR_FLOAT64            0xfb
+#define BHD_CBOR_BREAK              0xff
+
+#define BHD_CBOR_SIMPLE_FALSE       20
+#define BHD_CBOR_SIMPLE_TRUE        21
+#define BHD_CBOR_SIMPLE_NULL        22
+#define BHD_CBOR_SIMPLE_UNDEF       23
+
+int bhd_cbor_dec(const uint8_t *buf, int len, cJSON **out_root);
+int bhd_cbor_find_text(const uint8_t *buf, int len, const char *key,
+                       char *dst, int max_len);
+
+#endif
@@ -0,0 +1,596 @@
+#include <assert.h>
+#include <string.h>
+#include "defs/error.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_util.h"
+#include "bhd_tok.h"
+#include "bhd_dec.h"
+#include "parse.h"
+
+/**
+ * Table-driven request decoder.  Each request type has a table describing
+ * its fields (bhd_dec_field); a single pass over the members of the message
+ * object writes every recognized value directly into the corresponding
+ * member of struct bhd_req.  Unrecognized members are ignored.
+ *
+ * Values are read either from a tokenized JSON document (bhd_tok.c), or from
+ * a cJSON tree for CBOR messages.
+ */
+
+struct bhd_dec_val {
+    /* One of the cJSON_[...] type codes. */
+    int type;
+    double num;
+    char *str;
+};
+
+static void
+bhd_dec_val_from_tok(char *js, const struct bhd_tok *tok,
+                     struct bhd_dec_val *val)
+{
+    int b;
+
+    switch (tok->type) {
+    case BHD_TOK_STR:
+        val->type = cJSON_String;
+        val->str = bhd_tok_str(js, tok);
+        break;
+
+    case BHD_TOK_PRIM:
+        if (bhd_tok_num(js, tok, &val->num) == 0) {
+            val->type = cJSON_Number;
+        } else if (bhd_tok_bool(js, tok, &b) == 0) {
+            val->type = b ? cJSON_True : cJSON_False;
+        } else {
+            val->type = cJSON_NULL;
+        }
+        break;
+
+    case BHD_TOK_ARR:
+        val->type = cJSON_Array;
+        break;
+
+    default:
+        val->type = cJSON_Object;
+        break;
+    }
+}
+
+static void
+bhd_dec_val_from_cjson(const cJSON *item, struct bhd_dec_val *val)
+{
+    val->type = item->type & 0xff;
+    val->num = item->valuedouble;
+    val->str = item->valuestring;
+}
+
+static void
+bhd_dec_val_from_src(const struct bhd_dec_src *src, struct bhd_dec_val *val)
+{
+    if (src->root != NULL) {
+        bhd_dec_val_from_cjson(src->root, val);
+    } else {
+        bhd_dec_val_from_tok(src->js, src->toks + src->tok_idx, val);
+    }
+}
+
+static void
+bhd_dec_store_int(uint8_t *dst, int size, long long int val)
+{
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+
+    switch (size) {
+    case 1:
+        u8 = val;
+        memcpy(dst, &u8, sizeof u8);
+        break;
+
+    case 2:
+        u16 = val;
+        memcpy(dst, &u16, sizeof u16);
+        break;
+
+    case 4:
+        u32 = val;
+        memcpy(dst, &u32, sizeof u32);
+        break;
+
+    case 8:
+        u64 = val;
+        memcpy(dst, &u64, sizeof u64);
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+static int
+bhd_dec_uuid(const struct bhd_dec_val *val, ble_uuid_any_t *dst)
+{
+    switch (val->type) {
+    case cJSON_Number:
+        /* 16-bit UUID. */
+        if (val->num < 1 || val->num > 0xffff) {
+            return SYS_ERANGE;
+        }
+        dst->u.type = BLE_UUID_TYPE_16;
+        dst->u16.value = val->num;
+        return 0;
+
+    case cJSON_String:
+        /* 128-bit UUID. */
+        return bhd_uuid_str_parse(val->str, dst);
+
+    default:
+        return SYS_ERANGE;
+    }
+}
+
+static int bhd_dec_apply(const struct bhd_dec_src *src,
+                         const struct bhd_dec_field *field,
+                         const struct bhd_dec_val *val, uint8_t *base);
+
+/**
+ * Decodes an array of integers or key-value strings into a fixed-size array
+ * member.  The number of elements is written to the field's length member.
+ */
+static int
+bhd_dec_arr(const struct bhd_dec_src *arr, const struct bhd_dec_field *field,
+            uint8_t *dst, uint8_t *base)
+{
+    struct bhd_dec_field elem_field;
+    struct bhd_dec_src elem;
+    struct bhd_dec_val val;
+    int num_elems;
+    int rc;
+    int i;
+
+    num_elems = bhd_dec_arr_len(arr);
+    if (num_elems < 0 || num_elems > field->max_len) {
+        return SYS_ERANGE;
+    }
+
+    elem_field = *field;
+    elem_field.off = 0;
+    if (field->type == BHD_DEC_T_INT_ARR) {
+        elem_field.type = BHD_DEC_T_INT;
+    } else {
+        elem_field.type = BHD_DEC_T_KV;
+    }
+
+    if (num_elems > 0) {
+        bhd_dec_arr_first(arr, &elem);
+    }
+
+    for (i = 0; i < num_elems; i++) {
+        bhd_dec_val_from_src(&elem, &val);
+        rc = bhd_dec_apply(&elem, &elem_field, &val, dst + i * field->size);
+        if (rc != 0) {
+            return rc;
+        }
+
+        if (i + 1 < num_elems) {
+            bhd_dec_arr_next(&elem);
+        }
+    }
+
+    memcpy(base + field->len_off, &num_elems, sizeof num_elems);
+    return 0;
+}
+
+/**
+ * Decodes a single value into the destination member.  The source describes
+ * the value itself; it is only needed for arrays and byte strings.
+ */
+static int
+bhd_dec_apply(const struct bhd_dec_src *src,
+              const struct bhd_dec_field *field,
+              const struct bhd_dec_val *val, uint8_t *base)
+{
+    uint8_t *dst;
+    int num;
+    int len;
+    int rc;
+
+    dst = base + field->off;
+
+    switch (field->type) {
+    case BHD_DEC_T_INT:
+        if (val->type != cJSON_Number ||
+            val->num < field->minval || val->num > field->maxval) {
+
+            return SYS_ERANGE;
+        }
+        bhd_dec_store_int(dst, field->size, val->num);
+        return 0;
+
+    case BHD_DEC_T_BOOL:
+        if (val->type != cJSON_True && val->type != cJSON_False) {
+            return SYS_ERANGE;
+        }
+        bhd_dec_store_int(dst, field->size, val->type == cJSON_True);
+        return 0;
+
+    case BHD_DEC_T_KV:
+        if (val->type != cJSON_String) {
+            return SYS_ERANGE;
+        }
+        num = field->parse_cb(val->str);
+        if (num == -1) {
+            return SYS_ERANGE;
+        }
+        bhd_dec_store_int(dst, field->size, num);
+        return 0;
+
+    case BHD_DEC_T_ADDR:
+        if (val->type != cJSON_String) {
+            return SYS_ERANGE;
+        }
+        return parse_arg_mac(val->str, dst);
+
+    case BHD_DEC_T_UUID:
+        return bhd_dec_uuid(val, (ble_uuid_any_t *)dst);
+
+    case BHD_DEC_T_BYTES:
+        if (val->type != cJSON_String) {
+            return SYS_ERANGE;
+        }
+        rc = bhd_data_dec(src->data_enc, val->str, field->max_len, dst,
+                          &len);
+        if (rc != 0) {
+            return rc;
+        }
+        memcpy(base + field->len_off, &len, sizeof len);
+        return 0;
+
+    case BHD_DEC_T_BYTES_REF:
+        if (val->type != cJSON_String) {
+            return SYS_ERANGE;
+        }
+
+        /* Each decoded byte occupies more than one character of text, so the
+         * bytes can safely overwrite the string they are parsed from.
+         */
+        rc = bhd_data_dec(src->data_enc, val->str, field->max_len,
+                          (uint8_t *)val->str, &len);
+        if (rc != 0) {
+            return rc;
+        }
+        memcpy(dst, &val->str, sizeof val->str);
+        memcpy(base + field->len_off, &len, sizeof len);
+        return 0;
+
+    case BHD_DEC_T_INT_ARR:
+    case BHD_DEC_T_KV_ARR:
+        if (val->type != cJSON_Array) {
+            return SYS_ERANGE;
+        }
+        return bhd_dec_arr(src, field, dst, base);
+
+    default:
+        assert(0);
+        return SYS_EINVAL;
+    }
+}
+
+static int
+bhd_dec_field_find(const struct bhd_dec_field *fields,
+                   const char *key, int key_len)
+{
+    int i;
+
+    for (i = 0; fields[i].name != NULL; i++) {
+        if (strncmp(fields[i].name, key, key_len) == 0 &&
+            fields[i].name[key_len] == '\0') {
+
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int
+bhd_dec_tok_obj(const struct bhd_dec_src *src,
+                const struct bhd_dec_field *fields,
+                struct bhd_req *req, const char **out_err_msg,
+                uint32_t *out_seen)
+{
+    const struct bhd_tok *obj;
+    const struct bhd_tok *key;
+    const struct bhd_tok *val_tok;
+    struct bhd_dec_src val_src;
+    struct bhd_dec_val val;
+    int key_idx;
+    int fi;
+    int rc;
+    int i;
+
+    obj = src->toks + src->tok_idx;
+    if (obj->type != BHD_TOK_OBJ) {
+        /* Treat as empty; required fields are reported as missing. */
+        return 0;
+    }
+
+    key_idx = src->tok_idx + 1;
+    for (i = 0; i < obj->size; i++) {
+        key = src->toks + key_idx;
+        val_tok = key + 1;
+
+        fi = bhd_dec_field_find(fields, src->js + key->start,
+                                key->end - key->start);
+        if (fi != -1) {
+            val_src = *src;
+            val_src.tok_idx = val_tok - src->toks;
+            bhd_dec_val_from_tok(src->js, val_tok, &val);
+            rc = bhd_dec_apply(&val_src, fields + fi, &val, (uint8_t *)req);
+            if (rc != 0) {
+                *out_err_msg = fields[fi].err_msg;
+                return rc;
+            }
+            *out_seen |= 1UL << fi;
+        }
+
+        key_idx = val_tok->next;
+    }
+
+    return 0;
+}
+
+static int
+bhd_dec_cjson_obj(const struct bhd_dec_src *src,
+                  const struct bhd_dec_field *fields,
+                  struct bhd_req *req, const char **out_err_msg,
+                  uint32_t *out_seen)
+{
+    struct bhd_dec_src val_src;
+    struct bhd_dec_val val;
+    const cJSON *item;
+    int fi;
+    int rc;
+
+    if ((src->root->type & 0xff) != cJSON_Object) {
+        return 0;
+    }
+
+    cJSON_ArrayForEach(item, src->root) {
+        fi = bhd_dec_field_find(fields, item->string, strlen(item->string));
+        if (fi != -1) {
+            val_src = *src;
+            val_src.root = item;
+            bhd_dec_val_from_cjson(item, &val);
+            rc = bhd_dec_apply(&val_src, fields + fi, &val, (uint8_t *)req);
+            if (rc != 0) {
+                *out_err_msg = fields[fi].err_msg;
+                return rc;
+            }
+            *out_seen |= 1UL << fi;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Decodes the members of a message object into a request, as described by
+ * the specified field table.  Members that do not appear in the table are
+ * ignored.  Members of type "bytes ref" are decoded in place, so the source
+ * must remain valid for as long as the request is in use.
+ *
+ * @param out_err_msg           On failure, points to a description of the
+ *                                  offending field.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if a required field is missing;
+ *                              other nonzero on invalid field value.
+ */
+int
+bhd_dec_obj(const struct bhd_dec_src *src,
+            const struct bhd_dec_field *fields,
+            struct bhd_req *req, const char **out_err_msg)
+{
+    uint32_t seen;
+    int rc;
+    int i;
+
+    seen = 0;
+
+    if (src->root != NULL) {
+        rc = bhd_dec_cjson_obj(src, fields, req, out_err_msg, &seen);
+    } else {
+        rc = bhd_dec_tok_obj(src, fields, req, out_err_msg, &seen);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (i = 0; fields[i].name != NULL; i++) {
+        assert(i < BHD_DEC_MAX_FIELDS);
+
+        if (!(seen & (1UL << i)) && !(fields[i].flags & BHD_DEC_F_OPT)) {
+            *out_err_msg = fields[i].err_msg;
+            return SYS_ENOENT;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Looks up a member of the message object by name.
+ *
+ * @param out_member            On success, describes the member's value.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if the object has no such member.
+ */
+int
+bhd_dec_member(const struct bhd_dec_src *src, const char *name,
+               struct bhd_dec_src *out_member)
+{
+    const struct bhd_tok *obj;
+    const struct bhd_tok *key;
+    const cJSON *item;
+    int key_idx;
+    int i;
+
+    *out_member = *src;
+
+    if (src->root != NULL) {
+        item = cJSON_GetObjectItem(src->root, name);
+        if (item == NULL) {
+            return SYS_ENOENT;
+        }
+        out_member->root = item;
+        return 0;
+    }
+
+    obj = src->toks + src->tok_idx;
+    if (obj->type != BHD_TOK_OBJ) {
+        return SYS_ENOENT;
+    }
+
+    key_idx = src->tok_idx + 1;
+    for (i = 0; i < obj->size; i++) {
+        key = src->toks + key_idx;
+        if (bhd_tok_eq(src->js, key, name, strlen(name))) {
+            out_member->tok_idx = key_idx + 1;
+            return 0;
+        }
+        key_idx = key[1].next;
+    }
+
+    return SYS_ENOENT;
+}
+
+/**
+ * Retrieves the number of elements in an array.
+ *
+ * @return                      The number of elements on success;
+ *                              SYS_ERANGE if the value is not an array.
+ */
+int
+bhd_dec_arr_len(const struct bhd_dec_src *arr)
+{
+    const struct bhd_tok *tok;
+
+    if (arr->root != NULL) {
+        if ((arr->root->type & 0xff) != cJSON_Array) {
+            return SYS_ERANGE;
+        }
+        return bhd_arr_len(arr->root);
+    }
+
+    tok = arr->toks + arr->tok_idx;
+    if (tok->type != BHD_TOK_ARR) {
+        return SYS_ERANGE;
+    }
+    return tok->size;
+}
+
+/**
+ * Points a source at the first element of a non-empty array.
+ */
+void
+bhd_dec_arr_first(const struct bhd_dec_src *arr, struct bhd_dec_src *elem)
+{
+    *elem = *arr;
+
+    if (arr->root != NULL) {
+        elem->root = arr->root->child;
+    } else {
+        elem->tok_idx = arr->tok_idx + 1;
+    }
+}
+
+/**
+ * Advances a source to the next element of its array.  The caller must not
+ * advance past the last element.
+ */
+void
+bhd_dec_arr_next(struct bhd_dec_src *elem)
+{
+    if (elem->root != NULL) {
+        elem->root = elem->root->next;
+    } else {
+        elem->tok_idx = elem->toks[elem->tok_idx].next;
+    }
+}
+
+/**
+ * Builds a cJSON tree from a tokenized JSON document.  This is used for
+ * requests whose structure cannot be described by a field table.  String
+ * tokens are converted in place.
+ *
+ * @return                      The root of the new tree on success;
+ *                              NULL on memory exhaustion.
+ */
+cJSON *
+bhd_dec_tok_to_cjson(char *js, const struct bhd_tok *toks, int tok_idx)
+{
+    const struct bhd_tok *tok;
+    cJSON *child;
+    cJSON *item;
+    double num;
+    char *key;
+    int child_idx;
+    int b;
+    int i;
+
+    tok = toks + tok_idx;
+
+    switch (tok->type) {
+    case BHD_TOK_OBJ:
+    case BHD_TOK_ARR:
+        if (tok->type == BHD_TOK_OBJ) {
+            item = cJSON_CreateObject();
+        } else {
+            item = cJSON_CreateArray();
+        }
+        if (item == NULL) {
+            return NULL;
+        }
+
+        key = NULL;
+        child_idx = tok_idx + 1;
+        for (i = 0; i < tok->size; i++) {
+            if (tok->type == BHD_TOK_OBJ) {
+                key = bhd_tok_str(js, toks + child_idx);
+                child_idx++;
+            }
+
+            child = bhd_dec_tok_to_cjson(js, toks, child_idx);
+            if (child == NULL) {
+                cJSON_Delete(item);
+                return NULL;
+            }
+
+            if (tok->type == BHD_TOK_OBJ) {
+                cJSON_AddItemToObject(item, key, child);
+            } else {
+                cJSON_AddItemToArray(item, child);
+            }
+
+            child_idx = toks[child_idx].next;
+        }
+        return item;
+
+    case BHD_TOK_STR:
+        return cJSON_CreateString(bhd_tok_str(js, tok));
+
+    default:
+        if (bhd_tok_num(js, tok, &num) == 0) {
+            return cJSON_CreateNumber(num);
+        }
+        if (bhd_tok_bool(js, tok, &b) == 0) {
+            return b ? cJSON_CreateTrue() : cJSON_CreateFalse();
+        }
+        return cJSON_CreateNull();
+    }
+}
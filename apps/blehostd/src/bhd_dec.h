@@ -0,0 +1,210 @@
+#ifndef H_BHD_DEC_
+#define H_BHD_DEC_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "cjson/cJSON.h"
+#include "bhd_util.h"
+struct bhd_req;
+struct bhd_tok;
+
+#define BHD_DEC_T_INT               1
+#define BHD_DEC_T_BOOL              2
+#define BHD_DEC_T_KV                3
+#define BHD_DEC_T_ADDR              4
+#define BHD_DEC_T_UUID              5
+#define BHD_DEC_T_BYTES             6
+#define BHD_DEC_T_BYTES_REF         7
+#define BHD_DEC_T_INT_ARR           8
+#define BHD_DEC_T_KV_ARR            9
+
+/** The field may be absent from the message. */
+#define BHD_DEC_F_OPT               0x01
+
+/** Maximum number of fields in a single table. */
+#define BHD_DEC_MAX_FIELDS          32
+
+/**
+ * Describes how one member of a message object is decoded into a struct
+ * bhd_req.  A table of fields is terminated by an entry with a NULL name.
+ */
+struct bhd_dec_field {
+    const char *name;
+    uint8_t type;
+    uint8_t flags;
+
+    /** Size of the destination member, in bytes.  For arrays, the size of
+     *  one element.
+     */
+    uint8_t size;
+
+    /** Offset of the destination member within struct bhd_req. */
+    uint16_t off;
+
+    /** Byte strings and arrays: offset of the int that receives the
+     *  length.
+     */
+    uint16_t len_off;
+
+    /** Byte strings: maximum number of bytes.  Arrays: maximum number of
+     *  elements.
+     */
+    int max_len;
+
+    /** Integers: permitted range. */
+    long long int minval;
+    long long int maxval;
+
+    /** Key-value strings: maps the string to an integer. */
+    bhd_kv_parse_fn *parse_cb;
+
+    /** Error message reported if the field is missing or invalid. */
+    const char *err_msg;
+};
+
+/**
+ * The object that fields are decoded from: either a tokenized JSON document
+ * or a cJSON tree.  If root is non-NULL, the cJSON tree is used.
+ */
+struct bhd_dec_src {
+    char *js;
+    const struct bhd_tok *toks;
+    int tok_idx;
+
+    const cJSON *root;
+
+    /** Encoding of byte string fields (BHD_DATA_ENC_[...]). */
+    int data_enc;
+};
+
+#define BHD_DEC_MEMBER_SZ(member_)                                      \
+    sizeof ((struct bhd_req *)0)->member_
+
+#define BHD_DEC_INT(name_, member_, minval_, maxval_, flags_)           \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_INT,                                          \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .minval = (minval_),                                            \
+        .maxval = (maxval_),                                            \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+#define BHD_DEC_BOOL(name_, member_, flags_)                            \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_BOOL,                                         \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+#define BHD_DEC_KV(name_, member_, parse_cb_, flags_)                   \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_KV,                                           \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .parse_cb = (parse_cb_),                                        \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+#define BHD_DEC_ADDR(name_, member_, flags_)                            \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_ADDR,                                         \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+#define BHD_DEC_UUID(name_, member_, flags_)                            \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_UUID,                                         \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+/** Hex string decoded into a fixed-size array. */
+#define BHD_DEC_BYTES(name_, member_, len_member_, flags_)              \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_BYTES,                                        \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .len_off = offsetof(struct bhd_req, len_member_),               \
+        .max_len = BHD_DEC_MEMBER_SZ(member_),                          \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+/**
+ * Hex string decoded in place, within the message being decoded.  The
+ * destination member is a pointer to the decoded bytes; it remains valid
+ * until the message is freed.
+ */
+#define BHD_DEC_BYTES_REF(name_, member_, len_member_, max_len_, flags_) \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_BYTES_REF,                                    \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_),                             \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .len_off = offsetof(struct bhd_req, len_member_),               \
+        .max_len = (max_len_),                                          \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+/** Array of integers decoded into a fixed-size array. */
+#define BHD_DEC_INT_ARR(name_, member_, len_member_, minval_, maxval_,   \
+                        flags_)                                         \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_INT_ARR,                                      \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_[0]),                          \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .len_off = offsetof(struct bhd_req, len_member_),               \
+        .max_len = BHD_DEC_MEMBER_SZ(member_) /                         \
+                   BHD_DEC_MEMBER_SZ(member_[0]),                       \
+        .minval = (minval_),                                            \
+        .maxval = (maxval_),                                            \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+/** Array of key-value strings decoded into a fixed-size integer array. */
+#define BHD_DEC_KV_ARR(name_, member_, len_member_, parse_cb_, flags_)  \
+    {                                                                   \
+        .name = (name_),                                                \
+        .type = BHD_DEC_T_KV_ARR,                                       \
+        .flags = (flags_),                                              \
+        .size = BHD_DEC_MEMBER_SZ(member_[0]),                          \
+        .off = offsetof(struct bhd_req, member_),                       \
+        .len_off = offsetof(struct bhd_req, len_member_),               \
+        .max_len = BHD_DEC_MEMBER_SZ(member_) /                         \
+                   BHD_DEC_MEMBER_SZ(member_[0]),                       \
+        .parse_cb = (parse_cb_),                                        \
+        .err_msg = "invalid " name_,                                    \
+    }
+
+int bhd_dec_obj(const struct bhd_dec_src *src,
+                const struct bhd_dec_field *fields,
+                struct bhd_req *req, const char **out_err_msg);
+int bhd_dec_member(const struct bhd_dec_src *src, const char *name,
+                   struct bhd_dec_src *out_member);
+int bhd_dec_arr_len(const struct bhd_dec_src *arr);
+void bhd_dec_arr_first(const struct bhd_dec_src *arr,
+                       struct bhd_dec_src *elem);
+void bhd_dec_arr_next(struct bhd_dec_src *elem);
+cJSON *bhd_dec_tok_to_cjson(char *js, const struct bhd_tok *toks,
+                            int tok_idx);
+
+#endif
@@ -0,0 +1,469 @@
+#include <assert.h>
+#include <string.h>
+#include "os/os.h"
+#include "defs/error.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_util.h"
+#include "bhd_cbor.h"
+#include "bhd_enc.h"
+#include "bhd_hex.h"
+#include "bhd_b64.h"
+
+static const char bhd_enc_hex_digits[] = "0123456789abcdef";
+
+void
+bhd_enc_init(struct bhd_enc *enc, struct os_mbuf *om, int fmt, int data_enc)
+{
+    memset(enc, 0, sizeof *enc);
+    enc->om = om;
+    enc->fmt = fmt;
+    enc->data_enc = data_enc;
+}
+
+static void
+bhd_enc_write(struct bhd_enc *enc, const void *data, int len)
+{
+    int rc;
+
+    if (enc->rc != 0) {
+        return;
+    }
+
+    rc = os_mbuf_append(enc->om, data, len);
+    if (rc != 0) {
+        enc->rc = SYS_ENOMEM;
+    }
+}
+
+static void
+bhd_enc_write_u8(struct bhd_enc *enc, uint8_t u8)
+{
+    bhd_enc_write(enc, &u8, 1);
+}
+
+static void
+bhd_enc_cbor_hdr(struct bhd_enc *enc, uint8_t major, uint64_t val)
+{
+    uint8_t buf[9];
+    int len;
+    int i;
+
+    if (val < BHD_CBOR_AI_UINT8) {
+        buf[0] = (major << 5) | val;
+        len = 1;
+    } else if (val <= UINT8_MAX) {
+        buf[0] = (major << 5) | BHD_CBOR_AI_UINT8;
+        len = 2;
+    } else if (val <= UINT16_MAX) {
+        buf[0] = (major << 5) | BHD_CBOR_AI_UINT16;
+        len = 3;
+    } else if (val <= UINT32_MAX) {
+        buf[0] = (major << 5) | BHD_CBOR_AI_UINT32;
+        len = 5;
+    } else {
+        buf[0] = (major << 5) | BHD_CBOR_AI_UINT64;
+        len = 9;
+    }
+
+    for (i = len - 1; i > 0; i--) {
+        buf[i] = val;
+        val >>= 8;
+    }
+
+    bhd_enc_write(enc, buf, len);
+}
+
+/**
+ * Writes a JSON string body, escaping characters as necessary.  The
+ * surrounding quotes are not written.
+ */
+static void
+bhd_enc_json_escape(struct bhd_enc *enc, const char *s, int len)
+{
+    char esc[6];
+    uint8_t c;
+    int start;
+    int i;
+
+    start = 0;
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        bhd_enc_write(enc, s + start, i - start);
+        start = i + 1;
+
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            bhd_enc_write(enc, esc, 2);
+        } else {
+            esc[0] = '\\';
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = bhd_enc_hex_digits[c >> 4];
+            esc[5] = bhd_enc_hex_digits[c & 0x0f];
+            bhd_enc_write(enc, esc, 6);
+        }
+    }
+
+    bhd_enc_write(enc, s + start, i - start);
+}
+
+static void
+bhd_enc_text(struct bhd_enc *enc, const char *s, int len)
+{
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_TEXT, len);
+        bhd_enc_write(enc, s, len);
+    } else {
+        bhd_enc_write_u8(enc, '"');
+        bhd_enc_json_escape(enc, s, len);
+        bhd_enc_write_u8(enc, '"');
+    }
+}
+
+/**
+ * Writes the separator and key that precede an element.
+ */
+static void
+bhd_enc_key(struct bhd_enc *enc, const char *name)
+{
+    uint8_t bit;
+
+    bit = 1 << enc->depth;
+
+    if (enc->fmt != BHD_MSG_FMT_CBOR && enc->nonempty & bit) {
+        bhd_enc_write_u8(enc, ',');
+    }
+    enc->nonempty |= bit;
+
+    if (name != NULL) {
+        bhd_enc_text(enc, name, strlen(name));
+        if (enc->fmt != BHD_MSG_FMT_CBOR) {
+            bhd_enc_write_u8(enc, ':');
+        }
+    }
+}
+
+static void
+bhd_enc_open(struct bhd_enc *enc, const char *name, char json_c,
+             uint8_t cbor_major)
+{
+    bhd_enc_key(enc, name);
+
+    if (enc->depth >= BHD_ENC_MAX_DEPTH - 1) {
+        if (enc->rc == 0) {
+            enc->rc = SYS_ERANGE;
+        }
+        return;
+    }
+
+    /* Containers are encoded with indefinite length in CBOR; the number of
+     * elements is not known in advance.
+     */
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_write_u8(enc, (cbor_major << 5) | BHD_CBOR_AI_INDEF);
+    } else {
+        bhd_enc_write_u8(enc, json_c);
+    }
+
+    enc->depth++;
+    enc->nonempty &= ~(1 << enc->depth);
+}
+
+static void
+bhd_enc_close(struct bhd_enc *enc, char json_c)
+{
+    if (enc->depth == 0) {
+        if (enc->rc == 0) {
+            enc->rc = SYS_ERANGE;
+        }
+        return;
+    }
+
+    enc->depth--;
+
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_write_u8(enc, BHD_CBOR_BREAK);
+    } else {
+        bhd_enc_write_u8(enc, json_c);
+    }
+}
+
+void
+bhd_enc_open_obj(struct bhd_enc *enc, const char *name)
+{
+    bhd_enc_open(enc, name, '{', BHD_CBOR_MT_MAP);
+}
+
+void
+bhd_enc_close_obj(struct bhd_enc *enc)
+{
+    bhd_enc_close(enc, '}');
+}
+
+void
+bhd_enc_open_arr(struct bhd_enc *enc, const char *name)
+{
+    bhd_enc_open(enc, name, '[', BHD_CBOR_MT_ARR);
+}
+
+void
+bhd_enc_close_arr(struct bhd_enc *enc)
+{
+    bhd_enc_close(enc, ']');
+}
+
+void
+bhd_enc_int(struct bhd_enc *enc, const char *name, intmax_t val)
+{
+    char buf[24];
+    uintmax_t u;
+    int off;
+
+    bhd_enc_key(enc, name);
+
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        if (val >= 0) {
+            bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_UINT, val);
+        } else {
+            bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_NINT, -1 - val);
+        }
+        return;
+    }
+
+    u = val < 0 ? -(uintmax_t)val : (uintmax_t)val;
+
+    off = sizeof buf;
+    do {
+        buf[--off] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (val < 0) {
+        buf[--off] = '-';
+    }
+
+    bhd_enc_write(enc, buf + off, sizeof buf - off);
+}
+
+void
+bhd_enc_bool(struct bhd_enc *enc, const char *name, int val)
+{
+    bhd_enc_key(enc, name);
+
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_write_u8(enc, val ? BHD_CBOR_TRUE : BHD_CBOR_FALSE);
+    } else if (val) {
+        bhd_enc_write(enc, "true", 4);
+    } else {
+        bhd_enc_write(enc, "false", 5);
+    }
+}
+
+void
+bhd_enc_strn(struct bhd_enc *enc, const char *name, const char *val, int len)
+{
+    bhd_enc_key(enc, name);
+    bhd_enc_text(enc, val, len);
+}
+
+void
+bhd_enc_str(struct bhd_enc *enc, const char *name, const char *val)
+{
+    bhd_enc_strn(enc, name, val, strlen(val));
+}
+
+/**
+ * Encodes a byte array as a string of the form "0xaa:0xbb:0xcc".
+ */
+static void
+bhd_enc_bytes_hex(struct bhd_enc *enc, const uint8_t *data, int len)
+{
+    char buf[BHD_HEX_CHARS_PER_BYTE * 64];
+    int chunk_len;
+    int str_len;
+    int off;
+
+    str_len = len == 0 ? 0 : len * BHD_HEX_CHARS_PER_BYTE - 1;
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_TEXT, str_len);
+    } else {
+        bhd_enc_write_u8(enc, '"');
+    }
+
+    for (off = 0; off < len; off += chunk_len) {
+        chunk_len = len - off;
+        if (chunk_len > sizeof buf / BHD_HEX_CHARS_PER_BYTE) {
+            chunk_len = sizeof buf / BHD_HEX_CHARS_PER_BYTE;
+        }
+
+        str_len = bhd_hex_enc(buf, data + off, chunk_len);
+        if (off + chunk_len < len) {
+            /* More bytes follow; keep the separator. */
+            str_len++;
+        }
+        bhd_enc_write(enc, buf, str_len);
+    }
+
+    if (enc->fmt != BHD_MSG_FMT_CBOR) {
+        bhd_enc_write_u8(enc, '"');
+    }
+}
+
+/**
+ * Encodes a byte array as a base64 string.
+ */
+static void
+bhd_enc_bytes_b64(struct bhd_enc *enc, const uint8_t *data, int len)
+{
+    char buf[BHD_B64_ENC_LEN(48 * 3)];
+    int chunk_len;
+    int str_len;
+    int off;
+
+    if (enc->fmt == BHD_MSG_FMT_CBOR) {
+        bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_TEXT, BHD_B64_ENC_LEN(len));
+    } else {
+        bhd_enc_write_u8(enc, '"');
+    }
+
+    /* Chunks are a multiple of three bytes so that padding only appears at
+     * the end.
+     */
+    for (off = 0; off < len; off += chunk_len) {
+        chunk_len = len - off;
+        if (chunk_len > 48 * 3) {
+            chunk_len = 48 * 3;
+        }
+
+        str_len = bhd_b64_enc(buf, data + off, chunk_len);
+        bhd_enc_write(enc, buf, str_len);
+    }
+
+    if (enc->fmt != BHD_MSG_FMT_CBOR) {
+        bhd_enc_write_u8(enc, '"');
+    }
+}
+
+/**
+ * Encodes a byte array in the encoder's data encoding: a hex string of the
+ * form "0xaa:0xbb:0xcc", a base64 string, or (CBOR only) a byte string.  JSON
+ * cannot carry raw bytes, so raw falls back to base64 there.
+ */
+void
+bhd_enc_bytes(struct bhd_enc *enc, const char *name,
+              const uint8_t *data, int len)
+{
+    assert(len >= 0);
+
+    bhd_enc_key(enc, name);
+
+    switch (enc->data_enc) {
+    case BHD_DATA_ENC_RAW:
+        if (enc->fmt == BHD_MSG_FMT_CBOR) {
+            bhd_enc_cbor_hdr(enc, BHD_CBOR_MT_BYTES, len);
+            bhd_enc_write(enc, data, len);
+        } else {
+            bhd_enc_bytes_b64(enc, data, len);
+        }
+        break;
+
+    case BHD_DATA_ENC_BASE64:
+        bhd_enc_bytes_b64(enc, data, len);
+        break;
+
+    default:
+        bhd_enc_bytes_hex(enc, data, len);
+        break;
+    }
+}
+
+void
+bhd_enc_addr(struct bhd_enc *enc, const char *name, const uint8_t *addr)
+{
+    char valstr[18];
+
+    bhd_enc_str(enc, name, bhd_addr_str(valstr, addr));
+}
+
+void
+bhd_enc_uuid(struct bhd_enc *enc, const char *name, const ble_uuid_t *uuid)
+{
+    char valstr[BLE_UUID_STR_LEN];
+
+    switch (uuid->type) {
+    case BLE_UUID_TYPE_16:
+        bhd_enc_int(enc, name, BLE_UUID16(uuid)->value);
+        break;
+
+    case BLE_UUID_TYPE_32:
+        bhd_enc_int(enc, name, BLE_UUID32(uuid)->value);
+        break;
+
+    case BLE_UUID_TYPE_128:
+        bhd_enc_str(enc, name, ble_uuid_to_str(uuid, valstr));
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void
+bhd_enc_uuid128_bytes(struct bhd_enc *enc, const char *name,
+                      const uint8_t *uuid128_bytes)
+{
+    ble_uuid128_t uuid128;
+
+    uuid128.u.type = BLE_UUID_TYPE_128;
+    memcpy(uuid128.value, uuid128_bytes, sizeof uuid128.value);
+
+    bhd_enc_uuid(enc, name, &uuid128.u);
+}
+
+/**
+ * Encodes a string from a key-value map.  The element is omitted if the value
+ * has no string representation.
+ */
+static void
+bhd_enc_kv(struct bhd_enc *enc, const char *name, const char *valstr)
+{
+    if (valstr != NULL) {
+        bhd_enc_str(enc, name, valstr);
+    }
+}
+
+void
+bhd_enc_addr_type(struct bhd_enc *enc, const char *name, uint8_t addr_type)
+{
+    bhd_enc_kv(enc, name, bhd_addr_type_rev_parse(addr_type));
+}
+
+void
+bhd_enc_adv_event_type(struct bhd_enc *enc, const char *name,
+                       uint8_t adv_event_type)
+{
+    bhd_enc_kv(enc, name, bhd_adv_event_type_rev_parse(adv_event_type));
+}
+
+void
+bhd_enc_gatt_access_op(struct bhd_enc *enc, const char *name,
+                       uint8_t gatt_access_op)
+{
+    bhd_enc_kv(enc, name, bhd_gatt_access_op_rev_parse(gatt_access_op));
+}
+
+void
+bhd_enc_sm_passkey_action(struct bhd_enc *enc, const char *name,
+                          uint8_t sm_passkey_action)
+{
+    bhd_enc_kv(enc, name,
+               bhd_sm_passkey_action_rev_parse(sm_passkey_action));
+}
@@ -0,0 +1,62 @@
+#ifndef H_BHD_ENC_
+#define H_BHD_ENC_
+
+#include <inttypes.h>
+#include "host/ble_uuid.h"
+struct os_mbuf;
+
+#define BHD_ENC_MAX_DEPTH       8
+
+/**
+ * Streaming message encoder.  Writes the JSON or CBOR representation of a
+ * message directly into an mbuf chain as fields are added.
+ *
+ * Errors are sticky: once a write fails, all subsequent writes are no-ops and
+ * the first error is retained in the rc field.
+ *
+ * For each "add" function, name is the key of the element in the enclosing
+ * object.  It must be NULL if the enclosing container is an array.
+ */
+struct bhd_enc {
+    struct os_mbuf *om;
+    int fmt;
+
+    /** Encoding of byte strings (BHD_DATA_ENC_[...]). */
+    int data_enc;
+
+    int rc;
+    uint8_t depth;
+
+    /** Bit n is set if the container at depth n has at least one element. */
+    uint8_t nonempty;
+};
+
+void bhd_enc_init(struct bhd_enc *enc, struct os_mbuf *om, int fmt,
+                  int data_enc);
+void bhd_enc_open_obj(struct bhd_enc *enc, const char *name);
+void bhd_enc_close_obj(struct bhd_enc *enc);
+void bhd_enc_open_arr(struct bhd_enc *enc, const char *name);
+void bhd_enc_close_arr(struct bhd_enc *enc);
+void bhd_enc_int(struct bhd_enc *enc, const char *name, intmax_t val);
+void bhd_enc_bool(struct bhd_enc *enc, const char *name, int val);
+void bhd_enc_str(struct bhd_enc *enc, const char *name, const char *val);
+void bhd_enc_strn(struct bhd_enc *enc, const char *name, const char *val,
+                  int len);
+void bhd_enc_bytes(struct bhd_enc *enc, const char *name,
+                   const uint8_t *data, int len);
+void bhd_enc_addr(struct bhd_enc *enc, const char *name,
+                  const uint8_t *addr);
+void bhd_enc_uuid(struct bhd_enc *enc, const char *name,
+                  const ble_uuid_t *uuid);
+void bhd_enc_uuid128_bytes(struct bhd_enc *enc, const char *name,
+                           const uint8_t *uuid128_bytes);
+void bhd_enc_addr_type(struct bhd_enc *enc, const char *name,
+                       uint8_t addr_type);
+void bhd_enc_adv_event_type(struct bhd_enc *enc, const char *name,
+                            uint8_t adv_event_type);
+void bhd_enc_gatt_access_op(struct bhd_enc *enc, const char *name,
+                            uint8_t gatt_access_op);
+void bhd_enc_sm_passkey_action(struct bhd_enc *enc, const char *name,
+                               uint8_t sm_passkey_action);
+
+#endif
@@ -0,0 +1,415 @@
+#include <assert.h>
+#include <string.h>
+#include "syscfg/syscfg.h"
+#include "os/os.h"
+#include "host/ble_hs.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_util.h"
+#include "bhd_evtq.h"
+#include "defs/error.h"
+
+/**
+ * Flow control for outgoing events.  While the transmit queue holds fewer
+ * than BLEHOSTD_TXQ_HWM messages, every event is queued.  Once the queue
+ * reaches the high-water mark, high-rate events are limited according to
+ * their type:
+ *     o scan_evt: Merged into a queued report from the same advertiser if
+ *       one is known (see BLEHOSTD_SCAN_EVT_COALESCE_SLOTS); dropped
+ *       otherwise.
+ *     o notify_rx_evt: Queued while fewer than BLEHOSTD_NOTIFY_RX_EVT_MAX
+ *       are outstanding; dropped otherwise.
+ *     o All other events: Always queued.
+ * Responses do not pass through here and are never dropped.
+ *
+ * Once the queue has drained to half the high-water mark, a dropped_evt
+ * tells the client how many events it missed.
+ *
+ * Independently of queue depth, each client's event filter (set with a
+ * subscribe request) decides which unsolicited events it receives.
+ */
+
+#define BHD_EVTQ_HWM                MYNEWT_VAL(BLEHOSTD_TXQ_HWM)
+#define BHD_EVTQ_LWM                (BHD_EVTQ_HWM / 2)
+#define BHD_EVTQ_NOTIFY_RX_MAX      MYNEWT_VAL(BLEHOSTD_NOTIFY_RX_EVT_MAX)
+#define BHD_EVTQ_SCAN_SLOTS         MYNEWT_VAL(BLEHOSTD_SCAN_EVT_COALESCE_SLOTS)
+
+/** A queued scan report that later reports can be merged into. */
+struct bhd_evtq_scan_slot {
+    ble_addr_t addr;
+    uint32_t msg_id;
+    struct os_mbuf *om;
+};
+
+#if BHD_EVTQ_SCAN_SLOTS > 0
+static struct bhd_evtq_scan_slot bhd_evtq_scan_slots[BHD_EVTQ_SCAN_SLOTS];
+static int bhd_evtq_scan_slot_next;
+#endif
+
+/** Slot that the scan report being sent gets merged into; NULL if none. */
+static struct bhd_evtq_scan_slot *bhd_evtq_scan_merge;
+
+/**
+ * IDs of the most recently queued notify_rx events, oldest first.  An event
+ * stays outstanding until every copy has been sent, including copies waiting
+ * in clients' bulk queues.  The transmit queue is sent in order, but a slow
+ * bulk channel can hold an older event after newer ones have gone out; such
+ * an event keeps the newer ones counted until it is sent, so the count never
+ * falls short.
+ */
+static uint32_t bhd_evtq_notify_rx_ids[BHD_EVTQ_NOTIFY_RX_MAX];
+static int bhd_evtq_notify_rx_head;
+static int bhd_evtq_notify_rx_len;
+
+/** Events discarded since the last dropped_evt. */
+static struct bhd_dropped_evt bhd_evtq_drops;
+
+static int
+bhd_evtq_above_hwm(void)
+{
+    return blehostd_msg_queue_len() >= BHD_EVTQ_HWM;
+}
+
+/**
+ * Forgets the oldest notify_rx events once they have been sent, and returns
+ * the number still outstanding.
+ */
+static int
+bhd_evtq_notify_rx_outstanding(void)
+{
+    uint32_t id;
+
+    while (bhd_evtq_notify_rx_len > 0) {
+        id = bhd_evtq_notify_rx_ids[bhd_evtq_notify_rx_head];
+        if (blehostd_msg_is_queued(id)) {
+            break;
+        }
+
+        bhd_evtq_notify_rx_head =
+            (bhd_evtq_notify_rx_head + 1) % BHD_EVTQ_NOTIFY_RX_MAX;
+        bhd_evtq_notify_rx_len--;
+    }
+
+    return bhd_evtq_notify_rx_len;
+}
+
+static void
+bhd_evtq_notify_rx_record(uint32_t id)
+{
+    int idx;
+
+    if (bhd_evtq_notify_rx_len >= BHD_EVTQ_NOTIFY_RX_MAX) {
+        /* Overwrite the oldest entry. */
+        bhd_evtq_notify_rx_head =
+            (bhd_evtq_notify_rx_head + 1) % BHD_EVTQ_NOTIFY_RX_MAX;
+        bhd_evtq_notify_rx_len--;
+    }
+
+    idx = (bhd_evtq_notify_rx_head + bhd_evtq_notify_rx_len) %
+          BHD_EVTQ_NOTIFY_RX_MAX;
+    bhd_evtq_notify_rx_ids[idx] = id;
+    bhd_evtq_notify_rx_len++;
+}
+
+static struct bhd_evtq_scan_slot *
+bhd_evtq_scan_find(const ble_addr_t *addr)
+{
+#if BHD_EVTQ_SCAN_SLOTS > 0
+    struct bhd_evtq_scan_slot *slot;
+    int i;
+
+    for (i = 0; i < BHD_EVTQ_SCAN_SLOTS; i++) {
+        slot = bhd_evtq_scan_slots + i;
+        if (slot->om != NULL &&
+            blehostd_msg_is_queued(slot->msg_id) &&
+            ble_addr_cmp(&slot->addr, addr) == 0) {
+
+            return slot;
+        }
+    }
+#endif
+
+    return NULL;
+}
+
+static void
+bhd_evtq_scan_record(const ble_addr_t *addr, uint32_t id,
+                     struct os_mbuf *om)
+{
+#if BHD_EVTQ_SCAN_SLOTS > 0
+    struct bhd_evtq_scan_slot *slot;
+
+    slot = bhd_evtq_scan_find(addr);
+    if (slot == NULL) {
+        slot = bhd_evtq_scan_slots + bhd_evtq_scan_slot_next;
+        bhd_evtq_scan_slot_next =
+            (bhd_evtq_scan_slot_next + 1) % BHD_EVTQ_SCAN_SLOTS;
+    }
+
+    slot->addr = *addr;
+    slot->msg_id = id;
+    slot->om = om;
+#endif
+}
+
+/**
+ * Decides whether an event should be sent, according to the current depth
+ * of the transmit queue.  A discarded event is counted towards the next
+ * dropped_evt.
+ *
+ * @return                      1 if the event should be encoded and passed
+ *                                  to bhd_evtq_put();
+ *                              0 if the event was dropped.
+ */
+int
+bhd_evtq_admit(const struct bhd_evt *evt)
+{
+    bhd_evtq_scan_merge = NULL;
+
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_SCAN_EVT:
+        if (!bhd_evtq_above_hwm()) {
+            return 1;
+        }
+
+        bhd_evtq_scan_merge = bhd_evtq_scan_find(&evt->scan.addr);
+        if (bhd_evtq_scan_merge != NULL) {
+            bhd_evtq_drops.num_scan_coalesced++;
+            return 1;
+        }
+
+        bhd_evtq_drops.num_scan++;
+        return 0;
+
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+        if (!bhd_evtq_above_hwm() ||
+            bhd_evtq_notify_rx_outstanding() < BHD_EVTQ_NOTIFY_RX_MAX) {
+
+            return 1;
+        }
+
+        bhd_evtq_drops.num_notify_rx++;
+        return 0;
+
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Queues an encoded event for transmit.  The event must have been accepted
+ * by the preceding call to bhd_evtq_admit().  The mbuf is consumed.
+ */
+int
+bhd_evtq_put(const struct bhd_evt *evt, struct os_mbuf *om)
+{
+    struct bhd_evtq_scan_slot *merge;
+    uint32_t id;
+    int rc;
+
+    BHD_LOG(DEBUG, "Sending event over UDS (%d bytes)\n",
+            OS_MBUF_PKTLEN(om));
+
+    merge = bhd_evtq_scan_merge;
+    bhd_evtq_scan_merge = NULL;
+
+    if (merge != NULL) {
+        rc = blehostd_replace_msg(merge->msg_id, merge->om, om, &id);
+    } else {
+        rc = blehostd_enqueue_msg_id(om, &id);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_SCAN_EVT:
+        if (merge != NULL && id == merge->msg_id) {
+            /* The new report now lives in the original message. */
+            om = merge->om;
+        }
+        bhd_evtq_scan_record(&evt->scan.addr, id, om);
+        break;
+
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+        bhd_evtq_notify_rx_record(id);
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends a dropped_evt if any events have been discarded and the transmit
+ * queue has drained below the low-water mark.
+ */
+void
+bhd_evtq_report_drops(void)
+{
+    struct bhd_evt evt;
+    int rc;
+
+    if (bhd_evtq_drops.num_scan == 0 &&
+        bhd_evtq_drops.num_scan_coalesced == 0 &&
+        bhd_evtq_drops.num_notify_rx == 0) {
+
+        return;
+    }
+
+    if (blehostd_msg_queue_len() > BHD_EVTQ_LWM) {
+        return;
+    }
+
+    memset(&evt, 0, sizeof evt);
+    evt.hdr.op = BHD_MSG_OP_EVT;
+    evt.hdr.type = BHD_MSG_TYPE_DROPPED_EVT;
+    evt.hdr.seq = bhd_next_evt_seq();
+    evt.dropped = bhd_evtq_drops;
+
+    rc = bhd_evt_send(&evt);
+    if (rc == 0) {
+        memset(&bhd_evtq_drops, 0, sizeof bhd_evtq_drops);
+    }
+}
+
+static int
+bhd_evtq_conn_handle(const struct bhd_evt *evt, uint16_t *out_handle)
+{
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_CONNECT_EVT:
+        *out_handle = evt->connect.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_DISCONNECT_EVT:
+        *out_handle = evt->disconnect.desc.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_DISC_SVC_EVT:
+        *out_handle = evt->disc_svc.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_DISC_CHR_EVT:
+        *out_handle = evt->disc_chr.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_DISC_DSC_EVT:
+        *out_handle = evt->disc_dsc.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_WRITE_ACK_EVT:
+        *out_handle = evt->write_ack.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+        *out_handle = evt->notify_rx.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_MTU_CHANGE_EVT:
+        *out_handle = evt->mtu_change.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_ENC_CHANGE_EVT:
+        *out_handle = evt->enc_change.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_ACCESS_EVT:
+        *out_handle = evt->access.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_PASSKEY_EVT:
+        *out_handle = evt->passkey.conn_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_SUBSCRIBE_EVT:
+        *out_handle = evt->subscribe.conn_handle;
+        return 0;
+
+    default:
+        return SYS_ENOENT;
+    }
+}
+
+static int
+bhd_evtq_attr_handle(const struct bhd_evt *evt, uint16_t *out_handle)
+{
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_WRITE_ACK_EVT:
+        *out_handle = evt->write_ack.attr_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+        *out_handle = evt->notify_rx.attr_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_ACCESS_EVT:
+        *out_handle = evt->access.att_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_INDICATE_DONE_EVT:
+        *out_handle = evt->indicate_done.attr_handle;
+        return 0;
+
+    case BHD_MSG_TYPE_SUBSCRIBE_EVT:
+        *out_handle = evt->subscribe.attr_handle;
+        return 0;
+
+    default:
+        return SYS_ENOENT;
+    }
+}
+
+static int
+bhd_evtq_handle_listed(const uint16_t *handles, int num_handles,
+                       uint16_t handle)
+{
+    int i;
+
+    for (i = 0; i < num_handles; i++) {
+        if (handles[i] == handle) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Indicates whether an event passes a client's event filter.  This is
+ * checked before the event is encoded, so that events nobody wants cost
+ * nothing to discard.
+ */
+int
+bhd_evtq_match(const struct bhd_evt_filter *filter,
+               const struct bhd_evt *evt)
+{
+    uint16_t handle;
+    int idx;
+
+    idx = evt->hdr.type - BHD_MSG_TYPE_EVT_BASE;
+    assert(idx >= 0 && idx < 32);
+
+    if (filter->evt_types != 0 && !(filter->evt_types & (1UL << idx))) {
+        return 0;
+    }
+
+    if (filter->num_conn_handles > 0 &&
+        bhd_evtq_conn_handle(evt, &handle) == 0 &&
+        !bhd_evtq_handle_listed(filter->conn_handles,
+                                filter->num_conn_handles, handle)) {
+
+        return 0;
+    }
+
+    if (filter->num_attr_handles > 0 &&
+        bhd_evtq_attr_handle(evt, &handle) == 0 &&
+        !bhd_evtq_handle_listed(filter->attr_handles,
+                                filter->num_attr_handles, handle)) {
+
+        return 0;
+    }
+
+    return 1;
+}
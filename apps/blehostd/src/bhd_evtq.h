@@ -0,0 +1,14 @@
+#ifndef H_BHD_EVTQ_
+#define H_BHD_EVTQ_
+
+struct bhd_evt;
+struct bhd_evt_filter;
+struct os_mbuf;
+
+int bhd_evtq_admit(const struct bhd_evt *evt);
+int bhd_evtq_put(const struct bhd_evt *evt, struct os_mbuf *om);
+void bhd_evtq_report_drops(void);
+int bhd_evtq_match(const struct bhd_evt_filter *filter,
+                   const struct bhd_evt *evt);
+
+#endif
@@ -3,20 +3,111 @@
 #include "blehostd.h"
 #include "bhd_proto.h"
 #include "bhd_gap.h"
+#include "bhd_gattc.h"
+#include "bhd_gatts.h"
 #include "bhd_util.h"
 #include "defs/error.h"
 #include "nimble/ble.h"
 #include "host/ble_hs.h"
 
+/**
+ * The request that created each open connection.  Connection events are
+ * routed back to the client that sent it.
+ */
+struct bhd_gap_conn_src {
+    struct bhd_evt_src src;
+    uint16_t conn_handle;
+    uint8_t in_use;
+};
+
+static struct bhd_gap_conn_src
+    bhd_gap_conn_srcs[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+
+/**
+ * Sources of the current scan, advertising and connect procedures.  The
+ * host allows one of each at a time; the callback arg of each procedure
+ * points at the matching entry.
+ */
+static struct bhd_evt_src bhd_gap_disc_src;
+static struct bhd_evt_src bhd_gap_adv_src;
+static struct bhd_evt_src bhd_gap_conn_init_src;
+
+/** Source of events that no request asked for. */
+static const struct bhd_evt_src bhd_gap_no_src;
+
+static void
+bhd_gap_conn_src_add(uint16_t conn_handle, const struct bhd_evt_src *src)
+{
+    struct bhd_gap_conn_src *entry;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        entry = bhd_gap_conn_srcs + i;
+        if (!entry->in_use) {
+            entry->src = *src;
+            entry->conn_handle = conn_handle;
+            entry->in_use = 1;
+            return;
+        }
+    }
+}
+
+static struct bhd_gap_conn_src *
+bhd_gap_conn_src_find(uint16_t conn_handle)
+{
+    struct bhd_gap_conn_src *entry;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        entry = bhd_gap_conn_srcs + i;
+        if (entry->in_use && entry->conn_handle == conn_handle) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static const struct bhd_evt_src *
+bhd_gap_conn_src(uint16_t conn_handle)
+{
+    struct bhd_gap_conn_src *entry;
+
+    entry = bhd_gap_conn_src_find(conn_handle);
+    if (entry == NULL) {
+        return &bhd_gap_no_src;
+    }
+
+    return &entry->src;
+}
+
+/**
+ * Points a procedure source at the request being processed.  Returns the
+ * previous contents so the caller can restore them if the host rejects the
+ * procedure (e.g., because one is already in progress).
+ */
+static struct bhd_evt_src
+bhd_gap_proc_src_set(struct bhd_evt_src *src, const struct bhd_req *req)
+{
+    struct bhd_evt_src prev;
+
+    prev = *src;
+    src->seq = req->hdr.seq;
+    src->client_id = blehostd_cur_client_id();
+
+    return prev;
+}
+
 static int
-bhd_gap_send_connect_evt(int status, uint16_t conn_handle, bhd_seq_t seq)
+bhd_gap_send_connect_evt(int status, uint16_t conn_handle,
+                         const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_CONNECT_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
     evt.connect.status = status;
     evt.connect.conn_handle = conn_handle;
 
@@ -31,14 +122,14 @@ bhd_gap_send_connect_evt(int status, uint16_t conn_handle, bhd_seq_t seq)
 static int
 bhd_gap_send_disconnect_evt(int reason,
                             const struct ble_gap_conn_desc *desc,
-                            bhd_seq_t seq)
+                            const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_DISCONNECT_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
     evt.disconnect.reason = reason;
     evt.disconnect.desc = *desc;
 
@@ -53,6 +144,26 @@ bhd_gap_send_disconnect_evt(int reason,
     return 0;
 }
 
+static int
+bhd_gap_send_subscribe_evt(const struct ble_gap_event *event,
+                           const struct bhd_evt_src *src)
+{
+    struct bhd_evt evt = {{0}};
+
+    evt.hdr.op = BHD_MSG_OP_EVT;
+    evt.hdr.type = BHD_MSG_TYPE_SUBSCRIBE_EVT;
+    bhd_evt_set_src(&evt, src);
+    evt.subscribe.conn_handle = event->subscribe.conn_handle;
+    evt.subscribe.attr_handle = event->subscribe.attr_handle;
+    evt.subscribe.reason = event->subscribe.reason;
+    evt.subscribe.prev_notify = event->subscribe.prev_notify;
+    evt.subscribe.cur_notify = event->subscribe.cur_notify;
+    evt.subscribe.prev_indicate = event->subscribe.prev_indicate;
+    evt.subscribe.cur_indicate = event->subscribe.cur_indicate;
+
+    return bhd_evt_send(&evt);
+}
+
 static int
 bhd_gap_send_notify_rx_evt(uint16_t conn_handle,
                            uint16_t attr_handle,
@@ -81,7 +192,8 @@ bhd_gap_send_notify_rx_evt(uint16_t conn_handle,
 }
 
 static int
-bhd_gap_send_scan_evt(const struct ble_gap_disc_desc *desc, bhd_seq_t seq)
+bhd_gap_send_scan_evt(const struct ble_gap_disc_desc *desc,
+                      const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     struct ble_hs_adv_fields fields;
@@ -90,7 +202,7 @@ bhd_gap_send_scan_evt(const struct ble_gap_disc_desc *desc, bhd_seq_t seq)
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_SCAN_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
 
     evt.scan.event_type = desc->event_type;
     evt.scan.length_data = desc->length_data;
@@ -194,14 +306,14 @@ bhd_gap_send_scan_evt(const struct ble_gap_disc_desc *desc, bhd_seq_t seq)
 }
 
 static int
-bhd_gap_send_scan_tmo_evt(bhd_seq_t seq)
+bhd_gap_send_scan_tmo_evt(const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_SCAN_TMO_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
 
     BHD_LOG(INFO, "scan_tmo\n");
 
@@ -214,14 +326,14 @@ bhd_gap_send_scan_tmo_evt(bhd_seq_t seq)
 }
 
 static int
-bhd_gap_send_adv_complete_evt(int reason, bhd_seq_t seq)
+bhd_gap_send_adv_complete_evt(int reason, const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_ADV_COMPLETE_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
     evt.adv_complete.reason = reason;
 
     rc = bhd_evt_send(&evt);
@@ -233,14 +345,15 @@ bhd_gap_send_adv_complete_evt(int reason, bhd_seq_t seq)
 }
 
 static int
-bhd_gap_send_enc_change_evt(int status, uint16_t conn_handle, bhd_seq_t seq)
+bhd_gap_send_enc_change_evt(int status, uint16_t conn_handle,
+                            const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_ENC_CHANGE_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
     evt.enc_change.conn_handle = conn_handle;
     evt.enc_change.status = status;
 
@@ -257,14 +370,15 @@ bhd_gap_send_enc_change_evt(int status, uint16_t conn_handle, bhd_seq_t seq)
 
 static int
 bhd_gap_send_passkey_action_evt(uint16_t conn_handle, uint8_t action,
-                                uint32_t numcmp, bhd_seq_t seq)
+                                uint32_t numcmp,
+                                const struct bhd_evt_src *src)
 {
     struct bhd_evt evt = {{0}};
     int rc;
 
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_PASSKEY_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
     evt.passkey.conn_handle = conn_handle;
     evt.passkey.action = action;
     evt.passkey.numcmp = numcmp;
@@ -284,38 +398,58 @@ static int
 bhd_gap_event(struct ble_gap_event *event, void *arg)
 {
     uint8_t buf[BLE_ATT_ATTR_MAX_LEN];
+    const struct bhd_evt_src *src;
+    struct bhd_gap_conn_src *entry;
     struct ble_gap_conn_desc desc;
-    bhd_seq_t seq;
     uint16_t attr_len;
+    uint8_t flags;
     int rc;
 
-    seq = (bhd_seq_t)(uintptr_t)arg;
+    src = arg;
+    if (src == NULL) {
+        src = &bhd_gap_no_src;
+    }
 
     switch (event->type) {
     case BLE_GAP_EVENT_DISC:
-        bhd_gap_send_scan_evt(&event->disc, seq);
+        bhd_gap_send_scan_evt(&event->disc, src);
         return 0;
 
     case BLE_GAP_EVENT_DISC_COMPLETE:
-        bhd_gap_send_scan_tmo_evt(seq);
+        bhd_gap_send_scan_tmo_evt(src);
         return 0;
 
     case BLE_GAP_EVENT_CONNECT:
         /* A new connection was established or a connection attempt failed. */
+        if (event->connect.status == 0) {
+            bhd_gap_conn_src_add(event->connect.conn_handle, src);
+        }
         bhd_gap_send_connect_evt(event->connect.status,
                                  event->connect.conn_handle,
-                                 seq);
+                                 src);
         return 0;
 
     case BLE_GAP_EVENT_DISCONNECT:
+        bhd_gatts_conn_broken(event->disconnect.conn.conn_handle);
+        bhd_gattc_conn_broken(event->disconnect.conn.conn_handle);
+        entry = bhd_gap_conn_src_find(event->disconnect.conn.conn_handle);
+        if (entry != NULL) {
+            src = &entry->src;
+        } else {
+            src = &bhd_gap_no_src;
+        }
         bhd_gap_send_disconnect_evt(event->disconnect.reason,
                                     &event->disconnect.conn,
-                                    seq);
+                                    src);
+        if (entry != NULL) {
+            entry->in_use = 0;
+        }
         return 0;
 
     case BLE_GAP_EVENT_MTU:
         if (event->mtu.channel_id == BLE_L2CAP_CID_ATT) {
-            bhd_send_mtu_changed(seq, event->mtu.conn_handle, 0,
+            src = bhd_gap_conn_src(event->mtu.conn_handle);
+            bhd_send_mtu_changed(src, event->mtu.conn_handle, 0,
                                  event->mtu.value);
         }
         return 0;
@@ -333,21 +467,45 @@ bhd_gap_event(struct ble_gap_event *event, void *arg)
                                    buf, attr_len);
         return 0;
 
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        flags = 0;
+        if (event->subscribe.cur_notify) {
+            flags |= BHD_GATTS_SUB_F_NOTIFY;
+        }
+        if (event->subscribe.cur_indicate) {
+            flags |= BHD_GATTS_SUB_F_INDICATE;
+        }
+        bhd_gatts_sub_update(event->subscribe.conn_handle,
+                             event->subscribe.attr_handle, flags);
+        src = bhd_gap_conn_src(event->subscribe.conn_handle);
+        bhd_gap_send_subscribe_evt(event, src);
+        return 0;
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (event->notify_tx.indication) {
+            bhd_gattc_indicate_tx(event->notify_tx.conn_handle,
+                                  event->notify_tx.attr_handle,
+                                  event->notify_tx.status);
+        }
+        return 0;
+
     case BLE_GAP_EVENT_ADV_COMPLETE:
-        bhd_gap_send_adv_complete_evt(0, seq);
+        bhd_gap_send_adv_complete_evt(0, src);
         return 0;
 
     case BLE_GAP_EVENT_ENC_CHANGE:
+        src = bhd_gap_conn_src(event->enc_change.conn_handle);
         bhd_gap_send_enc_change_evt(event->enc_change.status,
                                     event->enc_change.conn_handle,
-                                    seq);
+                                    src);
         return 0;
 
     case BLE_GAP_EVENT_PASSKEY_ACTION:
+        src = bhd_gap_conn_src(event->passkey.conn_handle);
         bhd_gap_send_passkey_action_evt(event->passkey.conn_handle,
                                         event->passkey.params.action,
                                         event->passkey.params.numcmp,
-                                        seq);
+                                        src);
         return 0;
 
     case BLE_GAP_EVENT_REPEAT_PAIRING:
@@ -374,6 +532,7 @@ bhd_gap_event(struct ble_gap_event *event, void *arg)
 static int
 bhd_gap_conn_initiate(const struct bhd_req *req)
 {
+    struct bhd_evt_src prev;
     int rc;
 
     struct ble_gap_conn_params params = {
@@ -406,12 +565,16 @@ bhd_gap_conn_initiate(const struct bhd_req *req)
             params.min_ce_len,
             params.max_ce_len);
 
+    prev = bhd_gap_proc_src_set(&bhd_gap_conn_init_src, req);
     rc = ble_gap_connect(req->connect.own_addr_type,
                          &req->connect.peer_addr,
                          req->connect.duration_ms,
                          &params,
                          bhd_gap_event,
-                         bhd_seq_arg(req->hdr.seq));
+                         &bhd_gap_conn_init_src);
+    if (rc != 0) {
+        bhd_gap_conn_init_src = prev;
+    }
 
     return rc;
 }
@@ -439,6 +602,7 @@ bhd_gap_conn_cancel(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 void
 bhd_gap_scan(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
+    struct bhd_evt_src prev;
     const struct ble_gap_disc_params params = {
         .itvl = req->scan.itvl,
         .window = req->scan.window,
@@ -448,11 +612,15 @@ bhd_gap_scan(const struct bhd_req *req, struct bhd_rsp *out_rsp)
         .filter_duplicates = req->scan.filter_duplicates,
     };
 
+    prev = bhd_gap_proc_src_set(&bhd_gap_disc_src, req);
     out_rsp->scan.status = ble_gap_disc(req->scan.own_addr_type,
                                         req->scan.duration_ms,
                                         &params,
                                         bhd_gap_event,
-                                        bhd_seq_arg(req->hdr.seq));
+                                        &bhd_gap_disc_src);
+    if (out_rsp->scan.status != 0) {
+        bhd_gap_disc_src = prev;
+    }
 }
 
 void
@@ -501,6 +669,7 @@ void
 bhd_gap_adv_start(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
     struct ble_gap_adv_params adv_params;
+    struct bhd_evt_src prev;
 
     adv_params.conn_mode = req->adv_start.conn_mode;
     adv_params.disc_mode = req->adv_start.disc_mode;
@@ -510,12 +679,16 @@ bhd_gap_adv_start(const struct bhd_req *req, struct bhd_rsp *out_rsp)
     adv_params.filter_policy = req->adv_start.filter_policy;
     adv_params.high_duty_cycle = req->adv_start.high_duty_cycle;
 
+    prev = bhd_gap_proc_src_set(&bhd_gap_adv_src, req);
     out_rsp->adv_start.status = ble_gap_adv_start(req->adv_start.own_addr_type,
                                                   &req->adv_start.peer_addr,
                                                   req->adv_start.duration_ms,
                                                   &adv_params,
                                                   bhd_gap_event,
-                                                  bhd_seq_arg(req->hdr.seq));
+                                                  &bhd_gap_adv_src);
+    if (out_rsp->adv_start.status != 0) {
+        bhd_gap_adv_src = prev;
+    }
 }
 
 void
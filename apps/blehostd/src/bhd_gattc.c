@@ -4,42 +4,80 @@
 #include "blehostd.h"
 #include "bhd_proto.h"
 #include "bhd_gattc.h"
+#include "bhd_gatts.h"
 #include "bhd_util.h"
 #include "defs/error.h"
 #include "nimble/ble.h"
 #include "host/ble_hs.h"
 
 struct bhd_gattc_disc_chr_arg {
-    bhd_seq_t seq;
+    struct bhd_evt_src src;
     uint16_t svc_start_handle;
 };
 
 struct bhd_gattc_disc_dsc_arg {
-    bhd_seq_t seq;
+    struct bhd_evt_src src;
     uint16_t chr_val_handle;
 };
 
+/** One connection's indication within a notify_multi request. */
+struct bhd_gattc_ind_conn {
+    uint16_t conn_handle;
+    uint8_t pending;
+    int status;
+};
+
+/**
+ * The indications that one notify_multi request queued.  An
+ * indicate_done_evt is sent when the last of them completes.
+ */
+struct bhd_gattc_ind_batch {
+    STAILQ_ENTRY(bhd_gattc_ind_batch) next;
+
+    struct bhd_evt_src src;
+    uint16_t attr_handle;
+
+    /**
+     * Indications still awaiting confirmation, plus one while the
+     * requesting task is still queueing them.  Whichever task drops this
+     * to zero sends the event.
+     */
+    int num_pending;
+
+    int num_conns;
+    struct bhd_gattc_ind_conn conns[];
+};
+
+/*
+ * Shared by the blehostd task (notify_multi requests) and the host task
+ * (transmit and disconnect events); access in critical sections.
+ */
+static STAILQ_HEAD(, bhd_gattc_ind_batch) bhd_gattc_ind_batches =
+    STAILQ_HEAD_INITIALIZER(bhd_gattc_ind_batches);
+
 static int
 bhd_gattc_disc_svc_cb(uint16_t conn_handle,
                       const struct ble_gatt_error *error,
                       const struct ble_gatt_svc *service,
                       void *arg)
 {
+    struct bhd_evt_src *src;
     struct bhd_evt evt;
-    bhd_seq_t seq;
 
-    seq = (bhd_seq_t)(uintptr_t)arg;
+    src = arg;
 
     memset(&evt, 0, sizeof(evt));
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_DISC_SVC_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
 
     evt.disc_svc.conn_handle = conn_handle;
     evt.disc_svc.status = error->status;
 
     if (error->status == 0) {
         evt.disc_svc.svc = *service;
+    } else {
+        free(src);
     }
 
     bhd_evt_send(&evt);
@@ -61,7 +99,7 @@ bhd_gattc_disc_chr_cb(uint16_t conn_handle,
     memset(&evt, 0, sizeof(evt));
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_DISC_CHR_EVT;
-    evt.hdr.seq = chr_arg->seq;
+    bhd_evt_set_src(&evt, &chr_arg->src);
 
     evt.disc_chr.conn_handle = conn_handle;
     evt.disc_chr.status = error->status;
@@ -92,7 +130,7 @@ bhd_gattc_disc_dsc_cb(uint16_t conn_handle,
     memset(&evt, 0, sizeof(evt));
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_DISC_DSC_EVT;
-    evt.hdr.seq = dsc_arg->seq;
+    bhd_evt_set_src(&evt, &dsc_arg->src);
 
     evt.disc_dsc.conn_handle = conn_handle;
     evt.disc_dsc.status = error->status;
@@ -115,15 +153,16 @@ bhd_gattc_write_cb(uint16_t conn_handle,
                    struct ble_gatt_attr *attr,
                    void *arg)
 {
+    struct bhd_evt_src *src;
     struct bhd_evt evt;
-    bhd_seq_t seq;
 
-    seq = (bhd_seq_t)(uintptr_t)arg;
+    src = arg;
 
     memset(&evt, 0, sizeof(evt));
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_WRITE_ACK_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
+    free(src);
 
     evt.write_ack.conn_handle = conn_handle;
     evt.write_ack.attr_handle = attr->handle;
@@ -140,10 +179,11 @@ bhd_gatt_mtu_cb(uint16_t conn_handle,
                 uint16_t mtu,
                 void *arg)
 {
-    bhd_seq_t seq;
+    struct bhd_evt_src *src;
 
-    seq = (bhd_seq_t)(uintptr_t)arg;
-    bhd_send_mtu_changed(seq, conn_handle, error->status, mtu);
+    src = arg;
+    bhd_send_mtu_changed(src, conn_handle, error->status, mtu);
+    free(src);
 
     return 0;
 }
@@ -151,23 +191,35 @@ bhd_gatt_mtu_cb(uint16_t conn_handle,
 void
 bhd_gattc_disc_all_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
+    struct bhd_evt_src *src;
     int rc;
 
+    src = bhd_evt_src_alloc(req->hdr.seq);
+
     rc = ble_gattc_disc_all_svcs(req->disc_all_svcs.conn_handle,
-                                 bhd_gattc_disc_svc_cb,
-                                 bhd_seq_arg(req->hdr.seq));
+                                 bhd_gattc_disc_svc_cb, src);
+    if (rc != 0) {
+        free(src);
+    }
+
     out_rsp->disc_all_svcs.status = rc;
 }
 
 void
 bhd_gattc_disc_svc_uuid(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
+    struct bhd_evt_src *src;
     int rc;
 
+    src = bhd_evt_src_alloc(req->hdr.seq);
+
     rc = ble_gattc_disc_svc_by_uuid(req->disc_svc_uuid.conn_handle,
                                     &req->disc_svc_uuid.svc_uuid.u,
-                                    bhd_gattc_disc_svc_cb,
-                                    bhd_seq_arg(req->hdr.seq));
+                                    bhd_gattc_disc_svc_cb, src);
+    if (rc != 0) {
+        free(src);
+    }
+
     out_rsp->disc_svc_uuid.status = rc;
 }
 
@@ -179,7 +231,8 @@ bhd_gattc_disc_all_chrs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 
     chr_arg = malloc_success(sizeof *chr_arg);
 
-    chr_arg->seq = req->hdr.seq;
+    chr_arg->src.seq = req->hdr.seq;
+    chr_arg->src.client_id = blehostd_cur_client_id();
     chr_arg->svc_start_handle = req->disc_all_chrs.start_attr_handle;
 
     rc = ble_gattc_disc_all_chrs(req->disc_all_chrs.conn_handle,
@@ -200,7 +253,8 @@ bhd_gattc_disc_chr_uuid(const struct bhd_req *req, struct bhd_rsp *out_rsp)
     int rc;
 
     chr_arg = malloc_success(sizeof *chr_arg);
-    chr_arg->seq = req->hdr.seq;
+    chr_arg->src.seq = req->hdr.seq;
+    chr_arg->src.client_id = blehostd_cur_client_id();
     chr_arg->svc_start_handle = req->disc_chr_uuid.start_handle;
 
     rc = ble_gattc_disc_chrs_by_uuid(req->disc_chr_uuid.conn_handle,
@@ -223,7 +277,8 @@ bhd_gattc_disc_all_dscs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 
     dsc_arg = malloc_success(sizeof *dsc_arg);
 
-    dsc_arg->seq = req->hdr.seq;
+    dsc_arg->src.seq = req->hdr.seq;
+    dsc_arg->src.client_id = blehostd_cur_client_id();
     dsc_arg->chr_val_handle = req->disc_all_dscs.start_attr_handle;
 
     rc = ble_gattc_disc_all_dscs(req->disc_all_dscs.conn_handle,
@@ -240,6 +295,7 @@ bhd_gattc_disc_all_dscs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 void
 bhd_gattc_write(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
+    struct bhd_evt_src *src;
     struct os_mbuf *om;
     int rc;
 
@@ -249,9 +305,13 @@ bhd_gattc_write(const struct bhd_req *req, struct bhd_rsp *out_rsp)
         return;
     }
 
+    src = bhd_evt_src_alloc(req->hdr.seq);
     rc = ble_gattc_write(req->write.conn_handle, req->write.attr_handle,
-                         om, bhd_gattc_write_cb,
-                         bhd_seq_arg(req->hdr.seq));
+                         om, bhd_gattc_write_cb, src);
+    if (rc != 0) {
+        free(src);
+    }
+
     out_rsp->write.status = rc;
 }
 
@@ -275,11 +335,17 @@ bhd_gattc_write_no_rsp(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 void
 bhd_gattc_exchange_mtu(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
+    struct bhd_evt_src *src;
     int rc;
 
+    src = bhd_evt_src_alloc(req->hdr.seq);
+
     rc = ble_gattc_exchange_mtu(req->exchange_mtu.conn_handle,
-                                bhd_gatt_mtu_cb,
-                                bhd_seq_arg(req->hdr.seq));
+                                bhd_gatt_mtu_cb, src);
+    if (rc != 0) {
+        free(src);
+    }
+
     out_rsp->exchange_mtu.status = rc;
 }
 
@@ -309,3 +375,271 @@ bhd_gattc_notify(const struct bhd_req *req, struct bhd_rsp *out_rsp)
                                  om);
     out_rsp->notify.status = rc;
 }
+
+/**
+ * Marks one connection's indication as complete.  Must be called in a
+ * critical section.
+ *
+ * @return                      1 if this completed the whole batch;
+ *                              0 otherwise.
+ */
+static int
+bhd_gattc_ind_conn_done(struct bhd_gattc_ind_batch *batch,
+                        struct bhd_gattc_ind_conn *conn, int status)
+{
+    conn->pending = 0;
+    conn->status = status;
+
+    return --batch->num_pending == 0;
+}
+
+/**
+ * Sends the indicate_done_evt for a completed batch and frees it.  The
+ * batch must already be removed from the list.
+ */
+static void
+bhd_gattc_ind_batch_finish(struct bhd_gattc_ind_batch *batch)
+{
+    struct bhd_evt evt;
+    int i;
+
+    memset(&evt, 0, sizeof evt);
+    evt.hdr.op = BHD_MSG_OP_EVT;
+    evt.hdr.type = BHD_MSG_TYPE_INDICATE_DONE_EVT;
+    bhd_evt_set_src(&evt, &batch->src);
+
+    evt.indicate_done.attr_handle = batch->attr_handle;
+    for (i = 0; i < batch->num_conns; i++) {
+        evt.indicate_done.results[i].conn_handle =
+            batch->conns[i].conn_handle;
+        evt.indicate_done.results[i].status = batch->conns[i].status;
+    }
+    evt.indicate_done.num_results = batch->num_conns;
+
+    bhd_evt_send(&evt);
+
+    free(batch);
+}
+
+/**
+ * Applies the outcome of an indication to the oldest batch waiting on it.
+ * Called in the host task.
+ *
+ * @param conn_handle           The connection the indication was sent on.
+ * @param attr_handle           The indicated attribute; 0 to match any,
+ *                                  for a terminated connection.
+ * @param status                0 if the peer confirmed the indication;
+ *                                  otherwise, the reason it failed.
+ */
+static void
+bhd_gattc_ind_complete(uint16_t conn_handle, uint16_t attr_handle,
+                       int status)
+{
+    struct bhd_gattc_ind_batch *batch;
+    struct bhd_gattc_ind_batch *done;
+    os_sr_t sr;
+    int i;
+
+    do {
+        done = NULL;
+
+        OS_ENTER_CRITICAL(sr);
+        STAILQ_FOREACH(batch, &bhd_gattc_ind_batches, next) {
+            if (attr_handle != 0 && batch->attr_handle != attr_handle) {
+                continue;
+            }
+
+            for (i = 0; i < batch->num_conns; i++) {
+                if (batch->conns[i].pending &&
+                    batch->conns[i].conn_handle == conn_handle) {
+
+                    break;
+                }
+            }
+            if (i >= batch->num_conns) {
+                continue;
+            }
+
+            if (bhd_gattc_ind_conn_done(batch, batch->conns + i, status)) {
+                STAILQ_REMOVE(&bhd_gattc_ind_batches, batch,
+                              bhd_gattc_ind_batch, next);
+                done = batch;
+            }
+            break;
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        if (done != NULL) {
+            bhd_gattc_ind_batch_finish(done);
+        }
+
+        /*
+         * A transmit event completes one indication; a terminated
+         * connection fails its indications in every batch.
+         */
+    } while (attr_handle == 0 && batch != NULL);
+}
+
+/**
+ * Handles an indication transmit event from the host.  Called in the host
+ * task.
+ */
+void
+bhd_gattc_indicate_tx(uint16_t conn_handle, uint16_t attr_handle,
+                      int status)
+{
+    /* A status of 0 only means the indication went out. */
+    if (status == 0) {
+        return;
+    }
+
+    if (status == BLE_HS_EDONE) {
+        status = 0;
+    }
+
+    bhd_gattc_ind_complete(conn_handle, attr_handle, status);
+}
+
+/**
+ * Fails any indications still pending on a terminated connection.  Called
+ * in the host task.
+ */
+void
+bhd_gattc_conn_broken(uint16_t conn_handle)
+{
+    bhd_gattc_ind_complete(conn_handle, 0, BLE_HS_ENOTCONN);
+}
+
+/**
+ * Sends one value to several connections.  The payload is built once and
+ * duplicated for each connection.  Without an explicit connection list,
+ * the value goes to every peer subscribed to the characteristic for
+ * notifications (or indications, if "indicate" is set).  The response
+ * reports whether each notification or indication could be queued; for
+ * indications, an indicate_done_evt later reports each confirmation.
+ */
+void
+bhd_gattc_notify_multi(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    const struct bhd_notify_multi_req *nm;
+    struct bhd_notify_multi_result *result;
+    struct bhd_gattc_ind_batch *batch;
+    uint16_t conn_handles[BHD_NOTIFY_MULTI_MAX_CONNS];
+    struct os_mbuf *txom;
+    struct os_mbuf *om;
+    uint8_t sub_flags;
+    int num_conns;
+    int done;
+    os_sr_t sr;
+    int rc;
+    int i;
+
+    nm = &req->notify_multi;
+
+    if (nm->num_conn_handles > 0) {
+        num_conns = nm->num_conn_handles;
+        memcpy(conn_handles, nm->conn_handles,
+               num_conns * sizeof *conn_handles);
+    } else {
+        if (nm->indicate) {
+            sub_flags = BHD_GATTS_SUB_F_INDICATE;
+        } else {
+            sub_flags = BHD_GATTS_SUB_F_NOTIFY;
+        }
+        num_conns = bhd_gatts_subscribers(nm->attr_handle, sub_flags,
+                                          conn_handles,
+                                          BHD_NOTIFY_MULTI_MAX_CONNS);
+    }
+
+    batch = NULL;
+    if (nm->indicate) {
+        batch = calloc(1, sizeof *batch + num_conns * sizeof *batch->conns);
+        if (batch == NULL) {
+            bhd_err_build(out_rsp, SYS_ENOMEM, "out of memory");
+            return;
+        }
+        batch->src.seq = req->hdr.seq;
+        batch->src.client_id = blehostd_cur_client_id();
+        batch->attr_handle = nm->attr_handle;
+        batch->num_conns = num_conns;
+        batch->num_pending = 1;
+    }
+
+    om = ble_hs_mbuf_from_flat(nm->data, nm->data_len);
+    if (om == NULL) {
+        free(batch);
+        bhd_err_build(out_rsp, SYS_ENOMEM, "no mbufs available");
+        return;
+    }
+
+    if (batch != NULL) {
+        OS_ENTER_CRITICAL(sr);
+        STAILQ_INSERT_TAIL(&bhd_gattc_ind_batches, batch, next);
+        OS_EXIT_CRITICAL(sr);
+    }
+
+    for (i = 0; i < num_conns; i++) {
+        result = out_rsp->notify_multi.results + i;
+        result->conn_handle = conn_handles[i];
+
+        /* The last connection gets the original. */
+        if (i == num_conns - 1) {
+            txom = om;
+            om = NULL;
+        } else {
+            txom = os_mbuf_dup(om);
+        }
+
+        if (batch != NULL) {
+            batch->conns[i].conn_handle = conn_handles[i];
+        }
+
+        if (txom == NULL) {
+            rc = BLE_HS_ENOMEM;
+        } else if (batch != NULL) {
+            /* Count the indication before the host can complete it. */
+            OS_ENTER_CRITICAL(sr);
+            batch->conns[i].pending = 1;
+            batch->num_pending++;
+            OS_EXIT_CRITICAL(sr);
+
+            rc = ble_gattc_indicate_custom(conn_handles[i], nm->attr_handle,
+                                           txom);
+        } else {
+            rc = ble_gattc_notify_custom(conn_handles[i], nm->attr_handle,
+                                         txom);
+        }
+
+        if (batch != NULL && rc != 0) {
+            OS_ENTER_CRITICAL(sr);
+            if (batch->conns[i].pending) {
+                bhd_gattc_ind_conn_done(batch, batch->conns + i, rc);
+            } else {
+                batch->conns[i].status = rc;
+            }
+            OS_EXIT_CRITICAL(sr);
+        }
+
+        result->status = rc;
+    }
+    out_rsp->notify_multi.num_results = num_conns;
+
+    if (om != NULL) {
+        os_mbuf_free_chain(om);
+    }
+
+    if (batch != NULL) {
+        /* Release this task's hold on the batch. */
+        OS_ENTER_CRITICAL(sr);
+        done = --batch->num_pending == 0;
+        if (done) {
+            STAILQ_REMOVE(&bhd_gattc_ind_batches, batch,
+                          bhd_gattc_ind_batch, next);
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        if (done) {
+            bhd_gattc_ind_batch_finish(batch);
+        }
+    }
+}
@@ -19,5 +19,10 @@ void bhd_gattc_exchange_mtu(const struct bhd_req *req,
 void bhd_gattc_set_preferred_mtu(const struct bhd_req *req,
                                  struct bhd_rsp *out_rsp);
 void bhd_gattc_notify(const struct bhd_req *req, struct bhd_rsp *out_rsp);
+void bhd_gattc_notify_multi(const struct bhd_req *req,
+                            struct bhd_rsp *out_rsp);
+void bhd_gattc_indicate_tx(uint16_t conn_handle, uint16_t attr_handle,
+                           int status);
+void bhd_gattc_conn_broken(uint16_t conn_handle);
 
 #endif
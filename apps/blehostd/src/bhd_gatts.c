@@ -1,125 +1,537 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "defs/error.h"
 #include "host/ble_hs.h"
 #include "bhd_proto.h"
 #include "bhd_gatts.h"
 #include "bhd_util.h"
 
-#define BHD_GATTS_MAX_SVCS          32
-#define BHD_GATTS_MAX_CHRS          512
-#define BHD_GATTS_MAX_DSCS          2048
-#define BHD_GATTS_MAX_UUIDS         \
-    (BHD_GATTS_MAX_SVCS + BHD_GATTS_MAX_CHRS + BHD_GATTS_MAX_DSCS)
-#define BHD_GATTS_MAX_VAL_HANDLES   BHD_GATTS_MAX_CHRS
-
 #define BHD_GATTS_ACCESS_STATUS_TIMEOUT (10 * OS_TICKS_PER_SEC)
 #define BHD_GATTS_ACCESS_STATUS_NONE    UINT8_MAX
 
-static struct ble_gatt_svc_def bhd_gatts_svcs[BHD_GATTS_MAX_SVCS];
-static struct ble_gatt_chr_def bhd_gatts_chrs[BHD_GATTS_MAX_CHRS];
-static struct ble_gatt_dsc_def bhd_gatts_dscs[BHD_GATTS_MAX_DSCS];
-static ble_uuid_any_t bhd_gatts_uuids[BHD_GATTS_MAX_UUIDS];
-static uint16_t bhd_gatts_val_handles[BHD_GATTS_MAX_VAL_HANDLES];
+/**
+ * The definitions from one add_svcs request, in the form that the host
+ * registers.  The header and all of the arrays share a single allocation,
+ * sized by bhd_gatts_cnt_resources():
+ *
+ *     header | svcs | chrs | dscs | uuids | val_handles | prev_val_handles |
+ *     svc_handles | dsc_handles | removed
+ *
+ * Each array's element size is a multiple of the alignment of the arrays
+ * that follow, so no padding is needed.  The host keeps pointers into the
+ * block, so it lives until the database is reset.
+ */
+struct bhd_gatts_reg {
+    STAILQ_ENTRY(bhd_gatts_reg) next;
+
+    /** Null terminated. */
+    struct ble_gatt_svc_def *svcs;
+    int num_svcs;
+
+    /** All descriptor definitions, including null terminators. */
+    struct ble_gatt_dsc_def *dscs;
+    int num_dscs;
+
+    /** Characteristic value handles, written by the host. */
+    uint16_t *val_handles;
+    int num_val_handles;
 
-static int bhd_gatts_num_svcs;
-static int bhd_gatts_num_chrs;
-static int bhd_gatts_num_dscs;
-static int bhd_gatts_num_uuids;
-static int bhd_gatts_num_val_handles;
+    /**
+     * The handles from the previous commit, for moving stored values to the
+     * new handles; 0 if not yet committed.  svc_handles is parallel to svcs,
+     * dsc_handles to dscs, and prev_val_handles to val_handles.
+     */
+    uint16_t *prev_val_handles;
+    uint16_t *svc_handles;
+    uint16_t *dsc_handles;
+
+    /**
+     * Parallel to svcs; marks the services that the next commit drops.  The
+     * host refers to the definitions until then, so they stay in place.
+     */
+    uint8_t *removed;
+    int num_removed;
+
+    /** Whether the services are in the host's current database. */
+    int committed;
+
+    /**
+     * Whether the services have been passed to ble_gatts_count_cfg().  The
+     * host adds to its running totals on each call, so a registration is
+     * only counted once, even if it is registered by several commits.
+     */
+    int counted;
+};
+
+/** Number of each kind of entry that a registration needs. */
+struct bhd_gatts_cnt {
+    /* Including null terminators. */
+    int num_svcs;
+    int num_chrs;
+    int num_dscs;
 
+    int num_uuids;
+    int num_val_handles;
+};
+
+/** Next free entry of each array of a registration being filled in. */
+struct bhd_gatts_build {
+    struct ble_gatt_svc_def *svcs;
+    struct ble_gatt_chr_def *chrs;
+    struct ble_gatt_dsc_def *dscs;
+    ble_uuid_any_t *uuids;
+    uint16_t *val_handles;
+};
+
+static STAILQ_HEAD(, bhd_gatts_reg) bhd_gatts_regs =
+    STAILQ_HEAD_INITIALIZER(bhd_gatts_regs);
+
+/**
+ * One attribute in the handle index.  Characteristic entries have a NULL
+ * dsc_uuid.  The UUIDs point into the registrations, so the index is
+ * rebuilt by every commit.
+ */
+struct bhd_gatts_idx_entry {
+    const ble_uuid_t *svc_uuid;
+    const ble_uuid_t *chr_uuid;
+    const ble_uuid_t *dsc_uuid;
+
+    /** Characteristic definition handle; 0 for descriptors. */
+    uint16_t def_handle;
+
+    /** Characteristic value handle or descriptor handle. */
+    uint16_t handle;
+};
+
+/**
+ * Open addressed hash table of the committed attributes, keyed by
+ * (service, characteristic, descriptor) UUID.  The size is a power of two,
+ * at least twice the number of entries; 0 if nothing is committed.
+ */
+static struct bhd_gatts_idx_entry *bhd_gatts_idx;
+static int bhd_gatts_idx_size;
+
+/** Number of recent accesses that an access_status can still refer to. */
+#define BHD_GATTS_MAX_PENDING           16
+
+/**
+ * An access that has been reported to the client with an access event.
+ * Each is identified by a nonzero access ID carried in the event; the
+ * client's access_status names the access it answers with this ID.
+ */
+struct bhd_gatts_pending {
+    uint32_t id;
+    uint16_t attr_handle;
+    uint8_t op;
+};
+
+/** The client is told about reads with an async access event. */
+#define BHD_GATTS_VAL_F_FORWARD         0x01
+
+/**
+ * The value belongs to blehostd (set_value request): writes update it
+ * without asking the client.
+ */
+#define BHD_GATTS_VAL_F_OWNED           0x02
+
+/**
+ * An attribute value that blehostd answers reads with itself, without
+ * waiting for the client.  Either the client stored it with set_value, or
+ * it allowed a read result to be cached (access_status with "cache":
+ * true).  Indexed by attribute handle.
+ */
+struct bhd_gatts_val {
+    uint16_t len;
+    uint8_t flags;
+    uint8_t data[];
+};
+
+/*
+ * The following are shared by the host task (bhd_gatts_access()) and the
+ * blehostd task (access_status requests); access them in critical sections.
+ */
+static struct bhd_gatts_pending bhd_gatts_pending[BHD_GATTS_MAX_PENDING];
+static int bhd_gatts_pending_next;
+static uint32_t bhd_gatts_next_access_id;
+static struct bhd_gatts_val **bhd_gatts_vals;
+static int bhd_gatts_num_vals;
+
+/*
+ * The values stored under the previous attribute handles while a commit
+ * rebuilds the database.  Only the blehostd task touches these.
+ */
+static struct bhd_gatts_val **bhd_gatts_old_vals;
+static int bhd_gatts_num_old_vals;
+
+/** Whether the host has started the current database. */
+static int bhd_gatts_started;
+
+/** A peer's client characteristic configuration for one characteristic. */
+struct bhd_gatts_sub {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+
+    /** BHD_GATTS_SUB_F_[...] */
+    uint8_t flags;
+};
+
+/*
+ * Subscriptions with at least one flag set.  Only the host task changes
+ * the table; it grows the array outside of critical sections, and the
+ * blehostd task reads it in critical sections.
+ */
+static struct bhd_gatts_sub *bhd_gatts_subs;
+static int bhd_gatts_num_subs;
+static int bhd_gatts_max_subs;
+
+/**
+ * The access that the host task is blocked on; 0 if none.  The host task
+ * runs one access callback at a time, so there is at most one.
+ */
+static uint32_t bhd_gatts_wait_id;
 static struct os_sem bhd_gatts_access_sem;
 static uint8_t bhd_gatts_access_att_status = BHD_GATTS_ACCESS_STATUS_NONE;
 static uint8_t bhd_gatts_access_value[BLE_ATT_ATTR_MAX_LEN];
 static int bhd_gatts_access_value_len;
 
-static void
-bhd_gatts_cnt_resources(const struct bhd_add_svcs_req *req,
-                        int *out_num_svcs,
-                        int *out_num_chrs,
-                        int *out_num_dscs,
-                        int *out_num_uuids,
-                        int *out_num_val_handles)
+
+/**
+ * Records a new access and assigns it an ID.  The oldest record is
+ * recycled; an access_status for an access that old is rejected.  Must be
+ * called in a critical section.
+ */
+static uint32_t
+bhd_gatts_pending_add(uint16_t attr_handle, uint8_t op)
 {
-    const struct bhd_svc *svc;
-    const struct bhd_chr *chr;
-    int s;
-    int c;
+    struct bhd_gatts_pending *pending;
 
-    *out_num_svcs = req->num_svcs + 1;
-    *out_num_chrs = 0;
-    *out_num_dscs = 0;
-    *out_num_val_handles = 0;
+    if (++bhd_gatts_next_access_id == 0) {
+        bhd_gatts_next_access_id = 1;
+    }
 
-    for (s = 0; s < req->num_svcs; s++) {
-        svc = req->svcs + s;
-        *out_num_chrs += svc->num_chrs;
-        *out_num_val_handles += svc->num_chrs;
+    pending = bhd_gatts_pending + bhd_gatts_pending_next;
+    bhd_gatts_pending_next =
+        (bhd_gatts_pending_next + 1) % BHD_GATTS_MAX_PENDING;
 
-        for (c = 0; c < svc->num_chrs; c++) {
-            chr = svc->chrs + c;
-            *out_num_dscs += chr->num_dscs;
+    pending->id = bhd_gatts_next_access_id;
+    pending->attr_handle = attr_handle;
+    pending->op = op;
 
-            if (chr->num_dscs > 0) {
-                (*out_num_dscs)++;
-            }
+    return pending->id;
+}
+
+/**
+ * Removes the record of the specified access.  Must be called in a critical
+ * section.
+ *
+ * @param id                    The access to remove; 0 means the access the
+ *                                  host task is blocked on.
+ * @param out_pending           On success, a copy of the removed record.
+ *
+ * @return                      0 on success; SYS_ENOENT if there is no such
+ *                                  access.
+ */
+static int
+bhd_gatts_pending_remove(uint32_t id, struct bhd_gatts_pending *out_pending)
+{
+    int i;
+
+    if (id == 0) {
+        id = bhd_gatts_wait_id;
+        if (id == 0) {
+            return SYS_ENOENT;
         }
+    }
 
-        if (*out_num_chrs > 0) {
-            (*out_num_chrs)++;
+    for (i = 0; i < BHD_GATTS_MAX_PENDING; i++) {
+        if (bhd_gatts_pending[i].id == id) {
+            *out_pending = bhd_gatts_pending[i];
+            bhd_gatts_pending[i].id = 0;
+            return 0;
         }
     }
 
-    *out_num_uuids = *out_num_svcs + *out_num_chrs + *out_num_dscs;
+    return SYS_ENOENT;
+}
+
+/**
+ * Replaces the cached read value of an attribute.  Must be called in a
+ * critical section.
+ *
+ * @param val                   The new value, or NULL to clear the cache
+ *                                  entry.  Ownership passes to the cache.
+ *
+ * @return                      The previous value, for the caller to free
+ *                                  outside the critical section.
+ */
+static struct bhd_gatts_val *
+bhd_gatts_val_swap(uint16_t attr_handle, struct bhd_gatts_val *val)
+{
+    struct bhd_gatts_val *old;
+
+    if (attr_handle >= bhd_gatts_num_vals) {
+        /* The table is grown before any new value is stored. */
+        assert(val == NULL);
+        return NULL;
+    }
+
+    old = bhd_gatts_vals[attr_handle];
+    bhd_gatts_vals[attr_handle] = val;
+    return old;
 }
 
+/**
+ * Grows the value table so that it has an entry for the specified handle.
+ */
 static int
-bhd_gatts_verify_resource_cnt(const struct bhd_add_svcs_req *req)
+bhd_gatts_val_reserve(uint16_t attr_handle)
 {
-    int num_svcs;
-    int num_chrs;
-    int num_dscs;
-    int num_uuids;
-    int num_val_handles;
+    struct bhd_gatts_val **old_vals;
+    struct bhd_gatts_val **vals;
+    int num_vals;
+    os_sr_t sr;
 
-    bhd_gatts_cnt_resources(req, &num_svcs, &num_chrs, &num_dscs, &num_uuids,
-                            &num_val_handles);
+    if (attr_handle < bhd_gatts_num_vals) {
+        return 0;
+    }
 
-    if (bhd_gatts_num_svcs + num_svcs > BHD_GATTS_MAX_SVCS) {
-        return BLE_HS_ENOMEM;
+    num_vals = attr_handle + 1;
+    vals = malloc(num_vals * sizeof *vals);
+    if (vals == NULL) {
+        return SYS_ENOMEM;
     }
+    memset(vals, 0, num_vals * sizeof *vals);
 
-    if (bhd_gatts_num_chrs + num_chrs > BHD_GATTS_MAX_CHRS) {
-        return BLE_HS_ENOMEM;
+    OS_ENTER_CRITICAL(sr);
+    if (bhd_gatts_num_vals > 0) {
+        memcpy(vals, bhd_gatts_vals,
+               bhd_gatts_num_vals * sizeof *bhd_gatts_vals);
     }
+    old_vals = bhd_gatts_vals;
+    bhd_gatts_vals = vals;
+    bhd_gatts_num_vals = num_vals;
+    OS_EXIT_CRITICAL(sr);
 
-    if (bhd_gatts_num_dscs + num_dscs > BHD_GATTS_MAX_DSCS) {
-        return BLE_HS_ENOMEM;
+    free(old_vals);
+    return 0;
+}
+
+/**
+ * Stores a value that future reads of the attribute are answered with,
+ * without involving the client.
+ *
+ * @param flags                 BHD_GATTS_VAL_F_[...] flags.
+ */
+static int
+bhd_gatts_val_store(uint16_t attr_handle, const uint8_t *data, int len,
+                    uint8_t flags)
+{
+    struct bhd_gatts_val *val;
+    os_sr_t sr;
+    int rc;
+
+    rc = bhd_gatts_val_reserve(attr_handle);
+    if (rc != 0) {
+        return rc;
     }
 
-    if (bhd_gatts_num_uuids + num_uuids > BHD_GATTS_MAX_UUIDS) {
-        return BLE_HS_ENOMEM;
+    val = malloc(sizeof *val + len);
+    if (val == NULL) {
+        return SYS_ENOMEM;
+    }
+    val->len = len;
+    val->flags = flags;
+    memcpy(val->data, data, len);
+
+    OS_ENTER_CRITICAL(sr);
+    val = bhd_gatts_val_swap(attr_handle, val);
+    OS_EXIT_CRITICAL(sr);
+
+    free(val);
+    return 0;
+}
+
+/**
+ * Applies a peer's write to the attribute's stored value.  A value owned by
+ * blehostd takes on the written data; a value that was merely cached from
+ * the client is discarded, since only the client knows the result.
+ *
+ * @return                      0 if blehostd owns the value and the write
+ *                                  is complete;
+ *                              SYS_ENOENT if the client has to handle the
+ *                                  write.
+ */
+static int
+bhd_gatts_val_write(uint16_t attr_handle, const uint8_t *data, int len)
+{
+    struct bhd_gatts_val *val;
+    uint8_t flags;
+    os_sr_t sr;
+
+    flags = 0;
+
+    OS_ENTER_CRITICAL(sr);
+    val = NULL;
+    if (attr_handle < bhd_gatts_num_vals) {
+        val = bhd_gatts_vals[attr_handle];
+        if (val != NULL) {
+            flags = val->flags;
+        }
     }
+    if (!(flags & BHD_GATTS_VAL_F_OWNED)) {
+        val = bhd_gatts_val_swap(attr_handle, NULL);
+    }
+    OS_EXIT_CRITICAL(sr);
 
-    if (bhd_gatts_num_val_handles + num_val_handles >
-        BHD_GATTS_MAX_VAL_HANDLES) {
+    if (!(flags & BHD_GATTS_VAL_F_OWNED)) {
+        free(val);
+        return SYS_ENOENT;
+    }
 
-        return BLE_HS_ENOMEM;
+    if (bhd_gatts_val_store(attr_handle, data, len, flags) != 0) {
+        return SYS_ENOENT;
     }
 
     return 0;
 }
 
+/**
+ * Copies an attribute's stored value, if it has one.  The copy is taken in
+ * a critical section because the blehostd task may replace the value at
+ * any time.
+ *
+ * @param out_flags             On success, the value's BHD_GATTS_VAL_F_[...]
+ *                                  flags get written here.
+ *
+ * @return                      The length of the value;
+ *                              -1 if the attribute has no stored value.
+ */
+static int
+bhd_gatts_val_read(uint16_t attr_handle, uint8_t *dst, int max_len,
+                   uint8_t *out_flags)
+{
+    const struct bhd_gatts_val *val;
+    os_sr_t sr;
+    int len;
+
+    len = -1;
+
+    OS_ENTER_CRITICAL(sr);
+    if (attr_handle < bhd_gatts_num_vals) {
+        val = bhd_gatts_vals[attr_handle];
+        if (val != NULL) {
+            len = val->len;
+            if (len > max_len) {
+                len = max_len;
+            }
+            memcpy(dst, val->data, len);
+            *out_flags = val->flags;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return len;
+}
+
+/**
+ * Sets the whole value table aside while a commit reassigns attribute
+ * handles.  The register callback moves each value to its attribute's new
+ * handle with bhd_gatts_val_move().
+ */
+static void
+bhd_gatts_val_detach(void)
+{
+    os_sr_t sr;
+
+    assert(bhd_gatts_old_vals == NULL);
+
+    OS_ENTER_CRITICAL(sr);
+    bhd_gatts_old_vals = bhd_gatts_vals;
+    bhd_gatts_num_old_vals = bhd_gatts_num_vals;
+    bhd_gatts_vals = NULL;
+    bhd_gatts_num_vals = 0;
+    OS_EXIT_CRITICAL(sr);
+}
+
+/** Frees the values that no attribute claimed after a detach. */
+static void
+bhd_gatts_val_free_old(void)
+{
+    int i;
+
+    for (i = 0; i < bhd_gatts_num_old_vals; i++) {
+        free(bhd_gatts_old_vals[i]);
+    }
+    free(bhd_gatts_old_vals);
+
+    bhd_gatts_old_vals = NULL;
+    bhd_gatts_num_old_vals = 0;
+}
+
+static void
+bhd_gatts_val_move(uint16_t old_handle, uint16_t new_handle)
+{
+    struct bhd_gatts_val *val;
+    os_sr_t sr;
+    int rc;
+
+    if (old_handle == 0 || old_handle >= bhd_gatts_num_old_vals) {
+        return;
+    }
+
+    val = bhd_gatts_old_vals[old_handle];
+    if (val == NULL) {
+        return;
+    }
+
+    rc = bhd_gatts_val_reserve(new_handle);
+    if (rc != 0) {
+        /* The value gets freed; reads go to the client instead. */
+        return;
+    }
+    bhd_gatts_old_vals[old_handle] = NULL;
+
+    OS_ENTER_CRITICAL(sr);
+    val = bhd_gatts_val_swap(new_handle, val);
+    OS_EXIT_CRITICAL(sr);
+
+    free(val);
+}
+
+static void
+bhd_gatts_val_clear_all(void)
+{
+    bhd_gatts_val_detach();
+    bhd_gatts_val_free_old();
+}
+
+/**
+ * Applies the client's access_status.  If the host task is blocked on the
+ * access, the result is handed to it.  Otherwise the access was already
+ * answered from the cache; a value in the status refreshes the cache.
+ *
+ * @param access_id             The access being answered; 0 for the access
+ *                                  the host task is blocked on.
+ * @param cache                 Whether the value also answers future reads
+ *                                  of the attribute.
+ */
 int
-bhd_gatts_set_access_result(uint8_t att_status,
-                            const uint8_t *data, int data_len)
+bhd_gatts_set_access_result(uint32_t access_id, uint8_t att_status,
+                            const uint8_t *data, int data_len, int cache)
 {
+    struct bhd_gatts_pending pending;
+    int is_read;
     os_sr_t sr;
     int rc;
 
     OS_ENTER_CRITICAL(sr);
 
-    if (bhd_gatts_access_att_status == BHD_GATTS_ACCESS_STATUS_NONE) {
+    rc = bhd_gatts_pending_remove(access_id, &pending);
+    if (rc == 0 && pending.id == bhd_gatts_wait_id) {
+        bhd_gatts_wait_id = 0;
         bhd_gatts_access_att_status = att_status;
+        bhd_gatts_access_value_len = 0;
         if (data != NULL) {
             if (data_len > sizeof bhd_gatts_access_value) {
                 data_len = sizeof bhd_gatts_access_value;
@@ -129,15 +541,20 @@ bhd_gatts_set_access_result(uint8_t att_status,
             bhd_gatts_access_value_len = data_len;
         }
 
-        rc = 0;
-    } else {
-        rc = SYS_ENOENT;
+        os_sem_release(&bhd_gatts_access_sem);
     }
 
     OS_EXIT_CRITICAL(sr);
 
-    if (rc == 0) {
-        rc = os_sem_release(&bhd_gatts_access_sem);
+    if (rc != 0) {
+        return rc;
+    }
+
+    is_read = pending.op == BLE_GATT_ACCESS_OP_READ_CHR ||
+              pending.op == BLE_GATT_ACCESS_OP_READ_DSC;
+    if (cache && is_read && att_status == 0 && data != NULL) {
+        rc = bhd_gatts_val_store(pending.attr_handle, data, data_len,
+                                 BHD_GATTS_VAL_F_FORWARD);
     }
 
     return rc;
@@ -147,42 +564,99 @@ static uint8_t
 bhd_gatts_wait_for_access_status(const uint8_t **out_attr_val,
                                  int *out_attr_len)
 {
+    struct bhd_gatts_pending pending;
+    int timed_out;
     uint8_t status;
+    os_sr_t sr;
     int rc;
 
     rc = os_sem_pend(&bhd_gatts_access_sem, BHD_GATTS_ACCESS_STATUS_TIMEOUT);
-    if (rc != 0) {
+
+    OS_ENTER_CRITICAL(sr);
+
+    timed_out = rc != 0 && bhd_gatts_wait_id != 0;
+    if (timed_out) {
+        /* Forget the access so that a late status is not mistaken for the
+         * answer to a later one.
+         */
+        bhd_gatts_pending_remove(bhd_gatts_wait_id, &pending);
+        bhd_gatts_wait_id = 0;
         status = BLE_ATT_ERR_UNLIKELY;
     } else {
         status = bhd_gatts_access_att_status;
     }
 
     bhd_gatts_access_att_status = BHD_GATTS_ACCESS_STATUS_NONE;
+
+    OS_EXIT_CRITICAL(sr);
+
+    if (rc != 0 && !timed_out) {
+        /* The status arrived just as the wait timed out; consume the
+         * semaphore release that came with it.
+         */
+        os_sem_pend(&bhd_gatts_access_sem, 0);
+    }
+
     *out_attr_val = bhd_gatts_access_value;
     *out_attr_len = bhd_gatts_access_value_len;
 
     return status;
 }
 
+/**
+ * Host access callback for every attribute that a client registered.
+ * Reads of an attribute with a stored value are answered at once.  Unless
+ * blehostd owns the value outright, the client is sent an async access
+ * event that it may answer to refresh the value.  Writes to a value that
+ * blehostd owns update it, and are reported with an async access event.
+ * All other accesses block the host task until the client's access_status
+ * arrives.
+ */
 static int
 bhd_gatts_access(uint16_t conn_handle, uint16_t attr_handle,
                  struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     uint8_t buf[BLE_ATT_ATTR_MAX_LEN + 3];
     uint16_t data_len;
-    struct bhd_access_evt access_evt;
+    struct bhd_access_evt access_evt = { 0 };
     const uint8_t *attr_val;
-    int attr_len;
     bhd_seq_t seq;
+    uint8_t flags;
+    os_sr_t sr;
+    int attr_len;
+    int is_read;
     int rc;
 
     seq = (bhd_seq_t)(uintptr_t)arg;
 
+    is_read = ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR ||
+              ctxt->op == BLE_GATT_ACCESS_OP_READ_DSC;
+
     access_evt.access_op = ctxt->op;
     access_evt.conn_handle = conn_handle;
     access_evt.att_handle = attr_handle;
 
-    if (ctxt->om != NULL) {
+    if (is_read) {
+        attr_len = bhd_gatts_val_read(attr_handle, buf, BLE_ATT_ATTR_MAX_LEN,
+                                      &flags);
+        if (attr_len >= 0) {
+            rc = os_mbuf_append(ctxt->om, buf, attr_len);
+            if (rc != 0) {
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            }
+
+            if (flags & BHD_GATTS_VAL_F_FORWARD) {
+                OS_ENTER_CRITICAL(sr);
+                access_evt.access_id = bhd_gatts_pending_add(attr_handle,
+                                                             ctxt->op);
+                OS_EXIT_CRITICAL(sr);
+
+                access_evt.async = 1;
+                bhd_send_access_evt(seq, &access_evt);
+            }
+            return 0;
+        }
+    } else if (ctxt->om != NULL) {
         rc = ble_hs_mbuf_to_flat(ctxt->om, buf, sizeof buf, &data_len);
         if (rc != 0) {
             /* XXX: Log error. */
@@ -191,11 +665,31 @@ bhd_gatts_access(uint16_t conn_handle, uint16_t attr_handle,
 
         access_evt.data = buf;
         access_evt.data_len = data_len;
+
+        rc = bhd_gatts_val_write(attr_handle, buf, data_len);
+        if (rc == 0) {
+            OS_ENTER_CRITICAL(sr);
+            access_evt.access_id = bhd_gatts_pending_add(attr_handle,
+                                                         ctxt->op);
+            OS_EXIT_CRITICAL(sr);
+
+            access_evt.async = 1;
+            bhd_send_access_evt(seq, &access_evt);
+            return 0;
+        }
     }
 
+    OS_ENTER_CRITICAL(sr);
+    access_evt.access_id = bhd_gatts_pending_add(attr_handle, ctxt->op);
+    bhd_gatts_wait_id = access_evt.access_id;
+    OS_EXIT_CRITICAL(sr);
+
     rc = bhd_send_access_evt(seq, &access_evt);
     if (rc != 0) {
         /* XXX: Log error. */
+        OS_ENTER_CRITICAL(sr);
+        bhd_gatts_wait_id = 0;
+        OS_EXIT_CRITICAL(sr);
         return BLE_ATT_ERR_UNLIKELY;
     }
 
@@ -205,9 +699,7 @@ bhd_gatts_access(uint16_t conn_handle, uint16_t attr_handle,
         return rc;
     }
 
-    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR ||
-        ctxt->op == BLE_GATT_ACCESS_OP_READ_DSC) {
-
+    if (is_read) {
         rc = os_mbuf_append(ctxt->om, attr_val, attr_len);
         if (rc != 0) {
             return BLE_ATT_ERR_INSUFFICIENT_RES;
@@ -217,214 +709,866 @@ bhd_gatts_access(uint16_t conn_handle, uint16_t attr_handle,
     return 0;
 }
 
+static void
+bhd_gatts_cnt_resources(const struct bhd_add_svcs_req *req,
+                        struct bhd_gatts_cnt *out_cnt)
+{
+    const struct bhd_svc *svc;
+    const struct bhd_chr *chr;
+    int s;
+    int c;
+
+    *out_cnt = (struct bhd_gatts_cnt){ 0 };
+
+    out_cnt->num_svcs = req->num_svcs + 1;
+    out_cnt->num_uuids = req->num_svcs;
+
+    for (s = 0; s < req->num_svcs; s++) {
+        svc = req->svcs + s;
+        out_cnt->num_chrs += svc->num_chrs;
+        out_cnt->num_uuids += svc->num_chrs;
+        out_cnt->num_val_handles += svc->num_chrs;
+
+        if (svc->num_chrs > 0) {
+            out_cnt->num_chrs++;
+        }
+
+        for (c = 0; c < svc->num_chrs; c++) {
+            chr = svc->chrs + c;
+            out_cnt->num_dscs += chr->num_dscs;
+            out_cnt->num_uuids += chr->num_dscs;
+
+            if (chr->num_dscs > 0) {
+                out_cnt->num_dscs++;
+            }
+        }
+    }
+}
+
+/**
+ * Allocates a zeroed registration with room for the specified entries.
+ *
+ * @return                      The new registration on success;
+ *                              NULL on memory exhaustion.
+ */
+static struct bhd_gatts_reg *
+bhd_gatts_reg_alloc(const struct bhd_gatts_cnt *cnt,
+                    struct bhd_gatts_build *out_bld)
+{
+    struct bhd_gatts_reg *reg;
+    size_t sz;
+
+    sz = sizeof *reg +
+         cnt->num_svcs * sizeof *out_bld->svcs +
+         cnt->num_chrs * sizeof *out_bld->chrs +
+         cnt->num_dscs * sizeof *out_bld->dscs +
+         cnt->num_uuids * sizeof *out_bld->uuids +
+         cnt->num_val_handles * sizeof *reg->val_handles +
+         cnt->num_val_handles * sizeof *reg->prev_val_handles +
+         cnt->num_svcs * sizeof *reg->svc_handles +
+         cnt->num_dscs * sizeof *reg->dsc_handles +
+         cnt->num_svcs * sizeof *reg->removed;
+
+    reg = calloc(1, sz);
+    if (reg == NULL) {
+        return NULL;
+    }
+
+    out_bld->svcs = (struct ble_gatt_svc_def *)(reg + 1);
+    out_bld->chrs = (struct ble_gatt_chr_def *)(out_bld->svcs +
+                                                cnt->num_svcs);
+    out_bld->dscs = (struct ble_gatt_dsc_def *)(out_bld->chrs +
+                                                cnt->num_chrs);
+    out_bld->uuids = (ble_uuid_any_t *)(out_bld->dscs + cnt->num_dscs);
+    out_bld->val_handles = (uint16_t *)(out_bld->uuids + cnt->num_uuids);
+
+    reg->svcs = out_bld->svcs;
+    reg->num_svcs = cnt->num_svcs - 1;
+    reg->dscs = out_bld->dscs;
+    reg->num_dscs = cnt->num_dscs;
+    reg->val_handles = out_bld->val_handles;
+    reg->num_val_handles = cnt->num_val_handles;
+
+    reg->prev_val_handles = reg->val_handles + cnt->num_val_handles;
+    reg->svc_handles = reg->prev_val_handles + cnt->num_val_handles;
+    reg->dsc_handles = reg->svc_handles + cnt->num_svcs;
+    reg->removed = (uint8_t *)(reg->dsc_handles + cnt->num_dscs);
+
+    return reg;
+}
+
 static ble_uuid_any_t *
-bhd_gatts_save_uuid(const ble_uuid_any_t *src)
+bhd_gatts_save_uuid(struct bhd_gatts_build *bld, const ble_uuid_any_t *src)
 {
     ble_uuid_any_t *dst;
 
-    assert(bhd_gatts_num_uuids < BHD_GATTS_MAX_UUIDS);
-
-    dst = bhd_gatts_uuids + bhd_gatts_num_uuids;
+    dst = bld->uuids++;
     *dst = *src;
-    bhd_gatts_num_uuids++;
 
     return dst;
 }
 
 static void
-bhd_gatts_save_dsc(const struct bhd_dsc *dsc)
+bhd_gatts_save_dsc(struct bhd_gatts_build *bld, const struct bhd_dsc *dsc)
 {
     struct ble_gatt_dsc_def *dstd;
     ble_uuid_any_t *dstu;
 
-    assert(bhd_gatts_num_dscs < BHD_GATTS_MAX_DSCS);
-
-    dstd = bhd_gatts_dscs + bhd_gatts_num_dscs;
-    dstu = bhd_gatts_save_uuid(&dsc->uuid);
+    dstd = bld->dscs++;
+    dstu = bhd_gatts_save_uuid(bld, &dsc->uuid);
 
     dstd->uuid = &dstu->u;
     dstd->att_flags = dsc->att_flags;
     dstd->min_key_size = dsc->min_key_size;
     dstd->access_cb = bhd_gatts_access;
     dstd->arg = bhd_seq_arg(bhd_next_evt_seq());
-
-    bhd_gatts_num_dscs++;
 }
 
 static void
-bhd_gatts_save_chr(const struct bhd_chr *chr)
+bhd_gatts_save_chr(struct bhd_gatts_build *bld, const struct bhd_chr *chr)
 {
     struct ble_gatt_chr_def *dstc;
     ble_uuid_any_t *dstu;
     int i;
 
-    assert(bhd_gatts_num_chrs < BHD_GATTS_MAX_CHRS);
-
-    dstc = bhd_gatts_chrs + bhd_gatts_num_chrs;
-    dstu = bhd_gatts_save_uuid(&chr->uuid);
+    dstc = bld->chrs++;
+    dstu = bhd_gatts_save_uuid(bld, &chr->uuid);
 
     dstc->uuid = &dstu->u;
     dstc->flags = chr->flags;
     dstc->min_key_size = chr->min_key_size;
     dstc->access_cb = bhd_gatts_access;
     dstc->arg = bhd_seq_arg(bhd_next_evt_seq());
-
-    dstc->val_handle = bhd_gatts_val_handles + bhd_gatts_num_val_handles;
-    bhd_gatts_num_val_handles++;
+    dstc->val_handle = bld->val_handles++;
 
     if (chr->num_dscs > 0) {
-        dstc->descriptors = bhd_gatts_dscs + bhd_gatts_num_dscs;
+        dstc->descriptors = bld->dscs;
 
         for (i = 0; i < chr->num_dscs; i++) {
-            bhd_gatts_save_dsc(chr->dscs + i);
+            bhd_gatts_save_dsc(bld, chr->dscs + i);
         }
 
-        /* Null terminator. */
-        bhd_gatts_num_dscs++;
+        /* Null terminator (already zeroed). */
+        bld->dscs++;
     }
-
-    bhd_gatts_num_chrs++;
 }
 
 static void
-bhd_gatts_save_svc(const struct bhd_svc *svc)
+bhd_gatts_save_svc(struct bhd_gatts_build *bld, const struct bhd_svc *svc)
 {
     struct ble_gatt_svc_def *dsts;
     ble_uuid_any_t *dstu;
     int i;
 
-    assert(bhd_gatts_num_svcs < BHD_GATTS_MAX_SVCS);
-
-    dsts = bhd_gatts_svcs + bhd_gatts_num_svcs;
-    dstu = bhd_gatts_save_uuid(&svc->uuid);
+    dsts = bld->svcs++;
+    dstu = bhd_gatts_save_uuid(bld, &svc->uuid);
 
     dsts->type = svc->type;
     dsts->uuid = &dstu->u;
 
     if (svc->num_chrs > 0) {
-        dsts->characteristics = bhd_gatts_chrs + bhd_gatts_num_chrs;
+        dsts->characteristics = bld->chrs;
 
         for (i = 0; i < svc->num_chrs; i++) {
-            bhd_gatts_save_chr(svc->chrs + i);
+            bhd_gatts_save_chr(bld, svc->chrs + i);
         }
 
-        /* Null terminator. */
-        bhd_gatts_num_chrs++;
+        /* Null terminator (already zeroed). */
+        bld->chrs++;
     }
-
-    bhd_gatts_num_svcs++;
-}
-
-void
-bhd_gatts_clear_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
-{
-    ble_gatts_reset();
-    
-    bhd_gatts_num_svcs = 0;
-    bhd_gatts_num_chrs = 0;
-    bhd_gatts_num_dscs = 0;
-    bhd_gatts_num_uuids = 0;
-    bhd_gatts_num_val_handles = 0;
 }
 
-void
-bhd_gatts_add_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+static uint32_t
+bhd_gatts_uuid_hash(uint32_t hash, const ble_uuid_t *uuid)
 {
-    int rc;
+    const ble_uuid_any_t *any;
+    uint8_t buf[16];
+    int len;
     int i;
 
-    rc = bhd_gatts_verify_resource_cnt(&req->add_svcs);
-    if (rc != 0) {
-        out_rsp->add_svcs.status = rc;
-        return;
+    if (uuid == NULL) {
+        return hash;
     }
 
-    for (i = 0; i < req->add_svcs.num_svcs; i++) {
-        bhd_gatts_save_svc(req->add_svcs.svcs + i);
+    any = (const ble_uuid_any_t *)uuid;
+    switch (uuid->type) {
+    case BLE_UUID_TYPE_16:
+        buf[0] = any->u16.value;
+        buf[1] = any->u16.value >> 8;
+        len = 2;
+        break;
+
+    case BLE_UUID_TYPE_32:
+        buf[0] = any->u32.value;
+        buf[1] = any->u32.value >> 8;
+        buf[2] = any->u32.value >> 16;
+        buf[3] = any->u32.value >> 24;
+        len = 4;
+        break;
+
+    default:
+        memcpy(buf, any->u128.value, 16);
+        len = 16;
+        break;
+    }
+
+    /* FNV-1a, over the type and then the value. */
+    hash = (hash ^ uuid->type) * 16777619;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 16777619;
     }
-    /* Null terminator. */
-    bhd_gatts_num_svcs++;
+
+    return hash;
 }
 
-void
-bhd_gatts_commit_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+static uint32_t
+bhd_gatts_idx_hash(const ble_uuid_t *svc_uuid, const ble_uuid_t *chr_uuid,
+                   const ble_uuid_t *dsc_uuid)
 {
-    const struct ble_gatt_svc_def *src_svc;
-    const struct ble_gatt_chr_def *src_chr;
-    struct bhd_commit_svc *dst_svc;
-    struct bhd_commit_chr *dst_chr;
-    struct bhd_commit_svc *svcs;
-    int si;
-    int rc;
-    int i;
-
-    svcs = NULL;
+    uint32_t hash;
 
-    if (bhd_gatts_num_svcs > 0) {
-        rc = ble_gatts_count_cfg(bhd_gatts_svcs);
-        if (rc != 0) {
-            goto err;
-        }
+    hash = 2166136261;
+    hash = bhd_gatts_uuid_hash(hash, svc_uuid);
+    hash = bhd_gatts_uuid_hash(hash, chr_uuid);
+    hash = bhd_gatts_uuid_hash(hash, dsc_uuid);
 
-        rc = ble_gatts_add_svcs(bhd_gatts_svcs);
-        if (rc != 0) {
-            goto err;
-        }
-    }
+    return hash;
+}
 
-    rc = ble_gatts_start();
-    if (rc != 0) {
-        goto err;
-    }
+/**
+ * Looks up an attribute in the handle index.
+ *
+ * @param dsc_uuid              The descriptor UUID, or NULL to look up the
+ *                                  characteristic itself.
+ *
+ * @return                      The matching entry;
+ *                              NULL if no such attribute is committed.
+ */
+static const struct bhd_gatts_idx_entry *
+bhd_gatts_idx_find(const ble_uuid_t *svc_uuid, const ble_uuid_t *chr_uuid,
+                   const ble_uuid_t *dsc_uuid)
+{
+    const struct bhd_gatts_idx_entry *entry;
+    uint32_t mask;
+    uint32_t i;
 
-    svcs = calloc(bhd_gatts_num_svcs - 1, sizeof *svcs);
-    if (svcs == NULL) {
-        goto err;
+    if (bhd_gatts_idx_size == 0) {
+        return NULL;
     }
 
-    for (si = 0; si < bhd_gatts_num_svcs - 1; si++) {
-        src_svc = bhd_gatts_svcs + si;
-        dst_svc = svcs + si;
-
-        ble_uuid_copy(&dst_svc->uuid, src_svc->uuid);
-
-        /* Count the number of characteristics. */
-        for (dst_svc->num_chrs = 0; ; dst_svc->num_chrs++) {
-            if (src_svc->characteristics[dst_svc->num_chrs].uuid == NULL) {
-                break;
-            }
+    mask = bhd_gatts_idx_size - 1;
+    i = bhd_gatts_idx_hash(svc_uuid, chr_uuid, dsc_uuid) & mask;
+    while (1) {
+        entry = bhd_gatts_idx + i;
+        if (entry->svc_uuid == NULL) {
+            return NULL;
         }
 
-        dst_svc->chrs = calloc(dst_svc->num_chrs, sizeof *dst_svc->chrs);
-        if (dst_svc->chrs == NULL) {
-            goto err;
+        if (ble_uuid_cmp(entry->svc_uuid, svc_uuid) == 0 &&
+            ble_uuid_cmp(entry->chr_uuid, chr_uuid) == 0 &&
+            (entry->dsc_uuid == NULL) == (dsc_uuid == NULL) &&
+            (dsc_uuid == NULL ||
+             ble_uuid_cmp(entry->dsc_uuid, dsc_uuid) == 0)) {
+
+            return entry;
         }
 
-        for (i = 0; i < dst_svc->num_chrs; i++) {
-            src_chr = src_svc->characteristics + i;
-            dst_chr = dst_svc->chrs + i;
+        i = (i + 1) & mask;
+    }
+}
 
-            ble_uuid_copy(&dst_chr->uuid, src_chr->uuid);
-            dst_chr->val_handle = *src_chr->val_handle;
-            dst_chr->def_handle = dst_chr->val_handle - 1;
+/**
+ * Adds an attribute to the handle index.  If the same UUIDs occur more
+ * than once, the first registered attribute wins, as with
+ * ble_gatts_find_chr().
+ */
+static void
+bhd_gatts_idx_insert(const struct bhd_gatts_idx_entry *src)
+{
+    struct bhd_gatts_idx_entry *entry;
+    uint32_t mask;
+    uint32_t i;
 
-            /* XXX: Descriptors. */
-        }
+    if (bhd_gatts_idx_find(src->svc_uuid, src->chr_uuid,
+                           src->dsc_uuid) != NULL) {
+        return;
     }
 
-    out_rsp->commit_svcs.num_svcs = bhd_gatts_num_svcs - 1;
-    out_rsp->commit_svcs.svcs = svcs;
+    mask = bhd_gatts_idx_size - 1;
+    i = bhd_gatts_idx_hash(src->svc_uuid, src->chr_uuid,
+                           src->dsc_uuid) & mask;
+    while (bhd_gatts_idx[i].svc_uuid != NULL) {
+        i = (i + 1) & mask;
+    }
 
-    return;
+    entry = bhd_gatts_idx + i;
+    *entry = *src;
+}
 
-err:
-    if (svcs != NULL) {
-        for (i = 0; i < bhd_gatts_num_svcs; i++) {
-            free(svcs[i].chrs);
+static void
+bhd_gatts_idx_clear(void)
+{
+    free(bhd_gatts_idx);
+    bhd_gatts_idx = NULL;
+    bhd_gatts_idx_size = 0;
+}
+
+/** Counts the characteristics and descriptors of the committed services. */
+static void
+bhd_gatts_count_attrs(int *out_num_chrs, int *out_num_dscs)
+{
+    const struct ble_gatt_svc_def *svc;
+    const struct ble_gatt_chr_def *chr;
+    const struct ble_gatt_dsc_def *dsc;
+    const struct bhd_gatts_reg *reg;
+
+    *out_num_chrs = 0;
+    *out_num_dscs = 0;
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        for (svc = reg->svcs; svc->uuid != NULL; svc++) {
+            if (svc->characteristics == NULL) {
+                continue;
+            }
+
+            for (chr = svc->characteristics; chr->uuid != NULL; chr++) {
+                (*out_num_chrs)++;
+
+                if (chr->descriptors == NULL) {
+                    continue;
+                }
+
+                for (dsc = chr->descriptors; dsc->uuid != NULL; dsc++) {
+                    (*out_num_dscs)++;
+                }
+            }
+        }
+    }
+}
+
+static uint16_t
+bhd_gatts_dsc_handle(const struct bhd_gatts_reg *reg,
+                     const struct ble_gatt_dsc_def *dsc)
+{
+    return reg->dsc_handles[dsc - reg->dscs];
+}
+
+/**
+ * Indexes every characteristic and descriptor of the committed services.
+ */
+static int
+bhd_gatts_idx_build(void)
+{
+    struct bhd_gatts_idx_entry entry;
+    const struct ble_gatt_svc_def *svc;
+    const struct ble_gatt_chr_def *chr;
+    const struct ble_gatt_dsc_def *dsc;
+    const struct bhd_gatts_reg *reg;
+    int num_chrs;
+    int num_dscs;
+    int size;
+
+    bhd_gatts_idx_clear();
+
+    bhd_gatts_count_attrs(&num_chrs, &num_dscs);
+    if (num_chrs == 0) {
+        return 0;
+    }
+
+    size = 8;
+    while (size < 2 * (num_chrs + num_dscs)) {
+        size *= 2;
+    }
+
+    bhd_gatts_idx = calloc(size, sizeof *bhd_gatts_idx);
+    if (bhd_gatts_idx == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    bhd_gatts_idx_size = size;
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        for (svc = reg->svcs; svc->uuid != NULL; svc++) {
+            if (svc->characteristics == NULL) {
+                continue;
+            }
+
+            for (chr = svc->characteristics; chr->uuid != NULL; chr++) {
+                entry = (struct bhd_gatts_idx_entry) {
+                    .svc_uuid = svc->uuid,
+                    .chr_uuid = chr->uuid,
+                    .def_handle = *chr->val_handle - 1,
+                    .handle = *chr->val_handle,
+                };
+                bhd_gatts_idx_insert(&entry);
+
+                if (chr->descriptors == NULL) {
+                    continue;
+                }
+
+                for (dsc = chr->descriptors; dsc->uuid != NULL; dsc++) {
+                    entry = (struct bhd_gatts_idx_entry) {
+                        .svc_uuid = svc->uuid,
+                        .chr_uuid = chr->uuid,
+                        .dsc_uuid = dsc->uuid,
+                        .handle = bhd_gatts_dsc_handle(reg, dsc),
+                    };
+                    bhd_gatts_idx_insert(&entry);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Fills in the commit_svcs response.  The services, characteristics, and
+ * descriptors share one allocation, which bhd_rsp_send() frees by freeing
+ * the service array.
+ */
+static int
+bhd_gatts_commit_rsp_build(struct bhd_commit_svcs_rsp *out_rsp)
+{
+    const struct ble_gatt_svc_def *src_svc;
+    const struct ble_gatt_chr_def *src_chr;
+    const struct ble_gatt_dsc_def *src_dsc;
+    const struct bhd_gatts_reg *reg;
+    struct bhd_commit_svc *dst_svc;
+    struct bhd_commit_chr *dst_chr;
+    struct bhd_commit_dsc *dst_dsc;
+    int num_svcs;
+    int num_chrs;
+    int num_dscs;
+    int si;
+
+    num_svcs = 0;
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        num_svcs += reg->num_svcs;
+    }
+    if (num_svcs == 0) {
+        return 0;
+    }
+
+    bhd_gatts_count_attrs(&num_chrs, &num_dscs);
+
+    dst_svc = calloc(1, num_svcs * sizeof *dst_svc +
+                        num_chrs * sizeof *dst_chr +
+                        num_dscs * sizeof *dst_dsc);
+    if (dst_svc == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    dst_chr = (struct bhd_commit_chr *)(dst_svc + num_svcs);
+    dst_dsc = (struct bhd_commit_dsc *)(dst_chr + num_chrs);
+
+    out_rsp->svcs = dst_svc;
+    out_rsp->num_svcs = num_svcs;
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        for (si = 0; si < reg->num_svcs; si++, dst_svc++) {
+            src_svc = reg->svcs + si;
+
+            ble_uuid_copy(&dst_svc->uuid, src_svc->uuid);
+            dst_svc->handle = reg->svc_handles[si];
+
+            if (src_svc->characteristics == NULL) {
+                continue;
+            }
+
+            dst_svc->chrs = dst_chr;
+            for (src_chr = src_svc->characteristics;
+                 src_chr->uuid != NULL;
+                 src_chr++, dst_chr++) {
+
+                ble_uuid_copy(&dst_chr->uuid, src_chr->uuid);
+                dst_chr->val_handle = *src_chr->val_handle;
+                dst_chr->def_handle = dst_chr->val_handle - 1;
+                dst_svc->num_chrs++;
+
+                if (src_chr->descriptors == NULL) {
+                    continue;
+                }
+
+                dst_chr->dscs = dst_dsc;
+                for (src_dsc = src_chr->descriptors;
+                     src_dsc->uuid != NULL;
+                     src_dsc++, dst_dsc++) {
+
+                    ble_uuid_copy(&dst_dsc->uuid, src_dsc->uuid);
+                    dst_dsc->handle = bhd_gatts_dsc_handle(reg, src_dsc);
+                    dst_chr->num_dscs++;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+bhd_gatts_reg_free_all(void)
+{
+    struct bhd_gatts_reg *reg;
+
+    while ((reg = STAILQ_FIRST(&bhd_gatts_regs)) != NULL) {
+        STAILQ_REMOVE_HEAD(&bhd_gatts_regs, next);
+        free(reg);
+    }
+}
+
+/**
+ * Host callback for each attribute registered by ble_gatts_start().
+ * Records the assigned handles and moves any stored value from the
+ * attribute's previous handle to its new one.
+ */
+static void
+bhd_gatts_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
+{
+    struct bhd_gatts_reg *reg;
+    uint16_t old_handle;
+    int idx;
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        switch (ctxt->op) {
+        case BLE_GATT_REGISTER_OP_SVC:
+            if (ctxt->svc.svc_def >= reg->svcs &&
+                ctxt->svc.svc_def < reg->svcs + reg->num_svcs) {
+
+                idx = ctxt->svc.svc_def - reg->svcs;
+                reg->svc_handles[idx] = ctxt->svc.handle;
+                return;
+            }
+            break;
+
+        case BLE_GATT_REGISTER_OP_CHR:
+            if (ctxt->chr.chr_def->val_handle >= reg->val_handles &&
+                ctxt->chr.chr_def->val_handle <
+                    reg->val_handles + reg->num_val_handles) {
+
+                idx = ctxt->chr.chr_def->val_handle - reg->val_handles;
+                bhd_gatts_val_move(reg->prev_val_handles[idx],
+                                   ctxt->chr.val_handle);
+                return;
+            }
+            break;
+
+        case BLE_GATT_REGISTER_OP_DSC:
+            if (ctxt->dsc.dsc_def >= reg->dscs &&
+                ctxt->dsc.dsc_def < reg->dscs + reg->num_dscs) {
+
+                idx = ctxt->dsc.dsc_def - reg->dscs;
+                old_handle = reg->dsc_handles[idx];
+                reg->dsc_handles[idx] = ctxt->dsc.handle;
+                bhd_gatts_val_move(old_handle, ctxt->dsc.handle);
+                return;
+            }
+            break;
+
+        default:
+            return;
+        }
+    }
+}
+
+/**
+ * Drops the services that remove_svcs marked from their registrations,
+ * and frees registrations left empty.  Only called while the host has no
+ * database, as the host refers to the definitions being moved.
+ *
+ * @return                      The lowest handle that a removed service
+ *                                  occupied; 0xffff if none was removed.
+ */
+static uint16_t
+bhd_gatts_apply_removals(void)
+{
+    struct bhd_gatts_reg *reg;
+    struct bhd_gatts_reg *nxt;
+    uint16_t start_handle;
+    int dst;
+    int si;
+
+    start_handle = 0xffff;
+
+    for (reg = STAILQ_FIRST(&bhd_gatts_regs); reg != NULL; reg = nxt) {
+        nxt = STAILQ_NEXT(reg, next);
+
+        if (reg->num_removed > 0) {
+            dst = 0;
+            for (si = 0; si < reg->num_svcs; si++) {
+                if (reg->removed[si]) {
+                    if (reg->svc_handles[si] != 0 &&
+                        reg->svc_handles[si] < start_handle) {
+
+                        start_handle = reg->svc_handles[si];
+                    }
+                } else {
+                    reg->svcs[dst] = reg->svcs[si];
+                    reg->svc_handles[dst] = reg->svc_handles[si];
+                    reg->removed[dst] = 0;
+                    dst++;
+                }
+            }
+
+            /* Null terminator. */
+            memset(reg->svcs + dst, 0, sizeof *reg->svcs);
+            reg->num_svcs = dst;
+            reg->num_removed = 0;
+        }
+
+        if (reg->num_svcs == 0) {
+            STAILQ_REMOVE(&bhd_gatts_regs, reg, bhd_gatts_reg, next);
+            free(reg);
+        }
+    }
+
+    return start_handle;
+}
+
+/**
+ * Records that the attributes in the specified range changed.  A commit
+ * only rebuilds the database while no peer is connected, so this never
+ * reaches a connected peer: the host marks the Service Changed value as
+ * changed for bonded peers that subscribed to it, and indicates it when
+ * they reconnect.  This relies on the client having registered the GATT
+ * service with its Service Changed characteristic.
+ */
+static void
+bhd_gatts_svc_changed(uint16_t start_handle, uint16_t end_handle)
+{
+    static const ble_uuid16_t gatt_svc_uuid = BLE_UUID16_INIT(0x1801);
+    static const ble_uuid16_t svc_changed_uuid = BLE_UUID16_INIT(0x2a05);
+
+    const struct ble_gatt_chr_def *chr;
+    const struct bhd_gatts_reg *reg;
+    uint16_t val_handle;
+    uint8_t val[4];
+    int si;
+
+    val_handle = 0;
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        for (si = 0; si < reg->num_svcs && val_handle == 0; si++) {
+            if (ble_uuid_cmp(reg->svcs[si].uuid, &gatt_svc_uuid.u) != 0 ||
+                reg->svcs[si].characteristics == NULL) {
+
+                continue;
+            }
+
+            for (chr = reg->svcs[si].characteristics;
+                 chr->uuid != NULL;
+                 chr++) {
+
+                if (ble_uuid_cmp(chr->uuid, &svc_changed_uuid.u) == 0) {
+                    val_handle = *chr->val_handle;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (val_handle == 0) {
+        BHD_LOG(INFO, "services changed; no service changed "
+                      "characteristic to indicate\n");
+        return;
+    }
+
+    val[0] = start_handle;
+    val[1] = start_handle >> 8;
+    val[2] = end_handle;
+    val[3] = end_handle >> 8;
+
+    if (bhd_gatts_val_store(val_handle, val, sizeof val,
+                            BHD_GATTS_VAL_F_OWNED) != 0) {
+        return;
+    }
+
+    ble_gatts_chr_updated(val_handle);
+}
+
+void
+bhd_gatts_clear_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    int rc;
+
+    rc = ble_gatts_reset();
+    if (rc != 0) {
+        /* The host still refers to the definitions; keep them. */
+        out_rsp->clear_svcs.status = rc;
+        return;
+    }
+    bhd_gatts_started = 0;
+
+    /* Attribute handles get reassigned on the next commit. */
+    bhd_gatts_val_clear_all();
+    bhd_gatts_idx_clear();
+
+    bhd_gatts_reg_free_all();
+}
+
+/**
+ * Converts the services in an add_svcs request into host definitions.
+ * The services are registered with the host by the next commit_svcs.
+ */
+void
+bhd_gatts_add_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    struct bhd_gatts_build bld;
+    struct bhd_gatts_cnt cnt;
+    struct bhd_gatts_reg *reg;
+    int i;
+
+    if (req->add_svcs.num_svcs == 0) {
+        return;
+    }
+
+    bhd_gatts_cnt_resources(&req->add_svcs, &cnt);
+
+    reg = bhd_gatts_reg_alloc(&cnt, &bld);
+    if (reg == NULL) {
+        out_rsp->add_svcs.status = BLE_HS_ENOMEM;
+        return;
+    }
+
+    for (i = 0; i < req->add_svcs.num_svcs; i++) {
+        bhd_gatts_save_svc(&bld, req->add_svcs.svcs + i);
+    }
+
+    STAILQ_INSERT_TAIL(&bhd_gatts_regs, reg, next);
+}
+
+/**
+ * Marks services for removal by the next commit_svcs.  Every UUID must
+ * name a registered service; otherwise nothing is marked.  If several
+ * services share a UUID, all of them are removed.
+ */
+void
+bhd_gatts_remove_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    struct bhd_gatts_reg *reg;
+    int found;
+    int pass;
+    int si;
+    int i;
+
+    /* Validate on the first pass, mark on the second. */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < req->remove_svcs.num_uuids; i++) {
+            found = 0;
+            STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+                for (si = 0; si < reg->num_svcs; si++) {
+                    if (ble_uuid_cmp(reg->svcs[si].uuid,
+                                     &req->remove_svcs.uuids[i].u) != 0) {
+
+                        continue;
+                    }
+
+                    found = 1;
+                    if (pass == 1 && !reg->removed[si]) {
+                        reg->removed[si] = 1;
+                        reg->num_removed++;
+                    }
+                }
+            }
+
+            if (!found) {
+                out_rsp->remove_svcs.status = BLE_HS_ENOENT;
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Registers the current set of services with the host.  If a database is
+ * already running, it is rebuilt from scratch: the host cannot add to or
+ * remove from a started database, so the whole database is reset and every
+ * remaining service registered again.  Services marked by remove_svcs are
+ * dropped, services added since the last commit are appended, and stored
+ * values follow their attributes to any new handles.
+ *
+ * The host only allows the reset while no peer is connected; otherwise the
+ * commit fails with BLE_HS_EBUSY and the pending changes are kept for a
+ * later attempt.  Bonded peers learn of the change through Service Changed
+ * when they reconnect.
+ */
+void
+bhd_gatts_commit_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    struct bhd_gatts_reg *reg;
+    uint16_t changed_start;
+    int was_started;
+    int rc;
+
+    was_started = bhd_gatts_started;
+    if (was_started) {
+        rc = ble_gatts_reset();
+        if (rc != 0) {
+            goto err;
         }
-        free(svcs);
+        bhd_gatts_started = 0;
     }
 
+    /* The index refers to definitions that are about to change. */
+    bhd_gatts_idx_clear();
+
+    changed_start = bhd_gatts_apply_removals();
+
+    /* Remember the old handles so that stored values can follow them. */
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        memcpy(reg->prev_val_handles, reg->val_handles,
+               reg->num_val_handles * sizeof *reg->val_handles);
+    }
+    bhd_gatts_val_detach();
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        if (!reg->counted) {
+            rc = ble_gatts_count_cfg(reg->svcs);
+            if (rc != 0) {
+                goto err;
+            }
+            reg->counted = 1;
+        }
+
+        rc = ble_gatts_add_svcs(reg->svcs);
+        if (rc != 0) {
+            goto err;
+        }
+    }
+
+    rc = ble_gatts_start();
+    if (rc != 0) {
+        goto err;
+    }
+    bhd_gatts_started = 1;
+    bhd_gatts_val_free_old();
+
+    STAILQ_FOREACH(reg, &bhd_gatts_regs, next) {
+        if (!reg->committed) {
+            if (reg->svc_handles[0] < changed_start) {
+                changed_start = reg->svc_handles[0];
+            }
+            reg->committed = 1;
+        }
+    }
+
+    if (was_started && changed_start != 0xffff) {
+        bhd_gatts_svc_changed(changed_start, 0xffff);
+    }
+
+    rc = bhd_gatts_idx_build();
+    if (rc != 0) {
+        goto err;
+    }
+
+    rc = bhd_gatts_commit_rsp_build(&out_rsp->commit_svcs);
+    if (rc != 0) {
+        goto err;
+    }
+
+    return;
+
+err:
+    /* Values whose attributes never got registered are gone. */
+    bhd_gatts_val_free_old();
+
     out_rsp->commit_svcs.status = rc;
 }
 
@@ -432,19 +1576,282 @@ void
 bhd_gatts_access_status(const struct bhd_req *req, struct bhd_rsp *out_rsp)
 {
     out_rsp->access_status.status =
-        bhd_gatts_set_access_result(req->access_status.att_status,
+        bhd_gatts_set_access_result(req->access_status.access_id,
+                                    req->access_status.att_status,
                                     req->access_status.data,
-                                    req->access_status.data_len);
+                                    req->access_status.data_len,
+                                    req->access_status.cache);
+}
+
+void
+bhd_gatts_set_value(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    uint8_t flags;
+
+    if (req->set_value.attr_handle == 0) {
+        out_rsp->set_value.status = SYS_EINVAL;
+        return;
+    }
+
+    flags = BHD_GATTS_VAL_F_OWNED;
+    if (req->set_value.forward_reads) {
+        flags |= BHD_GATTS_VAL_F_FORWARD;
+    }
+
+    out_rsp->set_value.status =
+        bhd_gatts_val_store(req->set_value.attr_handle,
+                            req->set_value.data, req->set_value.data_len,
+                            flags);
 }
 
 void
 bhd_gatts_find_chr(const struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    rsp->find_chr.status =
-        ble_gatts_find_chr(&req->find_chr.svc_uuid.u,
-                           &req->find_chr.chr_uuid.u,
-                           &rsp->find_chr.def_handle,
-                           &rsp->find_chr.val_handle);
+    const struct bhd_gatts_idx_entry *entry;
+
+    entry = bhd_gatts_idx_find(&req->find_chr.svc_uuid.u,
+                               &req->find_chr.chr_uuid.u, NULL);
+    if (entry == NULL) {
+        rsp->find_chr.status = BLE_HS_ENOENT;
+        return;
+    }
+
+    rsp->find_chr.def_handle = entry->def_handle;
+    rsp->find_chr.val_handle = entry->handle;
+}
+
+void
+bhd_gatts_find_dsc(const struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    const struct bhd_gatts_idx_entry *entry;
+
+    entry = bhd_gatts_idx_find(&req->find_dsc.svc_uuid.u,
+                               &req->find_dsc.chr_uuid.u,
+                               &req->find_dsc.dsc_uuid.u);
+    if (entry == NULL) {
+        rsp->find_dsc.status = BLE_HS_ENOENT;
+        return;
+    }
+
+    rsp->find_dsc.handle = entry->handle;
+}
+
+/**
+ * Records a subscription change reported by the host.  Called in the host
+ * task.
+ *
+ * @param flags                 The peer's new BHD_GATTS_SUB_F_[...] flags;
+ *                                  0 if it unsubscribed.
+ */
+void
+bhd_gatts_sub_update(uint16_t conn_handle, uint16_t attr_handle,
+                     uint8_t flags)
+{
+    struct bhd_gatts_sub *old_subs;
+    struct bhd_gatts_sub *subs;
+    int max_subs;
+    os_sr_t sr;
+    int i;
+
+    for (i = 0; i < bhd_gatts_num_subs; i++) {
+        if (bhd_gatts_subs[i].conn_handle == conn_handle &&
+            bhd_gatts_subs[i].attr_handle == attr_handle) {
+
+            break;
+        }
+    }
+
+    if (i < bhd_gatts_num_subs) {
+        OS_ENTER_CRITICAL(sr);
+        if (flags != 0) {
+            bhd_gatts_subs[i].flags = flags;
+        } else {
+            bhd_gatts_num_subs--;
+            bhd_gatts_subs[i] = bhd_gatts_subs[bhd_gatts_num_subs];
+        }
+        OS_EXIT_CRITICAL(sr);
+        return;
+    }
+
+    if (flags == 0) {
+        return;
+    }
+
+    old_subs = NULL;
+    if (bhd_gatts_num_subs >= bhd_gatts_max_subs) {
+        max_subs = bhd_gatts_max_subs == 0 ? 8 : bhd_gatts_max_subs * 2;
+        subs = malloc(max_subs * sizeof *subs);
+        if (subs == NULL) {
+            BHD_LOG(ERROR, "no memory to record subscription; "
+                           "conn_handle=%d attr_handle=%d\n",
+                    conn_handle, attr_handle);
+            return;
+        }
+
+        OS_ENTER_CRITICAL(sr);
+        if (bhd_gatts_num_subs > 0) {
+            memcpy(subs, bhd_gatts_subs,
+                   bhd_gatts_num_subs * sizeof *bhd_gatts_subs);
+        }
+        old_subs = bhd_gatts_subs;
+        bhd_gatts_subs = subs;
+        bhd_gatts_max_subs = max_subs;
+        OS_EXIT_CRITICAL(sr);
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    bhd_gatts_subs[bhd_gatts_num_subs] = (struct bhd_gatts_sub) {
+        .conn_handle = conn_handle,
+        .attr_handle = attr_handle,
+        .flags = flags,
+    };
+    bhd_gatts_num_subs++;
+    OS_EXIT_CRITICAL(sr);
+
+    free(old_subs);
+}
+
+/**
+ * Forgets a terminated connection's subscriptions.  Called in the host
+ * task.
+ */
+void
+bhd_gatts_conn_broken(uint16_t conn_handle)
+{
+    os_sr_t sr;
+    int i;
+
+    OS_ENTER_CRITICAL(sr);
+    i = 0;
+    while (i < bhd_gatts_num_subs) {
+        if (bhd_gatts_subs[i].conn_handle == conn_handle) {
+            bhd_gatts_num_subs--;
+            bhd_gatts_subs[i] = bhd_gatts_subs[bhd_gatts_num_subs];
+        } else {
+            i++;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+}
+
+/**
+ * Lists the connections subscribed to a characteristic.
+ *
+ * @param flags                 The BHD_GATTS_SUB_F_[...] flags of interest;
+ *                                  a connection is listed if it has any of
+ *                                  them set.
+ *
+ * @return                      The number of connections written to
+ *                                  out_conn_handles.
+ */
+int
+bhd_gatts_subscribers(uint16_t attr_handle, uint8_t flags,
+                      uint16_t *out_conn_handles, int max_conn_handles)
+{
+    os_sr_t sr;
+    int num;
+    int i;
+
+    num = 0;
+
+    OS_ENTER_CRITICAL(sr);
+    for (i = 0; i < bhd_gatts_num_subs && num < max_conn_handles; i++) {
+        if (bhd_gatts_subs[i].attr_handle == attr_handle &&
+            bhd_gatts_subs[i].flags & flags) {
+
+            out_conn_handles[num++] = bhd_gatts_subs[i].conn_handle;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return num;
+}
+
+static int
+bhd_gatts_handle_listed(const uint16_t *handles, int num_handles,
+                        uint16_t handle)
+{
+    int i;
+
+    if (num_handles == 0) {
+        return 1;
+    }
+
+    for (i = 0; i < num_handles; i++) {
+        if (handles[i] == handle) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Lists the current subscriptions, optionally restricted to some
+ * connections and characteristics.
+ */
+void
+bhd_gatts_subscriptions(const struct bhd_req *req, struct bhd_rsp *out_rsp)
+{
+    const struct bhd_subscriptions_req *sreq;
+    struct bhd_subscription *subs;
+    struct bhd_gatts_sub *sub;
+    int max_subs;
+    int num_subs;
+    os_sr_t sr;
+    int i;
+
+    sreq = &req->subscriptions;
+
+    /*
+     * The host task can add entries between sizing the buffer and taking
+     * the snapshot.  If the table outgrew the buffer, try again; the whole
+     * snapshot is taken in one critical section, so it is never truncated.
+     */
+    max_subs = 0;
+    subs = NULL;
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        if (bhd_gatts_num_subs <= max_subs) {
+            break;
+        }
+        max_subs = bhd_gatts_num_subs;
+        OS_EXIT_CRITICAL(sr);
+
+        free(subs);
+        subs = malloc(max_subs * sizeof *subs);
+        if (subs == NULL) {
+            out_rsp->subscriptions.status = SYS_ENOMEM;
+            return;
+        }
+    }
+
+    /* Still in the critical section. */
+    num_subs = 0;
+    for (i = 0; i < bhd_gatts_num_subs; i++) {
+        sub = bhd_gatts_subs + i;
+        if (!bhd_gatts_handle_listed(sreq->conn_handles,
+                                     sreq->num_conn_handles,
+                                     sub->conn_handle) ||
+            !bhd_gatts_handle_listed(sreq->attr_handles,
+                                     sreq->num_attr_handles,
+                                     sub->attr_handle)) {
+
+            continue;
+        }
+
+        subs[num_subs] = (struct bhd_subscription) {
+            .conn_handle = sub->conn_handle,
+            .attr_handle = sub->attr_handle,
+            .notify = !!(sub->flags & BHD_GATTS_SUB_F_NOTIFY),
+            .indicate = !!(sub->flags & BHD_GATTS_SUB_F_INDICATE),
+        };
+        num_subs++;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    out_rsp->subscriptions.subs = subs;
+    out_rsp->subscriptions.num_subs = num_subs;
 }
 
 void
@@ -454,4 +1861,6 @@ bhd_gatts_init(void)
 
     rc = os_sem_init(&bhd_gatts_access_sem, 0);
     assert(rc == 0);
+
+    ble_hs_cfg.gatts_register_cb = bhd_gatts_register_cb;
 }
@@ -1,15 +1,30 @@
 #ifndef H_BHD_GATTS_
 #define H_BHD_GATTS_
 
+#include <inttypes.h>
+
 struct bhd_req;
 struct bhd_rsp;
 
+#define BHD_GATTS_SUB_F_NOTIFY          0x01
+#define BHD_GATTS_SUB_F_INDICATE        0x02
+
 void bhd_gatts_clear_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp);
 void bhd_gatts_add_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp);
+void bhd_gatts_remove_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp);
 void bhd_gatts_commit_svcs(const struct bhd_req *req, struct bhd_rsp *out_rsp);
 void bhd_gatts_access_status(const struct bhd_req *req,
                              struct bhd_rsp *out_rsp);
+void bhd_gatts_set_value(const struct bhd_req *req, struct bhd_rsp *out_rsp);
 void bhd_gatts_find_chr(const struct bhd_req *req, struct bhd_rsp *rsp);
+void bhd_gatts_find_dsc(const struct bhd_req *req, struct bhd_rsp *rsp);
+void bhd_gatts_sub_update(uint16_t conn_handle, uint16_t attr_handle,
+                          uint8_t flags);
+void bhd_gatts_conn_broken(uint16_t conn_handle);
+int bhd_gatts_subscribers(uint16_t attr_handle, uint8_t flags,
+                          uint16_t *out_conn_handles, int max_conn_handles);
+void bhd_gatts_subscriptions(const struct bhd_req *req,
+                             struct bhd_rsp *out_rsp);
 void bhd_gatts_init(void);
 
 #endif
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "defs/error.h"
+#include "bhd_hex.h"
+#include "parse.h"
+
+/**
+ * Codec for the byte string format used in blehostd messages:
+ * "0xaa:0xbb:0xcc".  Each byte is converted with a single table lookup rather
+ * than a call to snprintf() or strtoul().
+ */
+
+/** Two lowercase hex digits for each byte value. */
+static const char bhd_hex_pairs[] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/** Value of each hex digit character; -1 for non-digits. */
+static const int8_t bhd_hex_vals[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/**
+ * Encodes a byte array as "0xaa:0xbb:0xcc".  Every byte is written as five
+ * characters ("0xaa:"), so the destination must have room for 5 * src_len
+ * characters.  The final separator is not part of the result; the caller may
+ * overwrite it (e.g., with a null terminator).
+ *
+ * @return                      The length of the encoded string.
+ */
+int
+bhd_hex_enc(char *dst, const uint8_t *src, int src_len)
+{
+    const char *pair;
+    int i;
+
+    for (i = 0; i < src_len; i++) {
+        pair = bhd_hex_pairs + 2 * src[i];
+
+        dst[0] = '0';
+        dst[1] = 'x';
+        dst[2] = pair[0];
+        dst[3] = pair[1];
+        dst[4] = ':';
+        dst += 5;
+    }
+
+    return src_len == 0 ? 0 : src_len * 5 - 1;
+}
+
+/**
+ * Validates a string in the canonical "0xaa:0xbb" format.  Both ':' and '-'
+ * are accepted as separators.
+ *
+ * @return                      The number of bytes in the string;
+ *                              -1 if the string is not in canonical format.
+ */
+static int
+bhd_hex_canonical_len(const char *src)
+{
+    const uint8_t *u8p;
+    int len;
+
+    u8p = (const uint8_t *)src;
+    if (*u8p == '\0') {
+        return 0;
+    }
+
+    len = 0;
+    while (1) {
+        if (u8p[0] != '0' || (u8p[1] != 'x' && u8p[1] != 'X') ||
+            bhd_hex_vals[u8p[2]] == -1 || bhd_hex_vals[u8p[3]] == -1) {
+
+            return -1;
+        }
+        len++;
+
+        switch (u8p[4]) {
+        case '\0':
+            return len;
+
+        case ':':
+        case '-':
+            u8p += 5;
+            break;
+
+        default:
+            return -1;
+        }
+    }
+}
+
+/**
+ * Decodes a byte string of the form "0xaa:0xbb:0xcc".  Strings in a
+ * non-canonical form (e.g., "a:b:c") are handed to the generic parser, which
+ * may modify the source string.  The destination may be the source string
+ * itself.
+ *
+ * @return                      0 on success;
+ *                              SYS_EINVAL if the string contains more than
+ *                                  max_len bytes;
+ *                              other nonzero if the string is malformed.
+ */
+int
+bhd_hex_dec(char *src, int max_len, uint8_t *dst, int *out_len)
+{
+    const uint8_t *u8p;
+    int len;
+    int i;
+
+    len = bhd_hex_canonical_len(src);
+    if (len == -1) {
+        return parse_arg_byte_stream(src, max_len, dst, out_len);
+    }
+
+    if (len > max_len) {
+        return SYS_EINVAL;
+    }
+
+    /* Each byte is written at or before the text it was decoded from. */
+    u8p = (const uint8_t *)src;
+    for (i = 0; i < len; i++) {
+        dst[i] = (bhd_hex_vals[u8p[2]] << 4) | bhd_hex_vals[u8p[3]];
+        u8p += 5;
+    }
+
+    *out_len = len;
+    return 0;
+}
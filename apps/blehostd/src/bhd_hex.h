@@ -0,0 +1,12 @@
+#ifndef H_BHD_HEX_
+#define H_BHD_HEX_
+
+#include <inttypes.h>
+
+/** Number of characters needed to encode one byte ("0xaa:"). */
+#define BHD_HEX_CHARS_PER_BYTE      5
+
+int bhd_hex_enc(char *dst, const uint8_t *src, int src_len);
+int bhd_hex_dec(char *src, int max_len, uint8_t *dst, int *out_len);
+
+#endif
@@ -0,0 +1,508 @@
+#include <assert.h>
+#include <string.h>
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_kv.h"
+#include "defs/error.h"
+#include "nimble/ble.h"
+#include "nimble/hci_common.h"
+#include "host/ble_hs.h"
+
+static const struct bhd_kv_str_int bhd_op_map[] = {
+    { "request",            BHD_MSG_OP_REQ },
+    { "response",           BHD_MSG_OP_RSP },
+    { "event",              BHD_MSG_OP_EVT },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_type_map[] = {
+    { "error",              BHD_MSG_TYPE_ERR },
+    { "sync",               BHD_MSG_TYPE_SYNC },
+    { "connect",            BHD_MSG_TYPE_CONNECT },
+    { "terminate",          BHD_MSG_TYPE_TERMINATE },
+    { "disc_all_svcs",      BHD_MSG_TYPE_DISC_ALL_SVCS },
+    { "disc_svc_uuid",      BHD_MSG_TYPE_DISC_SVC_UUID },
+    { "disc_all_chrs",      BHD_MSG_TYPE_DISC_ALL_CHRS },
+    { "disc_chr_uuid",      BHD_MSG_TYPE_DISC_CHR_UUID },
+    { "disc_all_dscs",      BHD_MSG_TYPE_DISC_ALL_DSCS },
+    { "write",              BHD_MSG_TYPE_WRITE },
+    { "write_cmd",          BHD_MSG_TYPE_WRITE_CMD },
+    { "exchange_mtu",       BHD_MSG_TYPE_EXCHANGE_MTU },
+    { "gen_rand_addr",      BHD_MSG_TYPE_GEN_RAND_ADDR },
+    { "set_rand_addr",      BHD_MSG_TYPE_SET_RAND_ADDR },
+    { "conn_cancel",        BHD_MSG_TYPE_CONN_CANCEL },
+    { "scan",               BHD_MSG_TYPE_SCAN },
+    { "scan_cancel",        BHD_MSG_TYPE_SCAN_CANCEL },
+    { "set_preferred_mtu",  BHD_MSG_TYPE_SET_PREFERRED_MTU },
+    { "security_initiate",  BHD_MSG_TYPE_ENC_INITIATE },
+    { "conn_find",          BHD_MSG_TYPE_CONN_FIND },
+    { "reset",              BHD_MSG_TYPE_RESET },
+    { "adv_start",          BHD_MSG_TYPE_ADV_START },
+    { "adv_stop",           BHD_MSG_TYPE_ADV_STOP },
+    { "adv_set_data",       BHD_MSG_TYPE_ADV_SET_DATA },
+    { "adv_rsp_set_data",   BHD_MSG_TYPE_ADV_RSP_SET_DATA },
+    { "adv_fields",         BHD_MSG_TYPE_ADV_FIELDS },
+    { "clear_svcs",         BHD_MSG_TYPE_CLEAR_SVCS },
+    { "add_svcs",           BHD_MSG_TYPE_ADD_SVCS },
+    { "commit_svcs",        BHD_MSG_TYPE_COMMIT_SVCS },
+    { "access_status",      BHD_MSG_TYPE_ACCESS_STATUS },
+    { "notify",             BHD_MSG_TYPE_NOTIFY },
+    { "find_chr",           BHD_MSG_TYPE_FIND_CHR },
+    { "sm_inject_io",       BHD_MSG_TYPE_SM_INJECT_IO },
+    { "batch",              BHD_MSG_TYPE_BATCH },
+    { "subscribe",          BHD_MSG_TYPE_SUBSCRIBE },
+    { "ring_open",          BHD_MSG_TYPE_RING_OPEN },
+    { "bulk_open",          BHD_MSG_TYPE_BULK_OPEN },
+    { "set_value",          BHD_MSG_TYPE_SET_VALUE },
+    { "remove_svcs",        BHD_MSG_TYPE_REMOVE_SVCS },
+    { "find_dsc",           BHD_MSG_TYPE_FIND_DSC },
+    { "notify_multi",       BHD_MSG_TYPE_NOTIFY_MULTI },
+    { "subscriptions",      BHD_MSG_TYPE_SUBSCRIPTIONS },
+
+    { "sync_evt",           BHD_MSG_TYPE_SYNC_EVT },
+    { "connect_evt",        BHD_MSG_TYPE_CONNECT_EVT },
+    { "disconnect_evt",     BHD_MSG_TYPE_DISCONNECT_EVT },
+    { "disc_svc_evt",       BHD_MSG_TYPE_DISC_SVC_EVT },
+    { "disc_chr_evt",       BHD_MSG_TYPE_DISC_CHR_EVT },
+    { "disc_dsc_evt",       BHD_MSG_TYPE_DISC_DSC_EVT },
+    { "write_ack_evt",      BHD_MSG_TYPE_WRITE_ACK_EVT },
+    { "notify_rx_evt",      BHD_MSG_TYPE_NOTIFY_RX_EVT },
+    { "mtu_change_evt",     BHD_MSG_TYPE_MTU_CHANGE_EVT },
+    { "scan_evt",           BHD_MSG_TYPE_SCAN_EVT },
+    { "scan_tmo_evt",       BHD_MSG_TYPE_SCAN_TMO_EVT },
+    { "enc_change_evt",     BHD_MSG_TYPE_ENC_CHANGE_EVT },
+    { "reset_evt",          BHD_MSG_TYPE_RESET_EVT },
+    { "access_evt",         BHD_MSG_TYPE_ACCESS_EVT },
+    { "adv_complete_evt",   BHD_MSG_TYPE_ADV_COMPLETE_EVT },
+    { "passkey_evt",        BHD_MSG_TYPE_PASSKEY_EVT },
+    { "dropped_evt",        BHD_MSG_TYPE_DROPPED_EVT },
+    { "indicate_done_evt",  BHD_MSG_TYPE_INDICATE_DONE_EVT },
+    { "subscribe_evt",      BHD_MSG_TYPE_SUBSCRIBE_EVT },
+
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_msg_fmt_map[] = {
+    { "json",           BHD_MSG_FMT_JSON },
+    { "cbor",           BHD_MSG_FMT_CBOR },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_data_enc_map[] = {
+    { "hex",            BHD_DATA_ENC_HEX },
+    { "base64",         BHD_DATA_ENC_BASE64 },
+    { "raw",            BHD_DATA_ENC_RAW },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_addr_type_map[] = {
+    { "public",         BLE_ADDR_PUBLIC },
+    { "random",         BLE_ADDR_RANDOM },
+    { "rpa_pub",        BLE_ADDR_PUBLIC_ID },
+    { "rpa_rnd",        BLE_ADDR_RANDOM_ID },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_scan_filter_policy_map[] = {
+    { "no_wl",          BLE_HCI_SCAN_FILT_NO_WL },
+    { "use_wl",         BLE_HCI_SCAN_FILT_USE_WL },
+    { "no_wl_inita",    BLE_HCI_SCAN_FILT_NO_WL_INITA },
+    { "use_wl_inita",   BLE_HCI_SCAN_FILT_USE_WL_INITA },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_adv_event_type_map[] = {
+    { "ind",            BLE_HCI_ADV_TYPE_ADV_IND },
+    { "direct_ind_hd",  BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_HD },
+    { "scan_ind",       BLE_HCI_ADV_TYPE_ADV_SCAN_IND },
+    { "nonconn_ind",    BLE_HCI_ADV_TYPE_ADV_NONCONN_IND },
+    { "direct_ind_ld",  BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_LD },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_adv_conn_mode_map[] = {
+    { "non",            BLE_GAP_CONN_MODE_NON },
+    { "dir",            BLE_GAP_CONN_MODE_DIR },
+    { "und",            BLE_GAP_CONN_MODE_UND },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_adv_disc_mode_map[] = {
+    { "non",            BLE_GAP_DISC_MODE_NON },
+    { "ltd",            BLE_GAP_DISC_MODE_LTD },
+    { "gen",            BLE_GAP_DISC_MODE_GEN },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_adv_filter_policy_map[] = {
+    { "none",           BLE_HCI_ADV_FILT_NONE },
+    { "scan",           BLE_HCI_ADV_FILT_SCAN },
+    { "conn",           BLE_HCI_ADV_FILT_CONN },
+    { "both",           BLE_HCI_ADV_FILT_BOTH },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_svc_type_map[] = {
+    { "primary",        BLE_GATT_SVC_TYPE_PRIMARY },
+    { "secondary",      BLE_GATT_SVC_TYPE_SECONDARY },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_gatt_access_op_map[] = {
+    { "read_chr",       BLE_GATT_ACCESS_OP_READ_CHR },
+    { "write_chr",      BLE_GATT_ACCESS_OP_WRITE_CHR },
+    { "read_dsc",       BLE_GATT_ACCESS_OP_READ_DSC },
+    { "write_dsc",      BLE_GATT_ACCESS_OP_WRITE_DSC },
+    { 0 },
+};
+
+static const struct bhd_kv_str_int bhd_sm_passkey_action_map[] = {
+    { "oob",            BLE_SM_IOACT_OOB },
+    { "input",          BLE_SM_IOACT_INPUT },
+    { "disp",           BLE_SM_IOACT_DISP },
+    { "numcmp",         BLE_SM_IOACT_NUMCMP },
+    { 0 },
+};
+
+/**
+ * Defines a map index with 2^slot_bits slots.  The seeds are constants: they
+ * must place every key, and every value, in a distinct slot.  Run
+ * "make -C tools check" after changing a map; bhd_kv_test checks the seeds
+ * and prints replacements if they no longer work.
+ */
+#define BHD_KV_IDX(name_, map_, slot_bits_, key_seed_, val_seed_)       \
+    static uint8_t name_ ## _key_slots[1 << (slot_bits_)];              \
+    static uint8_t name_ ## _val_slots[1 << (slot_bits_)];              \
+    static struct bhd_kv_idx name_ = {                                  \
+        .name = #name_,                                                 \
+        .map = (map_),                                                  \
+        .key_seed = (key_seed_),                                        \
+        .val_seed = (val_seed_),                                        \
+        .slot_bits = (slot_bits_),                                      \
+        .key_slots = name_ ## _key_slots,                               \
+        .val_slots = name_ ## _val_slots,                               \
+    }
+
+BHD_KV_IDX(bhd_op_idx, bhd_op_map, 5, 1, 0);
+BHD_KV_IDX(bhd_type_idx, bhd_type_map, 9, 14, 198);
+BHD_KV_IDX(bhd_msg_fmt_idx, bhd_msg_fmt_map, 5, 0, 0);
+BHD_KV_IDX(bhd_data_enc_idx, bhd_data_enc_map, 5, 0, 0);
+BHD_KV_IDX(bhd_addr_type_idx, bhd_addr_type_map, 5, 0, 0);
+BHD_KV_IDX(bhd_scan_filter_policy_idx, bhd_scan_filter_policy_map, 5, 0, 0);
+BHD_KV_IDX(bhd_adv_event_type_idx, bhd_adv_event_type_map, 5, 0, 0);
+BHD_KV_IDX(bhd_adv_conn_mode_idx, bhd_adv_conn_mode_map, 5, 0, 0);
+BHD_KV_IDX(bhd_adv_disc_mode_idx, bhd_adv_disc_mode_map, 5, 0, 0);
+BHD_KV_IDX(bhd_adv_filter_policy_idx, bhd_adv_filter_policy_map, 5, 0, 0);
+BHD_KV_IDX(bhd_svc_type_idx, bhd_svc_type_map, 5, 0, 0);
+BHD_KV_IDX(bhd_gatt_access_op_idx, bhd_gatt_access_op_map, 5, 0, 0);
+BHD_KV_IDX(bhd_sm_passkey_action_idx, bhd_sm_passkey_action_map, 5, 0, 0);
+
+struct bhd_kv_idx * const bhd_kv_idxs[] = {
+    &bhd_op_idx,
+    &bhd_type_idx,
+    &bhd_msg_fmt_idx,
+    &bhd_data_enc_idx,
+    &bhd_addr_type_idx,
+    &bhd_scan_filter_policy_idx,
+    &bhd_adv_event_type_idx,
+    &bhd_adv_conn_mode_idx,
+    &bhd_adv_disc_mode_idx,
+    &bhd_adv_filter_policy_idx,
+    &bhd_svc_type_idx,
+    &bhd_gatt_access_op_idx,
+    &bhd_sm_passkey_action_idx,
+};
+
+const int bhd_kv_num_idxs = sizeof bhd_kv_idxs / sizeof bhd_kv_idxs[0];
+
+static uint32_t
+bhd_kv_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+static int
+bhd_kv_key_slot(const struct bhd_kv_idx *idx, uint32_t seed, const char *key)
+{
+    uint32_t h;
+
+    /* FNV-1a. */
+    h = 2166136261u ^ seed;
+    while (*key != '\0') {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+
+    return bhd_kv_mix(h) >> (32 - idx->slot_bits);
+}
+
+static int
+bhd_kv_val_slot(const struct bhd_kv_idx *idx, uint32_t seed, int val)
+{
+    return bhd_kv_mix((uint32_t)val ^ seed) >> (32 - idx->slot_bits);
+}
+
+/**
+ * Places every entry of a map in the slot table of its index, using the
+ * specified seed.
+ *
+ * @param slots                 The table to fill in; 2^slot_bits entries.
+ * @param by_val                Whether to place entries by value rather than
+ *                                  by key.
+ *
+ * @return                      0 on success;
+ *                              SYS_EAGAIN if two entries map to the same slot
+ *                                  or the map does not fit in the table.
+ */
+int
+bhd_kv_idx_place(const struct bhd_kv_idx *idx, uint8_t *slots, uint32_t seed,
+                 int by_val)
+{
+    int slot;
+    int i;
+
+    memset(slots, 0, 1 << idx->slot_bits);
+
+    for (i = 0; idx->map[i].key != NULL; i++) {
+        if (i >= UINT8_MAX) {
+            return SYS_EAGAIN;
+        }
+
+        if (by_val) {
+            slot = bhd_kv_val_slot(idx, seed, idx->map[i].val);
+        } else {
+            slot = bhd_kv_key_slot(idx, seed, idx->map[i].key);
+        }
+
+        if (slots[slot] != 0) {
+            return SYS_EAGAIN;
+        }
+        slots[slot] = i + 1;
+    }
+
+    return 0;
+}
+
+int
+bhd_kv_idx_parse(const struct bhd_kv_idx *idx, const char *key)
+{
+    const struct bhd_kv_str_int *entry;
+    int slot;
+
+    slot = bhd_kv_key_slot(idx, idx->key_seed, key);
+    if (idx->key_slots[slot] == 0) {
+        return -1;
+    }
+
+    entry = idx->map + idx->key_slots[slot] - 1;
+    if (strcmp(entry->key, key) != 0) {
+        return -1;
+    }
+
+    return entry->val;
+}
+
+const char *
+bhd_kv_idx_rev_parse(const struct bhd_kv_idx *idx, int val)
+{
+    const struct bhd_kv_str_int *entry;
+    int slot;
+
+    slot = bhd_kv_val_slot(idx, idx->val_seed, val);
+    if (idx->val_slots[slot] == 0) {
+        return NULL;
+    }
+
+    entry = idx->map + idx->val_slots[slot] - 1;
+    if (entry->val != val) {
+        return NULL;
+    }
+
+    return entry->key;
+}
+
+int
+bhd_op_parse(const char *op_str)
+{
+    return bhd_kv_idx_parse(&bhd_op_idx, op_str);
+}
+
+const char *
+bhd_op_rev_parse(int op)
+{
+    return bhd_kv_idx_rev_parse(&bhd_op_idx, op);
+}
+
+int
+bhd_type_parse(const char *type_str)
+{
+    return bhd_kv_idx_parse(&bhd_type_idx, type_str);
+}
+
+const char *
+bhd_type_rev_parse(int type)
+{
+    return bhd_kv_idx_rev_parse(&bhd_type_idx, type);
+}
+
+int
+bhd_msg_fmt_parse(const char *msg_fmt_str)
+{
+    return bhd_kv_idx_parse(&bhd_msg_fmt_idx, msg_fmt_str);
+}
+
+const char *
+bhd_msg_fmt_rev_parse(int msg_fmt)
+{
+    return bhd_kv_idx_rev_parse(&bhd_msg_fmt_idx, msg_fmt);
+}
+
+int
+bhd_data_enc_parse(const char *data_enc_str)
+{
+    return bhd_kv_idx_parse(&bhd_data_enc_idx, data_enc_str);
+}
+
+const char *
+bhd_data_enc_rev_parse(int data_enc)
+{
+    return bhd_kv_idx_rev_parse(&bhd_data_enc_idx, data_enc);
+}
+
+int
+bhd_addr_type_parse(const char *addr_type_str)
+{
+    return bhd_kv_idx_parse(&bhd_addr_type_idx, addr_type_str);
+}
+
+const char *
+bhd_addr_type_rev_parse(int addr_type)
+{
+    return bhd_kv_idx_rev_parse(&bhd_addr_type_idx, addr_type);
+}
+
+int
+bhd_scan_filter_policy_parse(const char *filter_policy_str)
+{
+    return bhd_kv_idx_parse(&bhd_scan_filter_policy_idx, filter_policy_str);
+}
+
+const char *
+bhd_scan_filter_policy_rev_parse(int filter_policy)
+{
+    return bhd_kv_idx_rev_parse(&bhd_scan_filter_policy_idx, filter_policy);
+}
+
+int
+bhd_adv_event_type_parse(const char *adv_event_type_str)
+{
+    return bhd_kv_idx_parse(&bhd_adv_event_type_idx, adv_event_type_str);
+}
+
+const char *
+bhd_adv_event_type_rev_parse(int adv_event_type)
+{
+    return bhd_kv_idx_rev_parse(&bhd_adv_event_type_idx, adv_event_type);
+}
+
+int
+bhd_adv_conn_mode_parse(const char *conn_mode_str)
+{
+    return bhd_kv_idx_parse(&bhd_adv_conn_mode_idx, conn_mode_str);
+}
+
+const char *
+bhd_adv_conn_mode_rev_parse(int conn_mode)
+{
+    return bhd_kv_idx_rev_parse(&bhd_adv_conn_mode_idx, conn_mode);
+}
+
+int
+bhd_adv_disc_mode_parse(const char *disc_mode_str)
+{
+    return bhd_kv_idx_parse(&bhd_adv_disc_mode_idx, disc_mode_str);
+}
+
+const char *
+bhd_adv_disc_mode_rev_parse(int disc_mode)
+{
+    return bhd_kv_idx_rev_parse(&bhd_adv_disc_mode_idx, disc_mode);
+}
+
+int
+bhd_adv_filter_policy_parse(const char *filter_policy_str)
+{
+    return bhd_kv_idx_parse(&bhd_adv_filter_policy_idx, filter_policy_str);
+}
+
+const char *
+bhd_adv_filter_policy_rev_parse(int filter_policy)
+{
+    return bhd_kv_idx_rev_parse(&bhd_adv_filter_policy_idx, filter_policy);
+}
+
+int
+bhd_svc_type_parse(const char *svc_type_str)
+{
+    return bhd_kv_idx_parse(&bhd_svc_type_idx, svc_type_str);
+}
+
+const char *
+bhd_svc_type_rev_parse(int svc_type)
+{
+    return bhd_kv_idx_rev_parse(&bhd_svc_type_idx, svc_type);
+}
+
+int
+bhd_gatt_access_op_parse(const char *gatt_access_op_str)
+{
+    return bhd_kv_idx_parse(&bhd_gatt_access_op_idx, gatt_access_op_str);
+}
+
+const char *
+bhd_gatt_access_op_rev_parse(int gatt_access_op)
+{
+    return bhd_kv_idx_rev_parse(&bhd_gatt_access_op_idx, gatt_access_op);
+}
+
+int
+bhd_sm_passkey_action_parse(const char *sm_passkey_action_str)
+{
+    return bhd_kv_idx_parse(&bhd_sm_passkey_action_idx, sm_passkey_action_str);
+}
+
+const char *
+bhd_sm_passkey_action_rev_parse(int sm_passkey_action)
+{
+    return bhd_kv_idx_rev_parse(&bhd_sm_passkey_action_idx, sm_passkey_action);
+}
+
+/**
+ * Fills in the slot tables of the key-value map indices from their fixed
+ * seeds.  Must be called before any of the parse functions are used.  A
+ * seed that no longer fits its map (e.g., after an entry was added) would
+ * leave some entries unreachable, so it stops the daemon here; run
+ * tools/bhd_kv_test to get a replacement.
+ */
+void
+bhd_kv_init(void)
+{
+    const struct bhd_kv_idx *idx;
+    int rc;
+    int i;
+
+    for (i = 0; i < bhd_kv_num_idxs; i++) {
+        idx = bhd_kv_idxs[i];
+
+        rc = bhd_kv_idx_place(idx, idx->key_slots, idx->key_seed, 0);
+        assert(rc == 0);
+
+        rc = bhd_kv_idx_place(idx, idx->val_slots, idx->val_seed, 1);
+        assert(rc == 0);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef H_BHD_KV_
+#define H_BHD_KV_
+
+#include <inttypes.h>
+
+struct bhd_kv_str_int;
+
+/**
+ * Perfect hash index over a key-value map, for constant-time lookups in both
+ * directions.  Each index has fixed seeds under which no two keys, and no two
+ * values, map to the same slot.  A lookup therefore costs one hash and at
+ * most one string comparison.
+ */
+struct bhd_kv_idx {
+    const char *name;
+    const struct bhd_kv_str_int *map;
+    uint32_t key_seed;
+    uint32_t val_seed;
+    uint8_t slot_bits;
+
+    /* For each slot: index of the entry, plus one; 0 if the slot is empty. */
+    uint8_t *key_slots;
+    uint8_t *val_slots;
+};
+
+extern struct bhd_kv_idx * const bhd_kv_idxs[];
+extern const int bhd_kv_num_idxs;
+
+void bhd_kv_init(void);
+int bhd_kv_idx_place(const struct bhd_kv_idx *idx, uint8_t *slots,
+                     uint32_t seed, int by_val);
+int bhd_kv_idx_parse(const struct bhd_kv_idx *idx, const char *key);
+const char *bhd_kv_idx_rev_parse(const struct bhd_kv_idx *idx, int val);
+
+int bhd_op_parse(const char *op_str);
+const char *bhd_op_rev_parse(int op);
+int bhd_type_parse(const char *type_str);
+const char *bhd_type_rev_parse(int type);
+int bhd_msg_fmt_parse(const char *msg_fmt_str);
+const char *bhd_msg_fmt_rev_parse(int msg_fmt);
+int bhd_data_enc_parse(const char *data_enc_str);
+const char *bhd_data_enc_rev_parse(int data_enc);
+int bhd_addr_type_parse(const char *addr_type_str);
+const char *bhd_addr_type_rev_parse(int addr_type);
+int bhd_scan_filter_policy_parse(const char *scan_filter_policy_str);
+const char *bhd_scan_filter_policy_rev_parse(int scan_filter_policy);
+int bhd_adv_event_type_parse(const char *adv_event_type_str);
+const char *bhd_adv_event_type_rev_parse(int adv_event_type);
+int bhd_adv_conn_mode_parse(const char *conn_mode_str);
+const char *bhd_adv_conn_mode_rev_parse(int conn_mode);
+int bhd_adv_disc_mode_parse(const char *disc_mode_str);
+const char *bhd_adv_disc_mode_rev_parse(int disc_mode);
+int bhd_adv_filter_policy_parse(const char *filter_policy_str);
+const char *bhd_adv_filter_policy_rev_parse(int filter_policy);
+int bhd_svc_type_parse(const char *svc_type_str);
+const char *bhd_svc_type_rev_parse(int svc_type);
+int bhd_gatt_access_op_parse(const char *gatt_access_op_str);
+const char *bhd_gatt_access_op_rev_parse(int gatt_access_op);
+int bhd_sm_passkey_action_parse(const char *sm_passkey_action_str);
+const char *bhd_sm_passkey_action_rev_parse(int sm_passkey_action);
+
+#endif
@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
 #include "blehostd.h"
 #include "bhd_proto.h"
 #include "bhd_gattc.h"
@@ -10,6 +12,12 @@
 #include "bhd_util.h"
 #include "bhd_id.h"
 #include "bhd_sm.h"
+#include "bhd_cbor.h"
+#include "bhd_enc.h"
+#include "bhd_tok.h"
+#include "bhd_dec.h"
+#include "bhd_evtq.h"
+#include "bhd_ring.h"
 #include "parse.h"
 #include "defs/error.h"
 #include "nimble/ble.h"
@@ -45,53 +53,359 @@ static bhd_req_run_fn bhd_adv_rsp_set_data_req_run;
 static bhd_req_run_fn bhd_adv_fields_req_run;
 static bhd_req_run_fn bhd_clear_svcs_req_run;
 static bhd_req_run_fn bhd_add_svcs_req_run;
+static bhd_req_run_fn bhd_remove_svcs_req_run;
 static bhd_req_run_fn bhd_commit_svcs_req_run;
 static bhd_req_run_fn bhd_access_status_req_run;
 static bhd_req_run_fn bhd_notify_req_run;
 static bhd_req_run_fn bhd_find_chr_req_run;
+static bhd_req_run_fn bhd_find_dsc_req_run;
+static bhd_req_run_fn bhd_notify_multi_req_run;
+static bhd_req_run_fn bhd_subscriptions_req_run;
 static bhd_req_run_fn bhd_sm_inject_io_req_run;
+static bhd_req_run_fn bhd_subscribe_req_run;
+static bhd_req_run_fn bhd_ring_open_req_run;
+static bhd_req_run_fn bhd_bulk_open_req_run;
+static bhd_req_run_fn bhd_set_value_req_run;
 
+/** Maximum number of JSON tokens in a request decoded without cJSON. */
+#define BHD_REQ_MAX_TOKS                    128
+
+static struct bhd_tok bhd_req_toks[BHD_REQ_MAX_TOKS];
+
+/** Sub-responses of the batch request being processed. */
+static struct bhd_rsp bhd_batch_rsps[BHD_BATCH_MAX_REQS];
+
+/**
+ * The batch item being decoded.  Kept off the blehostd task's stack, which
+ * already holds the batch request itself; batches do not nest, and only the
+ * blehostd task executes requests.
+ */
+static struct bhd_req bhd_batch_sub_req;
+
+static const struct bhd_dec_field bhd_msg_hdr_fields[] = {
+    BHD_DEC_KV("op", hdr.op, bhd_op_parse, 0),
+    BHD_DEC_KV("type", hdr.type, bhd_type_parse, 0),
+    BHD_DEC_INT("seq", hdr.seq, 0, BHD_SEQ_MAX, 0),
+    BHD_DEC_KV("data_enc", hdr.data_enc, bhd_data_enc_parse, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_no_fields[] = {
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_connect_fields[] = {
+    BHD_DEC_KV("own_addr_type", connect.own_addr_type,
+               bhd_addr_type_parse, 0),
+    BHD_DEC_KV("peer_addr_type", connect.peer_addr.type,
+               bhd_addr_type_parse, 0),
+    BHD_DEC_ADDR("peer_addr", connect.peer_addr.val, 0),
+    BHD_DEC_INT("duration_ms", connect.duration_ms, 0, INT32_MAX, 0),
+    BHD_DEC_INT("scan_itvl", connect.scan_itvl, 0, INT16_MAX, 0),
+    BHD_DEC_INT("scan_window", connect.scan_window, 0, INT16_MAX, 0),
+    BHD_DEC_INT("itvl_min", connect.itvl_min, 0, INT16_MAX, 0),
+    BHD_DEC_INT("itvl_max", connect.itvl_max, 0, INT16_MAX, 0),
+    BHD_DEC_INT("latency", connect.latency, 0, INT16_MAX, 0),
+    BHD_DEC_INT("supervision_timeout", connect.supervision_timeout,
+                0, INT16_MAX, 0),
+    BHD_DEC_INT("min_ce_len", connect.min_ce_len, 0, INT16_MAX, 0),
+    BHD_DEC_INT("max_ce_len", connect.max_ce_len, 0, INT16_MAX, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_terminate_fields[] = {
+    BHD_DEC_INT("conn_handle", terminate.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("hci_reason", terminate.hci_reason, 0, 0xff, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_disc_all_svcs_fields[] = {
+    BHD_DEC_INT("conn_handle", disc_all_svcs.conn_handle, 0, 0xffff, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_disc_svc_uuid_fields[] = {
+    BHD_DEC_INT("conn_handle", disc_svc_uuid.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_UUID("svc_uuid", disc_svc_uuid.svc_uuid, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_disc_all_chrs_fields[] = {
+    BHD_DEC_INT("conn_handle", disc_all_chrs.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("start_handle", disc_all_chrs.start_attr_handle,
+                0, 0xffff, 0),
+    BHD_DEC_INT("end_handle", disc_all_chrs.end_attr_handle, 0, 0xffff, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_disc_chr_uuid_fields[] = {
+    BHD_DEC_INT("conn_handle", disc_chr_uuid.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("start_handle", disc_chr_uuid.start_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("end_handle", disc_chr_uuid.end_handle, 0, 0xffff, 0),
+    BHD_DEC_UUID("chr_uuid", disc_chr_uuid.chr_uuid, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_disc_all_dscs_fields[] = {
+    BHD_DEC_INT("conn_handle", disc_all_dscs.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("start_handle", disc_all_dscs.start_attr_handle,
+                0, 0xffff, 0),
+    BHD_DEC_INT("end_handle", disc_all_dscs.end_attr_handle, 0, 0xffff, 0),
+    { 0 },
+};
+
+/* Used for both write and write_cmd. */
+static const struct bhd_dec_field bhd_write_fields[] = {
+    BHD_DEC_INT("conn_handle", write.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("attr_handle", write.attr_handle, 0, 0xffff, 0),
+    BHD_DEC_BYTES_REF("data", write.data, write.data_len,
+                      BLE_ATT_ATTR_MAX_LEN + 3, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_exchange_mtu_fields[] = {
+    BHD_DEC_INT("conn_handle", exchange_mtu.conn_handle, 0, 0xffff, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_gen_rand_addr_fields[] = {
+    BHD_DEC_BOOL("nrpa", gen_rand_addr.nrpa, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_set_rand_addr_fields[] = {
+    BHD_DEC_ADDR("addr", set_rand_addr.addr, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_scan_fields[] = {
+    BHD_DEC_KV("own_addr_type", scan.own_addr_type, bhd_addr_type_parse, 0),
+    BHD_DEC_INT("duration_ms", scan.duration_ms, 0, INT32_MAX, 0),
+    BHD_DEC_INT("itvl", scan.itvl, 0, UINT16_MAX, 0),
+    BHD_DEC_INT("window", scan.window, 0, UINT16_MAX, 0),
+    BHD_DEC_KV("filter_policy", scan.filter_policy,
+               bhd_scan_filter_policy_parse, 0),
+    BHD_DEC_BOOL("limited", scan.limited, 0),
+    BHD_DEC_BOOL("passive", scan.passive, 0),
+    BHD_DEC_BOOL("filter_duplicates", scan.filter_duplicates, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_set_preferred_mtu_fields[] = {
+    BHD_DEC_INT("mtu", set_preferred_mtu.mtu, 0, UINT16_MAX, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_security_initiate_fields[] = {
+    BHD_DEC_INT("conn_handle", security_initiate.conn_handle,
+                0, UINT16_MAX, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_conn_find_fields[] = {
+    BHD_DEC_INT("conn_handle", conn_find.conn_handle, 0, UINT16_MAX, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_adv_set_data_fields[] = {
+    BHD_DEC_BYTES("data", adv_set_data.data, adv_set_data.data_len, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_adv_rsp_set_data_fields[] = {
+    BHD_DEC_BYTES("data", adv_rsp_set_data.data, adv_rsp_set_data.data_len,
+                  0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_access_status_fields[] = {
+    BHD_DEC_INT("att_status", access_status.att_status, 0, UINT8_MAX, 0),
+    BHD_DEC_BYTES_REF("data", access_status.data, access_status.data_len,
+                      BLE_ATT_ATTR_MAX_LEN, BHD_DEC_F_OPT),
+    BHD_DEC_INT("access_id", access_status.access_id, 0, UINT32_MAX,
+                BHD_DEC_F_OPT),
+    BHD_DEC_BOOL("cache", access_status.cache, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_set_value_fields[] = {
+    BHD_DEC_INT("attr_handle", set_value.attr_handle, 0, 0xffff, 0),
+    BHD_DEC_BYTES_REF("data", set_value.data, set_value.data_len,
+                      BLE_ATT_ATTR_MAX_LEN, 0),
+    BHD_DEC_BOOL("forward_reads", set_value.forward_reads, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_notify_fields[] = {
+    BHD_DEC_INT("conn_handle", notify.conn_handle, 0, 0xffff, 0),
+    BHD_DEC_INT("attr_handle", notify.attr_handle, 0, 0xffff, 0),
+    BHD_DEC_BYTES_REF("data", notify.data, notify.data_len,
+                      BLE_ATT_ATTR_MAX_LEN + 3, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_notify_multi_fields[] = {
+    BHD_DEC_INT("attr_handle", notify_multi.attr_handle, 0, 0xffff, 0),
+    BHD_DEC_BYTES_REF("data", notify_multi.data, notify_multi.data_len,
+                      BLE_ATT_ATTR_MAX_LEN + 3, BHD_DEC_F_OPT),
+    BHD_DEC_INT_ARR("conn_handles", notify_multi.conn_handles,
+                    notify_multi.num_conn_handles, 0, 0xffff, BHD_DEC_F_OPT),
+    BHD_DEC_BOOL("indicate", notify_multi.indicate, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_subscriptions_fields[] = {
+    BHD_DEC_INT_ARR("conn_handles", subscriptions.conn_handles,
+                    subscriptions.num_conn_handles, 0, 0xffff,
+                    BHD_DEC_F_OPT),
+    BHD_DEC_INT_ARR("attr_handles", subscriptions.attr_handles,
+                    subscriptions.num_attr_handles, 0, 0xffff,
+                    BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_find_chr_fields[] = {
+    BHD_DEC_UUID("svc_uuid", find_chr.svc_uuid, 0),
+    BHD_DEC_UUID("chr_uuid", find_chr.chr_uuid, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_find_dsc_fields[] = {
+    BHD_DEC_UUID("svc_uuid", find_dsc.svc_uuid, 0),
+    BHD_DEC_UUID("chr_uuid", find_dsc.chr_uuid, 0),
+    BHD_DEC_UUID("dsc_uuid", find_dsc.dsc_uuid, 0),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_batch_fields[] = {
+    BHD_DEC_BOOL("stop_on_err", batch.stop_on_err, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_subscribe_fields[] = {
+    BHD_DEC_KV_ARR("evt_types", subscribe.evt_types,
+                   subscribe.num_evt_types, bhd_type_parse, BHD_DEC_F_OPT),
+    BHD_DEC_INT_ARR("conn_handles", subscribe.conn_handles,
+                    subscribe.num_conn_handles, 0, UINT16_MAX, BHD_DEC_F_OPT),
+    BHD_DEC_INT_ARR("attr_handles", subscribe.attr_handles,
+                    subscribe.num_attr_handles, 0, UINT16_MAX, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+static const struct bhd_dec_field bhd_ring_open_fields[] = {
+    BHD_DEC_KV_ARR("evt_types", ring_open.evt_types,
+                   ring_open.num_evt_types, bhd_type_parse, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+/* The header of a batch sub-request; "op" is implied. */
+static const struct bhd_dec_field bhd_batch_item_hdr_fields[] = {
+    BHD_DEC_KV("type", hdr.type, bhd_type_parse, 0),
+    BHD_DEC_INT("seq", hdr.seq, 0, BHD_SEQ_MAX, BHD_DEC_F_OPT),
+    { 0 },
+};
+
+/**
+ * Request dispatch table.
+ *
+ * If an entry has a field table, the request is fully decoded before its
+ * callback is called, and the callback's parent argument is NULL.  Otherwise,
+ * the callback decodes the request from the cJSON tree in parent.
+ *
+ * If decoding against a field table fails, the response is either a generic
+ * error response (err_rsp set) or a response of the request's own type with
+ * the status field set.  Response types that own heap memory (see
+ * bhd_rsp_free()) must set err_rsp: the error message would otherwise be
+ * stored over their pointer, and freed.
+ */
 static const struct bhd_req_dispatch_entry {
-    int req_type;
+    const struct bhd_dec_field *fields;
+    int err_rsp;
     bhd_req_run_fn *cb;
 } bhd_req_dispatch[] = {
-    { BHD_MSG_TYPE_SYNC,                bhd_sync_req_run },
-    { BHD_MSG_TYPE_CONNECT,             bhd_connect_req_run },
-    { BHD_MSG_TYPE_TERMINATE,           bhd_terminate_req_run },
-    { BHD_MSG_TYPE_DISC_ALL_SVCS,       bhd_disc_all_svcs_req_run },
-    { BHD_MSG_TYPE_DISC_SVC_UUID,       bhd_disc_svc_uuid_req_run },
-    { BHD_MSG_TYPE_DISC_ALL_CHRS,       bhd_disc_all_chrs_req_run },
-    { BHD_MSG_TYPE_DISC_CHR_UUID,       bhd_disc_chr_uuid_req_run },
-    { BHD_MSG_TYPE_DISC_ALL_DSCS,       bhd_disc_all_dscs_req_run },
-    { BHD_MSG_TYPE_WRITE,               bhd_write_req_run },
-    { BHD_MSG_TYPE_WRITE_CMD,           bhd_write_cmd_req_run },
-    { BHD_MSG_TYPE_EXCHANGE_MTU,        bhd_exchange_mtu_req_run },
-    { BHD_MSG_TYPE_GEN_RAND_ADDR,       bhd_gen_rand_addr_req_run },
-    { BHD_MSG_TYPE_SET_RAND_ADDR,       bhd_set_rand_addr_req_run },
-    { BHD_MSG_TYPE_CONN_CANCEL,         bhd_conn_cancel_req_run },
-    { BHD_MSG_TYPE_SCAN,                bhd_scan_req_run },
-    { BHD_MSG_TYPE_SCAN_CANCEL,         bhd_scan_cancel_req_run },
-    { BHD_MSG_TYPE_SET_PREFERRED_MTU,   bhd_set_preferred_mtu_req_run },
-    { BHD_MSG_TYPE_ENC_INITIATE,        bhd_security_initiate_req_run },
-    { BHD_MSG_TYPE_CONN_FIND,           bhd_conn_find_req_run },
-    { BHD_MSG_TYPE_RESET,               bhd_reset_req_run },
-    { BHD_MSG_TYPE_ADV_START,           bhd_adv_start_req_run },
-    { BHD_MSG_TYPE_ADV_STOP,            bhd_adv_stop_req_run },
-    { BHD_MSG_TYPE_ADV_SET_DATA,        bhd_adv_set_data_req_run },
-    { BHD_MSG_TYPE_ADV_RSP_SET_DATA,    bhd_adv_rsp_set_data_req_run },
-    { BHD_MSG_TYPE_ADV_FIELDS,          bhd_adv_fields_req_run },
-    { BHD_MSG_TYPE_CLEAR_SVCS,          bhd_clear_svcs_req_run },
-    { BHD_MSG_TYPE_ADD_SVCS,            bhd_add_svcs_req_run },
-    { BHD_MSG_TYPE_COMMIT_SVCS,         bhd_commit_svcs_req_run },
-    { BHD_MSG_TYPE_ACCESS_STATUS,       bhd_access_status_req_run },
-    { BHD_MSG_TYPE_NOTIFY,              bhd_notify_req_run },
-    { BHD_MSG_TYPE_FIND_CHR,            bhd_find_chr_req_run },
-    { BHD_MSG_TYPE_SM_INJECT_IO,        bhd_sm_inject_io_req_run },
-
-    { -1 },
+    [BHD_MSG_TYPE_SYNC] =
+        { NULL, 0, bhd_sync_req_run },
+    [BHD_MSG_TYPE_CONNECT] =
+        { bhd_connect_fields, 1, bhd_connect_req_run },
+    [BHD_MSG_TYPE_TERMINATE] =
+        { bhd_terminate_fields, 0, bhd_terminate_req_run },
+    [BHD_MSG_TYPE_DISC_ALL_SVCS] =
+        { bhd_disc_all_svcs_fields, 0, bhd_disc_all_svcs_req_run },
+    [BHD_MSG_TYPE_DISC_SVC_UUID] =
+        { bhd_disc_svc_uuid_fields, 0, bhd_disc_svc_uuid_req_run },
+    [BHD_MSG_TYPE_DISC_ALL_CHRS] =
+        { bhd_disc_all_chrs_fields, 0, bhd_disc_all_chrs_req_run },
+    [BHD_MSG_TYPE_DISC_CHR_UUID] =
+        { bhd_disc_chr_uuid_fields, 0, bhd_disc_chr_uuid_req_run },
+    [BHD_MSG_TYPE_DISC_ALL_DSCS] =
+        { bhd_disc_all_dscs_fields, 0, bhd_disc_all_dscs_req_run },
+    [BHD_MSG_TYPE_WRITE] =
+        { bhd_write_fields, 0, bhd_write_req_run },
+    [BHD_MSG_TYPE_WRITE_CMD] =
+        { bhd_write_fields, 0, bhd_write_cmd_req_run },
+    [BHD_MSG_TYPE_EXCHANGE_MTU] =
+        { bhd_exchange_mtu_fields, 0, bhd_exchange_mtu_req_run },
+    [BHD_MSG_TYPE_GEN_RAND_ADDR] =
+        { bhd_gen_rand_addr_fields, 0, bhd_gen_rand_addr_req_run },
+    [BHD_MSG_TYPE_SET_RAND_ADDR] =
+        { bhd_set_rand_addr_fields, 0, bhd_set_rand_addr_req_run },
+    [BHD_MSG_TYPE_CONN_CANCEL] =
+        { bhd_no_fields, 0, bhd_conn_cancel_req_run },
+    [BHD_MSG_TYPE_SCAN] =
+        { bhd_scan_fields, 1, bhd_scan_req_run },
+    [BHD_MSG_TYPE_SCAN_CANCEL] =
+        { bhd_no_fields, 0, bhd_scan_cancel_req_run },
+    [BHD_MSG_TYPE_SET_PREFERRED_MTU] =
+        { bhd_set_preferred_mtu_fields, 1, bhd_set_preferred_mtu_req_run },
+    [BHD_MSG_TYPE_ENC_INITIATE] =
+        { bhd_security_initiate_fields, 1, bhd_security_initiate_req_run },
+    [BHD_MSG_TYPE_CONN_FIND] =
+        { bhd_conn_find_fields, 1, bhd_conn_find_req_run },
+    [BHD_MSG_TYPE_RESET] =
+        { bhd_no_fields, 0, bhd_reset_req_run },
+    [BHD_MSG_TYPE_ADV_START] =
+        { NULL, 0, bhd_adv_start_req_run },
+    [BHD_MSG_TYPE_ADV_STOP] =
+        { bhd_no_fields, 0, bhd_adv_stop_req_run },
+    [BHD_MSG_TYPE_ADV_SET_DATA] =
+        { bhd_adv_set_data_fields, 0, bhd_adv_set_data_req_run },
+    [BHD_MSG_TYPE_ADV_RSP_SET_DATA] =
+        { bhd_adv_rsp_set_data_fields, 0, bhd_adv_rsp_set_data_req_run },
+    [BHD_MSG_TYPE_ADV_FIELDS] =
+        { NULL, 0, bhd_adv_fields_req_run },
+    [BHD_MSG_TYPE_CLEAR_SVCS] =
+        { bhd_no_fields, 0, bhd_clear_svcs_req_run },
+    [BHD_MSG_TYPE_ADD_SVCS] =
+        { NULL, 0, bhd_add_svcs_req_run },
+    [BHD_MSG_TYPE_COMMIT_SVCS] =
+        { bhd_no_fields, 1, bhd_commit_svcs_req_run },
+    [BHD_MSG_TYPE_ACCESS_STATUS] =
+        { bhd_access_status_fields, 0, bhd_access_status_req_run },
+    [BHD_MSG_TYPE_NOTIFY] =
+        { bhd_notify_fields, 0, bhd_notify_req_run },
+    [BHD_MSG_TYPE_FIND_CHR] =
+        { bhd_find_chr_fields, 0, bhd_find_chr_req_run },
+    [BHD_MSG_TYPE_SM_INJECT_IO] =
+        { NULL, 0, bhd_sm_inject_io_req_run },
+    [BHD_MSG_TYPE_SUBSCRIBE] =
+        { bhd_subscribe_fields, 0, bhd_subscribe_req_run },
+    [BHD_MSG_TYPE_RING_OPEN] =
+        { bhd_ring_open_fields, 0, bhd_ring_open_req_run },
+    [BHD_MSG_TYPE_BULK_OPEN] =
+        { bhd_no_fields, 0, bhd_bulk_open_req_run },
+    [BHD_MSG_TYPE_SET_VALUE] =
+        { bhd_set_value_fields, 0, bhd_set_value_req_run },
+    [BHD_MSG_TYPE_REMOVE_SVCS] =
+        { NULL, 0, bhd_remove_svcs_req_run },
+    [BHD_MSG_TYPE_FIND_DSC] =
+        { bhd_find_dsc_fields, 0, bhd_find_dsc_req_run },
+    [BHD_MSG_TYPE_NOTIFY_MULTI] =
+        { bhd_notify_multi_fields, 0, bhd_notify_multi_req_run },
+    [BHD_MSG_TYPE_SUBSCRIPTIONS] =
+        { bhd_subscriptions_fields, 1, bhd_subscriptions_req_run },
 };
 
-typedef int bhd_subrsp_enc_fn(cJSON *parent, const struct bhd_rsp *rsp);
+typedef int bhd_subrsp_enc_fn(struct bhd_enc *enc, const struct bhd_rsp *rsp);
 static bhd_subrsp_enc_fn bhd_err_rsp_enc;
 static bhd_subrsp_enc_fn bhd_sync_rsp_enc;
 static bhd_subrsp_enc_fn bhd_connect_rsp_enc;
@@ -119,54 +433,67 @@ static bhd_subrsp_enc_fn bhd_adv_rsp_set_data_rsp_enc;
 static bhd_subrsp_enc_fn bhd_adv_fields_rsp_enc;
 static bhd_subrsp_enc_fn bhd_clear_svcs_rsp_enc;
 static bhd_subrsp_enc_fn bhd_add_svcs_rsp_enc;
+static bhd_subrsp_enc_fn bhd_remove_svcs_rsp_enc;
 static bhd_subrsp_enc_fn bhd_commit_svcs_rsp_enc;
 static bhd_subrsp_enc_fn bhd_access_status_rsp_enc;
 static bhd_subrsp_enc_fn bhd_notify_rsp_enc;
 static bhd_subrsp_enc_fn bhd_find_chr_rsp_enc;
+static bhd_subrsp_enc_fn bhd_find_dsc_rsp_enc;
+static bhd_subrsp_enc_fn bhd_notify_multi_rsp_enc;
+static bhd_subrsp_enc_fn bhd_subscriptions_rsp_enc;
 static bhd_subrsp_enc_fn bhd_sm_inject_io_rsp_enc;
-
-static const struct bhd_rsp_dispatch_entry {
-    int rsp_type;
-    bhd_subrsp_enc_fn *cb;
-} bhd_rsp_dispatch[] = {
-    { BHD_MSG_TYPE_ERR,                 bhd_err_rsp_enc },
-    { BHD_MSG_TYPE_SYNC,                bhd_sync_rsp_enc },
-    { BHD_MSG_TYPE_CONNECT,             bhd_connect_rsp_enc },
-    { BHD_MSG_TYPE_TERMINATE,           bhd_terminate_rsp_enc },
-    { BHD_MSG_TYPE_DISC_ALL_SVCS,       bhd_disc_all_svcs_rsp_enc },
-    { BHD_MSG_TYPE_DISC_SVC_UUID,       bhd_disc_svc_uuid_rsp_enc },
-    { BHD_MSG_TYPE_DISC_ALL_CHRS,       bhd_disc_all_chrs_rsp_enc },
-    { BHD_MSG_TYPE_DISC_CHR_UUID,       bhd_disc_chr_uuid_rsp_enc },
-    { BHD_MSG_TYPE_DISC_ALL_DSCS,       bhd_disc_all_dscs_rsp_enc },
-    { BHD_MSG_TYPE_WRITE,               bhd_write_rsp_enc },
-    { BHD_MSG_TYPE_WRITE_CMD,           bhd_write_rsp_enc },
-    { BHD_MSG_TYPE_EXCHANGE_MTU,        bhd_exchange_mtu_rsp_enc },
-    { BHD_MSG_TYPE_GEN_RAND_ADDR,       bhd_gen_rand_addr_rsp_enc },
-    { BHD_MSG_TYPE_SET_RAND_ADDR,       bhd_set_rand_addr_rsp_enc },
-    { BHD_MSG_TYPE_CONN_CANCEL,         bhd_conn_cancel_rsp_enc },
-    { BHD_MSG_TYPE_SCAN,                bhd_scan_rsp_enc },
-    { BHD_MSG_TYPE_SCAN_CANCEL,         bhd_scan_cancel_rsp_enc },
-    { BHD_MSG_TYPE_SET_PREFERRED_MTU,   bhd_set_preferred_mtu_rsp_enc },
-    { BHD_MSG_TYPE_ENC_INITIATE,        bhd_security_initiate_rsp_enc },
-    { BHD_MSG_TYPE_CONN_FIND,           bhd_conn_find_rsp_enc },
-    { BHD_MSG_TYPE_RESET,               bhd_reset_rsp_enc },
-    { BHD_MSG_TYPE_ADV_START,           bhd_adv_start_rsp_enc },
-    { BHD_MSG_TYPE_ADV_STOP,            bhd_adv_stop_rsp_enc },
-    { BHD_MSG_TYPE_ADV_SET_DATA,        bhd_adv_set_data_rsp_enc },
-    { BHD_MSG_TYPE_ADV_RSP_SET_DATA,    bhd_adv_rsp_set_data_rsp_enc },
-    { BHD_MSG_TYPE_ADV_FIELDS,          bhd_adv_fields_rsp_enc },
-    { BHD_MSG_TYPE_ADD_SVCS,            bhd_add_svcs_rsp_enc },
-    { BHD_MSG_TYPE_CLEAR_SVCS,          bhd_clear_svcs_rsp_enc },
-    { BHD_MSG_TYPE_COMMIT_SVCS,         bhd_commit_svcs_rsp_enc },
-    { BHD_MSG_TYPE_ACCESS_STATUS,       bhd_access_status_rsp_enc },
-    { BHD_MSG_TYPE_NOTIFY,              bhd_notify_rsp_enc },
-    { BHD_MSG_TYPE_FIND_CHR,            bhd_find_chr_rsp_enc },
-    { BHD_MSG_TYPE_SM_INJECT_IO,        bhd_sm_inject_io_rsp_enc },
-
-    { -1 },
+static bhd_subrsp_enc_fn bhd_batch_rsp_enc;
+static bhd_subrsp_enc_fn bhd_subscribe_rsp_enc;
+static bhd_subrsp_enc_fn bhd_ring_open_rsp_enc;
+static bhd_subrsp_enc_fn bhd_bulk_open_rsp_enc;
+static bhd_subrsp_enc_fn bhd_set_value_rsp_enc;
+
+static bhd_subrsp_enc_fn * const bhd_rsp_dispatch[] = {
+    [BHD_MSG_TYPE_ERR]                  = bhd_err_rsp_enc,
+    [BHD_MSG_TYPE_SYNC]                 = bhd_sync_rsp_enc,
+    [BHD_MSG_TYPE_CONNECT]              = bhd_connect_rsp_enc,
+    [BHD_MSG_TYPE_TERMINATE]            = bhd_terminate_rsp_enc,
+    [BHD_MSG_TYPE_DISC_ALL_SVCS]        = bhd_disc_all_svcs_rsp_enc,
+    [BHD_MSG_TYPE_DISC_SVC_UUID]        = bhd_disc_svc_uuid_rsp_enc,
+    [BHD_MSG_TYPE_DISC_ALL_CHRS]        = bhd_disc_all_chrs_rsp_enc,
+    [BHD_MSG_TYPE_DISC_CHR_UUID]        = bhd_disc_chr_uuid_rsp_enc,
+    [BHD_MSG_TYPE_DISC_ALL_DSCS]        = bhd_disc_all_dscs_rsp_enc,
+    [BHD_MSG_TYPE_WRITE]                = bhd_write_rsp_enc,
+    [BHD_MSG_TYPE_WRITE_CMD]            = bhd_write_rsp_enc,
+    [BHD_MSG_TYPE_EXCHANGE_MTU]         = bhd_exchange_mtu_rsp_enc,
+    [BHD_MSG_TYPE_GEN_RAND_ADDR]        = bhd_gen_rand_addr_rsp_enc,
+    [BHD_MSG_TYPE_SET_RAND_ADDR]        = bhd_set_rand_addr_rsp_enc,
+    [BHD_MSG_TYPE_CONN_CANCEL]          = bhd_conn_cancel_rsp_enc,
+    [BHD_MSG_TYPE_SCAN]                 = bhd_scan_rsp_enc,
+    [BHD_MSG_TYPE_SCAN_CANCEL]          = bhd_scan_cancel_rsp_enc,
+    [BHD_MSG_TYPE_SET_PREFERRED_MTU]    = bhd_set_preferred_mtu_rsp_enc,
+    [BHD_MSG_TYPE_ENC_INITIATE]         = bhd_security_initiate_rsp_enc,
+    [BHD_MSG_TYPE_CONN_FIND]            = bhd_conn_find_rsp_enc,
+    [BHD_MSG_TYPE_RESET]                = bhd_reset_rsp_enc,
+    [BHD_MSG_TYPE_ADV_START]            = bhd_adv_start_rsp_enc,
+    [BHD_MSG_TYPE_ADV_STOP]             = bhd_adv_stop_rsp_enc,
+    [BHD_MSG_TYPE_ADV_SET_DATA]         = bhd_adv_set_data_rsp_enc,
+    [BHD_MSG_TYPE_ADV_RSP_SET_DATA]     = bhd_adv_rsp_set_data_rsp_enc,
+    [BHD_MSG_TYPE_ADV_FIELDS]           = bhd_adv_fields_rsp_enc,
+    [BHD_MSG_TYPE_ADD_SVCS]             = bhd_add_svcs_rsp_enc,
+    [BHD_MSG_TYPE_REMOVE_SVCS]          = bhd_remove_svcs_rsp_enc,
+    [BHD_MSG_TYPE_CLEAR_SVCS]           = bhd_clear_svcs_rsp_enc,
+    [BHD_MSG_TYPE_COMMIT_SVCS]          = bhd_commit_svcs_rsp_enc,
+    [BHD_MSG_TYPE_ACCESS_STATUS]        = bhd_access_status_rsp_enc,
+    [BHD_MSG_TYPE_NOTIFY]               = bhd_notify_rsp_enc,
+    [BHD_MSG_TYPE_FIND_CHR]             = bhd_find_chr_rsp_enc,
+    [BHD_MSG_TYPE_FIND_DSC]             = bhd_find_dsc_rsp_enc,
+    [BHD_MSG_TYPE_NOTIFY_MULTI]         = bhd_notify_multi_rsp_enc,
+    [BHD_MSG_TYPE_SUBSCRIPTIONS]        = bhd_subscriptions_rsp_enc,
+    [BHD_MSG_TYPE_SM_INJECT_IO]         = bhd_sm_inject_io_rsp_enc,
+    [BHD_MSG_TYPE_BATCH]                = bhd_batch_rsp_enc,
+    [BHD_MSG_TYPE_SUBSCRIBE]            = bhd_subscribe_rsp_enc,
+    [BHD_MSG_TYPE_RING_OPEN]            = bhd_ring_open_rsp_enc,
+    [BHD_MSG_TYPE_BULK_OPEN]            = bhd_bulk_open_rsp_enc,
+    [BHD_MSG_TYPE_SET_VALUE]            = bhd_set_value_rsp_enc,
 };
 
-typedef int bhd_evt_enc_fn(cJSON *parent, const struct bhd_evt *evt);
+typedef int bhd_evt_enc_fn(struct bhd_enc *enc, const struct bhd_evt *evt);
 static bhd_evt_enc_fn bhd_sync_evt_enc;
 static bhd_evt_enc_fn bhd_connect_evt_enc;
 static bhd_evt_enc_fn bhd_disconnect_evt_enc;
@@ -183,73 +510,74 @@ static bhd_evt_enc_fn bhd_enc_change_evt_enc;
 static bhd_evt_enc_fn bhd_reset_evt_enc;
 static bhd_evt_enc_fn bhd_access_evt_enc;
 static bhd_evt_enc_fn bhd_passkey_evt_enc;
-
-static const struct bhd_evt_dispatch_entry {
-    int msg_type;
-    bhd_evt_enc_fn *cb;
-} bhd_evt_dispatch[] = {
-    { BHD_MSG_TYPE_SYNC_EVT,            bhd_sync_evt_enc },
-    { BHD_MSG_TYPE_CONNECT_EVT,         bhd_connect_evt_enc },
-    { BHD_MSG_TYPE_DISCONNECT_EVT,      bhd_disconnect_evt_enc },
-    { BHD_MSG_TYPE_DISC_SVC_EVT,        bhd_disc_svc_evt_enc },
-    { BHD_MSG_TYPE_DISC_CHR_EVT,        bhd_disc_chr_evt_enc },
-    { BHD_MSG_TYPE_DISC_DSC_EVT,        bhd_disc_dsc_evt_enc },
-    { BHD_MSG_TYPE_WRITE_ACK_EVT,       bhd_write_ack_evt_enc },
-    { BHD_MSG_TYPE_NOTIFY_RX_EVT,       bhd_notify_rx_evt_enc },
-    { BHD_MSG_TYPE_MTU_CHANGE_EVT,      bhd_mtu_change_evt_enc },
-    { BHD_MSG_TYPE_SCAN_EVT,            bhd_scan_evt_enc },
-    { BHD_MSG_TYPE_SCAN_TMO_EVT,        bhd_scan_tmo_evt_enc },
-    { BHD_MSG_TYPE_ADV_COMPLETE_EVT,    bhd_adv_complete_evt_enc },
-    { BHD_MSG_TYPE_ENC_CHANGE_EVT,      bhd_enc_change_evt_enc },
-    { BHD_MSG_TYPE_RESET_EVT,           bhd_reset_evt_enc },
-    { BHD_MSG_TYPE_ACCESS_EVT,          bhd_access_evt_enc },
-    { BHD_MSG_TYPE_PASSKEY_EVT,         bhd_passkey_evt_enc },
-
-    { -1 },
+static bhd_evt_enc_fn bhd_dropped_evt_enc;
+static bhd_evt_enc_fn bhd_indicate_done_evt_enc;
+static bhd_evt_enc_fn bhd_subscribe_evt_enc;
+
+/* Indexed by event type, relative to the start of the event range. */
+#define BHD_EVT_IDX(type_)      ((type_) - BHD_MSG_TYPE_EVT_BASE)
+
+static bhd_evt_enc_fn * const bhd_evt_dispatch[] = {
+    [BHD_EVT_IDX(BHD_MSG_TYPE_SYNC_EVT)]          = bhd_sync_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_CONNECT_EVT)]       = bhd_connect_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_DISCONNECT_EVT)]    = bhd_disconnect_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_DISC_SVC_EVT)]      = bhd_disc_svc_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_DISC_CHR_EVT)]      = bhd_disc_chr_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_DISC_DSC_EVT)]      = bhd_disc_dsc_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_WRITE_ACK_EVT)]     = bhd_write_ack_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_NOTIFY_RX_EVT)]     = bhd_notify_rx_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_MTU_CHANGE_EVT)]    = bhd_mtu_change_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_SCAN_EVT)]          = bhd_scan_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_SCAN_TMO_EVT)]      = bhd_scan_tmo_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_ADV_COMPLETE_EVT)]  = bhd_adv_complete_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_ENC_CHANGE_EVT)]    = bhd_enc_change_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_RESET_EVT)]         = bhd_reset_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_ACCESS_EVT)]        = bhd_access_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_PASSKEY_EVT)]       = bhd_passkey_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_DROPPED_EVT)]       = bhd_dropped_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_INDICATE_DONE_EVT)] = bhd_indicate_done_evt_enc,
+    [BHD_EVT_IDX(BHD_MSG_TYPE_SUBSCRIBE_EVT)]     = bhd_subscribe_evt_enc,
 };
 
-static bhd_req_run_fn *
+#define BHD_DISPATCH_LEN(tbl_)  (sizeof (tbl_) / sizeof (tbl_)[0])
+
+static const struct bhd_req_dispatch_entry *
 bhd_req_dispatch_find(int req_type)
 {
     const struct bhd_req_dispatch_entry *entry;
 
-    for (entry = bhd_req_dispatch; entry->req_type != -1; entry++) {
-        if (entry->req_type == req_type) {
-            return entry->cb;
-        }
+    if (req_type < 0 || req_type >= BHD_DISPATCH_LEN(bhd_req_dispatch)) {
+        return NULL;
     }
 
-    return NULL;
+    entry = bhd_req_dispatch + req_type;
+    if (entry->cb == NULL) {
+        return NULL;
+    }
+
+    return entry;
 }
 
 static bhd_subrsp_enc_fn *
 bhd_rsp_dispatch_find(int rsp_type)
 {
-    const struct bhd_rsp_dispatch_entry *entry;
+    assert(rsp_type >= 0 && rsp_type < BHD_DISPATCH_LEN(bhd_rsp_dispatch));
+    assert(bhd_rsp_dispatch[rsp_type] != NULL);
 
-    for (entry = bhd_rsp_dispatch; entry->rsp_type != -1; entry++) {
-        if (entry->rsp_type == rsp_type) {
-            return entry->cb;
-        }
-    }
-
-    assert(0);
-    return NULL;
+    return bhd_rsp_dispatch[rsp_type];
 }
 
 static bhd_evt_enc_fn *
 bhd_evt_dispatch_find(int evt_type)
 {
-    const struct bhd_evt_dispatch_entry *entry;
+    int idx;
 
-    for (entry = bhd_evt_dispatch; entry->msg_type != -1; entry++) {
-        if (entry->msg_type == evt_type) {
-            return entry->cb;
-        }
-    }
+    idx = BHD_EVT_IDX(evt_type);
+
+    assert(idx >= 0 && idx < BHD_DISPATCH_LEN(bhd_evt_dispatch));
+    assert(bhd_evt_dispatch[idx] != NULL);
 
-    assert(0);
-    return NULL;
+    return bhd_evt_dispatch[idx];
 }
 
 static int
@@ -270,58 +598,20 @@ bhd_err_build(struct bhd_rsp *rsp, int status, const char *msg)
     return status;
 }
 
-static struct bhd_err_rsp
-bhd_msg_hdr_dec(cJSON *parent, struct bhd_msg_hdr *hdr)
-{
-    struct bhd_err_rsp err = {0};
-    char *valstr;
-    int rc;
-
-    valstr = bhd_json_string(parent, "op", &rc);
-    if (rc != 0) {
-        bhd_err_fill(&err, rc, "invalid op");
-        return err;
-    }
-    hdr->op = bhd_op_parse(valstr);
-    if (hdr->op == -1) {
-        bhd_err_fill(&err, SYS_ERANGE, "invalid op");
-        return err;
-    }
-
-    valstr = bhd_json_string(parent, "type", &rc);
-    if (rc != 0) {
-        bhd_err_fill(&err, rc, "invalid type");
-        return err;
-    }
-    hdr->type = bhd_type_parse(valstr);
-    if (hdr->type == -1) {
-        bhd_err_fill(&err, SYS_ERANGE, "invalid type");
-        return err;
-    }
-
-    hdr->seq = bhd_json_int_bounds(parent, "seq", 0, BHD_SEQ_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&err, rc, "invalid seq");
-        return err;
-    }
-
-    return err;
-}
-
 static int
-bhd_msg_hdr_enc(cJSON *parent, const struct bhd_msg_hdr *hdr)
+bhd_msg_hdr_enc(struct bhd_enc *enc, const struct bhd_msg_hdr *hdr)
 {
 #if MYNEWT_VAL(BLEHOSTD_FRAME_COUNTER)
     static uint32_t bhd_ctr;
 #endif
 
-    cJSON_AddStringToObject(parent, "op", bhd_op_rev_parse(hdr->op));
-    cJSON_AddStringToObject(parent, "type", bhd_type_rev_parse(hdr->type));
+    bhd_enc_str(enc, "op", bhd_op_rev_parse(hdr->op));
+    bhd_enc_str(enc, "type", bhd_type_rev_parse(hdr->type));
 
-    bhd_json_add_int(parent, "seq", hdr->seq);
+    bhd_enc_int(enc, "seq", hdr->seq);
 
 #if MYNEWT_VAL(BLEHOSTD_FRAME_COUNTER)
-    bhd_json_add_int(parent, "ctr", bhd_ctr++);
+    bhd_enc_int(enc, "ctr", bhd_ctr++);
 #endif
 
     return 0;
@@ -334,102 +624,61 @@ bhd_msg_hdr_enc(cJSON *parent, const struct bhd_msg_hdr *hdr)
 static int
 bhd_sync_req_run(cJSON *parent, struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    rsp->sync.synced = ble_hs_synced();
-    return 1;
-}
-
-/**
- * @return                      1 if a response should be sent;
- *                              0 for no response.
- */
-static int
-bhd_connect_req_run(cJSON *parent, struct bhd_req *req, struct bhd_rsp *rsp)
-{
+    int data_enc;
+    int msg_fmt;
     int rc;
 
-    req->connect.own_addr_type =
-        bhd_json_addr_type(parent, "own_addr_type", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid own_addr_type");
-        return 1;
-    }
+    /*
+     * The format and data encoding belong to the requesting client; other
+     * clients keep their own.
+     */
+    blehostd_client_fmt(blehostd_cur_client_idx(), &msg_fmt, &data_enc);
 
-    req->connect.peer_addr.type =
-        bhd_json_addr_type(parent, "peer_addr_type", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid peer_addr_type");
-        return 1;
-    }
-
-    bhd_json_addr(parent, "peer_addr", req->connect.peer_addr.val, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid peer_addr");
-        return 1;
-    }
-
-    req->connect.duration_ms =
-        bhd_json_int_bounds(parent, "duration_ms", 0, INT32_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid duration_ms");
-        return 1;
-    }
-
-    req->connect.scan_itvl =
-        bhd_json_int_bounds(parent, "scan_itvl", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid scan_itvl");
-        return 1;
-    }
+    req->sync.format = bhd_json_msg_fmt(parent, "format", &rc);
+    switch (rc) {
+    case 0:
+        msg_fmt = req->sync.format;
+        break;
 
-    req->connect.scan_window =
-        bhd_json_int_bounds(parent, "scan_window", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid scan_window");
-        return 1;
-    }
+    case SYS_ENOENT:
+        break;
 
-    req->connect.itvl_min =
-        bhd_json_int_bounds(parent, "itvl_min", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid itvl_min");
+    default:
+        bhd_err_build(rsp, rc, "invalid format");
         return 1;
     }
 
-    req->connect.itvl_max =
-        bhd_json_int_bounds(parent, "itvl_max", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid itvl_max");
-        return 1;
-    }
+    req->sync.data_enc = bhd_json_data_enc(parent, "data_enc", &rc);
+    switch (rc) {
+    case 0:
+        data_enc = req->sync.data_enc;
+        rsp->hdr.data_enc = data_enc;
+        break;
 
-    req->connect.latency =
-        bhd_json_int_bounds(parent, "latency", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid latency");
-        return 1;
-    }
+    case SYS_ENOENT:
+        break;
 
-    req->connect.supervision_timeout =
-        bhd_json_int_bounds(parent, "supervision_timeout", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid supervision_timeout");
+    default:
+        bhd_err_build(rsp, rc, "invalid data_enc");
         return 1;
     }
 
-    req->connect.min_ce_len =
-        bhd_json_int_bounds(parent, "min_ce_len", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid min_ce_len");
-        return 1;
-    }
+    /* Takes effect immediately; the response uses the new settings. */
+    blehostd_set_client_fmt(msg_fmt, data_enc);
 
-    req->connect.max_ce_len =
-        bhd_json_int_bounds(parent, "max_ce_len", 0, INT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid max_ce_len");
-        return 1;
-    }
+    rsp->sync.synced = ble_hs_synced();
+    rsp->sync.format = msg_fmt;
+    rsp->sync.data_enc = data_enc;
+    return 1;
+}
 
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_connect_req_run(cJSON *parent, struct bhd_req *req, struct bhd_rsp *rsp)
+{
     bhd_gap_connect(req, rsp);
     return 1;
 }
@@ -442,22 +691,6 @@ static int
 bhd_terminate_req_run(cJSON *parent,
                       struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->terminate.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
-    req->terminate.hci_reason =
-        bhd_json_int_bounds(parent, "hci_reason", 0, 0xff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid hci_reason");
-        return 1;
-    }
-
     bhd_gap_terminate(req, rsp);
     return 1;
 }
@@ -470,15 +703,6 @@ static int
 bhd_disc_all_svcs_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->disc_all_svcs.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
     bhd_gattc_disc_all_svcs(req, rsp);
     return 1;
 }
@@ -491,21 +715,6 @@ static int
 bhd_disc_svc_uuid_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->disc_svc_uuid.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
-    bhd_json_uuid(parent, "svc_uuid", &req->disc_svc_uuid.svc_uuid, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid svc_uuid");
-        return 1;
-    }
-
     bhd_gattc_disc_svc_uuid(req, rsp);
     return 1;
 }
@@ -518,29 +727,6 @@ static int
 bhd_disc_all_chrs_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->disc_all_chrs.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
-    req->disc_all_chrs.start_attr_handle =
-        bhd_json_int_bounds(parent, "start_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid start_attr_handle");
-        return 1;
-    }
-
-    req->disc_all_chrs.end_attr_handle =
-        bhd_json_int_bounds(parent, "end_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid end_attr_handle");
-        return 1;
-    }
-
     bhd_gattc_disc_all_chrs(req, rsp);
     return 1;
 }
@@ -553,35 +739,6 @@ static int
 bhd_disc_chr_uuid_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->disc_svc_uuid.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
-    req->disc_chr_uuid.start_handle =
-        bhd_json_int_bounds(parent, "start_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid start_attr_handle");
-        return 1;
-    }
-
-    req->disc_chr_uuid.end_handle =
-        bhd_json_int_bounds(parent, "end_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid end_attr_handle");
-        return 1;
-    }
-
-    bhd_json_uuid(parent, "chr_uuid", &req->disc_chr_uuid.chr_uuid, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid chr_uuid");
-        return 1;
-    }
-
     bhd_gattc_disc_chr_uuid(req, rsp);
     return 1;
 }
@@ -594,65 +751,10 @@ static int
 bhd_disc_all_dscs_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->disc_all_dscs.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-        return 1;
-    }
-
-    req->disc_all_dscs.start_attr_handle =
-        bhd_json_int_bounds(parent, "start_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid start_attr_handle");
-        return 1;
-    }
-
-    req->disc_all_dscs.end_attr_handle =
-        bhd_json_int_bounds(parent, "end_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        bhd_err_fill(&rsp->err, rc, "invalid end_attr_handle");
-        return 1;
-    }
-
     bhd_gattc_disc_all_dscs(req, rsp);
     return 1;
 }
 
-/**
- * @return                      0 on success; nonzero on failure.
- */
-static int
-bhd_write_req_dec(cJSON *parent, uint8_t *attr_buf, int attr_buf_sz,
-                  struct bhd_req *req, struct bhd_rsp *rsp)
-{
-    int rc;
-
-    req->write.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-    }
-
-    req->write.attr_handle =
-        bhd_json_int_bounds(parent, "attr_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid attr_handle");
-    }
-
-    req->write.data = attr_buf;
-    bhd_json_hex_string(parent, "data", attr_buf_sz, attr_buf,
-                        &req->write.data_len, &rc);
-
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid data");
-    }
-
-    return 0;
-}
-
 /**
  * @return                      1 if a response should be sent;
  *                              0 for no response.
@@ -661,14 +763,6 @@ static int
 bhd_write_req_run(cJSON *parent,
                   struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    uint8_t buf[BLE_ATT_ATTR_MAX_LEN + 3];
-    int rc;
-
-    rc = bhd_write_req_dec(parent, buf, sizeof buf, req, rsp);
-    if (rc != 0) {
-        return 1;
-    }
-
     bhd_gattc_write(req, rsp);
     return 1;
 }
@@ -681,14 +775,6 @@ static int
 bhd_write_cmd_req_run(cJSON *parent,
                       struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    uint8_t buf[BLE_ATT_ATTR_MAX_LEN + 3];
-    int rc;
-
-    rc = bhd_write_req_dec(parent, buf, sizeof buf, req, rsp);
-    if (rc != 0) {
-        return 1;
-    }
-
     bhd_gattc_write_no_rsp(req, rsp);
     return 1;
 }
@@ -701,14 +787,6 @@ static int
 bhd_exchange_mtu_req_run(cJSON *parent, struct bhd_req *req,
                             struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->exchange_mtu.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid conn_handle");
-    }
-
     bhd_gattc_exchange_mtu(req, rsp);
     return 1;
 }
@@ -721,14 +799,6 @@ static int
 bhd_gen_rand_addr_req_run(cJSON *parent, struct bhd_req *req,
                              struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->gen_rand_addr.nrpa =
-        bhd_json_bool(parent, "nrpa", &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid nrpa value");
-    }
-
     bhd_id_gen_rand_addr(req, rsp);
     return 1;
 }
@@ -741,13 +811,6 @@ static int
 bhd_set_rand_addr_req_run(cJSON *parent, struct bhd_req *req,
                              struct bhd_rsp *rsp)
 {
-    int rc;
-
-    bhd_json_addr(parent, "addr", req->set_rand_addr.addr, &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid address");
-    }
-
     bhd_id_set_rand_addr(req, rsp);
     return 1;
 }
@@ -771,64 +834,6 @@ bhd_conn_cancel_req_run(cJSON *parent, struct bhd_req *req,
 static int
 bhd_scan_req_run(cJSON *parent, struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->scan.own_addr_type =
-        bhd_json_addr_type(parent, "own_addr_type", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid own_addr_type");
-        return 1;
-    }
-
-    req->scan.duration_ms =
-        bhd_json_int_bounds(parent, "duration_ms", 0, INT32_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid duration_ms");
-        return 1;
-    }
-
-    req->scan.itvl =
-        bhd_json_int_bounds(parent, "itvl", 0, UINT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid itvl");
-        return 1;
-    }
-
-    req->scan.window =
-        bhd_json_int_bounds(parent, "window", 0, UINT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid window");
-        return 1;
-    }
-
-    req->scan.filter_policy =
-        bhd_json_scan_filter_policy(parent, "filter_policy", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid filter_policy");
-        return 1;
-    }
-
-    req->scan.limited =
-        bhd_json_bool(parent, "limited", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid limited");
-        return 1;
-    }
-
-    req->scan.passive =
-        bhd_json_bool(parent, "passive", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid passive");
-        return 1;
-    }
-
-    req->scan.filter_duplicates =
-        bhd_json_bool(parent, "filter_duplicates", &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid filter_duplicates");
-        return 1;
-    }
-
     bhd_gap_scan(req, rsp);
     return 1;
 }
@@ -853,14 +858,6 @@ static int
 bhd_set_preferred_mtu_req_run(cJSON *parent,
                               struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->set_preferred_mtu.mtu =
-        bhd_json_int_bounds(parent, "mtu", 0, UINT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid mtu");
-        return 1;
-    }
     bhd_gattc_set_preferred_mtu(req, rsp);
     return 1;
 }
@@ -873,14 +870,6 @@ static int
 bhd_security_initiate_req_run(cJSON *parent,
                          struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->security_initiate.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, UINT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid conn_handle");
-        return 1;
-    }
     bhd_gap_security_initiate(req, rsp);
     return 1;
 }
@@ -893,14 +882,6 @@ static int
 bhd_conn_find_req_run(cJSON *parent,
                       struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    req->conn_find.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, UINT16_MAX, &rc);
-    if (rc != 0) {
-        bhd_err_build(rsp, rc, "invalid conn_handle");
-        return 1;
-    }
     bhd_gap_conn_find(req, rsp);
     return 1;
 }
@@ -1035,15 +1016,6 @@ static int
 bhd_adv_set_data_req_run(cJSON *parent,
                          struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    bhd_json_hex_string(parent, "data",
-                        sizeof req->adv_set_data.data, req->adv_set_data.data,
-                        &req->adv_set_data.data_len, &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid data");
-    }
-
     bhd_gap_adv_set_data(req, rsp);
     return 1;
 }
@@ -1056,18 +1028,6 @@ static int
 bhd_adv_rsp_set_data_req_run(cJSON *parent,
                              struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    bhd_json_hex_string(parent,
-                        "data",
-                        sizeof req->adv_rsp_set_data.data,
-                        req->adv_rsp_set_data.data,
-                        &req->adv_rsp_set_data.data_len,
-                        &rc);
-    if (rc != 0) {
-        return bhd_err_fill(&rsp->err, rc, "invalid data");
-    }
-
     bhd_gap_adv_rsp_set_data(req, rsp);
     return 1;
 }
@@ -1385,6 +1345,30 @@ done:
     return 1;
 }
 
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_remove_svcs_req_run(cJSON *parent,
+                        struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    int rc;
+
+    rc = ble_json_arr_uuid(parent,
+                           "uuids",
+                           BHD_REMOVE_SVCS_MAX_UUIDS,
+                           req->remove_svcs.uuids,
+                           &req->remove_svcs.num_uuids);
+    if (rc != 0) {
+        bhd_err_build(rsp, rc, "invalid uuids");
+        return 1;
+    }
+
+    bhd_gatts_remove_svcs(req, rsp);
+    return 1;
+}
+
 /**
  * @return                      1 if a response should be sent;
  *                              0 for no response.
@@ -1405,29 +1389,22 @@ static int
 bhd_access_status_req_run(cJSON *parent,
                           struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    uint8_t buf[BLE_ATT_ATTR_MAX_LEN];
-    int data_len;
-    int rc;
-
-    req->access_status.att_status =
-        bhd_json_int_bounds(parent, "att_status", 0, UINT8_MAX, &rc);
-    if (rc != 0) {
-        rsp->access_status.status = rc;
-        return 1;
-    }
-
-    bhd_json_hex_string(parent, "data", sizeof buf, buf, &data_len, &rc);
-    if (rc != 0 && rc != SYS_ENOENT) {
-        rsp->access_status.status = rc;
-        return 1;
-    }
-    req->notify.data = buf;
-    req->notify.data_len = data_len;
-
     bhd_gatts_access_status(req, rsp);
     return 1;
 }
 
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_set_value_req_run(cJSON *parent,
+                      struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    bhd_gatts_set_value(req, rsp);
+    return 1;
+}
+
 /**
  * @return                      1 if a response should be sent;
  *                              0 for no response.
@@ -1436,30 +1413,31 @@ static int
 bhd_notify_req_run(cJSON *parent,
                    struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    uint8_t buf[BLE_ATT_ATTR_MAX_LEN + 3];
-    int rc;
-
-    req->notify.conn_handle =
-        bhd_json_int_bounds(parent, "conn_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        goto err;
-    }
-
-    req->notify.attr_handle =
-        bhd_json_int_bounds(parent, "attr_handle", 0, 0xffff, &rc);
-    if (rc != 0) {
-        goto err;
-    }
-
-    req->notify.data = buf;
-    bhd_json_hex_string(parent, "data", sizeof buf, buf,
-                        &req->notify.data_len, &rc);
-
     bhd_gattc_notify(req, rsp);
     return 1;
+}
+
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_notify_multi_req_run(cJSON *parent,
+                         struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    bhd_gattc_notify_multi(req, rsp);
+    return 1;
+}
 
-err:
-    rsp->notify.status = rc;
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_subscriptions_req_run(cJSON *parent,
+                          struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    bhd_gatts_subscriptions(req, rsp);
     return 1;
 }
 
@@ -1471,24 +1449,22 @@ static int
 bhd_find_chr_req_run(cJSON *parent,
                      struct bhd_req *req, struct bhd_rsp *rsp)
 {
-    int rc;
-
-    bhd_json_uuid(parent, "svc_uuid", &req->find_chr.svc_uuid, &rc);
-    if (rc != 0) {
-        rsp->find_chr.status = rc;
-        return 1;
-    }
-
-    bhd_json_uuid(parent, "chr_uuid", &req->find_chr.chr_uuid, &rc);
-    if (rc != 0) {
-        rsp->find_chr.status = rc;
-        return 1;
-    }
-
     bhd_gatts_find_chr(req, rsp);
     return 1;
 }
 
+/**
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_find_dsc_req_run(cJSON *parent,
+                     struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    bhd_gatts_find_dsc(req, rsp);
+    return 1;
+}
+
 /**
  * @return                      1 if a response should be sent;
  *                              0 for no response.
@@ -1538,59 +1514,534 @@ bhd_sm_inject_io_req_run(cJSON *parent,
             rsp->sm_inject_io.status = rc;
             return 1;
         }
-        break;
+        break;
+
+    case BLE_SM_IOACT_NUMCMP:
+        req->sm_inject_io.numcmp_accept =
+            bhd_json_bool(parent, "numcmp_accept", &rc);
+        if (rc != 0) {
+            rsp->sm_inject_io.status = rc;
+            return 1;
+        }
+        break;
+
+    default:
+        rsp->sm_inject_io.status = BLE_HS_EINVAL;
+        return 1;
+    }
+
+    bhd_sm_inject_io(req, rsp);
+    return 1;
+}
+
+/**
+ * Converts a list of event types to a bitmask in which bit n represents type
+ * BHD_MSG_TYPE_EVT_BASE + n.
+ *
+ * @return                      0 on success;
+ *                              SYS_ERANGE if a type is not an event type.
+ */
+static int
+bhd_evt_type_mask(const int *types, int num_types, uint32_t *out_mask)
+{
+    int idx;
+    int i;
+
+    *out_mask = 0;
+    for (i = 0; i < num_types; i++) {
+        idx = types[i] - BHD_MSG_TYPE_EVT_BASE;
+        if (idx < 0 || idx >= 32) {
+            return SYS_ERANGE;
+        }
+        *out_mask |= 1UL << idx;
+    }
+
+    return 0;
+}
+
+/**
+ * Replaces the requesting client's event filter.
+ *
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_subscribe_req_run(cJSON *parent,
+                      struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    struct bhd_evt_filter filter;
+    int rc;
+
+    memset(&filter, 0, sizeof filter);
+
+    rc = bhd_evt_type_mask(req->subscribe.evt_types,
+                           req->subscribe.num_evt_types, &filter.evt_types);
+    if (rc != 0) {
+        rsp->subscribe.status = rc;
+        return 1;
+    }
+
+    filter.num_conn_handles = req->subscribe.num_conn_handles;
+    memcpy(filter.conn_handles, req->subscribe.conn_handles,
+           filter.num_conn_handles * sizeof filter.conn_handles[0]);
+
+    filter.num_attr_handles = req->subscribe.num_attr_handles;
+    memcpy(filter.attr_handles, req->subscribe.attr_handles,
+           filter.num_attr_handles * sizeof filter.attr_handles[0]);
+
+    rsp->subscribe.status = blehostd_set_evt_filter(&filter);
+    return 1;
+}
+
+/**
+ * Maps the memfd that accompanied the request as the requesting client's
+ * event ring.
+ *
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_ring_open_req_run(cJSON *parent,
+                      struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    uint32_t evt_types;
+    int client_idx;
+    int fd;
+    int rc;
+
+    fd = blehostd_take_rx_fd();
+    client_idx = blehostd_cur_client_idx();
+    if (fd < 0 || client_idx < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        rsp->ring_open.status = SYS_EINVAL;
+        return 1;
+    }
+
+    rc = bhd_evt_type_mask(req->ring_open.evt_types,
+                           req->ring_open.num_evt_types, &evt_types);
+    if (rc != 0) {
+        close(fd);
+        rsp->ring_open.status = rc;
+        return 1;
+    }
+
+    rsp->ring_open.status = bhd_ring_open(client_idx, fd, evt_types,
+                                          &rsp->ring_open.data_sz);
+    return 1;
+}
+
+/**
+ * Makes the socket that accompanied the request the requesting client's
+ * bulk channel.
+ *
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_bulk_open_req_run(cJSON *parent,
+                      struct bhd_req *req, struct bhd_rsp *rsp)
+{
+    int fd;
+
+    fd = blehostd_take_rx_fd();
+    if (fd < 0) {
+        rsp->bulk_open.status = SYS_EINVAL;
+        return 1;
+    }
+
+    rsp->bulk_open.status = blehostd_bulk_open(fd);
+    return 1;
+}
+
+/**
+ * Determines the wire format of an incoming message from its first byte.  A
+ * CBOR message is always a map (major type 5: 0xa0-0xbf); no JSON document
+ * can start with a byte in this range.
+ */
+static int
+bhd_msg_fmt_detect(const uint8_t *buf, int len)
+{
+    if (len > 0 && buf[0] >> 5 == 5) {
+        return BHD_MSG_FMT_CBOR;
+    } else {
+        return BHD_MSG_FMT_JSON;
+    }
+}
+
+/**
+ * Finds the value of the top-level "type" member of a JSON request without
+ * tokenizing the whole request.  Nested objects and the contents of strings
+ * are skipped over.
+ *
+ * @return                      0 on success; SYS_ENOENT if the request has
+ *                                  no top-level type string that fits in
+ *                                  dst.
+ */
+static int
+bhd_json_peek_type(const uint8_t *buf, int len, char *dst, int max_len)
+{
+    int str_start;
+    int depth;
+    int off;
+    int i;
+
+    depth = 0;
+    for (off = 0; off < len; off++) {
+        switch (buf[off]) {
+        case '{':
+        case '[':
+            depth++;
+            break;
+
+        case '}':
+        case ']':
+            depth--;
+            break;
+
+        case '"':
+            str_start = ++off;
+            while (off < len && buf[off] != '"') {
+                if (buf[off] == '\\') {
+                    off++;
+                }
+                off++;
+            }
+            if (off >= len) {
+                return SYS_ENOENT;
+            }
+
+            if (depth != 1 || off - str_start != 4 ||
+                memcmp(buf + str_start, "type", 4) != 0) {
+
+                break;
+            }
+
+            /* Only a key is followed by a colon. */
+            off++;
+            while (off < len && isspace(buf[off])) {
+                off++;
+            }
+            if (off >= len || buf[off] != ':') {
+                /* Rescan this character. */
+                off--;
+                break;
+            }
+            off++;
+            while (off < len && isspace(buf[off])) {
+                off++;
+            }
+            if (off >= len || buf[off] != '"') {
+                return SYS_ENOENT;
+            }
+
+            for (i = 0, off++; off < len && buf[off] != '"'; i++, off++) {
+                if (i >= max_len - 1) {
+                    return SYS_ENOENT;
+                }
+                dst[i] = buf[off];
+            }
+            dst[i] = '\0';
+            return 0;
+
+        default:
+            break;
+        }
+    }
+
+    return SYS_ENOENT;
+}
+
+/**
+ * Classifies a received request, before it is queued, by looking only at
+ * its type.  Urgent requests are executed ahead of any normal requests that
+ * are still waiting.  These are the requests that unblock the host or tear
+ * something down: the host's GATT server callback is stalled until the
+ * corresponding access_status arrives.
+ *
+ * @return                      BHD_REQ_PRIO_URGENT or BHD_REQ_PRIO_NORMAL.
+ */
+int
+bhd_req_prio(const uint8_t *buf, int len)
+{
+    char type_str[32];
+    int rc;
+
+    if (bhd_msg_fmt_detect(buf, len) == BHD_MSG_FMT_CBOR) {
+        rc = bhd_cbor_find_text(buf, len, "type", type_str, sizeof type_str);
+    } else {
+        rc = bhd_json_peek_type(buf, len, type_str, sizeof type_str);
+    }
+    if (rc != 0) {
+        /* Malformed; let the decoder report the error in the usual order. */
+        return BHD_REQ_PRIO_NORMAL;
+    }
+
+    switch (bhd_type_parse(type_str)) {
+    case BHD_MSG_TYPE_ACCESS_STATUS:
+    case BHD_MSG_TYPE_TERMINATE:
+    case BHD_MSG_TYPE_SM_INJECT_IO:
+    case BHD_MSG_TYPE_CONN_CANCEL:
+        return BHD_REQ_PRIO_URGENT;
+
+    default:
+        return BHD_REQ_PRIO_NORMAL;
+    }
+}
+
+/**
+ * Decodes the body of a request whose header has already been decoded, and
+ * executes it.
+ *
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_req_exec(const struct bhd_dec_src *src, struct bhd_req *req,
+             struct bhd_rsp *rsp)
+{
+    const struct bhd_req_dispatch_entry *entry;
+    const char *err_msg;
+    cJSON *root;
+    int rc;
+
+    entry = bhd_req_dispatch_find(req->hdr.type);
+    if (entry == NULL) {
+        bhd_err_build(rsp, SYS_ERANGE, "invalid type");
+        return 1;
+    }
+
+    rsp->hdr.type = req->hdr.type;
+
+    if (entry->fields != NULL) {
+        rc = bhd_dec_obj(src, entry->fields, req, &err_msg);
+        if (rc != 0) {
+            if (entry->err_rsp) {
+                bhd_err_build(rsp, rc, err_msg);
+            } else {
+                bhd_err_fill(&rsp->err, rc, err_msg);
+            }
+            return 1;
+        }
+
+        return entry->cb(NULL, req, rsp);
+    }
+
+    if (src->root != NULL) {
+        root = (cJSON *)src->root;
+    } else {
+        root = bhd_dec_tok_to_cjson(src->js, src->toks, src->tok_idx);
+        if (root == NULL) {
+            bhd_err_build(rsp, SYS_ENOMEM, "out of memory");
+            return 1;
+        }
+    }
+
+    bhd_json_set_data_enc(src->data_enc);
+    rc = entry->cb(root, req, rsp);
+
+    if (root != src->root) {
+        cJSON_Delete(root);
+    }
+
+    return rc;
+}
+
+/**
+ * Retrieves the status code of a response.  Every response type other than
+ * sync starts with a status field, which err.status aliases.
+ */
+static int
+bhd_rsp_status(const struct bhd_rsp *rsp)
+{
+    if (rsp->hdr.type == BHD_MSG_TYPE_SYNC) {
+        return 0;
+    }
+
+    return rsp->err.status;
+}
+
+/**
+ * Executes each sub-request of a batch request in order.  Sub-requests have
+ * the same form as ordinary requests, except that "op" is not required and
+ * "seq" defaults to that of the batch.  Batches cannot be nested.
+ *
+ * @return                      1 if a response should be sent;
+ *                              0 for no response.
+ */
+static int
+bhd_batch_exec(const struct bhd_dec_src *src, struct bhd_req *req,
+               struct bhd_rsp *rsp)
+{
+    struct bhd_dec_src reqs;
+    struct bhd_dec_src elem;
+    struct bhd_req *sub_req;
+    struct bhd_rsp *sub_rsp;
+    const char *err_msg;
+    int num_reqs;
+    int status;
+    int rc;
+    int i;
+
+    rsp->hdr.type = BHD_MSG_TYPE_BATCH;
+    rsp->batch.status = 0;
+    rsp->batch.rsps = bhd_batch_rsps;
+    rsp->batch.num_rsps = 0;
+
+    rc = bhd_dec_obj(src, bhd_batch_fields, req, &err_msg);
+    if (rc != 0) {
+        bhd_err_build(rsp, rc, err_msg);
+        return 1;
+    }
+
+    rc = bhd_dec_member(src, "reqs", &reqs);
+    if (rc == 0) {
+        num_reqs = bhd_dec_arr_len(&reqs);
+        if (num_reqs < 0) {
+            rc = num_reqs;
+        }
+    }
+    if (rc != 0) {
+        bhd_err_build(rsp, rc, "invalid reqs");
+        return 1;
+    }
+    if (num_reqs > BHD_BATCH_MAX_REQS) {
+        bhd_err_build(rsp, SYS_ENOMEM, "too many reqs");
+        return 1;
+    }
 
-    case BLE_SM_IOACT_NUMCMP:
-        req->sm_inject_io.numcmp_accept =
-            bhd_json_bool(parent, "numcmp_accept", &rc);
+    if (num_reqs > 0) {
+        bhd_dec_arr_first(&reqs, &elem);
+    }
+
+    for (i = 0; i < num_reqs; i++) {
+        sub_rsp = bhd_batch_rsps + i;
+        *sub_rsp = (struct bhd_rsp){{0}};
+        sub_rsp->hdr.op = BHD_MSG_OP_RSP;
+        sub_rsp->hdr.data_enc = req->hdr.data_enc;
+
+        sub_req = &bhd_batch_sub_req;
+        *sub_req = (struct bhd_req){{0}};
+        sub_req->hdr.op = BHD_MSG_OP_REQ;
+        sub_req->hdr.seq = req->hdr.seq;
+        sub_req->hdr.data_enc = req->hdr.data_enc;
+
+        rc = bhd_dec_obj(&elem, bhd_batch_item_hdr_fields, sub_req,
+                         &err_msg);
+        sub_rsp->hdr.seq = sub_req->hdr.seq;
         if (rc != 0) {
-            rsp->sm_inject_io.status = rc;
-            return 1;
+            bhd_err_build(sub_rsp, rc, err_msg);
+        } else {
+            bhd_req_exec(&elem, sub_req, sub_rsp);
+        }
+        rsp->batch.num_rsps++;
+
+        status = bhd_rsp_status(sub_rsp);
+        if (status != 0) {
+            if (rsp->batch.status == 0) {
+                rsp->batch.status = status;
+            }
+            if (req->batch.stop_on_err) {
+                break;
+            }
         }
-        break;
 
-    default:
-        rsp->sm_inject_io.status = BLE_HS_EINVAL;
-        return 1;
+        if (i + 1 < num_reqs) {
+            bhd_dec_arr_next(&elem);
+        }
     }
 
-    bhd_sm_inject_io(req, rsp);
     return 1;
 }
 
 /**
+ * Decodes and executes a request.  The request can be encoded in either JSON
+ * or CBOR, regardless of the format selected for outgoing messages.
+ *
+ * A JSON request is tokenized in place and, for request types with a field
+ * table, decoded directly into a struct bhd_req without building a cJSON
+ * tree.  The buffer is modified during decoding and must be null-terminated
+ * (buf[len] == '\0').
+ *
  * @return                      1 if a response should be sent;
  *                              0 for no response.
  */
 int
-bhd_req_dec(const char *json, struct bhd_rsp *out_rsp)
+bhd_req_dec(uint8_t *buf, int len, struct bhd_rsp *out_rsp)
 {
-    bhd_req_run_fn *req_cb;
-    struct bhd_err_rsp err;
+    struct bhd_dec_src src;
     struct bhd_req req;
+    const char *err_msg;
     cJSON *root;
+    int data_enc;
+    int msg_fmt;
+    int num_toks;
+    int fmt;
     int rc;
 
     req = (struct bhd_req){{0}};
+    src = (struct bhd_dec_src){ 0 };
+    root = NULL;
+
+    blehostd_client_fmt(blehostd_cur_client_idx(), &msg_fmt, &data_enc);
 
     out_rsp->hdr.op = BHD_MSG_OP_RSP;
+    out_rsp->hdr.data_enc = data_enc;
+    req.hdr.data_enc = data_enc;
 
-    root = cJSON_Parse(json);
-    if (root == NULL) {
-        bhd_err_build(out_rsp, SYS_ERANGE, "invalid json");
-        rc = 1;
-        goto done;
+    fmt = bhd_msg_fmt_detect(buf, len);
+    if (fmt == BHD_MSG_FMT_CBOR) {
+        rc = bhd_cbor_dec(buf, len, &root);
+        if (rc != 0) {
+            bhd_err_build(out_rsp, rc, "invalid cbor");
+            rc = 1;
+            goto done;
+        }
+    } else {
+        BHD_LOG(DEBUG, "Received JSON request:\n%s\n", (const char *)buf);
+
+        rc = bhd_tok_parse((char *)buf, len, bhd_req_toks, BHD_REQ_MAX_TOKS,
+                           &num_toks);
+        switch (rc) {
+        case 0:
+            src.js = (char *)buf;
+            src.toks = bhd_req_toks;
+            break;
+
+        case SYS_ENOMEM:
+            /* Too large to tokenize; fall back to a cJSON tree. */
+            root = cJSON_Parse((const char *)buf);
+            if (root != NULL) {
+                break;
+            }
+            /* Fall through. */
+
+        default:
+            bhd_err_build(out_rsp, SYS_ERANGE, "invalid json");
+            rc = 1;
+            goto done;
+        }
     }
+    src.root = root;
 
-    err = bhd_msg_hdr_dec(root, &req.hdr);
-    if (err.status != 0) {
-        BHD_LOG(DEBUG, "failed to decode BHD header; json=%s\n", json);
-        out_rsp->hdr.type = BHD_MSG_TYPE_ERR;
-        out_rsp->err = err;
+    rc = bhd_dec_obj(&src, bhd_msg_hdr_fields, &req, &err_msg);
+    if (rc != 0) {
+        BHD_LOG(DEBUG, "failed to decode BHD header; fmt=%s\n",
+                bhd_msg_fmt_rev_parse(fmt));
+        bhd_err_build(out_rsp, rc, err_msg);
         rc = 1;
         goto done;
     }
     out_rsp->hdr.seq = req.hdr.seq;
+    out_rsp->hdr.data_enc = req.hdr.data_enc;
+
+    /* CBOR byte strings reach the decoder as hex strings. */
+    if (fmt == BHD_MSG_FMT_CBOR) {
+        src.data_enc = BHD_DATA_ENC_HEX;
+    } else {
+        src.data_enc = req.hdr.data_enc;
+    }
 
     if (req.hdr.op != BHD_MSG_OP_REQ) {
         bhd_err_build(out_rsp, SYS_ERANGE, "invalid op");
@@ -1598,432 +2049,570 @@ bhd_req_dec(const char *json, struct bhd_rsp *out_rsp)
         goto done;
     }
 
-    req_cb = bhd_req_dispatch_find(req.hdr.type);
-    if (req_cb == NULL) {
-        bhd_err_build(out_rsp, SYS_ERANGE, "invalid type");
-        rc = 1;
-        goto done;
+    if (req.hdr.type == BHD_MSG_TYPE_BATCH) {
+        rc = bhd_batch_exec(&src, &req, out_rsp);
+    } else {
+        rc = bhd_req_exec(&src, &req, out_rsp);
     }
 
-    out_rsp->hdr.type = req.hdr.type;
-
-    rc = req_cb(root, &req, out_rsp);
-
 done:
     cJSON_Delete(root);
     return rc;
 }
 
 static int
-bhd_conn_desc_enc(cJSON *parent, const struct ble_gap_conn_desc *desc)
+bhd_conn_desc_enc(struct bhd_enc *enc, const struct ble_gap_conn_desc *desc)
 {
     if (desc->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-        bhd_json_add_int(parent, "conn_handle", desc->conn_handle);
+        bhd_enc_int(enc, "conn_handle", desc->conn_handle);
     }
 
     if (desc->our_id_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "own_id_addr_type",
-                               desc->our_id_addr.type);
-        bhd_json_add_addr(parent, "own_id_addr", desc->our_id_addr.val);
+        bhd_enc_addr_type(enc, "own_id_addr_type",
+                       desc->our_id_addr.type);
+        bhd_enc_addr(enc, "own_id_addr", desc->our_id_addr.val);
     }
 
     if (desc->our_ota_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "own_ota_addr_type",
-                               desc->our_ota_addr.type);
-        bhd_json_add_addr(parent, "own_ota_addr", desc->our_ota_addr.val);
+        bhd_enc_addr_type(enc, "own_ota_addr_type",
+                       desc->our_ota_addr.type);
+        bhd_enc_addr(enc, "own_ota_addr", desc->our_ota_addr.val);
     }
 
     if (desc->peer_id_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "peer_id_addr_type",
-                               desc->peer_id_addr.type);
-        bhd_json_add_addr(parent, "peer_id_addr", desc->peer_id_addr.val);
+        bhd_enc_addr_type(enc, "peer_id_addr_type",
+                       desc->peer_id_addr.type);
+        bhd_enc_addr(enc, "peer_id_addr", desc->peer_id_addr.val);
     }
 
     if (desc->peer_ota_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "peer_ota_addr_type",
-                               desc->peer_ota_addr.type);
-        bhd_json_add_addr(parent, "peer_ota_addr", desc->peer_ota_addr.val);
+        bhd_enc_addr_type(enc, "peer_ota_addr_type",
+                       desc->peer_ota_addr.type);
+        bhd_enc_addr(enc, "peer_ota_addr", desc->peer_ota_addr.val);
     }
 
     return 0;
 }
 
 static int
-bhd_err_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_err_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->err.status);
-    cJSON_AddStringToObject(parent, "msg", rsp->err.msg);
+    bhd_enc_int(enc, "status", rsp->err.status);
+    bhd_enc_str(enc, "msg", rsp->err.msg);
     return 0;
 }
 
 static int
-bhd_sync_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_sync_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    cJSON_AddBoolToObject(parent, "synced", rsp->sync.synced);
+    bhd_enc_bool(enc, "synced", rsp->sync.synced);
+    bhd_enc_str(enc, "format",
+             bhd_msg_fmt_rev_parse(rsp->sync.format));
+    bhd_enc_str(enc, "data_enc",
+             bhd_data_enc_rev_parse(rsp->sync.data_enc));
     return 0;
 }
 
 static int
-bhd_connect_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_connect_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->connect.status);
+    bhd_enc_int(enc, "status", rsp->connect.status);
     return 0;
 }
 
 static int
-bhd_terminate_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_terminate_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->terminate.status);
+    bhd_enc_int(enc, "status", rsp->terminate.status);
     return 0;
 }
 
 static int
-bhd_disc_all_svcs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_disc_all_svcs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->disc_all_svcs.status);
+    bhd_enc_int(enc, "status", rsp->disc_all_svcs.status);
     return 0;
 }
 
 static int
-bhd_disc_svc_uuid_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_disc_svc_uuid_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->disc_svc_uuid.status);
+    bhd_enc_int(enc, "status", rsp->disc_svc_uuid.status);
     return 0;
 }
 
 static int
-bhd_disc_all_chrs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_disc_all_chrs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->disc_all_chrs.status);
+    bhd_enc_int(enc, "status", rsp->disc_all_chrs.status);
     return 0;
 }
 
 static int
-bhd_disc_chr_uuid_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_disc_chr_uuid_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->disc_all_chrs.status);
+    bhd_enc_int(enc, "status", rsp->disc_all_chrs.status);
     return 0;
 }
 
 static int
-bhd_disc_all_dscs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_disc_all_dscs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->disc_all_dscs.status);
+    bhd_enc_int(enc, "status", rsp->disc_all_dscs.status);
     return 0;
 }
 
 static int
-bhd_write_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_write_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->write.status);
+    bhd_enc_int(enc, "status", rsp->write.status);
     return 0;
 }
 
 static int
-bhd_exchange_mtu_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_exchange_mtu_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->exchange_mtu.status);
+    bhd_enc_int(enc, "status", rsp->exchange_mtu.status);
     return 0;
 }
 
 static int
-bhd_gen_rand_addr_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_gen_rand_addr_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->gen_rand_addr.status);
+    bhd_enc_int(enc, "status", rsp->gen_rand_addr.status);
     if (rsp->gen_rand_addr.status == 0) {
-        bhd_json_add_addr(parent, "addr", rsp->gen_rand_addr.addr);
+        bhd_enc_addr(enc, "addr", rsp->gen_rand_addr.addr);
     }
     return 0;
 }
 
 static int
-bhd_set_rand_addr_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_set_rand_addr_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->set_rand_addr.status);
+    bhd_enc_int(enc, "status", rsp->set_rand_addr.status);
     return 0;
 }
 
 static int
-bhd_conn_cancel_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_conn_cancel_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->conn_cancel.status);
+    bhd_enc_int(enc, "status", rsp->conn_cancel.status);
     return 0;
 }
 
 static int
-bhd_scan_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_scan_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->scan.status);
+    bhd_enc_int(enc, "status", rsp->scan.status);
     return 0;
 }
 
 static int
-bhd_scan_cancel_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_scan_cancel_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->scan_cancel.status);
+    bhd_enc_int(enc, "status", rsp->scan_cancel.status);
     return 0;
 }
 
 static int
-bhd_set_preferred_mtu_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_set_preferred_mtu_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->set_preferred_mtu.status);
+    bhd_enc_int(enc, "status", rsp->set_preferred_mtu.status);
     return 0;
 }
 
 static int
-bhd_security_initiate_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_security_initiate_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->security_initiate.status);
+    bhd_enc_int(enc, "status", rsp->security_initiate.status);
     return 0;
 }
 
 static int
-bhd_conn_find_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_conn_find_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->conn_find.status);
+    bhd_enc_int(enc, "status", rsp->conn_find.status);
 
     if (rsp->conn_find.conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-        bhd_json_add_int(parent, "conn_handle", rsp->conn_find.conn_handle);
+        bhd_enc_int(enc, "conn_handle", rsp->conn_find.conn_handle);
     }
 
-    bhd_json_add_int(parent, "conn_itvl", rsp->conn_find.conn_itvl);
-    bhd_json_add_int(parent, "conn_latency", rsp->conn_find.conn_latency);
-    bhd_json_add_int(parent, "supervision_timeout",
-                     rsp->conn_find.supervision_timeout);
-    bhd_json_add_int(parent, "role", rsp->conn_find.role);
-    bhd_json_add_int(parent, "master_clock_accuracy",
-                     rsp->conn_find.master_clock_accuracy);
+    bhd_enc_int(enc, "conn_itvl", rsp->conn_find.conn_itvl);
+    bhd_enc_int(enc, "conn_latency", rsp->conn_find.conn_latency);
+    bhd_enc_int(enc, "supervision_timeout",
+             rsp->conn_find.supervision_timeout);
+    bhd_enc_int(enc, "role", rsp->conn_find.role);
+    bhd_enc_int(enc, "master_clock_accuracy",
+             rsp->conn_find.master_clock_accuracy);
 
     if (rsp->conn_find.our_id_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "own_id_addr_type",
-                               rsp->conn_find.our_id_addr.type);
-        bhd_json_add_addr(parent, "own_id_addr",
-                          rsp->conn_find.our_id_addr.val);
+        bhd_enc_addr_type(enc, "own_id_addr_type",
+                       rsp->conn_find.our_id_addr.type);
+        bhd_enc_addr(enc, "own_id_addr",
+                  rsp->conn_find.our_id_addr.val);
     }
 
     if (rsp->conn_find.our_ota_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "own_ota_addr_type",
-                               rsp->conn_find.our_ota_addr.type);
-        bhd_json_add_addr(parent, "own_ota_addr",
-                          rsp->conn_find.our_ota_addr.val);
+        bhd_enc_addr_type(enc, "own_ota_addr_type",
+                       rsp->conn_find.our_ota_addr.type);
+        bhd_enc_addr(enc, "own_ota_addr",
+                  rsp->conn_find.our_ota_addr.val);
     }
 
     if (rsp->conn_find.peer_id_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "peer_id_addr_type",
-                               rsp->conn_find.peer_id_addr.type);
-        bhd_json_add_addr(parent, "peer_id_addr",
-                          rsp->conn_find.peer_id_addr.val);
+        bhd_enc_addr_type(enc, "peer_id_addr_type",
+                       rsp->conn_find.peer_id_addr.type);
+        bhd_enc_addr(enc, "peer_id_addr",
+                  rsp->conn_find.peer_id_addr.val);
     }
 
     if (rsp->conn_find.peer_ota_addr.type != BHD_ADDR_TYPE_NONE) {
-        bhd_json_add_addr_type(parent, "peer_ota_addr_type",
-                               rsp->conn_find.peer_ota_addr.type);
-        bhd_json_add_addr(parent, "peer_ota_addr",
-                          rsp->conn_find.peer_ota_addr.val);
+        bhd_enc_addr_type(enc, "peer_ota_addr_type",
+                       rsp->conn_find.peer_ota_addr.type);
+        bhd_enc_addr(enc, "peer_ota_addr",
+                  rsp->conn_find.peer_ota_addr.val);
     }
 
-    bhd_json_add_bool(parent, "encrypted", rsp->conn_find.encrypted);
-    bhd_json_add_bool(parent, "authenticated", rsp->conn_find.authenticated);
-    bhd_json_add_bool(parent, "bonded", rsp->conn_find.bonded);
-    bhd_json_add_int(parent, "key_size", rsp->conn_find.key_size);
+    bhd_enc_bool(enc, "encrypted", rsp->conn_find.encrypted);
+    bhd_enc_bool(enc, "authenticated", rsp->conn_find.authenticated);
+    bhd_enc_bool(enc, "bonded", rsp->conn_find.bonded);
+    bhd_enc_int(enc, "key_size", rsp->conn_find.key_size);
 
     return 0;
 }
 
 static int
-bhd_reset_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_reset_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
     return 0;
 }
 
 static int
-bhd_adv_start_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_adv_start_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->adv_start.status);
+    bhd_enc_int(enc, "status", rsp->adv_start.status);
     return 0;
 }
 
 static int
-bhd_adv_stop_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_adv_stop_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->adv_stop.status);
+    bhd_enc_int(enc, "status", rsp->adv_stop.status);
     return 0;
 }
 
 static int
-bhd_adv_set_data_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_adv_set_data_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->adv_set_data.status);
+    bhd_enc_int(enc, "status", rsp->adv_set_data.status);
     return 0;
 }
 
 static int
-bhd_adv_rsp_set_data_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_adv_rsp_set_data_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->adv_rsp_set_data.status);
+    bhd_enc_int(enc, "status", rsp->adv_rsp_set_data.status);
     return 0;
 }
 
 static int
-bhd_adv_fields_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_adv_fields_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->adv_fields.status);
+    bhd_enc_int(enc, "status", rsp->adv_fields.status);
 
     if (rsp->adv_fields.status == 0) {
-        bhd_json_add_bytes(parent, "data", rsp->adv_fields.data,
-                           rsp->adv_fields.data_len);
+        bhd_enc_bytes(enc, "data", rsp->adv_fields.data,
+                   rsp->adv_fields.data_len);
     }
 
     return 0;
 }
 
 static int
-bhd_clear_svcs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_clear_svcs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->clear_svcs.status);
+    bhd_enc_int(enc, "status", rsp->clear_svcs.status);
     return 0;
 }
 
 static int
-bhd_add_svcs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_add_svcs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->add_svcs.status);
+    bhd_enc_int(enc, "status", rsp->add_svcs.status);
     return 0;
 }
 
 static int
-bhd_commit_svcs_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_remove_svcs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->remove_svcs.status);
+    return 0;
+}
+
+static void
+bhd_commit_dsc_enc(struct bhd_enc *enc, const struct bhd_commit_dsc *dsc)
+{
+    bhd_enc_open_obj(enc, NULL);
+    bhd_enc_uuid(enc, "uuid", &dsc->uuid.u);
+    bhd_enc_int(enc, "handle", dsc->handle);
+    bhd_enc_close_obj(enc);
+}
+
+static void
+bhd_commit_chr_enc(struct bhd_enc *enc, const struct bhd_commit_chr *chr)
 {
-    cJSON *svcs;
-    cJSON *svc;
-    int rc;
     int i;
 
-    bhd_json_add_int(parent, "status", rsp->commit_svcs.status);
+    bhd_enc_open_obj(enc, NULL);
+    bhd_enc_uuid(enc, "uuid", &chr->uuid.u);
+    bhd_enc_int(enc, "def_handle", chr->def_handle);
+    bhd_enc_int(enc, "val_handle", chr->val_handle);
 
-    svcs = cJSON_CreateArray();
-    if (svcs == NULL) {
-        rc = SYS_ENOMEM;
-        goto done;
+    bhd_enc_open_arr(enc, "descriptors");
+    for (i = 0; i < chr->num_dscs; i++) {
+        bhd_commit_dsc_enc(enc, chr->dscs + i);
     }
+    bhd_enc_close_arr(enc);
 
-    for (i = 0; i < rsp->commit_svcs.num_svcs; i++) {
-        svc = bhd_json_create_commit_svc(rsp->commit_svcs.svcs + i);
-        if (svc == NULL) {
-            rc = SYS_ENOMEM;
-            goto done;
-        }
+    bhd_enc_close_obj(enc);
+}
+
+static void
+bhd_commit_svc_enc(struct bhd_enc *enc, const struct bhd_commit_svc *svc)
+{
+    int i;
+
+    bhd_enc_open_obj(enc, NULL);
+    bhd_enc_uuid(enc, "uuid", &svc->uuid.u);
+    bhd_enc_int(enc, "handle", svc->handle);
 
-        cJSON_AddItemToArray(svcs, svc);
+    bhd_enc_open_arr(enc, "characteristics");
+    for (i = 0; i < svc->num_chrs; i++) {
+        bhd_commit_chr_enc(enc, svc->chrs + i);
     }
+    bhd_enc_close_arr(enc);
 
-    cJSON_AddItemToObject(parent, "services", svcs);
+    bhd_enc_close_obj(enc);
+}
+
+static int
+bhd_commit_svcs_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    int i;
 
-    rc = 0;
+    bhd_enc_int(enc, "status", rsp->commit_svcs.status);
 
-done:
+    bhd_enc_open_arr(enc, "services");
     for (i = 0; i < rsp->commit_svcs.num_svcs; i++) {
-        free(rsp->commit_svcs.svcs[i].chrs);
+        bhd_commit_svc_enc(enc, rsp->commit_svcs.svcs + i);
     }
-    free(rsp->commit_svcs.svcs);
+    bhd_enc_close_arr(enc);
 
-    return rc;
+    return 0;
 }
 
 static int
-bhd_access_status_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_access_status_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->access_status.status);
+    bhd_enc_int(enc, "status", rsp->access_status.status);
     return 0;
 }
 
 static int
-bhd_notify_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_notify_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->notify.status);
+    bhd_enc_int(enc, "status", rsp->notify.status);
     return 0;
 }
 
+static void
+bhd_notify_multi_results_enc(struct bhd_enc *enc,
+                             const struct bhd_notify_multi_result *results,
+                             int num_results)
+{
+    int i;
+
+    bhd_enc_open_arr(enc, "results");
+    for (i = 0; i < num_results; i++) {
+        bhd_enc_open_obj(enc, NULL);
+        bhd_enc_int(enc, "conn_handle", results[i].conn_handle);
+        bhd_enc_int(enc, "status", results[i].status);
+        bhd_enc_close_obj(enc);
+    }
+    bhd_enc_close_arr(enc);
+}
+
 static int
-bhd_find_chr_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_notify_multi_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->find_chr.status);
-    bhd_json_add_int(parent, "def_handle", rsp->find_chr.def_handle);
-    bhd_json_add_int(parent, "val_handle", rsp->find_chr.val_handle);
+    bhd_enc_int(enc, "status", rsp->notify_multi.status);
+    bhd_notify_multi_results_enc(enc, rsp->notify_multi.results,
+                                 rsp->notify_multi.num_results);
     return 0;
 }
 
 static int
-bhd_sm_inject_io_rsp_enc(cJSON *parent, const struct bhd_rsp *rsp)
+bhd_subscriptions_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_json_add_int(parent, "status", rsp->sm_inject_io.status);
+    const struct bhd_subscription *sub;
+    int i;
+
+    bhd_enc_int(enc, "status", rsp->subscriptions.status);
+
+    bhd_enc_open_arr(enc, "subscriptions");
+    for (i = 0; i < rsp->subscriptions.num_subs; i++) {
+        sub = rsp->subscriptions.subs + i;
+
+        bhd_enc_open_obj(enc, NULL);
+        bhd_enc_int(enc, "conn_handle", sub->conn_handle);
+        bhd_enc_int(enc, "attr_handle", sub->attr_handle);
+        bhd_enc_bool(enc, "notify", sub->notify);
+        bhd_enc_bool(enc, "indicate", sub->indicate);
+        bhd_enc_close_obj(enc);
+    }
+    bhd_enc_close_arr(enc);
+
     return 0;
 }
 
-int
-bhd_rsp_enc(const struct bhd_rsp *rsp, cJSON **out_root)
+static int
+bhd_find_chr_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
 {
-    bhd_subrsp_enc_fn *rsp_cb;
-    cJSON *root;
-    int rc;
+    bhd_enc_int(enc, "status", rsp->find_chr.status);
+    bhd_enc_int(enc, "def_handle", rsp->find_chr.def_handle);
+    bhd_enc_int(enc, "val_handle", rsp->find_chr.val_handle);
+    return 0;
+}
 
-    root = cJSON_CreateObject();
-    if (root == NULL) {
-        rc = SYS_ENOMEM;
-        goto err;
+static int
+bhd_find_dsc_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->find_dsc.status);
+    bhd_enc_int(enc, "handle", rsp->find_dsc.handle);
+    return 0;
+}
+
+static int
+bhd_sm_inject_io_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->sm_inject_io.status);
+    return 0;
+}
+
+static int
+bhd_subscribe_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->subscribe.status);
+    return 0;
+}
+
+static int
+bhd_ring_open_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->ring_open.status);
+    if (rsp->ring_open.status == 0) {
+        bhd_enc_int(enc, "data_sz", rsp->ring_open.data_sz);
     }
+    return 0;
+}
 
-    rc = bhd_msg_hdr_enc(root, &rsp->hdr);
-    if (rc != 0) {
-        goto err;
+static int
+bhd_bulk_open_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->bulk_open.status);
+    return 0;
+}
+
+static int
+bhd_set_value_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    bhd_enc_int(enc, "status", rsp->set_value.status);
+    return 0;
+}
+
+static int
+bhd_batch_rsp_enc(struct bhd_enc *enc, const struct bhd_rsp *rsp)
+{
+    const struct bhd_rsp *sub_rsp;
+    int rc;
+    int i;
+
+    bhd_enc_int(enc, "status", rsp->batch.status);
+
+    bhd_enc_open_arr(enc, "rsps");
+    for (i = 0; i < rsp->batch.num_rsps; i++) {
+        sub_rsp = rsp->batch.rsps + i;
+
+        bhd_enc_open_obj(enc, NULL);
+        bhd_enc_str(enc, "type", bhd_type_rev_parse(sub_rsp->hdr.type));
+        bhd_enc_int(enc, "seq", sub_rsp->hdr.seq);
+
+        rc = bhd_rsp_dispatch_find(sub_rsp->hdr.type)(enc, sub_rsp);
+        if (rc != 0) {
+            return rc;
+        }
+
+        bhd_enc_close_obj(enc);
     }
+    bhd_enc_close_arr(enc);
+
+    return 0;
+}
+
+int
+bhd_rsp_enc(const struct bhd_rsp *rsp, struct bhd_enc *enc)
+{
+    bhd_subrsp_enc_fn *rsp_cb;
+    int rc;
 
     rsp_cb = bhd_rsp_dispatch_find(rsp->hdr.type);
     if (rsp_cb == NULL) {
-        rc = SYS_ERANGE;
-        goto err;
+        return SYS_ERANGE;
     }
 
-    rc = rsp_cb(root, rsp);
+    bhd_enc_open_obj(enc, NULL);
+
+    rc = bhd_msg_hdr_enc(enc, &rsp->hdr);
     if (rc != 0) {
-        goto err;
+        return rc;
     }
 
-    *out_root = root;
-    return 0;
+    rc = rsp_cb(enc, rsp);
+    if (rc != 0) {
+        return rc;
+    }
 
-err:
-    cJSON_Delete(root);
-    return rc;
+    bhd_enc_close_obj(enc);
+
+    return enc->rc;
 }
 
 static int
-bhd_sync_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_sync_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    cJSON_AddBoolToObject(parent, "synced", evt->sync.synced);
+    bhd_enc_bool(enc, "synced", evt->sync.synced);
     return 0;
 }
 
 static int
-bhd_connect_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_connect_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "status", evt->connect.status);
+    bhd_enc_int(enc, "status", evt->connect.status);
 
     if (evt->connect.conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-        bhd_json_add_int(parent, "conn_handle", evt->connect.conn_handle);
+        bhd_enc_int(enc, "conn_handle", evt->connect.conn_handle);
     }
 
     return 0;
 }
 
 static int
-bhd_disconnect_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_disconnect_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
     int rc;
 
-    bhd_json_add_int(parent, "reason", evt->disconnect.reason);
-    rc = bhd_conn_desc_enc(parent, &evt->disconnect.desc);
+    bhd_enc_int(enc, "reason", evt->disconnect.reason);
+    rc = bhd_conn_desc_enc(enc, &evt->disconnect.desc);
     if (rc != 0) {
         return rc;
     }
@@ -2032,391 +2621,552 @@ bhd_disconnect_evt_enc(cJSON *parent, const struct bhd_evt *evt)
 }
 
 static int
-bhd_disc_svc_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_disc_svc_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
     char uuid_str[BLE_UUID_STR_LEN];
-    cJSON *svc;
 
-    bhd_json_add_int(parent, "conn_handle", evt->disc_svc.conn_handle);
-    bhd_json_add_int(parent, "status", evt->disc_svc.status);
+    bhd_enc_int(enc, "conn_handle", evt->disc_svc.conn_handle);
+    bhd_enc_int(enc, "status", evt->disc_svc.status);
 
     if (evt->disc_svc.status == 0) {
-        svc = cJSON_CreateObject();
-        if (svc == NULL) {
-            return SYS_ENOMEM;
-        }
+        bhd_enc_open_obj(enc, "service");
 
-        cJSON_AddItemToObject(parent, "service", svc);
+        bhd_enc_int(enc, "start_handle", evt->disc_svc.svc.start_handle);
+        bhd_enc_int(enc, "end_handle", evt->disc_svc.svc.end_handle);
 
-        bhd_json_add_int(svc, "start_handle", evt->disc_svc.svc.start_handle);
-        bhd_json_add_int(svc, "end_handle", evt->disc_svc.svc.end_handle);
+        bhd_enc_str(enc, "uuid",
+                    ble_uuid_to_str(&evt->disc_svc.svc.uuid.u, uuid_str));
 
-        cJSON_AddStringToObject(svc, "uuid",
-                                ble_uuid_to_str(&evt->disc_svc.svc.uuid.u,
-                                                uuid_str));
+        bhd_enc_close_obj(enc);
     }
 
     return 0;
 }
 
 static int
-bhd_disc_chr_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_disc_chr_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
     char uuid_str[BLE_UUID_STR_LEN];
-    cJSON *chr;
 
-    bhd_json_add_int(parent, "conn_handle", evt->disc_chr.conn_handle);
-    bhd_json_add_int(parent, "status", evt->disc_chr.status);
+    bhd_enc_int(enc, "conn_handle", evt->disc_chr.conn_handle);
+    bhd_enc_int(enc, "status", evt->disc_chr.status);
 
     if (evt->disc_chr.status == 0) {
-        chr = cJSON_CreateObject();
-        if (chr == NULL) {
-            return SYS_ENOMEM;
-        }
+        bhd_enc_open_obj(enc, "characteristic");
 
-        cJSON_AddItemToObject(parent, "characteristic", chr);
+        bhd_enc_int(enc, "def_handle", evt->disc_chr.chr.def_handle);
+        bhd_enc_int(enc, "val_handle", evt->disc_chr.chr.val_handle);
+        bhd_enc_int(enc, "properties", evt->disc_chr.chr.properties);
 
-        bhd_json_add_int(chr, "def_handle", evt->disc_chr.chr.def_handle);
-        bhd_json_add_int(chr, "val_handle", evt->disc_chr.chr.val_handle);
-        bhd_json_add_int(chr, "properties", evt->disc_chr.chr.properties);
+        bhd_enc_str(enc, "uuid",
+                    ble_uuid_to_str(&evt->disc_chr.chr.uuid.u, uuid_str));
 
-        cJSON_AddStringToObject(chr, "uuid",
-                                ble_uuid_to_str(&evt->disc_chr.chr.uuid.u,
-                                                uuid_str));
+        bhd_enc_close_obj(enc);
     }
 
     return 0;
 }
 
 static int
-bhd_disc_dsc_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_disc_dsc_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
     char uuid_str[BLE_UUID_STR_LEN];
-    cJSON *dsc;
 
-    bhd_json_add_int(parent, "conn_handle", evt->disc_dsc.conn_handle);
-    bhd_json_add_int(parent, "status", evt->disc_dsc.status);
-    bhd_json_add_int(parent, "chr_def_handle", evt->disc_dsc.chr_def_handle);
+    bhd_enc_int(enc, "conn_handle", evt->disc_dsc.conn_handle);
+    bhd_enc_int(enc, "status", evt->disc_dsc.status);
+    bhd_enc_int(enc, "chr_def_handle", evt->disc_dsc.chr_def_handle);
 
     if (evt->disc_dsc.status == 0) {
-        dsc = cJSON_CreateObject();
-        if (dsc == NULL) {
-            return SYS_ENOMEM;
-        }
+        bhd_enc_open_obj(enc, "descriptor");
 
-        cJSON_AddItemToObject(parent, "descriptor", dsc);
+        bhd_enc_int(enc, "handle", evt->disc_dsc.dsc.handle);
+        bhd_enc_str(enc, "uuid",
+                    ble_uuid_to_str(&evt->disc_dsc.dsc.uuid.u, uuid_str));
 
-        bhd_json_add_int(dsc, "handle", evt->disc_dsc.dsc.handle);
-        cJSON_AddStringToObject(dsc, "uuid",
-                                ble_uuid_to_str(&evt->disc_dsc.dsc.uuid.u,
-                                                uuid_str));
+        bhd_enc_close_obj(enc);
     }
 
     return 0;
 }
 
 static int
-bhd_write_ack_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_write_ack_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "conn_handle", evt->write_ack.conn_handle);
-    bhd_json_add_int(parent, "attr_handle", evt->write_ack.attr_handle);
-    bhd_json_add_int(parent, "status", evt->write_ack.status);
+    bhd_enc_int(enc, "conn_handle", evt->write_ack.conn_handle);
+    bhd_enc_int(enc, "attr_handle", evt->write_ack.attr_handle);
+    bhd_enc_int(enc, "status", evt->write_ack.status);
     return 0;
 }
 
 static int
-bhd_notify_rx_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_notify_rx_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    char buf[BLE_ATT_ATTR_MAX_LEN * 5]; /* 0xXX[:] */
-
-    bhd_json_add_int(parent, "conn_handle", evt->notify_rx.conn_handle);
-    bhd_json_add_int(parent, "attr_handle", evt->notify_rx.attr_handle);
-    cJSON_AddBoolToObject(parent, "indication", evt->notify_rx.indication);
-    cJSON_AddStringToObject(parent, "data",
-                            bhd_hex_str(buf, sizeof buf, NULL,
-                            evt->notify_rx.data, evt->notify_rx.data_len));
+    bhd_enc_int(enc, "conn_handle", evt->notify_rx.conn_handle);
+    bhd_enc_int(enc, "attr_handle", evt->notify_rx.attr_handle);
+    bhd_enc_bool(enc, "indication", evt->notify_rx.indication);
+    bhd_enc_bytes(enc, "data", evt->notify_rx.data, evt->notify_rx.data_len);
     return 0;
 }
 
 static int
-bhd_mtu_change_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_mtu_change_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "conn_handle", evt->mtu_change.conn_handle);
-    bhd_json_add_int(parent, "mtu", evt->mtu_change.mtu);
-    bhd_json_add_int(parent, "status", evt->mtu_change.status);
+    bhd_enc_int(enc, "conn_handle", evt->mtu_change.conn_handle);
+    bhd_enc_int(enc, "mtu", evt->mtu_change.mtu);
+    bhd_enc_int(enc, "status", evt->mtu_change.status);
     return 0;
 }
 
 static int
-bhd_scan_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_scan_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    char str[BLE_HS_ADV_MAX_FIELD_SZ + 1];
+    int i;
 
-    bhd_json_add_adv_event_type(parent, "event_type", evt->scan.event_type);
-    bhd_json_add_addr_type(parent, "addr_type", evt->scan.addr.type);
-    bhd_json_add_addr(parent, "addr", evt->scan.addr.val);
-    bhd_json_add_int(parent, "rssi", evt->scan.rssi);
+    bhd_enc_adv_event_type(enc, "event_type", evt->scan.event_type);
+    bhd_enc_addr_type(enc, "addr_type", evt->scan.addr.type);
+    bhd_enc_addr(enc, "addr", evt->scan.addr.val);
+    bhd_enc_int(enc, "rssi", evt->scan.rssi);
 
     if (evt->scan.length_data > 0) {
-        bhd_json_add_bytes(parent, "data", evt->scan.data,
-                           evt->scan.length_data);
+        bhd_enc_bytes(enc, "data", evt->scan.data, evt->scan.length_data);
     }
 
     if (ble_addr_cmp(&evt->scan.direct_addr, BLE_ADDR_ANY) != 0) {
-        bhd_json_add_addr_type(parent, "direct_addr_type",
-                               evt->scan.direct_addr.type);
-        bhd_json_add_addr(parent, "direct_addr", evt->scan.direct_addr.val);
+        bhd_enc_addr_type(enc, "direct_addr_type",
+                          evt->scan.direct_addr.type);
+        bhd_enc_addr(enc, "direct_addr", evt->scan.direct_addr.val);
     }
 
     if (evt->scan.data_flags != 0) {
-        bhd_json_add_int(parent, "data_flags", evt->scan.data_flags);
+        bhd_enc_int(enc, "data_flags", evt->scan.data_flags);
     }
 
     if (evt->scan.data_num_uuids16 != 0) {
-        bhd_json_add_gen_arr(parent,
-                             "data_uuids16", 
-                             evt->scan.data_uuids16,
-                             evt->scan.data_num_uuids16,
-                             cJSON_CreateNumber);
-        bhd_json_add_bool(parent, "data_uuids16_is_complete",
-                          evt->scan.data_uuids16_is_complete);
+        bhd_enc_open_arr(enc, "data_uuids16");
+        for (i = 0; i < evt->scan.data_num_uuids16; i++) {
+            bhd_enc_int(enc, NULL, evt->scan.data_uuids16[i]);
+        }
+        bhd_enc_close_arr(enc);
+
+        bhd_enc_bool(enc, "data_uuids16_is_complete",
+                     evt->scan.data_uuids16_is_complete);
     }
 
     if (evt->scan.data_num_uuids32 != 0) {
-        bhd_json_add_gen_arr(parent,
-                             "data_uuids32", 
-                             evt->scan.data_uuids32,
-                             evt->scan.data_num_uuids32,
-                             cJSON_CreateNumber);
-        bhd_json_add_bool(parent, "data_uuids32_is_complete",
-                          evt->scan.data_uuids32_is_complete);
+        bhd_enc_open_arr(enc, "data_uuids32");
+        for (i = 0; i < evt->scan.data_num_uuids32; i++) {
+            bhd_enc_int(enc, NULL, evt->scan.data_uuids32[i]);
+        }
+        bhd_enc_close_arr(enc);
+
+        bhd_enc_bool(enc, "data_uuids32_is_complete",
+                     evt->scan.data_uuids32_is_complete);
     }
 
     if (evt->scan.data_num_uuids128 != 0) {
-        bhd_json_add_gen_arr(parent,
-                             "data_uuids128", 
-                             evt->scan.data_uuids128,
-                             evt->scan.data_num_uuids128,
-                             bhd_json_create_uuid128_bytes);
-        bhd_json_add_bool(parent, "data_uuids128_is_complete",
-                          evt->scan.data_uuids128_is_complete);
+        bhd_enc_open_arr(enc, "data_uuids128");
+        for (i = 0; i < evt->scan.data_num_uuids128; i++) {
+            bhd_enc_uuid128_bytes(enc, NULL, evt->scan.data_uuids128[i]);
+        }
+        bhd_enc_close_arr(enc);
+
+        bhd_enc_bool(enc, "data_uuids128_is_complete",
+                     evt->scan.data_uuids128_is_complete);
     }
 
     if (evt->scan.data_name_len != 0) {
-        memcpy(str, evt->scan.data_name, evt->scan.data_name_len);
-        str[evt->scan.data_name_len] = '\0';
-        cJSON_AddStringToObject(parent, "data_name", str);
-
-        bhd_json_add_bool(parent, "data_name_is_complete",
-                          evt->scan.data_name_is_complete);
+        bhd_enc_strn(enc, "data_name", (const char *)evt->scan.data_name,
+                     evt->scan.data_name_len);
+        bhd_enc_bool(enc, "data_name_is_complete",
+                     evt->scan.data_name_is_complete);
     }
 
     if (evt->scan.data_tx_pwr_lvl_is_present) {
-        bhd_json_add_int(parent, "data_tx_pwr_lvl", evt->scan.data_tx_pwr_lvl);
+        bhd_enc_int(enc, "data_tx_pwr_lvl", evt->scan.data_tx_pwr_lvl);
     }
 
     if (evt->scan.data_slave_itvl_range_is_present) {
-        bhd_json_add_int(parent, "data_slave_itvl_min",
-                         evt->scan.data_slave_itvl_min);
-        bhd_json_add_int(parent, "data_slave_itvl_max",
-                         evt->scan.data_slave_itvl_max);
+        bhd_enc_int(enc, "data_slave_itvl_min",
+                    evt->scan.data_slave_itvl_min);
+        bhd_enc_int(enc, "data_slave_itvl_max",
+                    evt->scan.data_slave_itvl_max);
     }
 
     if (evt->scan.data_svc_data_uuid16_len != 0) {
-        bhd_json_add_bytes(parent, "data_svc_data_uuid16",
-                           evt->scan.data_svc_data_uuid16,
-                           evt->scan.data_svc_data_uuid16_len);
+        bhd_enc_bytes(enc, "data_svc_data_uuid16",
+                      evt->scan.data_svc_data_uuid16,
+                      evt->scan.data_svc_data_uuid16_len);
     }
 
     if (evt->scan.data_num_public_tgt_addrs != 0) {
-        bhd_json_add_gen_arr(parent,
-                             "data_public_tgt_addrs", 
-                             evt->scan.data_public_tgt_addrs,
-                             evt->scan.data_num_public_tgt_addrs,
-                             bhd_json_create_addr);
+        bhd_enc_open_arr(enc, "data_public_tgt_addrs");
+        for (i = 0; i < evt->scan.data_num_public_tgt_addrs; i++) {
+            bhd_enc_addr(enc, NULL, evt->scan.data_public_tgt_addrs[i]);
+        }
+        bhd_enc_close_arr(enc);
     }
 
     if (evt->scan.data_appearance_is_present) {
-        bhd_json_add_int(parent, "data_appearance", evt->scan.data_appearance);
+        bhd_enc_int(enc, "data_appearance", evt->scan.data_appearance);
     }
 
     if (evt->scan.data_adv_itvl_is_present) {
-        bhd_json_add_int(parent, "data_adv_itvl", evt->scan.data_adv_itvl);
+        bhd_enc_int(enc, "data_adv_itvl", evt->scan.data_adv_itvl);
     }
 
     if (evt->scan.data_svc_data_uuid32_len != 0) {
-        bhd_json_add_bytes(parent, "data_svc_data_uuid32",
-                           evt->scan.data_svc_data_uuid32,
-                           evt->scan.data_svc_data_uuid32_len);
+        bhd_enc_bytes(enc, "data_svc_data_uuid32",
+                      evt->scan.data_svc_data_uuid32,
+                      evt->scan.data_svc_data_uuid32_len);
     }
 
     if (evt->scan.data_svc_data_uuid128_len != 0) {
-        bhd_json_add_bytes(parent, "data_svc_data_uuid128",
-                           evt->scan.data_svc_data_uuid128,
-                           evt->scan.data_svc_data_uuid128_len);
+        bhd_enc_bytes(enc, "data_svc_data_uuid128",
+                      evt->scan.data_svc_data_uuid128,
+                      evt->scan.data_svc_data_uuid128_len);
     }
 
     if (evt->scan.data_uri_len != 0) {
-        memcpy(str, evt->scan.data_uri, evt->scan.data_uri_len);
-        str[evt->scan.data_uri_len] = '\0';
-        cJSON_AddStringToObject(parent, "data_uri", str);
+        bhd_enc_strn(enc, "data_uri", (const char *)evt->scan.data_uri,
+                     evt->scan.data_uri_len);
     }
 
     if (evt->scan.data_mfg_data_len != 0) {
-        bhd_json_add_bytes(parent, "data_mfg_data",
-                           evt->scan.data_mfg_data,
-                           evt->scan.data_mfg_data_len);
+        bhd_enc_bytes(enc, "data_mfg_data",
+                      evt->scan.data_mfg_data,
+                      evt->scan.data_mfg_data_len);
     }
 
     return 0;
 }
 
 static int
-bhd_scan_tmo_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_scan_tmo_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
     return 0;
 }
 
 static int
-bhd_adv_complete_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_adv_complete_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "reason", evt->adv_complete.reason);
+    bhd_enc_int(enc, "reason", evt->adv_complete.reason);
     return 0;
 }
 
 static int
-bhd_enc_change_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_enc_change_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "conn_handle", evt->enc_change.conn_handle);
-    bhd_json_add_int(parent, "status", evt->enc_change.status);
+    bhd_enc_int(enc, "conn_handle", evt->enc_change.conn_handle);
+    bhd_enc_int(enc, "status", evt->enc_change.status);
     return 0;
 }
 
 static int
-bhd_reset_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_reset_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "reason", evt->reset.reason);
+    bhd_enc_int(enc, "reason", evt->reset.reason);
     return 0;
 }
 
 static int
-bhd_access_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_access_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_gatt_access_op(parent, "access_op", evt->access.access_op);
-    bhd_json_add_int(parent, "conn_handle", evt->access.conn_handle);
-    bhd_json_add_int(parent, "att_handle", evt->access.att_handle);
-    bhd_json_add_bytes(parent, "data", evt->access.data, evt->access.data_len);
+    bhd_enc_int(enc, "access_id", evt->access.access_id);
+    bhd_enc_gatt_access_op(enc, "access_op", evt->access.access_op);
+    bhd_enc_int(enc, "conn_handle", evt->access.conn_handle);
+    bhd_enc_int(enc, "att_handle", evt->access.att_handle);
+    bhd_enc_bytes(enc, "data", evt->access.data, evt->access.data_len);
+    if (evt->access.async) {
+        bhd_enc_bool(enc, "async", 1);
+    }
     return 0;
 }
 
 static int
-bhd_passkey_evt_enc(cJSON *parent, const struct bhd_evt *evt)
+bhd_passkey_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
 {
-    bhd_json_add_int(parent, "conn_handle", evt->passkey.conn_handle);
-    bhd_json_add_sm_passkey_action(parent, "action", evt->passkey.action);
+    bhd_enc_int(enc, "conn_handle", evt->passkey.conn_handle);
+    bhd_enc_sm_passkey_action(enc, "action", evt->passkey.action);
 
     if (evt->passkey.action == BLE_SM_IOACT_NUMCMP) {
-        bhd_json_add_int(parent, "numcmp", evt->passkey.numcmp);
+        bhd_enc_int(enc, "numcmp", evt->passkey.numcmp);
     }
     return 0;
 }
 
+static int
+bhd_dropped_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
+{
+    bhd_enc_int(enc, "num_scan", evt->dropped.num_scan);
+    bhd_enc_int(enc, "num_scan_coalesced", evt->dropped.num_scan_coalesced);
+    bhd_enc_int(enc, "num_notify_rx", evt->dropped.num_notify_rx);
+    return 0;
+}
+
+static int
+bhd_subscribe_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
+{
+    bhd_enc_int(enc, "conn_handle", evt->subscribe.conn_handle);
+    bhd_enc_int(enc, "attr_handle", evt->subscribe.attr_handle);
+    bhd_enc_int(enc, "reason", evt->subscribe.reason);
+    bhd_enc_bool(enc, "prev_notify", evt->subscribe.prev_notify);
+    bhd_enc_bool(enc, "cur_notify", evt->subscribe.cur_notify);
+    bhd_enc_bool(enc, "prev_indicate", evt->subscribe.prev_indicate);
+    bhd_enc_bool(enc, "cur_indicate", evt->subscribe.cur_indicate);
+    return 0;
+}
+
+static int
+bhd_indicate_done_evt_enc(struct bhd_enc *enc, const struct bhd_evt *evt)
+{
+    bhd_enc_int(enc, "attr_handle", evt->indicate_done.attr_handle);
+    bhd_notify_multi_results_enc(enc, evt->indicate_done.results,
+                                 evt->indicate_done.num_results);
+    return 0;
+}
+
 int
-bhd_evt_enc(const struct bhd_evt *evt, cJSON **out_root)
+bhd_evt_enc(const struct bhd_evt *evt, struct bhd_enc *enc)
 {
     bhd_evt_enc_fn *evt_cb;
-    cJSON *root;
     int rc;
 
-    root = cJSON_CreateObject();
-    if (root == NULL) {
-        rc = SYS_ENOMEM;
-        goto err;
+    evt_cb = bhd_evt_dispatch_find(evt->hdr.type);
+    if (evt_cb == NULL) {
+        return SYS_ERANGE;
     }
 
-    rc = bhd_msg_hdr_enc(root, &evt->hdr);
-    if (rc != 0) {
-        goto err;
-    }
+    bhd_enc_open_obj(enc, NULL);
 
-    evt_cb = bhd_evt_dispatch_find(evt->hdr.type);
-    if (evt_cb == NULL) {
-        rc = SYS_ERANGE;
-        goto err;
+    rc = bhd_msg_hdr_enc(enc, &evt->hdr);
+    if (rc != 0) {
+        return rc;
     }
 
-    rc = evt_cb(root, evt);
+    rc = evt_cb(enc, evt);
     if (rc != 0) {
-        goto err;
+        return rc;
     }
 
-    *out_root = root;
-    return 0;
+    bhd_enc_close_obj(enc);
 
-err:
-    cJSON_Delete(root);
-    return rc;
+    return enc->rc;
+}
+
+/**
+ * Queues an encoded message for transmit.  The mbuf is consumed.
+ */
+int
+bhd_msg_send(struct os_mbuf *om)
+{
+    BHD_LOG(DEBUG, "Sending message over UDS (%d bytes)\n",
+            OS_MBUF_PKTLEN(om));
+
+    return blehostd_enqueue_msg(om);
+}
+
+/**
+ * Frees the heap memory that a response refers to.  Called once the
+ * response has been sent, or has failed to be, on every path.  A response
+ * of one of these types always holds its own body, never an error filled in
+ * by bhd_req_exec(); their dispatch entries set err_rsp.
+ */
+static void
+bhd_rsp_free(const struct bhd_rsp *rsp)
+{
+    int i;
+
+    switch (rsp->hdr.type) {
+    case BHD_MSG_TYPE_COMMIT_SVCS:
+        /* The characteristics and descriptors share this allocation. */
+        free(rsp->commit_svcs.svcs);
+        break;
+
+    case BHD_MSG_TYPE_SUBSCRIPTIONS:
+        free(rsp->subscriptions.subs);
+        break;
+
+    case BHD_MSG_TYPE_BATCH:
+        for (i = 0; i < rsp->batch.num_rsps; i++) {
+            bhd_rsp_free(rsp->batch.rsps + i);
+        }
+        break;
+
+    default:
+        break;
+    }
 }
 
 int
-bhd_msg_send(cJSON *root)
+bhd_rsp_send(const struct bhd_rsp *rsp)
 {
-    char *json_str;
+    struct bhd_enc enc;
+    struct os_mbuf *om;
+    int data_enc;
+    int msg_fmt;
     int rc;
 
-    json_str = cJSON_Print(root);
-    if (json_str == NULL) {
+    om = blehostd_alloc_msg();
+    if (om == NULL) {
         rc = SYS_ENOMEM;
         goto done;
     }
 
-    BHD_LOG(DEBUG, "Sending JSON over UDS:\n%s\n", json_str);
+    blehostd_msg_dst_req(om);
+    blehostd_client_fmt(blehostd_cur_client_idx(), &msg_fmt, &data_enc);
+    bhd_enc_init(&enc, om, msg_fmt, rsp->hdr.data_enc);
 
-    rc = blehostd_enqueue_rsp(json_str);
+    rc = bhd_rsp_enc(rsp, &enc);
     if (rc != 0) {
+        os_mbuf_free_chain(om);
         goto done;
     }
 
+    BHD_LOG(DEBUG, "Sending %s response over UDS (%d bytes)\n",
+            bhd_msg_fmt_rev_parse(msg_fmt), OS_MBUF_PKTLEN(om));
+
+    /* Responses go out ahead of any queued events. */
+    rc = blehostd_enqueue_rsp(om);
+
 done:
-    cJSON_Delete(root);
-    free(json_str);
+    bhd_rsp_free(rsp);
     return rc;
 }
 
-int
-bhd_rsp_send(const struct bhd_rsp *rsp)
+/**
+ * Indicates whether an event is high-rate data that belongs on a client's
+ * bulk channel rather than its control channel.
+ */
+static int
+bhd_evt_is_bulk(const struct bhd_evt *evt)
 {
-    cJSON *root;
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_SCAN_EVT:
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+    case BHD_MSG_TYPE_ACCESS_EVT:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Encodes an event for the subset of recipients that share the message
+ * format and data encoding of the lowest-numbered recipient.
+ *
+ * @param recipients            The clients still awaiting the event.
+ * @param out_om                On success, the encoded message.
+ * @param out_group             The clients the message is addressed to.
+ *
+ * @return                      0 on success; nonzero on failure.
+ */
+static int
+bhd_evt_enc_group(const struct bhd_evt *evt, uint32_t recipients,
+                  struct os_mbuf **out_om, uint32_t *out_group)
+{
+    struct bhd_enc enc;
+    struct os_mbuf *om;
+    uint32_t group;
+    int data_enc;
+    int msg_fmt;
+    int enc2;
+    int fmt2;
     int rc;
+    int i;
 
-    rc = bhd_rsp_enc(rsp, &root);
-    if (rc != 0) {
-        return rc;
+    for (i = 0; !(recipients & (1UL << i)); i++) {
+    }
+    blehostd_client_fmt(i, &msg_fmt, &data_enc);
+
+    group = 0;
+    for (; (recipients >> i) != 0; i++) {
+        if (recipients & (1UL << i)) {
+            blehostd_client_fmt(i, &fmt2, &enc2);
+            if (fmt2 == msg_fmt && enc2 == data_enc) {
+                group |= 1UL << i;
+            }
+        }
+    }
+
+    *out_group = group;
+
+    om = blehostd_alloc_msg();
+    if (om == NULL) {
+        return SYS_ENOMEM;
+    }
+
+    blehostd_msg_set_recipients(om, group);
+    if (bhd_evt_is_bulk(evt)) {
+        blehostd_msg_set_bulk(om);
     }
+    bhd_enc_init(&enc, om, msg_fmt, data_enc);
 
-    rc = bhd_msg_send(root);
+    rc = bhd_evt_enc(evt, &enc);
     if (rc != 0) {
+        os_mbuf_free_chain(om);
         return rc;
     }
 
+    *out_om = om;
     return 0;
 }
 
+/**
+ * Sends an event to every interested client, in each client's own message
+ * format and data encoding.  The event is encoded once per distinct
+ * (format, encoding) pair among the recipients.
+ */
 int
 bhd_evt_send(const struct bhd_evt *evt)
 {
-    cJSON *root;
+    struct os_mbuf *om;
+    uint32_t recipients;
+    uint32_t group;
     int rc;
 
-    rc = bhd_evt_enc(evt, &root);
+    recipients = blehostd_evt_recipients(evt);
+
+    /* Clients with an event ring get high-rate events through it instead. */
+    recipients = bhd_ring_divert(evt, recipients);
+    if (recipients == 0) {
+        /* No client is interested; don't bother encoding. */
+        return 0;
+    }
+
+    if (!bhd_evtq_admit(evt)) {
+        /* Transmit queue is backed up; the client hears about this later. */
+        return 0;
+    }
+
+    /*
+     * The first message goes through the event queue, which coalesces and
+     * accounts for it.  Recipients with a different format (rare) get their
+     * own copies queued directly.
+     */
+    rc = bhd_evt_enc_group(evt, recipients, &om, &group);
     if (rc != 0) {
         return rc;
     }
+    recipients &= ~group;
 
-    rc = bhd_msg_send(root);
+    rc = bhd_evtq_put(evt, om);
     if (rc != 0) {
         return rc;
     }
 
+    while (recipients != 0) {
+        rc = bhd_evt_enc_group(evt, recipients, &om, &group);
+        if (rc != 0) {
+            return rc;
+        }
+        recipients &= ~group;
+
+        rc = blehostd_enqueue_msg(om);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
     return 0;
 }
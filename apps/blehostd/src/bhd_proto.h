@@ -42,6 +42,18 @@
 #define BHD_MSG_TYPE_NOTIFY                 31
 #define BHD_MSG_TYPE_FIND_CHR               32
 #define BHD_MSG_TYPE_SM_INJECT_IO           33
+#define BHD_MSG_TYPE_BATCH                  34
+#define BHD_MSG_TYPE_SUBSCRIBE              35
+#define BHD_MSG_TYPE_RING_OPEN              36
+#define BHD_MSG_TYPE_BULK_OPEN              37
+#define BHD_MSG_TYPE_SET_VALUE              38
+#define BHD_MSG_TYPE_REMOVE_SVCS            39
+#define BHD_MSG_TYPE_FIND_DSC               40
+#define BHD_MSG_TYPE_NOTIFY_MULTI           41
+#define BHD_MSG_TYPE_SUBSCRIPTIONS          42
+
+/* Event types occupy a contiguous range starting here. */
+#define BHD_MSG_TYPE_EVT_BASE               2049
 
 #define BHD_MSG_TYPE_SYNC_EVT               2049
 #define BHD_MSG_TYPE_CONNECT_EVT            2050
@@ -60,6 +72,17 @@
 #define BHD_MSG_TYPE_RESET_EVT              2063
 #define BHD_MSG_TYPE_ACCESS_EVT             2064
 #define BHD_MSG_TYPE_PASSKEY_EVT            2065
+#define BHD_MSG_TYPE_DROPPED_EVT            2066
+#define BHD_MSG_TYPE_INDICATE_DONE_EVT      2067
+#define BHD_MSG_TYPE_SUBSCRIBE_EVT          2068
+
+#define BHD_MSG_FMT_JSON                    0
+#define BHD_MSG_FMT_CBOR                    1
+
+/* Encoding of byte string fields ("data", etc.). */
+#define BHD_DATA_ENC_HEX                    0
+#define BHD_DATA_ENC_BASE64                 1
+#define BHD_DATA_ENC_RAW                    2
 
 #define BHD_ADDR_TYPE_NONE                  255
 
@@ -67,14 +90,34 @@
 #define BHD_SEQ_EVT_MIN                     0xffffff00
 #define BHD_SEQ_MAX                         0xfffffff0
 
-#define BHD_REG_MAX_SVCS                    32
-#define BHD_SVC_MAX_CHRS                    16
-#define BHD_CHR_MAX_DSCS                    4
+#define BHD_BATCH_MAX_REQS                  32
+
+#define BHD_SUBSCRIBE_MAX_EVT_TYPES         32
+#define BHD_SUBSCRIBE_MAX_HANDLES           16
+
+#define BHD_REMOVE_SVCS_MAX_UUIDS           16
+
+#define BHD_NOTIFY_MULTI_MAX_CONNS          32
 
 struct bhd_msg_hdr {
     int op;
     int type;
     bhd_seq_t seq;
+
+    /* Optional; defaults to the encoding selected via sync. */
+    int data_enc;
+
+    /*
+     * Events only, not encoded: the client whose request produced the
+     * event; 0 if the event is unsolicited.
+     */
+    uint16_t client_id;
+};
+
+struct bhd_sync_req {
+    /* Optional. */
+    int format;
+    int data_enc;
 };
 
 struct bhd_connect_req {
@@ -152,9 +195,9 @@ struct bhd_scan_req {
     uint16_t itvl;
     uint16_t window;
     uint8_t filter_policy;
-    uint8_t limited:1;
-    uint8_t passive:1;
-    uint8_t filter_duplicates:1;
+    uint8_t limited;
+    uint8_t passive;
+    uint8_t filter_duplicates;
 };
 
 struct bhd_set_preferred_mtu_req {
@@ -286,10 +329,28 @@ struct bhd_add_svcs_req {
     int num_svcs;
 };
 
+struct bhd_remove_svcs_req {
+    ble_uuid_any_t uuids[BHD_REMOVE_SVCS_MAX_UUIDS];
+    int num_uuids;
+};
+
 struct bhd_access_status_req {
     uint8_t att_status;
     uint8_t *data;
     int data_len;
+
+    /* Optional. */
+    uint32_t access_id;
+    uint8_t cache;
+};
+
+struct bhd_set_value_req {
+    uint16_t attr_handle;
+    uint8_t *data;
+    int data_len;
+
+    /* Optional. */
+    uint8_t forward_reads;
 };
 
 struct bhd_notify_req {
@@ -299,11 +360,38 @@ struct bhd_notify_req {
     int data_len;
 };
 
+struct bhd_notify_multi_req {
+    uint16_t attr_handle;
+    uint8_t *data;
+    int data_len;
+
+    /* Optional; all subscribers if empty. */
+    uint16_t conn_handles[BHD_NOTIFY_MULTI_MAX_CONNS];
+    int num_conn_handles;
+
+    /* Optional. */
+    uint8_t indicate;
+};
+
+struct bhd_subscriptions_req {
+    /* Optional filters; an empty list matches everything. */
+    uint16_t conn_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_conn_handles;
+    uint16_t attr_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_attr_handles;
+};
+
 struct bhd_find_chr_req {
     ble_uuid_any_t svc_uuid;
     ble_uuid_any_t chr_uuid;
 };
 
+struct bhd_find_dsc_req {
+    ble_uuid_any_t svc_uuid;
+    ble_uuid_any_t chr_uuid;
+    ble_uuid_any_t dsc_uuid;
+};
+
 struct bhd_sm_inject_io_req {
     uint16_t conn_handle;
     uint8_t action;
@@ -314,9 +402,40 @@ struct bhd_sm_inject_io_req {
     uint8_t numcmp_accept;  /* Numeric comparison. */
 };
 
+struct bhd_batch_req {
+    /* Optional. */
+    int stop_on_err;
+};
+
+/* An empty list matches everything. */
+struct bhd_subscribe_req {
+    /* Optional. */
+    int evt_types[BHD_SUBSCRIBE_MAX_EVT_TYPES];
+    int num_evt_types;
+
+    /* Optional. */
+    uint16_t conn_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_conn_handles;
+
+    /* Optional. */
+    uint16_t attr_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_attr_handles;
+};
+
+/*
+ * The ring's memfd accompanies the request as an SCM_RIGHTS message.  It
+ * must be sealed with F_SEAL_SHRINK | F_SEAL_GROW.
+ */
+struct bhd_ring_open_req {
+    /* Optional; an empty list selects all types that rings support. */
+    int evt_types[BHD_SUBSCRIBE_MAX_EVT_TYPES];
+    int num_evt_types;
+};
+
 struct bhd_req {
     struct bhd_msg_hdr hdr;
     union {
+        struct bhd_sync_req sync;
         struct bhd_connect_req connect;
         struct bhd_terminate_req terminate;
         struct bhd_disc_all_svcs_req disc_all_svcs;
@@ -337,10 +456,18 @@ struct bhd_req {
         struct bhd_adv_rsp_set_data_req adv_rsp_set_data;
         struct bhd_adv_fields_req adv_fields;
         struct bhd_add_svcs_req add_svcs;
+        struct bhd_remove_svcs_req remove_svcs;
         struct bhd_access_status_req access_status;
+        struct bhd_set_value_req set_value;
         struct bhd_notify_req notify;
+        struct bhd_notify_multi_req notify_multi;
+        struct bhd_subscriptions_req subscriptions;
         struct bhd_find_chr_req find_chr;
+        struct bhd_find_dsc_req find_dsc;
         struct bhd_sm_inject_io_req sm_inject_io;
+        struct bhd_batch_req batch;
+        struct bhd_subscribe_req subscribe;
+        struct bhd_ring_open_req ring_open;
     };
 };
 
@@ -351,6 +478,8 @@ struct bhd_err_rsp {
 
 struct bhd_sync_rsp {
     int synced;
+    int format;
+    int data_enc;
 };
 
 struct bhd_connect_rsp {
@@ -472,6 +601,10 @@ struct bhd_add_svcs_rsp {
     int status;
 };
 
+struct bhd_remove_svcs_rsp {
+    int status;
+};
+
 struct bhd_commit_dsc {
     ble_uuid_any_t uuid;
     uint16_t handle;
@@ -494,6 +627,11 @@ struct bhd_commit_svc {
 
 struct bhd_commit_svcs_rsp {
     int status;
+
+    /*
+     * Heap allocated, together with the characteristics and descriptors;
+     * freed by bhd_rsp_send().
+     */
     struct bhd_commit_svc *svcs;
     int num_svcs;
 };
@@ -502,20 +640,79 @@ struct bhd_access_status_rsp {
     int status;
 };
 
+struct bhd_set_value_rsp {
+    int status;
+};
+
 struct bhd_notify_rsp {
     int status;
 };
 
+/** The outcome of a notify_multi for one connection. */
+struct bhd_notify_multi_result {
+    uint16_t conn_handle;
+    int status;
+};
+
+struct bhd_notify_multi_rsp {
+    int status;
+    struct bhd_notify_multi_result results[BHD_NOTIFY_MULTI_MAX_CONNS];
+    int num_results;
+};
+
+/** One peer's subscription to one characteristic. */
+struct bhd_subscription {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    uint8_t notify:1;
+    uint8_t indicate:1;
+};
+
+struct bhd_subscriptions_rsp {
+    int status;
+
+    /* Heap allocated; freed by bhd_rsp_send(). */
+    struct bhd_subscription *subs;
+    int num_subs;
+};
+
 struct bhd_find_chr_rsp {
     int status;
     uint16_t def_handle;
     uint16_t val_handle;
 };
 
+struct bhd_find_dsc_rsp {
+    int status;
+    uint16_t handle;
+};
+
 struct bhd_sm_inject_io_rsp {
     int status;
 };
 
+struct bhd_subscribe_rsp {
+    int status;
+};
+
+struct bhd_ring_open_rsp {
+    int status;
+    uint32_t data_sz;
+};
+
+struct bhd_bulk_open_rsp {
+    int status;
+};
+
+struct bhd_batch_rsp {
+    /* Status of the first failed sub-request; 0 if all succeeded. */
+    int status;
+
+    /* One response per executed sub-request, in request order. */
+    struct bhd_rsp *rsps;
+    int num_rsps;
+};
+
 struct bhd_rsp {
     struct bhd_msg_hdr hdr;
     union {
@@ -545,11 +742,20 @@ struct bhd_rsp {
         struct bhd_adv_fields_rsp adv_fields;
         struct bhd_clear_svcs_rsp clear_svcs;
         struct bhd_add_svcs_rsp add_svcs;
+        struct bhd_remove_svcs_rsp remove_svcs;
         struct bhd_commit_svcs_rsp commit_svcs;
         struct bhd_access_status_rsp access_status;
+        struct bhd_set_value_rsp set_value;
         struct bhd_notify_rsp notify;
+        struct bhd_notify_multi_rsp notify_multi;
+        struct bhd_subscriptions_rsp subscriptions;
         struct bhd_find_chr_rsp find_chr;
+        struct bhd_find_dsc_rsp find_dsc;
         struct bhd_sm_inject_io_rsp sm_inject_io;
+        struct bhd_batch_rsp batch;
+        struct bhd_subscribe_rsp subscribe;
+        struct bhd_ring_open_rsp ring_open;
+        struct bhd_bulk_open_rsp bulk_open;
     };
 };
 
@@ -692,11 +898,15 @@ struct bhd_reset_evt {
 };
 
 struct bhd_access_evt {
+    uint32_t access_id;
     uint8_t access_op;
     uint16_t conn_handle;
     uint16_t att_handle;
     uint8_t *data;
     int data_len;
+
+    /** The access has already been answered from the cached value. */
+    uint8_t async;
 };
 
 struct bhd_adv_complete_evt {
@@ -711,6 +921,55 @@ struct bhd_passkey_evt {
     uint32_t numcmp;
 };
 
+/**
+ * Selects the unsolicited events that a client receives.  An event passes
+ * if its type is in evt_types, and each of its connection and attribute
+ * handles (where the event has one) is in the corresponding list.  An empty
+ * set matches everything.
+ */
+struct bhd_evt_filter {
+    /** Bit n set means type BHD_MSG_TYPE_EVT_BASE + n is selected. */
+    uint32_t evt_types;
+
+    uint16_t conn_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_conn_handles;
+
+    uint16_t attr_handles[BHD_SUBSCRIBE_MAX_HANDLES];
+    int num_attr_handles;
+};
+
+/** Events discarded because the transmit queue was backed up. */
+struct bhd_dropped_evt {
+    /** Scan reports that were dropped outright. */
+    int num_scan;
+
+    /** Scan reports superseded by a newer report from the same device. */
+    int num_scan_coalesced;
+
+    int num_notify_rx;
+};
+
+/**
+ * Sent once every indication queued by a notify_multi request has been
+ * confirmed or has failed.  A status of 0 means the peer confirmed it.
+ */
+struct bhd_indicate_done_evt {
+    uint16_t attr_handle;
+    struct bhd_notify_multi_result results[BHD_NOTIFY_MULTI_MAX_CONNS];
+    int num_results;
+};
+
+/** A peer changed its client characteristic configuration. */
+struct bhd_subscribe_evt {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    uint8_t reason;
+    uint8_t prev_notify:1;
+    uint8_t cur_notify:1;
+    uint8_t prev_indicate:1;
+    uint8_t cur_indicate:1;
+};
+
 struct bhd_evt {
     struct bhd_msg_hdr hdr;
     union {
@@ -729,6 +988,9 @@ struct bhd_evt {
         struct bhd_access_evt access;
         struct bhd_adv_complete_evt adv_complete;
         struct bhd_passkey_evt passkey;
+        struct bhd_dropped_evt dropped;
+        struct bhd_indicate_done_evt indicate_done;
+        struct bhd_subscribe_evt subscribe;
     };
 };
 
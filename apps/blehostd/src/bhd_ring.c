@@ -0,0 +1,246 @@
+/* For the memfd sealing commands. */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "syscfg/syscfg.h"
+#include "host/ble_hs.h"
+#include "blehostd.h"
+#include "bhd_proto.h"
+#include "bhd_ring.h"
+#include "bhd_ring_shm.h"
+#include "defs/error.h"
+
+/**
+ * Shared-memory delivery of high-rate events.  A client that has opened a
+ * ring receives its notify_rx and scan events as raw records in the ring
+ * (see bhd_ring_shm.h) rather than as encoded messages on its socket.  The
+ * ring bypasses the transmit queue entirely, so its events are neither
+ * encoded nor subject to the transmit queue's flow control; if the client
+ * falls behind, records are dropped and counted in the ring header.
+ *
+ * Rings are indexed by client slot, the same as the recipient masks.
+ */
+
+#define BHD_RING_MAX_MAP_SZ     MYNEWT_VAL(BLEHOSTD_RING_MAX_SZ)
+#define BHD_RING_MAX_CLIENTS    MYNEWT_VAL(BLEHOSTD_MAX_CLIENTS)
+
+/**
+ * Seals that a ring's memfd must carry.  Without them the client could
+ * shrink the file while it is mapped, and blehostd's next write to the
+ * ring would fault.
+ */
+#define BHD_RING_REQ_SEALS      (F_SEAL_SHRINK | F_SEAL_GROW)
+
+struct bhd_ring_client {
+    struct bhd_ring ring;
+    size_t map_sz;
+
+    /** Bit n set means type BHD_MSG_TYPE_EVT_BASE + n goes in the ring. */
+    uint32_t evt_types;
+};
+
+static struct bhd_ring_client bhd_ring_clients[BHD_RING_MAX_CLIENTS];
+
+/** Bit n set means bhd_ring_clients[n] has an open ring. */
+static uint32_t bhd_ring_open_mask;
+
+#define BHD_RING_EVT_BIT(type)  (1UL << ((type) - BHD_MSG_TYPE_EVT_BASE))
+
+#define BHD_RING_EVT_TYPES                                              \
+    (BHD_RING_EVT_BIT(BHD_MSG_TYPE_NOTIFY_RX_EVT) |                      \
+     BHD_RING_EVT_BIT(BHD_MSG_TYPE_SCAN_EVT))
+
+/**
+ * Maps a client-supplied memfd and initializes a ring in it.  The memfd must
+ * be sealed against shrinking and growing.  Any ring that the client
+ * already has is closed first.  The descriptor is always closed; the mapping
+ * keeps the memory alive.
+ *
+ * @param evt_types             Event types to deliver through the ring, as
+ *                                  an event-type bitmask; 0 for all types
+ *                                  that rings support.
+ *
+ * @return                      0 on success;
+ *                              SYS_EINVAL if the memory is unsuitable or
+ *                                  not sealed;
+ *                              SYS_ENOTSUP if an unsupported event type was
+ *                                  requested;
+ *                              SYS_ENOMEM if the memory cannot be mapped.
+ */
+int
+bhd_ring_open(int client_idx, int fd, uint32_t evt_types,
+              uint32_t *out_data_sz)
+{
+    struct bhd_ring_client *client;
+    struct stat st;
+    void *base;
+    int seals;
+    int rc;
+
+    assert(client_idx >= 0 && client_idx < BHD_RING_MAX_CLIENTS);
+
+    bhd_ring_close(client_idx);
+
+    if (evt_types == 0) {
+        evt_types = BHD_RING_EVT_TYPES;
+    } else if (evt_types & ~BHD_RING_EVT_TYPES) {
+        rc = SYS_ENOTSUP;
+        goto done;
+    }
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & BHD_RING_REQ_SEALS) != BHD_RING_REQ_SEALS) {
+        BHD_LOG(INFO, "Rejecting event ring; memfd not sealed\n");
+        rc = SYS_EINVAL;
+        goto done;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size > BHD_RING_MAX_MAP_SZ) {
+        rc = SYS_EINVAL;
+        goto done;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        rc = SYS_ENOMEM;
+        goto done;
+    }
+
+    client = bhd_ring_clients + client_idx;
+    rc = bhd_ring_init(&client->ring, base, st.st_size);
+    if (rc != 0) {
+        munmap(base, st.st_size);
+        rc = SYS_EINVAL;
+        goto done;
+    }
+
+    client->map_sz = st.st_size;
+    client->evt_types = evt_types;
+    bhd_ring_open_mask |= 1UL << client_idx;
+
+    *out_data_sz = client->ring.hdr->data_sz;
+
+    BHD_LOG(INFO, "Opened event ring; client_idx=%d data_sz=%u\n",
+            client_idx, (unsigned)*out_data_sz);
+
+done:
+    close(fd);
+    return rc;
+}
+
+/**
+ * Unmaps a client's ring, if it has one.
+ */
+void
+bhd_ring_close(int client_idx)
+{
+    struct bhd_ring_client *client;
+
+    if (!(bhd_ring_open_mask & (1UL << client_idx))) {
+        return;
+    }
+
+    client = bhd_ring_clients + client_idx;
+    munmap(client->ring.hdr, client->map_sz);
+    memset(client, 0, sizeof *client);
+
+    bhd_ring_open_mask &= ~(1UL << client_idx);
+}
+
+static void
+bhd_ring_put(struct bhd_ring *ring, const struct bhd_evt *evt,
+             uint64_t timestamp_us)
+{
+    struct bhd_ring_rec *rec;
+
+    switch (evt->hdr.type) {
+    case BHD_MSG_TYPE_NOTIFY_RX_EVT:
+        rec = bhd_ring_reserve(ring, evt->notify_rx.data_len);
+        if (rec == NULL) {
+            return;
+        }
+
+        rec->type = BHD_RING_REC_NOTIFY_RX;
+        if (evt->notify_rx.indication) {
+            rec->flags |= BHD_RING_F_INDICATION;
+        }
+        rec->notify_rx.conn_handle = evt->notify_rx.conn_handle;
+        rec->notify_rx.attr_handle = evt->notify_rx.attr_handle;
+        memcpy(rec->data, evt->notify_rx.data, evt->notify_rx.data_len);
+        break;
+
+    case BHD_MSG_TYPE_SCAN_EVT:
+        rec = bhd_ring_reserve(ring, evt->scan.length_data);
+        if (rec == NULL) {
+            return;
+        }
+
+        rec->type = BHD_RING_REC_SCAN;
+        rec->scan.addr_type = evt->scan.addr.type;
+        memcpy(rec->scan.addr, evt->scan.addr.val, 6);
+        rec->scan.rssi = evt->scan.rssi;
+        rec->scan.event_type = evt->scan.event_type;
+        memcpy(rec->data, evt->scan.data, evt->scan.length_data);
+        break;
+
+    default:
+        assert(0);
+        return;
+    }
+
+    rec->timestamp_us = timestamp_us;
+    bhd_ring_commit(ring);
+}
+
+/**
+ * Writes an event into the ring of each recipient that has the event's type
+ * routed to its ring.
+ *
+ * @param recipients            The clients that the event is addressed to,
+ *                                  as a client-slot bitmask.
+ *
+ * @return                      The recipients that still need the event
+ *                                  sent over their sockets.
+ */
+uint32_t
+bhd_ring_divert(const struct bhd_evt *evt, uint32_t recipients)
+{
+    struct bhd_ring_client *client;
+    uint64_t timestamp_us;
+    uint32_t diverted;
+    uint32_t evt_bit;
+    int i;
+
+    diverted = recipients & bhd_ring_open_mask;
+    if (diverted == 0) {
+        return recipients;
+    }
+
+    evt_bit = BHD_RING_EVT_BIT(evt->hdr.type);
+    if (!(evt_bit & BHD_RING_EVT_TYPES)) {
+        return recipients;
+    }
+
+    timestamp_us = bhd_ring_now_us();
+
+    for (i = 0; i < 32; i++) {
+        if (!(diverted & (1UL << i))) {
+            continue;
+        }
+
+        client = bhd_ring_clients + i;
+        if (!(client->evt_types & evt_bit)) {
+            diverted &= ~(1UL << i);
+            continue;
+        }
+
+        bhd_ring_put(&client->ring, evt, timestamp_us);
+    }
+
+    return recipients & ~diverted;
+}
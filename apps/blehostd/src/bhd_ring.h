@@ -0,0 +1,12 @@
+#ifndef H_BHD_RING_
+#define H_BHD_RING_
+
+#include <inttypes.h>
+struct bhd_evt;
+
+int bhd_ring_open(int client_idx, int fd, uint32_t evt_types,
+                  uint32_t *out_data_sz);
+void bhd_ring_close(int client_idx);
+uint32_t bhd_ring_divert(const struct bhd_evt *evt, uint32_t recipients);
+
+#endif
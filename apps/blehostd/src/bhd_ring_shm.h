@@ -0,0 +1,325 @@
+#ifndef H_BHD_RING_SHM_
+#define H_BHD_RING_SHM_
+
+/**
+ * Layout of the shared-memory event ring, and the single-producer /
+ * single-consumer operations on it.  This header is shared by blehostd (the
+ * producer) and its clients (the consumer), so it must not depend on
+ * anything outside of libc and Linux.
+ *
+ * A client creates a memfd of BHD_RING_DATA_OFF + data_sz bytes, where
+ * data_sz is a power of two, seals it with F_SEAL_SHRINK | F_SEAL_GROW, and
+ * passes it to blehostd with a ring_open request.  blehostd initializes the header and from then on writes the
+ * selected events into the ring as raw records instead of sending them over
+ * the socket.
+ *
+ * The ring is a byte buffer of variable-length records.  head and tail are
+ * free-running byte offsets; head is only written by the producer and tail
+ * only by the consumer.  A record never wraps; if one does not fit before
+ * the end of the buffer, a padding record fills the remainder.  When the
+ * ring is full, records are dropped and counted in num_dropped.
+ *
+ * A consumer that runs out of records may sleep on wake_seq with
+ * bhd_ring_wait(); the producer only issues a wakeup while reader_waiting
+ * is set.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define BHD_RING_MAGIC              0x676e5242  /* "BRng" */
+#define BHD_RING_VERSION            1
+
+/** Offset of the record buffer from the start of the mapping. */
+#define BHD_RING_DATA_OFF           256
+
+#define BHD_RING_MIN_DATA_SZ        4096
+
+#define BHD_RING_REC_PAD            0
+#define BHD_RING_REC_NOTIFY_RX      1
+#define BHD_RING_REC_SCAN           2
+
+/** notify_rx record: the peer sent an indication rather than a
+ *  notification.
+ */
+#define BHD_RING_F_INDICATION       0x01
+
+struct bhd_ring_hdr {
+    /* Written once by the producer when the ring is initialized. */
+    uint32_t magic;
+    uint32_t version;
+    uint32_t data_sz;
+
+    /* Written by the producer only. */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t num_dropped;
+    uint32_t wake_seq;
+
+    /* Written by the consumer only. */
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t reader_waiting;
+};
+
+struct bhd_ring_rec {
+    /** Total size of the record, including padding; a multiple of 8. */
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t data_len;
+
+    /** CLOCK_MONOTONIC time that blehostd received the event. */
+    uint64_t timestamp_us;
+
+    union {
+        struct {
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+        } notify_rx;
+
+        struct {
+            uint8_t addr_type;
+            uint8_t addr[6];
+            int8_t rssi;
+            uint8_t event_type;
+        } scan;
+
+        uint8_t raw[16];
+    };
+
+    /** Attribute value or advertising data. */
+    uint8_t data[];
+};
+
+/** One end of a mapped ring. */
+struct bhd_ring {
+    struct bhd_ring_hdr *hdr;
+    uint8_t *data;
+    uint32_t mask;
+
+    /** Producer only: head including records not yet committed. */
+    uint64_t prod_head;
+
+    /** Producer only: size of the record from the last reservation.  The
+     *  record itself lives in client-writable memory, so its len field
+     *  cannot be trusted when committing it.
+     */
+    uint32_t prod_rec_sz;
+};
+
+static inline uint32_t
+bhd_ring_rec_sz(int data_len)
+{
+    return (sizeof (struct bhd_ring_rec) + data_len + 7) & ~7u;
+}
+
+static inline uint64_t
+bhd_ring_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Initializes a freshly mapped ring.  Called by the producer.
+ *
+ * @return                      0 on success;
+ *                              -1 if the mapping size is unsuitable.
+ */
+static inline int
+bhd_ring_init(struct bhd_ring *ring, void *base, size_t map_sz)
+{
+    size_t data_sz;
+
+    if (map_sz < BHD_RING_DATA_OFF + BHD_RING_MIN_DATA_SZ) {
+        return -1;
+    }
+
+    data_sz = map_sz - BHD_RING_DATA_OFF;
+    if ((data_sz & (data_sz - 1)) != 0 || data_sz > UINT32_MAX) {
+        return -1;
+    }
+
+    ring->hdr = base;
+    ring->data = (uint8_t *)base + BHD_RING_DATA_OFF;
+    ring->mask = data_sz - 1;
+    ring->prod_head = 0;
+    ring->prod_rec_sz = 0;
+
+    memset(ring->hdr, 0, sizeof *ring->hdr);
+    ring->hdr->version = BHD_RING_VERSION;
+    ring->hdr->data_sz = data_sz;
+    __atomic_store_n(&ring->hdr->magic, BHD_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Attaches to a ring that the producer has initialized.  Called by the
+ * consumer.
+ *
+ * @return                      0 on success;
+ *                              -1 if the ring is not (yet) valid.
+ */
+static inline int
+bhd_ring_attach(struct bhd_ring *ring, void *base, size_t map_sz)
+{
+    struct bhd_ring_hdr *hdr;
+
+    hdr = base;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BHD_RING_MAGIC ||
+        hdr->version != BHD_RING_VERSION ||
+        BHD_RING_DATA_OFF + (size_t)hdr->data_sz != map_sz) {
+
+        return -1;
+    }
+
+    ring->hdr = hdr;
+    ring->data = (uint8_t *)base + BHD_RING_DATA_OFF;
+    ring->mask = hdr->data_sz - 1;
+    ring->prod_head = 0;
+    ring->prod_rec_sz = 0;
+
+    return 0;
+}
+
+/**
+ * Reserves space for a record with the specified amount of data.  The
+ * caller fills in the record and publishes it with bhd_ring_commit().
+ *
+ * @return                      The record to fill in;
+ *                              NULL if the ring is full.  The record is
+ *                                  counted as dropped.
+ */
+static inline struct bhd_ring_rec *
+bhd_ring_reserve(struct bhd_ring *ring, int data_len)
+{
+    struct bhd_ring_rec *rec;
+    uint64_t tail;
+    uint32_t contig;
+    uint32_t off;
+    uint32_t need;
+    uint32_t sz;
+
+    sz = bhd_ring_rec_sz(data_len);
+    off = ring->prod_head & ring->mask;
+    contig = ring->mask + 1 - off;
+
+    need = sz;
+    if (sz > contig) {
+        need += contig;
+    }
+
+    tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+    if (need > ring->mask + 1 - (ring->prod_head - tail)) {
+        __atomic_store_n(&ring->hdr->num_dropped, ring->hdr->num_dropped + 1,
+                         __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (sz > contig) {
+        rec = (struct bhd_ring_rec *)(ring->data + off);
+        rec->len = contig;
+        rec->type = BHD_RING_REC_PAD;
+        ring->prod_head += contig;
+        off = 0;
+    }
+
+    rec = (struct bhd_ring_rec *)(ring->data + off);
+    memset(rec, 0, sizeof *rec);
+    rec->len = sz;
+    rec->data_len = data_len;
+    ring->prod_rec_sz = sz;
+
+    return rec;
+}
+
+/**
+ * Publishes the record obtained from the last call to bhd_ring_reserve(),
+ * and wakes the consumer if it is waiting.
+ */
+static inline void
+bhd_ring_commit(struct bhd_ring *ring)
+{
+    ring->prod_head += ring->prod_rec_sz;
+    ring->prod_rec_sz = 0;
+    __atomic_store_n(&ring->hdr->head, ring->prod_head, __ATOMIC_RELEASE);
+
+    /* Order the head update before the check of reader_waiting; pairs with
+     * the fence in bhd_ring_wait().
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->hdr->reader_waiting, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&ring->hdr->wake_seq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ring->hdr->wake_seq, FUTEX_WAKE, 1,
+                NULL, NULL, 0);
+    }
+}
+
+/**
+ * Retrieves the oldest unconsumed record without consuming it.
+ *
+ * @return                      The record on success;
+ *                              NULL if the ring is empty.
+ */
+static inline const struct bhd_ring_rec *
+bhd_ring_peek(struct bhd_ring *ring)
+{
+    const struct bhd_ring_rec *rec;
+    uint64_t head;
+    uint64_t tail;
+
+    tail = ring->hdr->tail;
+    head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        rec = (const struct bhd_ring_rec *)(ring->data + (tail & ring->mask));
+        if (rec->type != BHD_RING_REC_PAD) {
+            return rec;
+        }
+
+        tail += rec->len;
+        __atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Releases the record returned by the last call to bhd_ring_peek().
+ */
+static inline void
+bhd_ring_consume(struct bhd_ring *ring, const struct bhd_ring_rec *rec)
+{
+    __atomic_store_n(&ring->hdr->tail, ring->hdr->tail + rec->len,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Blocks until the ring is not empty or the timeout expires.
+ *
+ * @param timeout               Maximum time to wait; NULL to wait forever.
+ */
+static inline void
+bhd_ring_wait(struct bhd_ring *ring, const struct timespec *timeout)
+{
+    uint32_t seq;
+
+    seq = __atomic_load_n(&ring->hdr->wake_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->hdr->reader_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (bhd_ring_peek(ring) == NULL) {
+        syscall(SYS_futex, &ring->hdr->wake_seq, FUTEX_WAIT, seq,
+                timeout, NULL, 0);
+    }
+
+    __atomic_store_n(&ring->hdr->reader_waiting, 0, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,537 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "defs/error.h"
+#include "bhd_tok.h"
+
+/**
+ * In-situ JSON tokenizer.  Splits a JSON document into a flat array of tokens
+ * that refer back to the source text; no memory is allocated.  Values are
+ * only converted when a decoder asks for them (bhd_tok_str(), bhd_tok_num(),
+ * bhd_tok_bool()).
+ */
+
+struct bhd_tok_parser {
+    const char *js;
+    int len;
+    int off;
+
+    struct bhd_tok *toks;
+    int max_toks;
+    int num_toks;
+};
+
+static int bhd_tok_parse_val(struct bhd_tok_parser *p, int depth);
+
+static int
+bhd_tok_is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int
+bhd_tok_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void
+bhd_tok_skip_ws(struct bhd_tok_parser *p)
+{
+    while (p->off < p->len && bhd_tok_is_ws(p->js[p->off])) {
+        p->off++;
+    }
+}
+
+static int
+bhd_tok_hex_val(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Reserves the next token.
+ *
+ * @return                      The index of the new token;
+ *                              -1 if the token array is full.
+ */
+static int
+bhd_tok_alloc(struct bhd_tok_parser *p, uint8_t type, int start)
+{
+    struct bhd_tok *tok;
+    int idx;
+
+    if (p->num_toks >= p->max_toks) {
+        return -1;
+    }
+
+    idx = p->num_toks++;
+
+    tok = p->toks + idx;
+    tok->type = type;
+    tok->start = start;
+    tok->end = start;
+    tok->size = 0;
+    tok->next = idx + 1;
+
+    return idx;
+}
+
+static int
+bhd_tok_parse_str(struct bhd_tok_parser *p)
+{
+    int start;
+    int idx;
+    char c;
+    int i;
+
+    /* Skip opening quote. */
+    p->off++;
+    start = p->off;
+
+    while (p->off < p->len) {
+        c = p->js[p->off];
+
+        if (c == '"') {
+            idx = bhd_tok_alloc(p, BHD_TOK_STR, start);
+            if (idx == -1) {
+                return SYS_ENOMEM;
+            }
+            p->toks[idx].end = p->off;
+            p->off++;
+            return 0;
+        }
+
+        if (c == '\\') {
+            p->off++;
+            if (p->off >= p->len) {
+                return SYS_ERANGE;
+            }
+
+            switch (p->js[p->off]) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                break;
+
+            case 'u':
+                if (p->len - p->off <= 4) {
+                    return SYS_ERANGE;
+                }
+                for (i = 1; i <= 4; i++) {
+                    if (bhd_tok_hex_val(p->js[p->off + i]) == -1) {
+                        return SYS_ERANGE;
+                    }
+                }
+                p->off += 4;
+                break;
+
+            default:
+                return SYS_ERANGE;
+            }
+        } else if ((uint8_t)c < 0x20) {
+            return SYS_ERANGE;
+        }
+
+        p->off++;
+    }
+
+    /* Unterminated string. */
+    return SYS_ERANGE;
+}
+
+/**
+ * Verifies that the specified text conforms to the JSON number grammar.
+ */
+static int
+bhd_tok_num_valid(const char *s, int len)
+{
+    int i;
+
+    i = 0;
+    if (i < len && s[i] == '-') {
+        i++;
+    }
+
+    if (i >= len || !bhd_tok_is_digit(s[i])) {
+        return 0;
+    }
+    if (s[i] == '0') {
+        i++;
+    } else {
+        while (i < len && bhd_tok_is_digit(s[i])) {
+            i++;
+        }
+    }
+
+    if (i < len && s[i] == '.') {
+        i++;
+        if (i >= len || !bhd_tok_is_digit(s[i])) {
+            return 0;
+        }
+        while (i < len && bhd_tok_is_digit(s[i])) {
+            i++;
+        }
+    }
+
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < len && (s[i] == '+' || s[i] == '-')) {
+            i++;
+        }
+        if (i >= len || !bhd_tok_is_digit(s[i])) {
+            return 0;
+        }
+        while (i < len && bhd_tok_is_digit(s[i])) {
+            i++;
+        }
+    }
+
+    return i == len;
+}
+
+static int
+bhd_tok_parse_prim(struct bhd_tok_parser *p)
+{
+    const char *s;
+    int start;
+    int len;
+    int idx;
+    char c;
+
+    start = p->off;
+    while (p->off < p->len) {
+        c = p->js[p->off];
+        if (bhd_tok_is_ws(c) || c == ',' || c == ']' || c == '}' ||
+            c == ':') {
+
+            break;
+        }
+        p->off++;
+    }
+
+    s = p->js + start;
+    len = p->off - start;
+
+    if (!(len == 4 && memcmp(s, "true", 4) == 0)  &&
+        !(len == 5 && memcmp(s, "false", 5) == 0) &&
+        !(len == 4 && memcmp(s, "null", 4) == 0)  &&
+        !bhd_tok_num_valid(s, len)) {
+
+        return SYS_ERANGE;
+    }
+
+    idx = bhd_tok_alloc(p, BHD_TOK_PRIM, start);
+    if (idx == -1) {
+        return SYS_ENOMEM;
+    }
+    p->toks[idx].end = p->off;
+
+    return 0;
+}
+
+static int
+bhd_tok_parse_container(struct bhd_tok_parser *p, int depth, uint8_t type)
+{
+    char close;
+    int size;
+    int idx;
+    int rc;
+    char c;
+
+    if (depth >= BHD_TOK_MAX_DEPTH) {
+        return SYS_ERANGE;
+    }
+
+    idx = bhd_tok_alloc(p, type, p->off);
+    if (idx == -1) {
+        return SYS_ENOMEM;
+    }
+
+    close = type == BHD_TOK_OBJ ? '}' : ']';
+    size = 0;
+
+    /* Skip opening bracket. */
+    p->off++;
+
+    bhd_tok_skip_ws(p);
+    if (p->off < p->len && p->js[p->off] == close) {
+        p->off++;
+        goto done;
+    }
+
+    while (1) {
+        if (type == BHD_TOK_OBJ) {
+            bhd_tok_skip_ws(p);
+            if (p->off >= p->len || p->js[p->off] != '"') {
+                return SYS_ERANGE;
+            }
+
+            rc = bhd_tok_parse_str(p);
+            if (rc != 0) {
+                return rc;
+            }
+
+            bhd_tok_skip_ws(p);
+            if (p->off >= p->len || p->js[p->off] != ':') {
+                return SYS_ERANGE;
+            }
+            p->off++;
+        }
+
+        rc = bhd_tok_parse_val(p, depth + 1);
+        if (rc != 0) {
+            return rc;
+        }
+        size++;
+
+        bhd_tok_skip_ws(p);
+        if (p->off >= p->len) {
+            return SYS_ERANGE;
+        }
+
+        c = p->js[p->off++];
+        if (c == close) {
+            break;
+        }
+        if (c != ',') {
+            return SYS_ERANGE;
+        }
+    }
+
+done:
+    p->toks[idx].end = p->off;
+    p->toks[idx].size = size;
+    p->toks[idx].next = p->num_toks;
+    return 0;
+}
+
+static int
+bhd_tok_parse_val(struct bhd_tok_parser *p, int depth)
+{
+    bhd_tok_skip_ws(p);
+    if (p->off >= p->len) {
+        return SYS_ERANGE;
+    }
+
+    switch (p->js[p->off]) {
+    case '{':
+        return bhd_tok_parse_container(p, depth, BHD_TOK_OBJ);
+
+    case '[':
+        return bhd_tok_parse_container(p, depth, BHD_TOK_ARR);
+
+    case '"':
+        return bhd_tok_parse_str(p);
+
+    default:
+        return bhd_tok_parse_prim(p);
+    }
+}
+
+/**
+ * Tokenizes a JSON document.  The document must consist of a single value,
+ * optionally surrounded by whitespace.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOMEM if the document contains more than
+ *                                  max_toks tokens;
+ *                              SYS_ERANGE if the document is malformed.
+ */
+int
+bhd_tok_parse(const char *js, int len, struct bhd_tok *toks, int max_toks,
+              int *out_num_toks)
+{
+    struct bhd_tok_parser p;
+    int rc;
+
+    p.js = js;
+    p.len = len;
+    p.off = 0;
+    p.toks = toks;
+    p.max_toks = max_toks;
+    p.num_toks = 0;
+
+    rc = bhd_tok_parse_val(&p, 0);
+    if (rc != 0) {
+        return rc;
+    }
+
+    bhd_tok_skip_ws(&p);
+    if (p.off != p.len) {
+        return SYS_ERANGE;
+    }
+
+    *out_num_toks = p.num_toks;
+    return 0;
+}
+
+/**
+ * Indicates whether a string token is equal to the specified text.  Escape
+ * sequences in the token are not interpreted.
+ */
+int
+bhd_tok_eq(const char *js, const struct bhd_tok *tok, const char *s, int slen)
+{
+    return tok->type == BHD_TOK_STR &&
+           tok->end - tok->start == slen &&
+           memcmp(js + tok->start, s, slen) == 0;
+}
+
+static int
+bhd_tok_utf8_enc(char *dst, unsigned int cp)
+{
+    if (cp < 0x80) {
+        dst[0] = cp;
+        return 1;
+    }
+
+    if (cp < 0x800) {
+        dst[0] = 0xc0 | (cp >> 6);
+        dst[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+
+    dst[0] = 0xe0 | (cp >> 12);
+    dst[1] = 0x80 | ((cp >> 6) & 0x3f);
+    dst[2] = 0x80 | (cp & 0x3f);
+    return 3;
+}
+
+/**
+ * Converts a string token to a null-terminated C string.  The conversion is
+ * done in place: escape sequences are expanded within the token's text and
+ * the closing quote is overwritten with a null terminator.  Converting a
+ * token a second time is a no-op.
+ *
+ * @return                      The converted string, pointing into js.
+ */
+char *
+bhd_tok_str(char *js, const struct bhd_tok *tok)
+{
+    unsigned int cp;
+    char *src;
+    char *dst;
+    char *end;
+    int i;
+
+    assert(tok->type == BHD_TOK_STR);
+
+    src = js + tok->start;
+    end = js + tok->end;
+
+    if (*end == '\0') {
+        /* Already converted. */
+        return src;
+    }
+
+    dst = memchr(src, '\\', end - src);
+    if (dst == NULL) {
+        *end = '\0';
+        return src;
+    }
+
+    /* The tokenizer has already validated every escape sequence. */
+    src = dst;
+    while (src < end) {
+        if (*src != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+
+        src++;
+        switch (*src) {
+        case 'b':   *dst++ = '\b'; src++; break;
+        case 'f':   *dst++ = '\f'; src++; break;
+        case 'n':   *dst++ = '\n'; src++; break;
+        case 'r':   *dst++ = '\r'; src++; break;
+        case 't':   *dst++ = '\t'; src++; break;
+
+        case 'u':
+            cp = 0;
+            for (i = 1; i <= 4; i++) {
+                cp = (cp << 4) | bhd_tok_hex_val(src[i]);
+            }
+            dst += bhd_tok_utf8_enc(dst, cp);
+            src += 5;
+            break;
+
+        default:
+            *dst++ = *src++;
+            break;
+        }
+    }
+
+    *dst = '\0';
+    *end = '\0';
+
+    return js + tok->start;
+}
+
+/**
+ * Reads the value of a numeric token.
+ *
+ * @return                      0 on success;
+ *                              SYS_ERANGE if the token is not a number.
+ */
+int
+bhd_tok_num(const char *js, const struct bhd_tok *tok, double *out_dbl)
+{
+    char c;
+
+    if (tok->type != BHD_TOK_PRIM) {
+        return SYS_ERANGE;
+    }
+
+    /* The tokenizer has already validated the number's syntax; the token is
+     * followed by a delimiter, so strtod() stops at the end of the token.
+     */
+    c = js[tok->start];
+    if (c != '-' && !bhd_tok_is_digit(c)) {
+        return SYS_ERANGE;
+    }
+
+    *out_dbl = strtod(js + tok->start, NULL);
+    return 0;
+}
+
+/**
+ * Reads the value of a true or false token.
+ *
+ * @return                      0 on success;
+ *                              SYS_ERANGE if the token is not a boolean.
+ */
+int
+bhd_tok_bool(const char *js, const struct bhd_tok *tok, int *out_val)
+{
+    if (tok->type != BHD_TOK_PRIM) {
+        return SYS_ERANGE;
+    }
+
+    switch (js[tok->start]) {
+    case 't':
+        *out_val = 1;
+        return 0;
+
+    case 'f':
+        *out_val = 0;
+        return 0;
+
+    default:
+        return SYS_ERANGE;
+    }
+}
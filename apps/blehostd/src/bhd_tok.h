@@ -0,0 +1,43 @@
+#ifndef H_BHD_TOK_
+#define H_BHD_TOK_
+
+#include <inttypes.h>
+
+#define BHD_TOK_OBJ                 1
+#define BHD_TOK_ARR                 2
+#define BHD_TOK_STR                 3
+#define BHD_TOK_PRIM                4
+
+#define BHD_TOK_MAX_DEPTH           16
+
+/**
+ * A JSON token.  Tokens refer to the source text by offset; nothing is copied
+ * during tokenization.  Tokens are stored in document order, so the children
+ * of a container immediately follow it.  In an object, each key is a string
+ * token directly followed by its value.
+ */
+struct bhd_tok {
+    uint8_t type;
+
+    /** Offset of the first character (strings: after the opening quote). */
+    int start;
+
+    /** Offset one past the last character (strings: the closing quote). */
+    int end;
+
+    /** Number of elements in an array, or number of members in an object. */
+    int size;
+
+    /** Index of the first token after this one and all of its children. */
+    int next;
+};
+
+int bhd_tok_parse(const char *js, int len, struct bhd_tok *toks, int max_toks,
+                  int *out_num_toks);
+int bhd_tok_eq(const char *js, const struct bhd_tok *tok, const char *s,
+               int slen);
+char *bhd_tok_str(char *js, const struct bhd_tok *tok);
+int bhd_tok_num(const char *js, const struct bhd_tok *tok, double *out_dbl);
+int bhd_tok_bool(const char *js, const struct bhd_tok *tok, int *out_val);
+
+#endif
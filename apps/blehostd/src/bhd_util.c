@@ -4,143 +4,15 @@
 #include "parse.h"
 #include "bhd_proto.h"
 #include "bhd_util.h"
+#include "bhd_hex.h"
+#include "bhd_b64.h"
 #include "defs/error.h"
 #include "nimble/ble.h"
 #include "nimble/hci_common.h"
 #include "host/ble_hs.h"
 
-typedef int bhd_kv_parse_fn(const char *src);
-
-static const struct bhd_kv_str_int bhd_op_map[] = {
-    { "request",            BHD_MSG_OP_REQ },
-    { "response",           BHD_MSG_OP_RSP },
-    { "event",              BHD_MSG_OP_EVT },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_type_map[] = {
-    { "error",              BHD_MSG_TYPE_ERR },
-    { "sync",               BHD_MSG_TYPE_SYNC },
-    { "connect",            BHD_MSG_TYPE_CONNECT },
-    { "terminate",          BHD_MSG_TYPE_TERMINATE },
-    { "disc_all_svcs",      BHD_MSG_TYPE_DISC_ALL_SVCS },
-    { "disc_svc_uuid",      BHD_MSG_TYPE_DISC_SVC_UUID },
-    { "disc_all_chrs",      BHD_MSG_TYPE_DISC_ALL_CHRS },
-    { "disc_chr_uuid",      BHD_MSG_TYPE_DISC_CHR_UUID },
-    { "disc_all_dscs",      BHD_MSG_TYPE_DISC_ALL_DSCS },
-    { "write",              BHD_MSG_TYPE_WRITE },
-    { "write_cmd",          BHD_MSG_TYPE_WRITE_CMD },
-    { "exchange_mtu",       BHD_MSG_TYPE_EXCHANGE_MTU },
-    { "gen_rand_addr",      BHD_MSG_TYPE_GEN_RAND_ADDR },
-    { "set_rand_addr",      BHD_MSG_TYPE_SET_RAND_ADDR },
-    { "conn_cancel",        BHD_MSG_TYPE_CONN_CANCEL },
-    { "scan",               BHD_MSG_TYPE_SCAN },
-    { "scan_cancel",        BHD_MSG_TYPE_SCAN_CANCEL },
-    { "set_preferred_mtu",  BHD_MSG_TYPE_SET_PREFERRED_MTU },
-    { "security_initiate",  BHD_MSG_TYPE_ENC_INITIATE },
-    { "conn_find",          BHD_MSG_TYPE_CONN_FIND },
-    { "reset",              BHD_MSG_TYPE_RESET },
-    { "adv_start",          BHD_MSG_TYPE_ADV_START },
-    { "adv_stop",           BHD_MSG_TYPE_ADV_STOP },
-    { "adv_set_data",       BHD_MSG_TYPE_ADV_SET_DATA },
-    { "adv_rsp_set_data",   BHD_MSG_TYPE_ADV_RSP_SET_DATA },
-    { "adv_fields",         BHD_MSG_TYPE_ADV_FIELDS },
-    { "clear_svcs",         BHD_MSG_TYPE_CLEAR_SVCS },
-    { "add_svcs",           BHD_MSG_TYPE_ADD_SVCS },
-    { "commit_svcs",        BHD_MSG_TYPE_COMMIT_SVCS },
-    { "access_status",      BHD_MSG_TYPE_ACCESS_STATUS },
-    { "notify",             BHD_MSG_TYPE_NOTIFY },
-    { "find_chr",           BHD_MSG_TYPE_FIND_CHR },
-    { "sm_inject_io",       BHD_MSG_TYPE_SM_INJECT_IO },
-
-    { "sync_evt",           BHD_MSG_TYPE_SYNC_EVT },
-    { "connect_evt",        BHD_MSG_TYPE_CONNECT_EVT },
-    { "disconnect_evt",     BHD_MSG_TYPE_DISCONNECT_EVT },
-    { "disc_svc_evt",       BHD_MSG_TYPE_DISC_SVC_EVT },
-    { "disc_chr_evt",       BHD_MSG_TYPE_DISC_CHR_EVT },
-    { "disc_dsc_evt",       BHD_MSG_TYPE_DISC_DSC_EVT },
-    { "write_ack_evt",      BHD_MSG_TYPE_WRITE_ACK_EVT },
-    { "notify_rx_evt",      BHD_MSG_TYPE_NOTIFY_RX_EVT },
-    { "mtu_change_evt",     BHD_MSG_TYPE_MTU_CHANGE_EVT },
-    { "scan_evt",           BHD_MSG_TYPE_SCAN_EVT },
-    { "scan_tmo_evt",       BHD_MSG_TYPE_SCAN_TMO_EVT },
-    { "enc_change_evt",     BHD_MSG_TYPE_ENC_CHANGE_EVT },
-    { "reset_evt",          BHD_MSG_TYPE_RESET_EVT },
-    { "access_evt",         BHD_MSG_TYPE_ACCESS_EVT },
-    { "adv_complete_evt",   BHD_MSG_TYPE_ADV_COMPLETE_EVT },
-    { "passkey_evt",        BHD_MSG_TYPE_PASSKEY_EVT },
-
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_addr_type_map[] = {
-    { "public",         BLE_ADDR_PUBLIC },
-    { "random",         BLE_ADDR_RANDOM },
-    { "rpa_pub",        BLE_ADDR_PUBLIC_ID },
-    { "rpa_rnd",        BLE_ADDR_RANDOM_ID },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_scan_filter_policy_map[] = {
-    { "no_wl",          BLE_HCI_SCAN_FILT_NO_WL },
-    { "use_wl",         BLE_HCI_SCAN_FILT_USE_WL },
-    { "no_wl_inita",    BLE_HCI_SCAN_FILT_NO_WL_INITA },
-    { "use_wl_inita",   BLE_HCI_SCAN_FILT_USE_WL_INITA },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_adv_event_type_map[] = {
-    { "ind",            BLE_HCI_ADV_TYPE_ADV_IND },
-    { "direct_ind_hd",  BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_HD },
-    { "scan_ind",       BLE_HCI_ADV_TYPE_ADV_SCAN_IND },
-    { "nonconn_ind",    BLE_HCI_ADV_TYPE_ADV_NONCONN_IND },
-    { "direct_ind_ld",  BLE_HCI_ADV_TYPE_ADV_DIRECT_IND_LD },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_adv_conn_mode_map[] = {
-    { "non",            BLE_GAP_CONN_MODE_NON },
-    { "dir",            BLE_GAP_CONN_MODE_DIR },
-    { "und",            BLE_GAP_CONN_MODE_UND },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_adv_disc_mode_map[] = {
-    { "non",            BLE_GAP_DISC_MODE_NON },
-    { "ltd",            BLE_GAP_DISC_MODE_LTD },
-    { "gen",            BLE_GAP_DISC_MODE_GEN },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_adv_filter_policy_map[] = {
-    { "none",           BLE_HCI_ADV_FILT_NONE },
-    { "scan",           BLE_HCI_ADV_FILT_SCAN },
-    { "conn",           BLE_HCI_ADV_FILT_CONN },
-    { "both",           BLE_HCI_ADV_FILT_BOTH },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_svc_type_map[] = {
-    { "primary",        BLE_GATT_SVC_TYPE_PRIMARY },
-    { "secondary",      BLE_GATT_SVC_TYPE_SECONDARY },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_gatt_access_op_map[] = {
-    { "read_chr",       BLE_GATT_ACCESS_OP_READ_CHR },
-    { "write_chr",      BLE_GATT_ACCESS_OP_WRITE_CHR },
-    { "read_dsc",       BLE_GATT_ACCESS_OP_READ_DSC },
-    { "write_dsc",      BLE_GATT_ACCESS_OP_WRITE_DSC },
-    { 0 },
-};
-
-static const struct bhd_kv_str_int bhd_sm_passkey_action_map[] = {
-    { "oob",            BLE_SM_IOACT_OOB },
-    { "input",          BLE_SM_IOACT_INPUT },
-    { "disp",           BLE_SM_IOACT_DISP },
-    { "numcmp",         BLE_SM_IOACT_NUMCMP },
-    { 0 },
-};
+/** Encoding of byte strings in the cJSON request being processed. */
+static int bhd_json_cur_data_enc = BHD_DATA_ENC_HEX;
 
 const struct bhd_kv_str_int *
 bhd_kv_str_int_find_entry(const struct bhd_kv_str_int *map, const char *key)
@@ -203,140 +75,6 @@ bhd_kv_str_int_rev_find(const struct bhd_kv_str_int *map, int val)
     }
 }
 
-int
-bhd_op_parse(const char *op_str)
-{
-    return bhd_kv_str_int_find(bhd_op_map, op_str);
-}
-
-const char *
-bhd_op_rev_parse(int op)
-{
-    return bhd_kv_str_int_rev_find(bhd_op_map, op);
-}
-
-int
-bhd_type_parse(const char *type_str)
-{
-    return bhd_kv_str_int_find(bhd_type_map, type_str);
-}
-
-const char *
-bhd_type_rev_parse(int type)
-{
-    return bhd_kv_str_int_rev_find(bhd_type_map, type);
-}
-
-int
-bhd_addr_type_parse(const char *addr_type_str)
-{
-    return bhd_kv_str_int_find(bhd_addr_type_map, addr_type_str);
-}
-
-const char *
-bhd_addr_type_rev_parse(int addr_type)
-{
-    return bhd_kv_str_int_rev_find(bhd_addr_type_map, addr_type);
-}
-
-int
-bhd_scan_filter_policy_parse(const char *filter_policy_str)
-{
-    return bhd_kv_str_int_find(bhd_scan_filter_policy_map, filter_policy_str);
-}
-
-const char *
-bhd_scan_filter_policy_rev_parse(int filter_policy)
-{
-    return bhd_kv_str_int_rev_find(bhd_scan_filter_policy_map, filter_policy);
-}
-
-int
-bhd_adv_event_type_parse(const char *adv_event_type_str)
-{
-    return bhd_kv_str_int_find(bhd_adv_event_type_map, adv_event_type_str);
-}
-
-const char *
-bhd_adv_event_type_rev_parse(int adv_event_type)
-{
-    return bhd_kv_str_int_rev_find(bhd_adv_event_type_map, adv_event_type);
-}
-
-int
-bhd_adv_conn_mode_parse(const char *conn_mode_str)
-{
-    return bhd_kv_str_int_find(bhd_adv_conn_mode_map, conn_mode_str);
-}
-
-const char *
-bhd_adv_conn_mode_rev_parse(int conn_mode)
-{
-    return bhd_kv_str_int_rev_find(bhd_adv_conn_mode_map, conn_mode);
-}
-
-int
-bhd_adv_disc_mode_parse(const char *disc_mode_str)
-{
-    return bhd_kv_str_int_find(bhd_adv_disc_mode_map, disc_mode_str);
-}
-
-const char *
-bhd_adv_disc_mode_rev_parse(int disc_mode)
-{
-    return bhd_kv_str_int_rev_find(bhd_adv_disc_mode_map, disc_mode);
-}
-
-int
-bhd_adv_filter_policy_parse(const char *filter_policy_str)
-{
-    return bhd_kv_str_int_find(bhd_adv_filter_policy_map, filter_policy_str);
-}
-
-const char *
-bhd_adv_filter_policy_rev_parse(int filter_policy)
-{
-    return bhd_kv_str_int_rev_find(bhd_adv_filter_policy_map, filter_policy);
-}
-
-int
-bhd_svc_type_parse(const char *svc_type_str)
-{
-    return bhd_kv_str_int_find(bhd_svc_type_map, svc_type_str);
-}
-
-const char *
-bhd_svc_type_rev_parse(int svc_type)
-{
-    return bhd_kv_str_int_rev_find(bhd_svc_type_map, svc_type);
-}
-
-int
-bhd_gatt_access_op_parse(const char *gatt_access_op_str)
-{
-    return bhd_kv_str_int_find(bhd_gatt_access_op_map, gatt_access_op_str);
-}
-
-const char *
-bhd_gatt_access_op_rev_parse(int gatt_access_op)
-{
-    return bhd_kv_str_int_rev_find(bhd_gatt_access_op_map, gatt_access_op);
-}
-
-int
-bhd_sm_passkey_action_parse(const char *sm_passkey_action_str)
-{
-    return bhd_kv_str_int_find(bhd_sm_passkey_action_map,
-                               sm_passkey_action_str);
-}
-
-const char *
-bhd_sm_passkey_action_rev_parse(int sm_passkey_action)
-{
-    return bhd_kv_str_int_rev_find(bhd_sm_passkey_action_map,
-                                   sm_passkey_action);
-}
-
 long long int
 bhd_process_json_int(const cJSON *item, int *rc)
 {
@@ -382,6 +120,40 @@ bhd_process_json_string(const cJSON *item, int *rc)
     return item->valuestring;
 }
 
+/**
+ * Decodes a byte string field in the specified encoding.  The destination
+ * may be the source string itself.
+ *
+ * @return                      0 on success;
+ *                              SYS_EINVAL if the string contains more than
+ *                                  max_len bytes;
+ *                              other nonzero if the string is malformed.
+ */
+int
+bhd_data_dec(int data_enc, char *src, int max_len, uint8_t *dst,
+             int *out_len)
+{
+    switch (data_enc) {
+    case BHD_DATA_ENC_BASE64:
+    case BHD_DATA_ENC_RAW:
+        /* JSON text cannot carry raw bytes; base64 is used instead. */
+        return bhd_b64_dec(src, max_len, dst, out_len);
+
+    default:
+        return bhd_hex_dec(src, max_len, dst, out_len);
+    }
+}
+
+/**
+ * Sets the encoding of byte strings read by bhd_process_json_hex_string() and
+ * the functions built on it.
+ */
+void
+bhd_json_set_data_enc(int data_enc)
+{
+    bhd_json_cur_data_enc = data_enc;
+}
+
 uint8_t *
 bhd_process_json_hex_string(const cJSON *item, int max_len,
                             uint8_t *dst, int *out_dst_len, int *rc)
@@ -391,7 +163,8 @@ bhd_process_json_hex_string(const cJSON *item, int max_len,
     valstr = bhd_process_json_string(item, rc);
     switch (*rc) {
     case 0:
-        *rc = parse_arg_byte_stream(valstr, max_len, dst, out_dst_len);
+        *rc = bhd_data_dec(bhd_json_cur_data_enc, valstr, max_len, dst,
+                           out_dst_len);
         return dst;
 
     case SYS_ENOENT:
@@ -858,6 +631,18 @@ bhd_json_kv(bhd_kv_parse_fn *parse_cb,
     }
 }
 
+int
+bhd_json_msg_fmt(const cJSON *parent, const char *name, int *rc)
+{
+    return bhd_json_kv(bhd_msg_fmt_parse, parent, name, rc);
+}
+
+int
+bhd_json_data_enc(const cJSON *parent, const char *name, int *rc)
+{
+    return bhd_json_kv(bhd_data_enc_parse, parent, name, rc);
+}
+
 int
 bhd_json_addr_type(const cJSON *parent, const char *name, int *rc)
 {
@@ -914,43 +699,25 @@ bhd_json_addr(const cJSON *parent, const char *name, uint8_t *dst, int *rc)
     return bhd_process_json_addr(item, dst, rc);
 }
 
-ble_uuid_t *
-bhd_process_json_uuid(const cJSON *item, ble_uuid_any_t *dst, int *status)
+/**
+ * Parses a 128-bit UUID string of the form
+ * "00001101-0000-1000-8000-00805f9b34fb".
+ */
+int
+bhd_uuid_str_parse(const char *valstr, ble_uuid_any_t *dst)
 {
     unsigned long ul;
-    const char *srcptr;
-    uint16_t u16;
     uint8_t *dstptr;
-    char *valstr;
     char *endptr;
     char buf[3];
     int vallen;
-    int rc;
     int i;
 
-    /* First, try a 16-bit UUID. */
-    u16 = bhd_process_json_int_bounds(item, 1, 0xffff, &rc);
-    if (rc == 0) {
-        dst->u.type = BLE_UUID_TYPE_16;
-        dst->u16.value = u16;
-        *status = 0;
-        return &dst->u;
-    }
-
-    /* Next try a 128-bit UUID. */
-    /* 00001101-0000-1000-8000-00805f9b34fb */
-    valstr = bhd_process_json_string(item, status);
-    if (*status != 0) {
-        return NULL;
-    }
-
     vallen = strlen(valstr);
     if (vallen < BLE_UUID_STR_LEN - 1) {
-        *status = SYS_ERANGE;
-        return NULL;
+        return SYS_ERANGE;
     }
 
-    srcptr = valstr;
     dstptr = dst->u128.value + 15;
     i = 0;
     while (i < 36) {
@@ -959,22 +726,20 @@ bhd_process_json_uuid(const cJSON *item, ble_uuid_any_t *dst, int *status)
         case 13:
         case 18:
         case 23:
-            if (srcptr[i] != '-') {
-                *status = SYS_ERANGE;
-                return NULL;
+            if (valstr[i] != '-') {
+                return SYS_ERANGE;
             }
             i++;
             break;
 
         default:
-            buf[0] = srcptr[i + 0];
-            buf[1] = srcptr[i + 1];
+            buf[0] = valstr[i + 0];
+            buf[1] = valstr[i + 1];
             buf[2] = '\0';
 
             ul = strtoul(buf, &endptr, 16);
             if (*endptr != '\0') {
-                *status = SYS_ERANGE;
-                return NULL;
+                return SYS_ERANGE;
             }
             *dstptr = ul;
 
@@ -985,7 +750,36 @@ bhd_process_json_uuid(const cJSON *item, ble_uuid_any_t *dst, int *status)
     }
 
     dst->u.type = BLE_UUID_TYPE_128;
-    *status = 0;
+    return 0;
+}
+
+ble_uuid_t *
+bhd_process_json_uuid(const cJSON *item, ble_uuid_any_t *dst, int *status)
+{
+    uint16_t u16;
+    char *valstr;
+    int rc;
+
+    /* First, try a 16-bit UUID. */
+    u16 = bhd_process_json_int_bounds(item, 1, 0xffff, &rc);
+    if (rc == 0) {
+        dst->u.type = BLE_UUID_TYPE_16;
+        dst->u16.value = u16;
+        *status = 0;
+        return &dst->u;
+    }
+
+    /* Next try a 128-bit UUID. */
+    valstr = bhd_process_json_string(item, status);
+    if (*status != 0) {
+        return NULL;
+    }
+
+    *status = bhd_uuid_str_parse(valstr, dst);
+    if (*status != 0) {
+        return NULL;
+    }
+
     return &dst->u;
 }
 
@@ -1040,6 +834,7 @@ bhd_json_chr(cJSON *parent, struct bhd_chr *out_chr, char **out_err)
     cJSON *item;
     cJSON *arr;
     int rc;
+    int di;
 
     *out_chr = (struct bhd_chr){{{0}}};
 
@@ -1069,12 +864,13 @@ bhd_json_chr(cJSON *parent, struct bhd_chr *out_chr, char **out_err)
         out_chr->dscs = malloc_success(
             out_chr->num_dscs * sizeof *out_chr->dscs);
 
+        di = 0;
         cJSON_ArrayForEach(item, arr) {
-            rc = bhd_json_dsc(item, out_chr->dscs + out_chr->num_dscs,
-                              out_err);
+            rc = bhd_json_dsc(item, out_chr->dscs + di, out_err);
             if (rc != 0) {
                 return rc;
             }
+            di++;
         }
         break;
 
@@ -1164,271 +960,33 @@ bhd_json_create_byte_string(const uint8_t *data, int len)
 
     assert(len >= 0);
 
-    max_len = len * 5 + 1; /* 0xXX: */
+    max_len = len * BHD_HEX_CHARS_PER_BYTE + 1;
 
     buf = malloc_success(max_len);
 
-    bhd_hex_str(buf, max_len, NULL, data, len);
+    buf[bhd_hex_enc(buf, data, len)] = '\0';
     item = cJSON_CreateString(buf);
 
     free(buf);
     return item;
 }
 
-cJSON *
-bhd_json_add_object(cJSON *parent, const char *name)
-{
-    struct cJSON *item;
-
-    item = cJSON_CreateObject();
-    if (item == NULL) {
-        return NULL;
-    }
-    cJSON_AddItemToObject(parent, name, item);
-    return item;
-}
-
-void
-bhd_json_add_bytes(cJSON *parent, const char *name, const uint8_t *data,
-                   int len)
-{
-    cJSON *item;
-
-    item = bhd_json_create_byte_string(data, len);
-    cJSON_AddItemToObject(parent, name, item);
-}
-
-cJSON *
-bhd_json_create_uuid(const ble_uuid_t *uuid)
-{
-    char valstr[BLE_UUID_STR_LEN];
-
-    switch (uuid->type) {
-    case BLE_UUID_TYPE_16:
-        return cJSON_CreateNumber(BLE_UUID16(uuid)->value);
-    case BLE_UUID_TYPE_32:
-        return cJSON_CreateNumber(BLE_UUID32(uuid)->value);
-    case BLE_UUID_TYPE_128:
-        return cJSON_CreateString(ble_uuid_to_str(uuid, valstr));
-    default:
-        assert(0);
-        return NULL;
-    }
-}
-
-cJSON *
-bhd_json_create_uuid128_bytes(const uint8_t uuid128_bytes[16])
-{
-    ble_uuid128_t uuid128;
-
-    uuid128.u.type = BLE_UUID_TYPE_128;
-    memcpy(uuid128.value, uuid128_bytes, sizeof uuid128.value);
-
-    return bhd_json_create_uuid(&uuid128.u);
-}
-
-void
-bhd_json_add_uuid(cJSON *parent, const char *name, const ble_uuid_t *uuid)
-{
-    cJSON *item;
-
-    item = bhd_json_create_uuid(uuid);
-    cJSON_AddItemToObject(parent, name, item);
-}
-
-cJSON *
-bhd_json_create_addr(const uint8_t *addr)
-{
-    char valstr[18];
-
-    return cJSON_CreateString(bhd_addr_str(valstr, addr));
-}
-
-int
-bhd_json_add_addr(cJSON *parent, const char *name, const uint8_t *addr)
-{
-    cJSON *item;
-
-    item = bhd_json_create_addr(addr);
-    cJSON_AddItemToObject(parent, name, item);
-    return 0;
-}
-
-/**
- * This function is necessary to prevent the manifestation of a gcc-5 bug on
- * MacOS (https://gcc.gnu.org/bugzilla/show_bug.cgi?id=66509).
- */
-void
-bhd_json_add_int(cJSON *parent, const char *name, intmax_t val)
-{
-    cJSON *item;
-
-    item = cJSON_CreateNumber(val);
-    cJSON_AddItemToObject(parent, name, item);
-}
-
-void
-bhd_json_add_bool(cJSON *parent, const char *name, int val)
-{
-    cJSON_AddItemToObject(parent, name, cJSON_CreateBool(val));
-}
-
-int
-bhd_json_add_addr_type(cJSON *parent, const char *name, uint8_t addr_type)
-{
-    const char *valstr;
-
-    valstr = bhd_addr_type_rev_parse(addr_type);
-    if (valstr == NULL) {
-        return SYS_EINVAL;
-    }
-
-    cJSON_AddStringToObject(parent, name, valstr);
-    return 0;
-}
-
-int
-bhd_json_add_adv_event_type(cJSON *parent, const char *name,
-                            uint8_t adv_event_type)
-{
-    const char *valstr;
-
-    valstr = bhd_adv_event_type_rev_parse(adv_event_type);
-    if (valstr == NULL) {
-        return SYS_EINVAL;
-    }
-
-    cJSON_AddStringToObject(parent, name, valstr);
-    return 0;
-}
-
-int
-bhd_json_add_gatt_access_op(cJSON *parent, const char *name,
-                            uint8_t gatt_access_op)
-{
-    const char *valstr;
-
-    valstr = bhd_gatt_access_op_rev_parse(gatt_access_op);
-    if (valstr == NULL) {
-        return SYS_EINVAL;
-    }
-
-    cJSON_AddStringToObject(parent, name, valstr);
-    return 0;
-}
-
-int
-bhd_json_add_sm_passkey_action(cJSON *parent, const char *name,
-                               uint8_t sm_passkey_action)
-{
-    const char *valstr;
-
-    valstr = bhd_sm_passkey_action_rev_parse(sm_passkey_action);
-    if (valstr == NULL) {
-        return SYS_EINVAL;
-    }
-
-    cJSON_AddStringToObject(parent, name, valstr);
-    return 0;
-}
-
-cJSON *
-bhd_json_create_commit_dsc(const struct bhd_commit_dsc *dsc)
-{
-    cJSON *item;
-
-    item = cJSON_CreateObject();
-    bhd_json_add_uuid(item, "uuid", &dsc->uuid.u);
-    bhd_json_add_int(item, "handle", dsc->handle);
-
-    return item;
-}
-
-cJSON *
-bhd_json_create_commit_chr(const struct bhd_commit_chr *chr)
-{
-    cJSON *item;
-    cJSON *dscs;
-    cJSON *dsc;
-    int i;
-
-    item = cJSON_CreateObject();
-    bhd_json_add_uuid(item, "uuid", &chr->uuid.u);
-    bhd_json_add_int(item, "def_handle", chr->def_handle);
-    bhd_json_add_int(item, "val_handle", chr->val_handle);
-
-    dscs = cJSON_CreateArray();
-    for (i = 0; i < chr->num_dscs; i++) {
-        dsc = bhd_json_create_commit_dsc(chr->dscs + i);
-        cJSON_AddItemToArray(dscs, dsc);
-    }
-    cJSON_AddItemToObject(item, "descriptors", dscs);
-
-    return item;
-}
-
-cJSON *
-bhd_json_create_commit_svc(const struct bhd_commit_svc *svc)
-{
-    cJSON *item;
-    cJSON *chrs;
-    cJSON *chr;
-    int i;
-
-    item = cJSON_CreateObject();
-    if (item == NULL) {
-        goto err;
-    }
-
-    bhd_json_add_uuid(item, "uuid", &svc->uuid.u);
-    bhd_json_add_int(item, "handle", svc->handle);
-
-    chrs = cJSON_CreateArray();
-    if (chrs == NULL) {
-        goto err;
-    }
-
-    for (i = 0; i < svc->num_chrs; i++) {
-        chr = bhd_json_create_commit_chr(svc->chrs + i);
-        if (chr == NULL) {
-            goto err;
-        }
-
-        cJSON_AddItemToArray(chrs, chr);
-    }
-    cJSON_AddItemToObject(item, "characteristics", chrs);
-
-    return item;
-
-err:
-    cJSON_Delete(item);
-    return NULL;
-}
-
 char *
 bhd_hex_str(char *dst, int max_dst_len, int *out_dst_len, const uint8_t *src,
             int src_len)
 {
-    int rem_len;
     int off;
-    int rc;
-    int i;
 
     off = 0;
-    rem_len = max_dst_len;
 
     if (max_dst_len >= 1) {
-        *dst = '\0';
-    }
-
-    for (i = 0; i < src_len; i++) {
-        rc = snprintf(dst + off, rem_len, "%s0x%02x",
-                      i > 0 ? ":" : "", src[i]);
-        if (rc >= rem_len) {
-            break;
+        /* Only encode as many bytes as fit, including the null terminator. */
+        if (src_len > max_dst_len / BHD_HEX_CHARS_PER_BYTE) {
+            src_len = max_dst_len / BHD_HEX_CHARS_PER_BYTE;
         }
-        off += rc;
-        rem_len -= rc;
+
+        off = bhd_hex_enc(dst, src, src_len);
+        dst[off] = '\0';
     }
 
     if (out_dst_len != NULL) {
@@ -1486,9 +1044,33 @@ bhd_next_evt_seq(void)
     return seq;
 }
 
+/**
+ * Allocates the source for the events of a host procedure started by the
+ * request being processed.  The procedure's callbacks free it once the
+ * procedure is over.
+ */
+struct bhd_evt_src *
+bhd_evt_src_alloc(bhd_seq_t seq)
+{
+    struct bhd_evt_src *src;
+
+    src = malloc_success(sizeof *src);
+    src->seq = seq;
+    src->client_id = blehostd_cur_client_id();
+
+    return src;
+}
+
+void
+bhd_evt_set_src(struct bhd_evt *evt, const struct bhd_evt_src *src)
+{
+    evt->hdr.seq = src->seq;
+    evt->hdr.client_id = src->client_id;
+}
+
 int
-bhd_send_mtu_changed(bhd_seq_t seq, uint16_t conn_handle, int status,
-                     uint16_t mtu)
+bhd_send_mtu_changed(const struct bhd_evt_src *src, uint16_t conn_handle,
+                     int status, uint16_t mtu)
 {
     struct bhd_evt evt;
     int rc;
@@ -1496,7 +1078,7 @@ bhd_send_mtu_changed(bhd_seq_t seq, uint16_t conn_handle, int status,
     memset(&evt, 0, sizeof(evt));
     evt.hdr.op = BHD_MSG_OP_EVT;
     evt.hdr.type = BHD_MSG_TYPE_MTU_CHANGE_EVT;
-    evt.hdr.seq = seq;
+    bhd_evt_set_src(&evt, src);
 
     evt.mtu_change.conn_handle = conn_handle;
     evt.mtu_change.mtu = mtu;
@@ -1559,32 +1141,35 @@ bhd_send_access_evt(bhd_seq_t seq, const struct bhd_access_evt *access)
 char *
 bhd_mbuf_to_s(const struct os_mbuf *om, char *str, size_t maxlen)
 {
-    char *dst;
-    uint8_t byte;
-    size_t remlen;
-    size_t moff;
-    int rc;
+    size_t max_bytes;
+    int off;
+    int len;
 
-    dst = str;
-    remlen = maxlen;
+    if (maxlen == 0) {
+        return str;
+    }
+
+    /* Only encode as many bytes as fit, including the null terminator. */
+    max_bytes = maxlen / BHD_HEX_CHARS_PER_BYTE;
 
-    for (moff = 0; moff < OS_MBUF_PKTLEN(om); moff++) {
-        if (moff != 0) {
-            rc = snprintf(dst, remlen, ":");
-            dst += rc;
-            remlen -= rc;
+    off = 0;
+    for (; om != NULL && max_bytes > 0; om = SLIST_NEXT(om, om_next)) {
+        len = om->om_len;
+        if (len > max_bytes) {
+            len = max_bytes;
         }
-        
-        rc = os_mbuf_copydata(om, moff, 1, &byte);
-        if (rc != 0) {
-            break;
+        if (len == 0) {
+            continue;
         }
 
-        rc = snprintf(dst, remlen, "0x%02x", byte);
-        dst += rc;
-        remlen -= rc;
+        /* Each encoded segment is followed by a separator. */
+        off += bhd_hex_enc(str + off, om->om_data, len) + 1;
+        max_bytes -= len;
     }
 
+    /* Replace the final separator with a null terminator. */
+    str[off == 0 ? 0 : off - 1] = '\0';
+
     return str;
 }
 
@@ -11,12 +11,27 @@
 struct bhd_req;
 struct bhd_rsp;
 struct bhd_evt;
+struct bhd_evt_filter;
 struct bhd_dev;
 struct bhd_connect_req;
+struct bhd_enc;
 struct peer;
 
 typedef uint32_t bhd_seq_t;
 
+/**
+ * Identifies the request that started a host procedure: the seq of the
+ * request and the client that sent it.  Events produced by the procedure
+ * carry both, so they go back to that client even if another client uses
+ * the same seq.
+ */
+struct bhd_evt_src {
+    bhd_seq_t seq;
+
+    /** 0 if no client request started the procedure. */
+    uint16_t client_id;
+};
+
 struct bhd_kv_str_int {
     const char *key;
     int val;
@@ -38,12 +53,36 @@ char *bhd_hex_str(char *dst, int max_dst_len, int *out_dst_len,
 char *bhd_addr_str(char *dst, const uint8_t *addr);
 void *bhd_seq_arg(bhd_seq_t seq);
 
-int bhd_msg_send(cJSON *root);
+int bhd_msg_send(struct os_mbuf *om);
 int bhd_rsp_send(const struct bhd_rsp *rsp);
 int bhd_evt_send(const struct bhd_evt *evt);
-int blehostd_enqueue_rsp(const char *json_rsp);
-int bhd_req_dec(const char *json, struct bhd_rsp *out_rsp);
-int bhd_rsp_enc(const struct bhd_rsp *rsp, cJSON **out_root);
+struct os_mbuf *blehostd_alloc_msg(void);
+int blehostd_enqueue_msg(struct os_mbuf *om);
+int blehostd_enqueue_rsp(struct os_mbuf *om);
+int blehostd_enqueue_msg_id(struct os_mbuf *om, uint32_t *out_id);
+int blehostd_replace_msg(uint32_t id, struct os_mbuf *queued,
+                         struct os_mbuf *om, uint32_t *out_id);
+int blehostd_msg_is_queued(uint32_t id);
+int blehostd_msg_queue_len(void);
+void blehostd_msg_dst_req(struct os_mbuf *om);
+void blehostd_msg_set_recipients(struct os_mbuf *om, uint32_t recipients);
+void blehostd_msg_set_bulk(struct os_mbuf *om);
+uint32_t blehostd_evt_recipients(const struct bhd_evt *evt);
+int blehostd_set_evt_filter(const struct bhd_evt_filter *filter);
+int blehostd_set_client_fmt(int msg_fmt, int data_enc);
+void blehostd_client_fmt(int client_idx, int *out_msg_fmt, int *out_data_enc);
+int blehostd_cur_client_idx(void);
+uint16_t blehostd_cur_client_id(void);
+int blehostd_take_rx_fd(void);
+int blehostd_bulk_open(int fd);
+/** Request priority classes; see bhd_req_prio(). */
+#define BHD_REQ_PRIO_URGENT     0
+#define BHD_REQ_PRIO_NORMAL     1
+
+int bhd_req_prio(const uint8_t *buf, int len);
+int bhd_req_dec(uint8_t *buf, int len, struct bhd_rsp *out_rsp);
+int bhd_rsp_enc(const struct bhd_rsp *rsp, struct bhd_enc *enc);
+int bhd_evt_enc(const struct bhd_evt *evt, struct bhd_enc *enc);
 
 void blehostd_logf(const char *fmt, ...);
 
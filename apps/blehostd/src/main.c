@@ -6,45 +6,264 @@
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "blehostd.h"
 #include "bhd_proto.h"
 #include "bhd_util.h"
 #include "bhd_gatts.h"
+#include "bhd_arena.h"
+#include "bhd_evtq.h"
+#include "bhd_ring.h"
 #include "syscfg/syscfg.h"
 #include "sysinit/sysinit.h"
 #include "os/os.h"
-#include "native_sockets/native_sock.h"
 #include "mcu/native_bsp.h"
-#include "mn_socket/mn_socket.h"
 #include "host/ble_hs.h"
 #include "defs/error.h"
 #include "config/config.h"
+#include "stats/stats.h"
 
 #define BLEHOSTD_STACK_SIZE     (OS_STACK_ALIGN(512))
 #define BLEHOSTD_TASK_PRIO      3
 
 #define BLEHOSTD_MAX_MSG_SZ     10240
 
+/**
+ * In stream mode, each message is preceded by one of two frame headers:
+ *     o Legacy: 16-bit big-endian length, at most BLEHOSTD_MAX_MSG_SZ.
+ *     o Extended: BLEHOSTD_FRAME_MARKER, one version byte, and a 32-bit
+ *       big-endian length, at most BLEHOSTD_MAX_FRAME_SZ.
+ * The marker byte cannot begin a legacy header, a JSON message, or a CBOR
+ * map, so the two are told apart by the first byte.  Outgoing messages use
+ * the legacy header whenever they fit, so existing clients are unaffected.
+ */
+#define BLEHOSTD_FRAME_MARKER   0xff
+#define BLEHOSTD_FRAME_VERSION  1
+#define BLEHOSTD_FRAME_HDR_SZ   6
+#define BLEHOSTD_MAX_FRAME_SZ   MYNEWT_VAL(BLEHOSTD_MAX_FRAME_SZ)
+
+/* Frames are received into, and responses built in, msys mbufs, which the
+ * host stack allocates from as well.  Keep a full-size frame in each
+ * direction well clear of the pool.
+ */
+#if BLEHOSTD_MAX_FRAME_SZ * 4 > \
+    MYNEWT_VAL(MSYS_1_BLOCK_COUNT) * MYNEWT_VAL(MSYS_1_BLOCK_SIZE)
+#error "BLEHOSTD_MAX_FRAME_SZ is too large for the msys pool"
+#endif
+
+#define BLEHOSTD_MAX_CLIENTS    MYNEWT_VAL(BLEHOSTD_MAX_CLIENTS)
+
+#if BLEHOSTD_MAX_CLIENTS > 32
+#error "BLEHOSTD_MAX_CLIENTS must not exceed 32"
+#endif
+
+/** Stored in the user header of each outgoing message. */
+struct blehostd_msg_meta {
+    /** Bit n set means the message goes to blehostd_clients[n]. */
+    uint32_t recipients;
+
+    /**
+     * Whether this is a high-rate event that goes over the bulk channel of
+     * clients that have opened one.
+     */
+    uint8_t bulk;
+
+    /**
+     * ID assigned when the message entered the transmit queue.  Copies moved
+     * to clients' bulk queues keep it.
+     */
+    uint32_t id;
+};
+
+#define BLEHOSTD_MSG_META(om)   ((struct blehostd_msg_meta *)OS_MBUF_USRHDR(om))
+
+/**
+ * Number of bytes at the front of a received request that are examined to
+ * determine its priority.  The type is always near the start.
+ */
+#define BLEHOSTD_REQ_PEEK_SZ    128
+
+/**
+ * Maximum number of normal requests executed from one client's queue before
+ * yielding to other events.
+ */
+#define BLEHOSTD_REQ_BURST      8
+
+/** Maximum number of mbuf segments passed to a single writev() call. */
+#define BLEHOSTD_IOV_MAX        64
+
+/** epoll data value that identifies the listening socket. */
+#define BLEHOSTD_IO_LISTEN      UINT32_MAX
+
+/** Set in the epoll data value of a client's bulk channel. */
+#define BLEHOSTD_IO_BULK        0x10000
+
+/** How often the blehostd task polls the epoll set, in OS ticks. */
+#define BLEHOSTD_IO_POLL_TICKS  1
+
+/** A socket to a client, and the messages being written to it. */
+struct blehostd_chan {
+    /** -1 if the channel is not open. */
+    int fd;
+
+    /**
+     * Outgoing messages that have been gathered into a single chain but not
+     * yet accepted by the socket.
+     */
+    struct os_mbuf *tx_chain;
+    int tx_chain_msgs;
+    int tx_chain_bytes;
+};
+
+struct blehostd_client {
+    /** Carries requests, responses and all events not sent over bulk. */
+    struct blehostd_chan ctl;
+
+    /** 0 if this slot is unused. */
+    uint16_t id;
+
+    /**
+     * Received requests.  Urgent requests (see bhd_req_prio()) wait in
+     * their own queue, and are executed ahead of the normal requests of
+     * every client.
+     */
+    struct os_mqueue req_mq;
+    struct os_mqueue req_urgent_mq;
+
+    /** Unsolicited events that this client wants to receive. */
+    struct bhd_evt_filter evt_filter;
+
+    /**
+     * Wire format of messages sent to this client and its default byte
+     * string encoding (BHD_MSG_FMT_[...], BHD_DATA_ENC_[...]); selected
+     * via sync.  Zero (JSON, hex) until then.
+     */
+    int msg_fmt;
+    int data_enc;
+
+    /** Partially received request. */
+    struct os_mbuf *rx_packet;
+    uint32_t rx_packet_len;
+
+    /** Time that data was last read from the socket, in microseconds. */
+    uint64_t rx_time_us;
+
+    /**
+     * Descriptor most recently passed by the client (SCM_RIGHTS), waiting
+     * to be claimed by the request it accompanied; -1 if none.
+     */
+    int rx_fd;
+
+    /**
+     * Optional second socket for high-rate events (scan, notify_rx and
+     * access), opened with a bulk_open request.  Bulk events wait in
+     * bulk_q rather than in the shared transmit queue, so a slow bulk
+     * channel never holds up control traffic.
+     */
+    struct blehostd_chan bulk;
+    STAILQ_HEAD(, os_mbuf_pkthdr) bulk_q;
+    int bulk_q_len;
+};
+
 static FILE *blehostd_log_file;
 
 static struct os_task blehostd_task;
 static os_stack_t blehostd_stack[BLEHOSTD_STACK_SIZE];
 
 static struct os_eventq blehostd_evq;
-static struct os_mqueue blehostd_req_mq;
 static struct os_mqueue blehostd_rsp_mq;
 
-static struct mn_sockaddr_un blehostd_server_addr;
-static struct mn_socket *blehostd_socket;
+/**
+ * Responses.  These are sent ahead of anything waiting in blehostd_rsp_mq,
+ * so a client never waits for its answer behind a backlog of events.
+ */
+static struct os_mqueue blehostd_prio_mq;
+
+static struct sockaddr_un blehostd_server_addr;
+
+/** Accepts client connections; only used in listening mode (-l). */
+static int blehostd_listen_fd = -1;
+static int blehostd_listen_mode;
+
+/**
+ * Packet mode (-p): clients connect with SOCK_SEQPACKET rather than
+ * SOCK_STREAM.  Each datagram carries exactly one message, so messages are
+ * sent without a length header and never need to be reassembled.
+ */
+static int blehostd_packet_mode;
+
+/**
+ * All sockets are registered with one epoll set, which blehostd_io_callout
+ * polls without blocking every BLEHOSTD_IO_POLL_TICKS.  Nothing outside the
+ * OS can wake a task in the sim (MCU_NATIVE_USE_SIGNALS is off, so nothing
+ * keeps a signal handler out of a critical section), so this poll is the
+ * only way readiness reaches the blehostd task.  Each socket is registered
+ * with EPOLLONESHOT and re-armed once it has been serviced; writability is
+ * only watched while a transmit chain is pending.
+ */
+static int blehostd_epoll_fd = -1;
+static struct os_callout blehostd_io_callout;
 
 static const char *blehostd_socket_filename;
 static const char *blehostd_dev_filename;
 
-static struct os_mbuf *blehostd_packet;
-static uint16_t blehostd_packet_len;
+static struct blehostd_client blehostd_clients[BLEHOSTD_MAX_CLIENTS];
+
+/** Requests are decoded in place; one extra byte for a null terminator. */
+static uint8_t blehostd_req_buf[BLEHOSTD_MAX_MSG_SZ + 1];
+static uint16_t blehostd_next_client_id;
+
+/** The client whose request is currently being processed, if any. */
+static struct blehostd_client *blehostd_cur_client;
+
+/**
+ * Every queued outgoing message is assigned an ID from a running counter.
+ * Messages leave the transmit queue in order, so a message is still in it if
+ * and only if its ID is not less than the number of messages dequeued so
+ * far.  Bulk events that have moved on to clients' bulk queues are looked up
+ * by the ID in their metadata instead.
+ */
+static uint32_t blehostd_rsp_mq_num_enqueued;
+static uint32_t blehostd_rsp_mq_num_dequeued;
+
+/** Total number of messages waiting in all clients' bulk queues. */
+static int blehostd_bulk_q_total;
+
+STATS_SECT_START(blehostd_stats)
+    STATS_SECT_ENTRY(io_wakeups)
+    STATS_SECT_ENTRY(reqs)
+    STATS_SECT_ENTRY(req_lat_us_sum)
+    STATS_SECT_ENTRY(req_lat_us_max)
+    STATS_SECT_ENTRY(tx_flushes)
+    STATS_SECT_ENTRY(tx_msgs)
+    STATS_SECT_ENTRY(tx_bytes)
+    STATS_SECT_ENTRY(tx_eagain)
+    STATS_SECT_ENTRY(tx_flush_1)
+    STATS_SECT_ENTRY(tx_flush_2_4)
+    STATS_SECT_ENTRY(tx_flush_5_16)
+    STATS_SECT_ENTRY(tx_flush_17_plus)
+STATS_SECT_END
+static STATS_SECT_DECL(blehostd_stats) blehostd_stats;
+
+STATS_NAME_START(blehostd_stats)
+    STATS_NAME(blehostd_stats, io_wakeups)
+    STATS_NAME(blehostd_stats, reqs)
+    STATS_NAME(blehostd_stats, req_lat_us_sum)
+    STATS_NAME(blehostd_stats, req_lat_us_max)
+    STATS_NAME(blehostd_stats, tx_flushes)
+    STATS_NAME(blehostd_stats, tx_msgs)
+    STATS_NAME(blehostd_stats, tx_bytes)
+    STATS_NAME(blehostd_stats, tx_eagain)
+    STATS_NAME(blehostd_stats, tx_flush_1)
+    STATS_NAME(blehostd_stats, tx_flush_2_4)
+    STATS_NAME(blehostd_stats, tx_flush_5_16)
+    STATS_NAME(blehostd_stats, tx_flush_17_plus)
+STATS_NAME_END(blehostd_stats)
 
 void
 blehostd_logf(const char *fmt, ...)
@@ -62,258 +281,1983 @@ blehostd_logf(const char *fmt, ...)
 
     off = 0;
 
-	va_start(args, fmt);
+	va_start(args, fmt);
+
+    if (!midline) {
+        time(&tt);
+        ts = ctime(&tt);
+        if (ts != NULL) {
+            ts[24] = '\0';
+            off += snprintf(buf + off, sizeof buf - off, "%s    ", ts);
+        }
+    }
+
+    off += vsnprintf(buf + off, sizeof buf - off, fmt, args);
+    va_end(args);
+
+    if (off <= sizeof buf) {
+        midline = buf[off - 1] != '\n';
+    }
+
+    fputs(buf, blehostd_log_file);
+}
+
+static void
+blehostd_log_mbuf(const struct os_mbuf *om)
+{
+    uint8_t u8;
+    int rc;
+    int i;
+
+    if (MYNEWT_VAL(LOG_LEVEL) > LOG_LEVEL_DEBUG) {
+        return;
+    }
+
+    for (i = 0; i < OS_MBUF_PKTLEN(om); i++) {
+        rc = os_mbuf_copydata(om, i, 1, &u8);
+        assert(rc == 0);
+        BHD_LOG(DEBUG, "%s0x%02x", i == 0 ? "" : " ", u8);
+    }
+    BHD_LOG(DEBUG, "\n");
+}
+
+static struct blehostd_client *
+blehostd_client_find(uint16_t client_id)
+{
+    int i;
+
+    if (client_id == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (blehostd_clients[i].id == client_id) {
+            return blehostd_clients + i;
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t
+blehostd_client_bit(const struct blehostd_client *client)
+{
+    return 1UL << (client - blehostd_clients);
+}
+
+/**
+ * Retrieves the set of connected clients.
+ */
+static uint32_t
+blehostd_client_mask(void)
+{
+    uint32_t mask;
+    int i;
+
+    mask = 0;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (blehostd_clients[i].id != 0) {
+            mask |= 1UL << i;
+        }
+    }
+
+    return mask;
+}
+
+/**
+ * Allocates an mbuf for an outgoing message.  Unless in packet mode, space
+ * for the frame header is reserved at the front; the caller appends the
+ * message body.  The message
+ * is addressed to all connected clients until blehostd_msg_dst_req() or
+ * blehostd_msg_set_recipients() is called.
+ */
+struct os_mbuf *
+blehostd_alloc_msg(void)
+{
+    struct os_mbuf *om;
+
+    om = os_msys_get_pkthdr(0, sizeof (struct blehostd_msg_meta));
+    if (om == NULL) {
+        return NULL;
+    }
+
+    if (!blehostd_packet_mode &&
+        os_mbuf_extend(om, BLEHOSTD_FRAME_HDR_SZ) == NULL) {
+
+        os_mbuf_free_chain(om);
+        return NULL;
+    }
+
+    BLEHOSTD_MSG_META(om)->recipients = blehostd_client_mask();
+    BLEHOSTD_MSG_META(om)->bulk = 0;
+
+    return om;
+}
+
+/**
+ * Addresses an outgoing message to the client whose request is being
+ * processed.
+ */
+void
+blehostd_msg_dst_req(struct os_mbuf *om)
+{
+    if (blehostd_cur_client != NULL) {
+        BLEHOSTD_MSG_META(om)->recipients =
+            blehostd_client_bit(blehostd_cur_client);
+    }
+}
+
+/**
+ * Addresses an outgoing message to the specified set of clients, as
+ * returned by blehostd_evt_recipients().
+ */
+void
+blehostd_msg_set_recipients(struct os_mbuf *om, uint32_t recipients)
+{
+    BLEHOSTD_MSG_META(om)->recipients = recipients;
+}
+
+/**
+ * Determines which clients an event should be sent to.  An event produced
+ * by a client's request only goes to that client; the (client, seq) pair
+ * travels with the event, so clients that happen to use the same seq do
+ * not see each other's events.  Any other event, or one whose client has
+ * since disconnected, goes to every client whose event filter matches it.
+ *
+ * @return                      A set of clients; 0 if no client wants the
+ *                                  event.
+ */
+uint32_t
+blehostd_evt_recipients(const struct bhd_evt *evt)
+{
+    const struct blehostd_client *client;
+    uint32_t mask;
+    int i;
+
+    if (evt->hdr.client_id != 0 && evt->hdr.seq < BHD_SEQ_EVT_MIN) {
+        client = blehostd_client_find(evt->hdr.client_id);
+        if (client != NULL) {
+            return blehostd_client_bit(client);
+        }
+    }
+
+    mask = 0;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        client = blehostd_clients + i;
+        if (client->id != 0 && bhd_evtq_match(&client->evt_filter, evt)) {
+            mask |= 1UL << i;
+        }
+    }
+
+    return mask;
+}
+
+/**
+ * Replaces the event filter of the client whose request is being processed.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if no request is being processed.
+ */
+int
+blehostd_set_evt_filter(const struct bhd_evt_filter *filter)
+{
+    if (blehostd_cur_client == NULL) {
+        return SYS_ENOENT;
+    }
+
+    blehostd_cur_client->evt_filter = *filter;
+    return 0;
+}
+
+/**
+ * Selects the message format and default data encoding of the client whose
+ * request is being processed.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if no request is being processed.
+ */
+int
+blehostd_set_client_fmt(int msg_fmt, int data_enc)
+{
+    if (blehostd_cur_client == NULL) {
+        return SYS_ENOENT;
+    }
+
+    blehostd_cur_client->msg_fmt = msg_fmt;
+    blehostd_cur_client->data_enc = data_enc;
+    return 0;
+}
+
+/**
+ * Retrieves the message format and default data encoding of the client in
+ * the specified slot.  A negative index yields the defaults.
+ */
+void
+blehostd_client_fmt(int client_idx, int *out_msg_fmt, int *out_data_enc)
+{
+    const struct blehostd_client *client;
+
+    if (client_idx < 0 || client_idx >= BLEHOSTD_MAX_CLIENTS) {
+        *out_msg_fmt = BHD_MSG_FMT_JSON;
+        *out_data_enc = BHD_DATA_ENC_HEX;
+        return;
+    }
+
+    client = blehostd_clients + client_idx;
+    *out_msg_fmt = client->msg_fmt;
+    *out_data_enc = client->data_enc;
+}
+
+/**
+ * Retrieves the slot index of the client whose request is being processed;
+ * -1 if no request is being processed.
+ */
+int
+blehostd_cur_client_idx(void)
+{
+    if (blehostd_cur_client == NULL) {
+        return -1;
+    }
+
+    return blehostd_cur_client - blehostd_clients;
+}
+
+/**
+ * Retrieves the ID of the client whose request is being processed; 0 if no
+ * request is being processed.
+ */
+uint16_t
+blehostd_cur_client_id(void)
+{
+    if (blehostd_cur_client == NULL) {
+        return 0;
+    }
+
+    return blehostd_cur_client->id;
+}
+
+/**
+ * Takes ownership of the descriptor that the requesting client passed along
+ * with its request.
+ *
+ * @return                      The descriptor on success;
+ *                              -1 if the client did not pass one.
+ */
+int
+blehostd_take_rx_fd(void)
+{
+    int fd;
+
+    if (blehostd_cur_client == NULL) {
+        return -1;
+    }
+
+    fd = blehostd_cur_client->rx_fd;
+    blehostd_cur_client->rx_fd = -1;
+    return fd;
+}
+
+/**
+ * Marks an outgoing message as a bulk event.  Clients that have opened a bulk
+ * channel receive it there instead of over their control channel.
+ */
+void
+blehostd_msg_set_bulk(struct os_mbuf *om)
+{
+    BLEHOSTD_MSG_META(om)->bulk = 1;
+}
+
+/**
+ * Fills in the frame header of an outgoing message.  The legacy header is
+ * used if the message fits; otherwise, the extended header.
+ */
+static int
+blehostd_fill_msg_len(struct os_mbuf *om)
+{
+    uint8_t hdr[BLEHOSTD_FRAME_HDR_SZ];
+    uint16_t len16;
+    uint32_t len32;
+    uint32_t len;
+    int rc;
+
+    if (blehostd_packet_mode) {
+        /* The datagram boundary delimits the message. */
+        return 0;
+    }
+
+    len = OS_MBUF_PKTLEN(om) - BLEHOSTD_FRAME_HDR_SZ;
+    if (len > BLEHOSTD_MAX_FRAME_SZ) {
+        return SYS_EINVAL;
+    }
+
+    if (len <= BLEHOSTD_MAX_MSG_SZ) {
+        /* Trim the unused part of the reserved header. */
+        os_mbuf_adj(om, BLEHOSTD_FRAME_HDR_SZ - sizeof len16);
+
+        len16 = htons(len);
+        rc = os_mbuf_copyinto(om, 0, &len16, sizeof len16);
+    } else {
+        len32 = htonl(len);
+        hdr[0] = BLEHOSTD_FRAME_MARKER;
+        hdr[1] = BLEHOSTD_FRAME_VERSION;
+        memcpy(hdr + 2, &len32, sizeof len32);
+
+        rc = os_mbuf_copyinto(om, 0, hdr, sizeof hdr);
+    }
+    if (rc != 0) {
+        return SYS_ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * Fills in the length header of a message allocated with
+ * blehostd_alloc_msg() and queues it for transmit.  The mbuf is consumed
+ * whether or not this function succeeds.
+ *
+ * @param out_id                On success, the ID assigned to the queued
+ *                                  message gets written here.  Pass NULL if
+ *                                  you don't need this information.
+ */
+int
+blehostd_enqueue_msg_id(struct os_mbuf *om, uint32_t *out_id)
+{
+    os_sr_t sr;
+    int rc;
+
+    rc = blehostd_fill_msg_len(om);
+    if (rc != 0) {
+        os_mbuf_free_chain(om);
+        return rc;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+
+    BLEHOSTD_MSG_META(om)->id = blehostd_rsp_mq_num_enqueued;
+    if (out_id != NULL) {
+        *out_id = blehostd_rsp_mq_num_enqueued;
+    }
+    blehostd_rsp_mq_num_enqueued++;
+
+    rc = os_mqueue_put(&blehostd_rsp_mq, &blehostd_evq, om);
+    assert(rc == 0);
+
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+int
+blehostd_enqueue_msg(struct os_mbuf *om)
+{
+    return blehostd_enqueue_msg_id(om, NULL);
+}
+
+/**
+ * Queues a response for transmit ahead of all queued events.  The mbuf is
+ * consumed whether or not this function succeeds.
+ */
+int
+blehostd_enqueue_rsp(struct os_mbuf *om)
+{
+    os_sr_t sr;
+    int rc;
+
+    rc = blehostd_fill_msg_len(om);
+    if (rc != 0) {
+        os_mbuf_free_chain(om);
+        return rc;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    rc = os_mqueue_put(&blehostd_prio_mq, &blehostd_evq, om);
+    assert(rc == 0);
+    OS_EXIT_CRITICAL(sr);
+
+    return 0;
+}
+
+/**
+ * Indicates whether the message with the specified ID is still waiting in
+ * the transmit queue proper, i.e., has not yet been sent or moved to a bulk
+ * queue.
+ */
+static int
+blehostd_rsp_mq_has_msg(uint32_t id)
+{
+    return (int32_t)(id - blehostd_rsp_mq_num_dequeued) >= 0 &&
+           (int32_t)(blehostd_rsp_mq_num_enqueued - id) > 0;
+}
+
+/**
+ * Overwrites the contents of a queued message with those of another, keeping
+ * its place in its queue.  The source message is not consumed.
+ */
+static int
+blehostd_msg_overwrite(struct os_mbuf *queued, struct os_mbuf *om)
+{
+    int old_len;
+    int rc;
+
+    old_len = OS_MBUF_PKTLEN(queued);
+    rc = os_mbuf_appendfrom(queued, om, 0, OS_MBUF_PKTLEN(om));
+    if (rc != 0) {
+        /* Restore the original message. */
+        os_mbuf_adj(queued, old_len - OS_MBUF_PKTLEN(queued));
+        return SYS_ENOMEM;
+    }
+    os_mbuf_adj(queued, old_len);
+
+    return 0;
+}
+
+/**
+ * Finds the first copy of the message with the specified ID that is waiting
+ * in a client's bulk queue.  Must be called in a critical section.
+ *
+ * @return                      The copy on success; NULL if there is none.
+ */
+static struct os_mbuf *
+blehostd_bulk_find_msg(uint32_t id)
+{
+    struct os_mbuf_pkthdr *omp;
+    int i;
+
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        STAILQ_FOREACH(omp, &blehostd_clients[i].bulk_q, omp_next) {
+            if (BLEHOSTD_MSG_META(OS_MBUF_PKTHDR_TO_MBUF(omp))->id == id) {
+                return OS_MBUF_PKTHDR_TO_MBUF(omp);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Replaces the contents of a message that is still waiting to be sent,
+ * keeping its place in the queue.  If the message has moved to clients' bulk
+ * queues, every copy is replaced.  If the message has already been sent, or
+ * if the new message has different recipients or is not the same kind of
+ * event (bulk or not), the new message is queued at the back instead.  The
+ * mbuf is consumed whether or not this function succeeds.
+ *
+ * @param id                    The ID of the message to replace.
+ * @param queued                The queued message to replace.  Only
+ *                                  dereferenced while the message is still
+ *                                  in the transmit queue.
+ * @param om                    The new message, allocated with
+ *                                  blehostd_alloc_msg().
+ * @param out_id                On success, the ID of the message that now
+ *                                  holds the new contents.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOMEM if a copy could not be
+ *                                  overwritten; any other copies hold the
+ *                                  new contents.
+ */
+int
+blehostd_replace_msg(uint32_t id, struct os_mbuf *queued, struct os_mbuf *om,
+                     uint32_t *out_id)
+{
+    struct blehostd_msg_meta *old_meta;
+    struct blehostd_msg_meta *new_meta;
+    struct os_mbuf_pkthdr *omp;
+    struct os_mbuf *first;
+    os_sr_t sr;
+    int rc;
+    int i;
+
+    OS_ENTER_CRITICAL(sr);
+
+    if (blehostd_rsp_mq_has_msg(id)) {
+        first = queued;
+    } else {
+        first = blehostd_bulk_find_msg(id);
+    }
+
+    /* Overwriting in place keeps the old message's metadata, so only do it
+     * if the new message would be routed the same way.
+     */
+    if (first != NULL) {
+        old_meta = BLEHOSTD_MSG_META(first);
+        new_meta = BLEHOSTD_MSG_META(om);
+        if (old_meta->recipients != new_meta->recipients ||
+            old_meta->bulk != new_meta->bulk) {
+
+            first = NULL;
+        }
+    }
+
+    if (first == NULL) {
+        OS_EXIT_CRITICAL(sr);
+        return blehostd_enqueue_msg_id(om, out_id);
+    }
+
+    rc = blehostd_fill_msg_len(om);
+    if (rc != 0) {
+        goto done;
+    }
+
+    if (blehostd_rsp_mq_has_msg(id)) {
+        rc = blehostd_msg_overwrite(queued, om);
+    } else {
+        for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+            STAILQ_FOREACH(omp, &blehostd_clients[i].bulk_q, omp_next) {
+                if (BLEHOSTD_MSG_META(OS_MBUF_PKTHDR_TO_MBUF(omp))->id == id &&
+                    blehostd_msg_overwrite(OS_MBUF_PKTHDR_TO_MBUF(omp),
+                                           om) != 0) {
+
+                    rc = SYS_ENOMEM;
+                }
+            }
+        }
+    }
+    if (rc != 0) {
+        goto done;
+    }
+
+    *out_id = id;
+
+done:
+    OS_EXIT_CRITICAL(sr);
+    os_mbuf_free_chain(om);
+    return rc;
+}
+
+/**
+ * Indicates whether the message with the specified ID is still waiting to be
+ * sent, either in the transmit queue or, for a bulk event, in any client's
+ * bulk queue.
+ */
+int
+blehostd_msg_is_queued(uint32_t id)
+{
+    os_sr_t sr;
+    int found;
+
+    if (blehostd_rsp_mq_has_msg(id)) {
+        return 1;
+    }
+
+    /* Only IDs that have been assigned can be in a bulk queue. */
+    if ((int32_t)(blehostd_rsp_mq_num_enqueued - id) <= 0 ||
+        blehostd_bulk_q_total == 0) {
+
+        return 0;
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    found = blehostd_bulk_find_msg(id) != NULL;
+    OS_EXIT_CRITICAL(sr);
+
+    return found;
+}
+
+/**
+ * Retrieves the number of messages waiting in the transmit queue, including
+ * bulk events waiting for clients' bulk channels.  Responses are not
+ * counted; they are few, and are never subject to event flow control.
+ */
+int
+blehostd_msg_queue_len(void)
+{
+    return blehostd_rsp_mq_num_enqueued - blehostd_rsp_mq_num_dequeued +
+           blehostd_bulk_q_total;
+}
+
+/**
+ * Retrieves the recipients of the message at the front of a transmit
+ * queue, and whether it is a bulk event.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if the queue is empty.
+ */
+static int
+blehostd_tx_mq_peek(struct os_mqueue *mq, uint32_t *out_recipients,
+                    int *out_bulk)
+{
+    struct blehostd_msg_meta *meta;
+    struct os_mbuf_pkthdr *omp;
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    omp = STAILQ_FIRST(&mq->mq_head);
+    if (omp != NULL) {
+        meta = BLEHOSTD_MSG_META(OS_MBUF_PKTHDR_TO_MBUF(omp));
+        *out_recipients = meta->recipients;
+        *out_bulk = meta->bulk;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return omp == NULL ? SYS_ENOENT : 0;
+}
+
+/**
+ * Removes consecutive messages with the same recipients from the front of
+ * a transmit queue, and chains them together until the chain reaches the
+ * BLEHOSTD_TX_GATHER_SZ byte budget.  A message that is larger than the
+ * budget by itself is sent alone.  In packet mode, each message is its own
+ * datagram, so only one message is removed.
+ *
+ * @param split_bulk            Whether each bulk event must be removed by
+ *                                  itself, so that it can be routed to bulk
+ *                                  channels.
+ */
+static struct os_mbuf *
+blehostd_gather_rsps(struct os_mqueue *mq, uint32_t recipients,
+                     int split_bulk, int *out_num_msgs)
+{
+    struct os_mbuf_pkthdr *omp;
+    struct os_mbuf *chain;
+    struct os_mbuf *om;
+    os_sr_t sr;
+
+    chain = NULL;
+    *out_num_msgs = 0;
+
+    while (1) {
+        OS_ENTER_CRITICAL(sr);
+        omp = STAILQ_FIRST(&mq->mq_head);
+        OS_EXIT_CRITICAL(sr);
+
+        if (omp == NULL) {
+            break;
+        }
+
+        om = OS_MBUF_PKTHDR_TO_MBUF(omp);
+        if (BLEHOSTD_MSG_META(om)->recipients != recipients) {
+            break;
+        }
+
+        if (chain != NULL &&
+            (blehostd_packet_mode ||
+             (split_bulk && (BLEHOSTD_MSG_META(chain)->bulk ||
+                             BLEHOSTD_MSG_META(om)->bulk)) ||
+             OS_MBUF_PKTLEN(chain) + omp->omp_len >
+                MYNEWT_VAL(BLEHOSTD_TX_GATHER_SZ))) {
+
+            break;
+        }
+
+        om = os_mqueue_get(mq);
+        assert(om == OS_MBUF_PKTHDR_TO_MBUF(omp));
+        if (mq == &blehostd_rsp_mq) {
+            blehostd_rsp_mq_num_dequeued++;
+        }
+
+        BHD_LOG(DEBUG, "Sending %d bytes\n", OS_MBUF_PKTLEN(om));
+        blehostd_log_mbuf(om);
+
+        if (chain == NULL) {
+            chain = om;
+        } else {
+            os_mbuf_concat(chain, om);
+        }
+        (*out_num_msgs)++;
+    }
+
+    return chain;
+}
+
+static void
+blehostd_count_flush(int num_msgs, int num_bytes)
+{
+    STATS_INC(blehostd_stats, tx_flushes);
+    STATS_INCN(blehostd_stats, tx_msgs, num_msgs);
+    STATS_INCN(blehostd_stats, tx_bytes, num_bytes);
+
+    if (num_msgs <= 1) {
+        STATS_INC(blehostd_stats, tx_flush_1);
+    } else if (num_msgs <= 4) {
+        STATS_INC(blehostd_stats, tx_flush_2_4);
+    } else if (num_msgs <= 16) {
+        STATS_INC(blehostd_stats, tx_flush_5_16);
+    } else {
+        STATS_INC(blehostd_stats, tx_flush_17_plus);
+    }
+}
+
+static uint64_t
+blehostd_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Re-registers one of a client's sockets with the epoll set after it has
+ * been serviced.  Writability is only watched while a transmit chain is
+ * pending.
+ */
+static void
+blehostd_io_arm(const struct blehostd_client *client,
+                const struct blehostd_chan *chan)
+{
+    struct epoll_event ev;
+    int rc;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    if (chan->tx_chain != NULL) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u32 = client - blehostd_clients;
+    if (chan == &client->bulk) {
+        ev.data.u32 |= BLEHOSTD_IO_BULK;
+    }
+
+    rc = epoll_ctl(blehostd_epoll_fd, EPOLL_CTL_MOD, chan->fd, &ev);
+    if (rc != 0) {
+        BHD_LOG(ERROR, "epoll_ctl() failed; client=%d errno=%d\n",
+                client->id, errno);
+    }
+}
+
+static void blehostd_client_close(struct blehostd_client *client);
+static void blehostd_bulk_close(struct blehostd_client *client);
+
+/**
+ * Writes as much of a channel's pending transmit chain to its socket as the
+ * socket accepts, with one writev() per BLEHOSTD_IOV_MAX mbuf segments.  If
+ * the socket fills up, the unwritten remainder stays queued (possibly
+ * starting part way through a message) and the socket is watched for
+ * writability again.  A write error closes the channel;
+ * for the control channel, this means the whole client.
+ *
+ * @return                      0 if the chain was sent or the channel went
+ *                                  away;
+ *                              SYS_EAGAIN if the socket cannot accommodate
+ *                                  the rest of the chain yet.
+ */
+static int
+blehostd_chan_flush(struct blehostd_client *client, struct blehostd_chan *chan)
+{
+    /* Too large for the task stack; only the blehostd task flushes. */
+    static struct iovec iov[BLEHOSTD_IOV_MAX];
+
+    struct os_mbuf *om;
+    ssize_t num_written;
+    uint8_t *flat;
+    int iovcnt;
+
+    while (chan->tx_chain != NULL) {
+        iovcnt = 0;
+        for (om = chan->tx_chain;
+             om != NULL && iovcnt < BLEHOSTD_IOV_MAX;
+             om = SLIST_NEXT(om, om_next)) {
+
+            if (om->om_len > 0) {
+                iov[iovcnt].iov_base = om->om_data;
+                iov[iovcnt].iov_len = om->om_len;
+                iovcnt++;
+            }
+        }
+
+        flat = NULL;
+        if (om != NULL && blehostd_packet_mode) {
+            /* A datagram must be written in a single call; flatten a
+             * message with too many segments to describe at once.
+             */
+            flat = malloc_success(OS_MBUF_PKTLEN(chan->tx_chain));
+            os_mbuf_copydata(chan->tx_chain, 0,
+                             OS_MBUF_PKTLEN(chan->tx_chain), flat);
+            iov[0].iov_base = flat;
+            iov[0].iov_len = OS_MBUF_PKTLEN(chan->tx_chain);
+            iovcnt = 1;
+        }
+
+        num_written = writev(chan->fd, iov, iovcnt);
+        free(flat);
+        if (num_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                STATS_INC(blehostd_stats, tx_eagain);
+                blehostd_io_arm(client, chan);
+                return SYS_EAGAIN;
+            }
+
+            BHD_LOG(INFO, "writev() failed; client=%d bulk=%d errno=%d\n",
+                    client->id, chan == &client->bulk, errno);
+            if (chan == &client->bulk) {
+                blehostd_bulk_close(client);
+            } else {
+                assert(blehostd_listen_mode);
+                blehostd_client_close(client);
+            }
+            return 0;
+        }
+
+        os_mbuf_adj(chan->tx_chain, num_written);
+        if (OS_MBUF_PKTLEN(chan->tx_chain) == 0) {
+            blehostd_count_flush(chan->tx_chain_msgs, chan->tx_chain_bytes);
+            os_mbuf_free_chain(chan->tx_chain);
+            chan->tx_chain = NULL;
+            chan->tx_chain_msgs = 0;
+            chan->tx_chain_bytes = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void
+blehostd_chan_send(struct blehostd_client *client, struct blehostd_chan *chan,
+                   struct os_mbuf *chain, int num_msgs)
+{
+    chan->tx_chain = chain;
+    chan->tx_chain_msgs = num_msgs;
+    chan->tx_chain_bytes = OS_MBUF_PKTLEN(chain);
+    blehostd_chan_flush(client, chan);
+}
+
+static int
+blehostd_sock_type(void)
+{
+    return blehostd_packet_mode ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+/**
+ * Retrieves the set of clients that have a bulk channel open.
+ */
+static uint32_t
+blehostd_bulk_mask(void)
+{
+    uint32_t mask;
+    int i;
+
+    mask = 0;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (blehostd_clients[i].id != 0 && blehostd_clients[i].bulk.fd >= 0) {
+            mask |= 1UL << i;
+        }
+    }
+
+    return mask;
+}
+
+/**
+ * Removes messages from the front of a client's bulk queue and chains them
+ * together, subject to the same limits as blehostd_gather_rsps().
+ */
+static struct os_mbuf *
+blehostd_bulk_gather(struct blehostd_client *client, int *out_num_msgs)
+{
+    struct os_mbuf_pkthdr *omp;
+    struct os_mbuf *chain;
+    struct os_mbuf *om;
+    os_sr_t sr;
+
+    chain = NULL;
+    *out_num_msgs = 0;
+
+    while ((omp = STAILQ_FIRST(&client->bulk_q)) != NULL) {
+        if (chain != NULL &&
+            (blehostd_packet_mode ||
+             OS_MBUF_PKTLEN(chain) + omp->omp_len >
+                MYNEWT_VAL(BLEHOSTD_TX_GATHER_SZ))) {
+
+            break;
+        }
+
+        /* blehostd_msg_is_queued() searches bulk queues from other tasks. */
+        OS_ENTER_CRITICAL(sr);
+        STAILQ_REMOVE_HEAD(&client->bulk_q, omp_next);
+        client->bulk_q_len--;
+        blehostd_bulk_q_total--;
+        OS_EXIT_CRITICAL(sr);
+
+        om = OS_MBUF_PKTHDR_TO_MBUF(omp);
+        if (chain == NULL) {
+            chain = om;
+        } else {
+            os_mbuf_concat(chain, om);
+        }
+        (*out_num_msgs)++;
+    }
+
+    return chain;
+}
+
+/**
+ * Writes a client's queued bulk events to its bulk channel until the queue
+ * is empty or the socket is full.
+ */
+static void
+blehostd_bulk_flush(struct blehostd_client *client)
+{
+    struct os_mbuf *chain;
+    int num_msgs;
+    int rc;
+
+    while (client->bulk.fd >= 0) {
+        if (client->bulk.tx_chain != NULL) {
+            rc = blehostd_chan_flush(client, &client->bulk);
+            if (rc != 0) {
+                return;
+            }
+            continue;
+        }
+
+        chain = blehostd_bulk_gather(client, &num_msgs);
+        if (chain == NULL) {
+            return;
+        }
+
+        blehostd_chan_send(client, &client->bulk, chain, num_msgs);
+    }
+}
+
+/**
+ * Appends a message to the bulk queue of each specified client.  The
+ * message is duplicated for each recipient but the last.  The mbuf is
+ * consumed.
+ */
+static void
+blehostd_bulk_route(uint32_t recipients, struct os_mbuf *om)
+{
+    struct blehostd_client *client;
+    struct os_mbuf *msg;
+    os_sr_t sr;
+    int i;
+
+    /* Ignore clients that have closed their bulk channel. */
+    recipients &= blehostd_bulk_mask();
+
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (!(recipients & (1UL << i))) {
+            continue;
+        }
+        client = blehostd_clients + i;
+
+        recipients &= ~(1UL << i);
+        if (recipients == 0) {
+            msg = om;
+            om = NULL;
+        } else {
+            msg = os_mbuf_dup(om);
+            if (msg == NULL) {
+                BHD_LOG(ERROR, "failed to duplicate message for client %d\n",
+                        client->id);
+                continue;
+            }
+        }
+
+        OS_ENTER_CRITICAL(sr);
+        STAILQ_INSERT_TAIL(&client->bulk_q, OS_MBUF_PKTHDR(msg), omp_next);
+        client->bulk_q_len++;
+        blehostd_bulk_q_total++;
+        OS_EXIT_CRITICAL(sr);
+
+        blehostd_bulk_flush(client);
+    }
+
+    if (om != NULL) {
+        os_mbuf_free_chain(om);
+    }
+}
+
+/**
+ * Closes a client's bulk channel and discards its queued bulk events.  Later
+ * bulk events for the client go over its control channel again.
+ */
+static void
+blehostd_bulk_close(struct blehostd_client *client)
+{
+    struct os_mbuf_pkthdr *omp;
+    struct os_mbuf_pkthdr *next;
+    os_sr_t sr;
+
+    if (client->bulk.fd < 0) {
+        return;
+    }
+
+    BHD_LOG(INFO, "Client %d bulk channel closed\n", client->id);
+
+    close(client->bulk.fd);
+    if (client->bulk.tx_chain != NULL) {
+        os_mbuf_free_chain(client->bulk.tx_chain);
+    }
+
+    /* Detach the queue so that it can be freed outside the critical
+     * section.
+     */
+    OS_ENTER_CRITICAL(sr);
+    omp = STAILQ_FIRST(&client->bulk_q);
+    STAILQ_INIT(&client->bulk_q);
+    blehostd_bulk_q_total -= client->bulk_q_len;
+    client->bulk_q_len = 0;
+    OS_EXIT_CRITICAL(sr);
+
+    while (omp != NULL) {
+        next = STAILQ_NEXT(omp, omp_next);
+        os_mbuf_free_chain(OS_MBUF_PKTHDR_TO_MBUF(omp));
+        omp = next;
+    }
+
+    memset(&client->bulk, 0, sizeof client->bulk);
+    client->bulk.fd = -1;
+}
+
+/**
+ * Makes a descriptor passed by the requesting client its bulk channel,
+ * replacing any bulk channel it already has.  The descriptor is consumed.
+ *
+ * @return                      0 on success;
+ *                              SYS_ENOENT if no request is being processed;
+ *                              SYS_EINVAL if the descriptor is not a
+ *                                  suitable socket.
+ */
+int
+blehostd_bulk_open(int fd)
+{
+    struct blehostd_client *client;
+    struct epoll_event ev;
+    int type;
+    int rc;
+
+    client = blehostd_cur_client;
+    if (client == NULL) {
+        close(fd);
+        return SYS_ENOENT;
+    }
+
+    rc = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type,
+                    &(socklen_t){ sizeof type });
+    if (rc != 0 || type != blehostd_sock_type()) {
+        close(fd);
+        return SYS_EINVAL;
+    }
+
+    rc = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (rc != 0) {
+        close(fd);
+        return SYS_EINVAL;
+    }
+
+    blehostd_bulk_close(client);
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.u32 = (client - blehostd_clients) | BLEHOSTD_IO_BULK;
+    rc = epoll_ctl(blehostd_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (rc != 0) {
+        close(fd);
+        return SYS_EINVAL;
+    }
+
+    client->bulk.fd = fd;
+
+    BHD_LOG(INFO, "Client %d bulk channel opened\n", client->id);
+
+    return 0;
+}
+
+/**
+ * Services a client's bulk channel.  Clients do not send anything over the
+ * bulk channel; reading only detects that the client has closed it.
+ */
+static void
+blehostd_bulk_io(struct blehostd_client *client, int rx_ready, int tx_ready)
+{
+    uint8_t buf[256];
+    ssize_t num_read;
+
+    if (rx_ready) {
+        do {
+            num_read = recv(client->bulk.fd, buf, sizeof buf, 0);
+        } while (num_read > 0 || (num_read < 0 && errno == EINTR));
+
+        if (num_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            blehostd_bulk_close(client);
+            return;
+        }
+    }
+
+    if (tx_ready) {
+        blehostd_bulk_flush(client);
+        if (client->bulk.fd < 0) {
+            return;
+        }
+    }
+
+    blehostd_io_arm(client, &client->bulk);
+}
+
+/**
+ * Indicates whether every client that a message is addressed to can accept
+ * a new transmit chain.  Messages are sent in queue order, so a client that
+ * is not keeping up holds up the queue; the event flow control then limits
+ * how far the queue grows.
+ */
+static int
+blehostd_recipients_ready(uint32_t recipients)
+{
+    int i;
+
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (recipients & (1UL << i) &&
+            blehostd_clients[i].ctl.tx_chain != NULL) {
+
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Hands a transmit chain to the clients it is addressed to.  The chain is
+ * duplicated for each recipient but the last.  The chain is consumed.
+ */
+static void
+blehostd_route_chain(uint32_t recipients, struct os_mbuf *chain,
+                     int num_msgs)
+{
+    struct blehostd_client *client;
+    struct blehostd_client *last;
+    struct os_mbuf *dup;
+    int i;
+
+    /* Ignore clients that have disconnected. */
+    recipients &= blehostd_client_mask();
+
+    last = NULL;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (!(recipients & (1UL << i))) {
+            continue;
+        }
+        client = blehostd_clients + i;
+
+        if (last != NULL) {
+            dup = os_mbuf_dup(chain);
+            if (dup == NULL) {
+                BHD_LOG(ERROR, "failed to duplicate message for client %d\n",
+                        last->id);
+            } else {
+                blehostd_chan_send(last, &last->ctl, dup, num_msgs);
+            }
+        }
+        last = client;
+    }
+
+    if (last == NULL) {
+        os_mbuf_free_chain(chain);
+    } else {
+        blehostd_chan_send(last, &last->ctl, chain, num_msgs);
+    }
+}
+
+/**
+ * Drains a transmit queue.  Bulk events addressed to clients with a bulk
+ * channel move to those clients' bulk queues, which never block the
+ * transmit queue; everything else goes out over the control channels.
+ */
+static void
+blehostd_drain_tx_mq(struct os_mqueue *mq)
+{
+    struct os_mbuf *chain;
+    struct os_mbuf *om;
+    uint32_t recipients;
+    uint32_t bulk_mask;
+    uint32_t bulk_rcpts;
+    int num_msgs;
+    int bulk;
+    int rc;
+
+    while (1) {
+        rc = blehostd_tx_mq_peek(mq, &recipients, &bulk);
+        if (rc != 0) {
+            break;
+        }
+
+        bulk_mask = blehostd_bulk_mask();
+
+        bulk_rcpts = bulk ? recipients & bulk_mask : 0;
+        if (!blehostd_recipients_ready(recipients & ~bulk_rcpts)) {
+            break;
+        }
+
+        if (bulk_rcpts == 0) {
+            chain = blehostd_gather_rsps(mq, recipients, bulk_mask != 0,
+                                         &num_msgs);
+            blehostd_route_chain(recipients, chain, num_msgs);
+            continue;
+        }
+
+        om = blehostd_gather_rsps(mq, recipients, 1, &num_msgs);
+        assert(num_msgs == 1);
+
+        recipients &= ~bulk_rcpts;
+        if (recipients != 0) {
+            chain = os_mbuf_dup(om);
+            if (chain == NULL) {
+                BHD_LOG(ERROR, "failed to duplicate bulk message\n");
+            } else {
+                blehostd_route_chain(recipients, chain, 1);
+            }
+        }
+        blehostd_bulk_route(bulk_rcpts, om);
+    }
+}
+
+/**
+ * Sends queued responses, then queued events.  A client's control channel
+ * takes one chain at a time, so a response queued behind a burst of scan
+ * or notify events would otherwise wait for all of them to be written.
+ */
+static void
+blehostd_process_rsp_mq(struct os_event *ev)
+{
+    int i;
+
+    /* Retry chains that a socket could not accept earlier. */
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        if (blehostd_clients[i].id != 0) {
+            blehostd_chan_flush(blehostd_clients + i,
+                                &blehostd_clients[i].ctl);
+        }
+    }
+
+    blehostd_drain_tx_mq(&blehostd_prio_mq);
+    blehostd_drain_tx_mq(&blehostd_rsp_mq);
+
+    /* Let the clients know about any events that had to be discarded. */
+    bhd_evtq_report_drops();
+}
+
+static int
+blehostd_fill_addr(struct sockaddr_un *addr, const char *filename)
+{
+    size_t name_len;
+
+    name_len = strlen(filename);
+    if (name_len + 1 > sizeof addr->sun_path) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, filename, name_len + 1);
+
+    return 0;
+}
+
+/**
+ * Parses the frame header at the front of a client's receive buffer.  On
+ * success, the header is stripped and the client's expected packet length
+ * is set.
+ *
+ * @return                      0 on success;
+ *                              SYS_EAGAIN if the header is incomplete;
+ *                              SYS_EINVAL if the header is invalid.
+ */
+static int
+blehostd_parse_frame_hdr(struct blehostd_client *client)
+{
+    uint8_t hdr[BLEHOSTD_FRAME_HDR_SZ];
+    uint16_t len16;
+    uint32_t len32;
+    int rc;
+
+    rc = os_mbuf_copydata(client->rx_packet, 0, 1, hdr);
+    if (rc != 0) {
+        return SYS_EAGAIN;
+    }
+
+    if (hdr[0] == BLEHOSTD_FRAME_MARKER) {
+        rc = os_mbuf_copydata(client->rx_packet, 0, sizeof hdr, hdr);
+        if (rc != 0) {
+            return SYS_EAGAIN;
+        }
+
+        if (hdr[1] != BLEHOSTD_FRAME_VERSION) {
+            BHD_LOG(ERROR, "unsupported frame version: %d\n", hdr[1]);
+            return SYS_EINVAL;
+        }
+
+        memcpy(&len32, hdr + 2, sizeof len32);
+        len32 = ntohl(len32);
+        if (len32 == 0 || len32 > BLEHOSTD_MAX_FRAME_SZ) {
+            BHD_LOG(ERROR, "invalid frame length: %u\n", (unsigned)len32);
+            return SYS_EINVAL;
+        }
+
+        os_mbuf_adj(client->rx_packet, sizeof hdr);
+        client->rx_packet_len = len32;
+        return 0;
+    }
+
+    rc = os_mbuf_copydata(client->rx_packet, 0, sizeof len16, &len16);
+    if (rc != 0) {
+        return SYS_EAGAIN;
+    }
+    len16 = ntohs(len16);
+
+    /* Temporary hack: Allow user to bypass length header; assume entire
+     * packet received in one read.
+     */
+    if (len16 > BLEHOSTD_MAX_MSG_SZ) {
+        client->rx_packet_len = OS_MBUF_PKTLEN(client->rx_packet);
+    } else {
+        os_mbuf_adj(client->rx_packet, sizeof len16);
+        client->rx_packet_len = len16;
+    }
+
+    return 0;
+}
+
+/**
+ * Selects the queue that a received request waits in, according to its
+ * priority.
+ */
+static struct os_mqueue *
+blehostd_req_mq_for(struct blehostd_client *client, const struct os_mbuf *om)
+{
+    uint8_t buf[BLEHOSTD_REQ_PEEK_SZ];
+    int len;
+    int rc;
+
+    len = OS_MBUF_PKTLEN(om);
+    if (len > sizeof buf) {
+        len = sizeof buf;
+    }
+
+    rc = os_mbuf_copydata(om, 0, len, buf);
+    if (rc == 0 && bhd_req_prio(buf, len) == BHD_REQ_PRIO_URGENT) {
+        return &client->req_urgent_mq;
+    } else {
+        return &client->req_mq;
+    }
+}
+
+static int
+blehostd_enqueue_one(struct blehostd_client *client)
+{
+    struct os_mbuf *next;
+    struct os_mbuf *om;
+    uint32_t excess;
+    int rc;
+
+    if (client->rx_packet == NULL) {
+        return 0;
+    }
+
+    if (client->rx_packet_len == 0) {
+        rc = blehostd_parse_frame_hdr(client);
+        if (rc == SYS_EINVAL) {
+            /* There is no way to find the next frame; discard everything
+             * received so far.
+             */
+            os_mbuf_free_chain(client->rx_packet);
+            client->rx_packet = NULL;
+            return 0;
+        }
+    }
+
+    if (client->rx_packet_len == 0 ||
+        OS_MBUF_PKTLEN(client->rx_packet) < client->rx_packet_len) {
+
+        return 0;
+    }
+
+    if (OS_MBUF_PKTLEN(client->rx_packet) == client->rx_packet_len) {
+        om = client->rx_packet;
+        client->rx_packet = NULL;
+        client->rx_packet_len = 0;
+    } else if (client->rx_packet_len <=
+               OS_MBUF_PKTLEN(client->rx_packet) - client->rx_packet_len) {
+
+        /* Full packet plus at least as much of what follows it received;
+         * copy the packet out.
+         */
+        om = os_msys_get_pkthdr(client->rx_packet_len, 0);
+        if (om == NULL) {
+            fprintf(stderr, "* Error: failed to allocate mbuf\n");
+            return 0;
+        }
+
+        rc = os_mbuf_appendfrom(om, client->rx_packet, 0,
+                                client->rx_packet_len);
+        if (rc != 0) {
+            os_mbuf_free_chain(om);
+            fprintf(stderr, "* Error: failed to allocate mbuf\n");
+            return 0;
+        }
+
+        os_mbuf_adj(client->rx_packet, client->rx_packet_len);
+        client->rx_packet_len = 0;
+    } else {
+        /* Full packet plus a smaller amount of what follows it received.
+         * Move the excess to a new chain instead, so that a large frame
+         * never needs a second copy.
+         */
+        excess = OS_MBUF_PKTLEN(client->rx_packet) - client->rx_packet_len;
+        next = os_msys_get_pkthdr(excess, 0);
+        if (next == NULL) {
+            fprintf(stderr, "* Error: failed to allocate mbuf\n");
+            return 0;
+        }
+
+        rc = os_mbuf_appendfrom(next, client->rx_packet,
+                                client->rx_packet_len, excess);
+        if (rc != 0) {
+            os_mbuf_free_chain(next);
+            fprintf(stderr, "* Error: failed to allocate mbuf\n");
+            return 0;
+        }
+
+        om = client->rx_packet;
+        os_mbuf_adj(om, -(int)excess);
+        client->rx_packet = next;
+        client->rx_packet_len = 0;
+    }
+
+    rc = os_mqueue_put(blehostd_req_mq_for(client, om), &blehostd_evq, om);
+    assert(rc == 0);
+
+    return 1;
+}
+
+static void
+blehostd_client_close(struct blehostd_client *client)
+{
+    struct os_mbuf_pkthdr *omp;
+    struct os_mbuf *om;
+    uint32_t bit;
+    os_sr_t sr;
+
+    BHD_LOG(INFO, "Client %d disconnected\n", client->id);
+
+    /* Closing the descriptor also removes it from the epoll set. */
+    close(client->ctl.fd);
+    if (client->rx_fd >= 0) {
+        close(client->rx_fd);
+    }
+
+    bhd_ring_close(client - blehostd_clients);
+    blehostd_bulk_close(client);
+
+    os_eventq_remove(&blehostd_evq, &client->req_mq.mq_ev);
+    while ((om = os_mqueue_get(&client->req_mq)) != NULL) {
+        os_mbuf_free_chain(om);
+    }
+    os_eventq_remove(&blehostd_evq, &client->req_urgent_mq.mq_ev);
+    while ((om = os_mqueue_get(&client->req_urgent_mq)) != NULL) {
+        os_mbuf_free_chain(om);
+    }
+
+    if (client->rx_packet != NULL) {
+        os_mbuf_free_chain(client->rx_packet);
+    }
+    if (client->ctl.tx_chain != NULL) {
+        os_mbuf_free_chain(client->ctl.tx_chain);
+    }
+
+    /* Don't let queued messages reach a future client in the same slot. */
+    bit = blehostd_client_bit(client);
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_FOREACH(omp, &blehostd_rsp_mq.mq_head, omp_next) {
+        BLEHOSTD_MSG_META(OS_MBUF_PKTHDR_TO_MBUF(omp))->recipients &= ~bit;
+    }
+    STAILQ_FOREACH(omp, &blehostd_prio_mq.mq_head, omp_next) {
+        BLEHOSTD_MSG_META(OS_MBUF_PKTHDR_TO_MBUF(omp))->recipients &= ~bit;
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if (blehostd_cur_client == client) {
+        blehostd_cur_client = NULL;
+    }
+
+    memset(client, 0, sizeof *client);
+    client->ctl.fd = -1;
+    client->bulk.fd = -1;
+    client->rx_fd = -1;
+
+    /* Messages held up by this client can now go to everyone else. */
+    os_eventq_put(&blehostd_evq, &blehostd_rsp_mq.mq_ev);
+}
+
+/**
+ * Reads from a client socket.  A descriptor passed by the client is kept
+ * until a request claims it with blehostd_take_rx_fd(); an unclaimed one is
+ * replaced by the next.
+ *
+ * @return                      The number of bytes read; 0 on EOF;
+ *                              -1 on error, with errno set.
+ */
+static ssize_t
+blehostd_recv(struct blehostd_client *client, void *buf, size_t len)
+{
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof (int))];
+    } cmsg_buf;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t num_read;
+    int fd;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf.buf;
+    msg.msg_controllen = sizeof cmsg_buf.buf;
+
+    num_read = recvmsg(client->ctl.fd, &msg, MSG_CMSG_CLOEXEC);
+    if (num_read <= 0) {
+        return num_read;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof fd)) {
+
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+            if (client->rx_fd >= 0) {
+                close(client->rx_fd);
+            }
+            client->rx_fd = fd;
+        }
+    }
+
+    return num_read;
+}
+
+static void blehostd_process_req_mq(struct os_event *ev);
+static void blehostd_process_req_buf(struct blehostd_client *client,
+                                     uint8_t *buf, int len);
+
+/**
+ * Receives and processes every datagram waiting on a SOCK_SEQPACKET client
+ * socket.  Each datagram is one request; it is received straight into the
+ * decode buffer, so no reassembly or intermediate copy is needed.
+ *
+ * @return                      0 on success;
+ *                              SYS_EDONE if the peer has closed the
+ *                                  connection;
+ *                              other nonzero on error.
+ */
+static int
+blehostd_client_read_packets(struct blehostd_client *client)
+{
+    uint8_t *buf;
+    ssize_t num_read;
+    ssize_t len;
+
+    while (client->id != 0) {
+        /* Determine the size of the next datagram without consuming it. */
+        len = recv(client->ctl.fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+        if (len == 0) {
+            return SYS_EDONE;
+        }
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return SYS_EIO;
+        }
+
+        if (len > BLEHOSTD_MAX_FRAME_SZ) {
+            /* Discard the datagram, along with any descriptor it carries,
+             * without reading it.
+             */
+            BHD_LOG(ERROR, "datagram too large (client=%d): %d bytes\n",
+                    client->id, (int)len);
+            if (recv(client->ctl.fd, NULL, 0, MSG_TRUNC) < 0 &&
+                errno != EINTR) {
+
+                return SYS_EIO;
+            }
+            continue;
+        }
+
+        if (len < sizeof blehostd_req_buf) {
+            buf = blehostd_req_buf;
+        } else {
+            /* One extra byte for a null terminator. */
+            buf = malloc_success(len + 1);
+        }
 
-    if (!midline) {
-        time(&tt);
-        ts = ctime(&tt);
-        if (ts != NULL) {
-            ts[24] = '\0';
-            off += snprintf(buf + off, sizeof buf - off, "%s    ", ts);
+        num_read = blehostd_recv(client, buf, len);
+        if (num_read != len) {
+            if (buf != blehostd_req_buf) {
+                free(buf);
+            }
+            return SYS_EIO;
         }
-    }
 
-    off += vsnprintf(buf + off, sizeof buf - off, fmt, args);
-    va_end(args);
+        BHD_LOG(DEBUG, "Rxed UDS packet (client=%d): %d bytes\n",
+                client->id, (int)len);
 
-    if (off <= sizeof buf) {
-        midline = buf[off - 1] != '\n';
+        client->rx_time_us = blehostd_time_us();
+        blehostd_process_req_buf(client, buf, len);
+
+        if (buf != blehostd_req_buf) {
+            free(buf);
+        }
     }
 
-    fputs(buf, blehostd_log_file);
+    return 0;
 }
 
-static void
-blehostd_log_mbuf(const struct os_mbuf *om)
+/**
+ * Reads everything available from a client socket and queues each complete
+ * request.
+ *
+ * @return                      0 on success;
+ *                              SYS_EDONE if the peer has closed the
+ *                                  connection;
+ *                              other nonzero on error.
+ */
+static int
+blehostd_client_read(struct blehostd_client *client)
 {
-    uint8_t u8;
+    static uint8_t buf[2048];
+
+    struct os_mbuf *om;
+    ssize_t num_read;
+    int enqueued;
     int rc;
-    int i;
 
-    if (MYNEWT_VAL(LOG_LEVEL) > LOG_LEVEL_DEBUG) {
-        return;
+    if (blehostd_packet_mode) {
+        return blehostd_client_read_packets(client);
     }
 
-    for (i = 0; i < OS_MBUF_PKTLEN(om); i++) {
-        rc = os_mbuf_copydata(om, i, 1, &u8);
-        assert(rc == 0);
-        BHD_LOG(DEBUG, "%s0x%02x", i == 0 ? "" : " ", u8);
+    while (1) {
+        num_read = blehostd_recv(client, buf, sizeof buf);
+        if (num_read == 0) {
+            return SYS_EDONE;
+        }
+
+        if (num_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return SYS_EIO;
+        }
+
+        BHD_LOG(DEBUG, "Rxed UDS data (client=%d): %d bytes\n",
+                client->id, (int)num_read);
+
+        if (client->rx_packet == NULL) {
+            /* Beginning of packet. */
+            om = os_msys_get_pkthdr(num_read, 0);
+            if (om == NULL) {
+                return SYS_ENOMEM;
+            }
+            client->rx_packet = om;
+        }
+
+        /* Beginning or continuation of packet. */
+        rc = os_mbuf_append(client->rx_packet, buf, num_read);
+        if (rc != 0) {
+            return SYS_ENOMEM;
+        }
+
+        client->rx_time_us = blehostd_time_us();
     }
-    BHD_LOG(DEBUG, "\n");
+
+    while (1) {
+        enqueued = blehostd_enqueue_one(client);
+        if (!enqueued) {
+            break;
+        }
+    }
+
+    return 0;
 }
 
-int
-blehostd_enqueue_rsp(const char *json_rsp)
+/**
+ * Assigns a client slot to a newly connected socket, and registers the
+ * socket with the epoll set.
+ *
+ * @return                      The new client on success;
+ *                              NULL if the maximum number of clients are
+ *                                  already connected.
+ */
+static struct blehostd_client *
+blehostd_client_add(int fd)
 {
-    struct os_mbuf *om;
-    uint16_t *rsplen;
-    size_t len;
+    struct blehostd_client *client;
+    struct epoll_event ev;
     int rc;
+    int i;
 
-    om = NULL;
-
-    len = strlen(json_rsp);
-    if (len > BLEHOSTD_MAX_MSG_SZ) {
-        rc = SYS_EINVAL;
-        goto err;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        client = blehostd_clients + i;
+        if (client->id == 0) {
+            break;
+        }
     }
-
-    om = os_msys_get_pkthdr(len + 2, 0);
-    if (om == NULL) {
-        rc = SYS_ENOMEM;
-        goto err;
+    if (i >= BLEHOSTD_MAX_CLIENTS) {
+        return NULL;
     }
 
-    rsplen = os_mbuf_extend(om, sizeof *rsplen);
-    if (rsplen == NULL) {
-        rc = SYS_ENOMEM;
-        goto err;
+    rc = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (rc != 0) {
+        return NULL;
     }
 
-    *rsplen = htons(len);
+    memset(client, 0, sizeof *client);
+    client->ctl.fd = fd;
+    client->bulk.fd = -1;
+    client->rx_fd = -1;
+    STAILQ_INIT(&client->bulk_q);
 
-    rc = os_mbuf_append(om, json_rsp, len);
-    if (rc != 0) {
-        rc = SYS_ENOMEM;
-        goto err;
-    }
+    do {
+        client->id = ++blehostd_next_client_id;
+    } while (client->id == 0 ||
+             blehostd_client_find(client->id) != client);
 
-    rc = os_mqueue_put(&blehostd_rsp_mq, &blehostd_evq, om);
+    rc = os_mqueue_init(&client->req_mq, blehostd_process_req_mq, client);
+    assert(rc == 0);
+    rc = os_mqueue_init(&client->req_urgent_mq, blehostd_process_req_mq,
+                        client);
     assert(rc == 0);
 
-    return 0;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.u32 = i;
+    rc = epoll_ctl(blehostd_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (rc != 0) {
+        memset(client, 0, sizeof *client);
+        client->ctl.fd = -1;
+        client->bulk.fd = -1;
+        client->rx_fd = -1;
+        return NULL;
+    }
 
-err:
-    os_mbuf_free_chain(om);
-    return rc;
+    BHD_LOG(INFO, "Client %d connected\n", client->id);
+
+    return client;
 }
 
-static int
-blehostd_process_rsp(struct os_mbuf *om)
+static void
+blehostd_accept_all(void)
 {
-    int rc;
+    struct epoll_event ev;
+    int fd;
 
-    BHD_LOG(DEBUG, "Sending %d bytes\n", OS_MBUF_PKTLEN(om));
+    while (1) {
+        fd = accept(blehostd_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
 
-    blehostd_log_mbuf(om);
-    rc = mn_sendto(blehostd_socket, om,
-                   (struct mn_sockaddr *)&blehostd_server_addr);
-    return rc;
+        if (blehostd_client_add(fd) == NULL) {
+            BHD_LOG(ERROR, "Rejecting client; too many clients connected\n");
+            close(fd);
+        }
+    }
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u32 = BLEHOSTD_IO_LISTEN;
+    epoll_ctl(blehostd_epoll_fd, EPOLL_CTL_MOD, blehostd_listen_fd, &ev);
 }
 
+/**
+ * Services the sockets that epoll reported ready.  Executes in the blehostd
+ * task.
+ */
 static void
-blehostd_process_rsp_mq(struct os_event *ev)
+blehostd_io_service(const struct epoll_event *evs, int num_evs)
 {
-    struct os_mbuf *om;
-    os_sr_t sr;
+    struct blehostd_client *client;
+    uint32_t bulk_rx_ready;
+    uint32_t bulk_tx_ready;
+    uint32_t *rx_ready;
+    uint32_t *tx_ready;
+    uint32_t ctl_rx_ready;
+    uint32_t ctl_tx_ready;
+    uint32_t bit;
+    int accept_ready;
     int rc;
+    int i;
 
-    while ((om = os_mqueue_get(&blehostd_rsp_mq)) != NULL) {
-        rc = blehostd_process_rsp(om);
-        if (rc == MN_EAGAIN) {
-            /* Socket cannot accommodate packet; try again later. */
-            OS_ENTER_CRITICAL(sr);
-            STAILQ_INSERT_HEAD(&blehostd_rsp_mq.mq_head,
-                               OS_MBUF_PKTHDR(om),
-                               omp_next);
-            OS_EXIT_CRITICAL(sr);
-            break;
-        } else if (rc != 0) {
-            BHD_LOG(INFO, "mn_sendto() failed; rc=%d\n", rc);
-            assert(0);
-            break;
+    STATS_INC(blehostd_stats, io_wakeups);
+
+    ctl_rx_ready = 0;
+    ctl_tx_ready = 0;
+    bulk_rx_ready = 0;
+    bulk_tx_ready = 0;
+    accept_ready = 0;
+
+    for (i = 0; i < num_evs; i++) {
+        if (evs[i].data.u32 == BLEHOSTD_IO_LISTEN) {
+            accept_ready = 1;
+            continue;
         }
-    }
-}
 
-static int
-blehostd_fill_addr(struct mn_sockaddr_un *addr, const char *filename)
-{
-    size_t name_len;
+        if (evs[i].data.u32 & BLEHOSTD_IO_BULK) {
+            rx_ready = &bulk_rx_ready;
+            tx_ready = &bulk_tx_ready;
+        } else {
+            rx_ready = &ctl_rx_ready;
+            tx_ready = &ctl_tx_ready;
+        }
 
-    name_len = strlen(filename);
-    if (name_len + 1 > sizeof addr->msun_path) {
-        return -1;
+        bit = 1UL << (evs[i].data.u32 & ~BLEHOSTD_IO_BULK);
+        if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            *rx_ready |= bit;
+        }
+        if (evs[i].events & EPOLLOUT) {
+            *tx_ready |= bit;
+        }
     }
 
-    addr->msun_len = sizeof *addr;
-    addr->msun_family = MN_AF_LOCAL;
-    memcpy(addr->msun_path, filename, name_len + 1);
+    if (accept_ready) {
+        blehostd_accept_all();
+    }
 
-    return 0;
-}
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        client = blehostd_clients + i;
+        if (client->id != 0 && client->bulk.fd >= 0 &&
+            (bulk_rx_ready | bulk_tx_ready) & (1UL << i)) {
 
-static int
-blehostd_enqueue_one(void)
-{
-    struct os_mbuf *om;
-    int rc;
+            blehostd_bulk_io(client, bulk_rx_ready & (1UL << i),
+                             bulk_tx_ready & (1UL << i));
+        }
 
-    if (blehostd_packet_len == 0) {
-        rc = os_mbuf_copydata(blehostd_packet, 0, sizeof blehostd_packet_len,
-                              &blehostd_packet_len);
-        if (rc == 0) {
-            blehostd_packet_len = ntohs(blehostd_packet_len);
+        if (client->id == 0 ||
+            !((ctl_rx_ready | ctl_tx_ready) & (1UL << i))) {
 
-            /* Temporary hack: Allow user to bypass length header; assume
-             * entire packet received in one read.
-             */
-            if (blehostd_packet_len > BLEHOSTD_MAX_MSG_SZ) {
-                blehostd_packet_len = OS_MBUF_PKTLEN(blehostd_packet);
-            } else {
-                os_mbuf_adj(blehostd_packet, sizeof blehostd_packet_len);
+            continue;
+        }
+
+        if (ctl_rx_ready & (1UL << i)) {
+            rc = blehostd_client_read(client);
+            if (rc != 0) {
+                BHD_LOG(INFO, "Client %d read failed; rc=%d\n",
+                        client->id, rc);
+                assert(blehostd_listen_mode);
+                blehostd_client_close(client);
+                continue;
+            }
+        }
+
+        if (ctl_tx_ready & (1UL << i)) {
+            blehostd_chan_flush(client, &client->ctl);
+            if (client->id == 0) {
+                continue;
             }
         }
+
+        blehostd_io_arm(client, &client->ctl);
+    }
+
+    if ((ctl_tx_ready | bulk_tx_ready) != 0) {
+        /* Messages may have been held up behind a full socket. */
+        os_eventq_put(&blehostd_evq, &blehostd_rsp_mq.mq_ev);
     }
+}
 
-    if (blehostd_packet_len == 0 ||
-        OS_MBUF_PKTLEN(blehostd_packet) < blehostd_packet_len) {
+/**
+ * Periodic check for socket readiness.  Executes in the blehostd task.
+ */
+static void
+blehostd_io_poll(struct os_event *ev)
+{
+    /* Kept off the task stack, like the writev() iovec array. */
+    static struct epoll_event evs[2 * BLEHOSTD_MAX_CLIENTS + 1];
 
-        return 0;
+    int num_evs;
+
+    num_evs = epoll_wait(blehostd_epoll_fd, evs, sizeof evs / sizeof evs[0],
+                         0);
+    if (num_evs > 0) {
+        blehostd_io_service(evs, num_evs);
     }
 
-    if (OS_MBUF_PKTLEN(blehostd_packet) == blehostd_packet_len) {
-        om = blehostd_packet;
-        blehostd_packet = NULL;
-        blehostd_packet_len = 0;
-    } else {
-        /* Full packet plus some (or all) of next packet received. */
-        om = os_msys_get_pkthdr(blehostd_packet_len, 0);
-        if (om == NULL) {
-            fprintf(stderr, "* Error: failed to allocate mbuf\n");
-            return 0;
-        }
+    os_callout_reset(&blehostd_io_callout, BLEHOSTD_IO_POLL_TICKS);
+}
 
-        rc = os_mbuf_appendfrom(om, blehostd_packet, 0, blehostd_packet_len);
-        if (rc != 0) {
-            fprintf(stderr, "* Error: failed to allocate mbuf\n");
-            return 0;
-        }
+static int
+blehostd_io_init(void)
+{
+    int i;
 
-        os_mbuf_adj(blehostd_packet, blehostd_packet_len);
-        blehostd_packet_len = 0;
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        blehostd_clients[i].ctl.fd = -1;
+        blehostd_clients[i].bulk.fd = -1;
+        blehostd_clients[i].rx_fd = -1;
     }
 
-    rc = os_mqueue_put(&blehostd_req_mq, &blehostd_evq, om);
-    assert(rc == 0);
+    /* A client that disconnects mid-write must not kill the daemon. */
+    signal(SIGPIPE, SIG_IGN);
 
-    return 1;
+    blehostd_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (blehostd_epoll_fd < 0) {
+        return -1;
+    }
+
+    os_callout_init(&blehostd_io_callout, &blehostd_evq, blehostd_io_poll,
+                    NULL);
+    os_callout_reset(&blehostd_io_callout, BLEHOSTD_IO_POLL_TICKS);
+
+    return 0;
 }
 
-static void
-blehostd_socket_readable(void *unused, int err)
+static int
+blehostd_connect(const char *sock_path)
 {
-    struct mn_sockaddr_un from_addr;
-    struct os_mbuf *om;
-    int enqueued;
+    int fd;
     int rc;
 
-    if (err != 0) {
-        /* Socket error. */
-        assert(0);
-    }
-
-    rc = mn_recvfrom(blehostd_socket, &om, (void *)&from_addr);
+    rc = blehostd_fill_addr(&blehostd_server_addr, sock_path);
     if (rc != 0) {
-        return;
+        return rc;
     }
 
-    BHD_LOG(DEBUG, "Rxed UDS data:\n");
-    blehostd_log_mbuf(om);
+    fd = socket(AF_UNIX, blehostd_sock_type() | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
 
-    if (blehostd_packet == NULL) {
-        /* Beginning of packet. */
-        blehostd_packet = om;
-    } else {
-        /* Continuation of packet. */
-        os_mbuf_concat(blehostd_packet, om);
+    rc = connect(fd, (struct sockaddr *)&blehostd_server_addr,
+                 sizeof blehostd_server_addr);
+    if (rc != 0) {
+        close(fd);
+        return -1;
     }
 
-    while (1) {
-        enqueued = blehostd_enqueue_one();
-        if (!enqueued) {
-            break;
-        }
+    if (blehostd_client_add(fd) == NULL) {
+        close(fd);
+        return -1;
     }
-}
 
-static void
-blehostd_socket_writable(void *unused, int err)
-{
-    /* XXX: Spurious event when there is nothing else left to write. */
-    os_eventq_put(os_eventq_dflt_get(), &blehostd_rsp_mq.mq_ev);
+    return 0;
 }
 
+/**
+ * Listens for client connections on the specified UDS path.  Any stale
+ * socket file left at the path is removed first.
+ */
 static int
-blehostd_connect(const char *sock_path)
+blehostd_listen(const char *sock_path)
 {
-    static const union mn_socket_cb cbs = {
-        .socket = {
-            .readable = blehostd_socket_readable,
-            .writable = blehostd_socket_writable,
-        },
-    };
-
+    struct epoll_event ev;
     int rc;
 
     rc = blehostd_fill_addr(&blehostd_server_addr, sock_path);
@@ -321,17 +2265,32 @@ blehostd_connect(const char *sock_path)
         return rc;
     }
 
-    rc = mn_socket(&blehostd_socket, MN_PF_LOCAL, SOCK_STREAM, 0);
+    unlink(sock_path);
+
+    blehostd_listen_fd = socket(AF_UNIX,
+                                blehostd_sock_type() |
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                0);
+    if (blehostd_listen_fd < 0) {
+        return -1;
+    }
+
+    rc = bind(blehostd_listen_fd, (struct sockaddr *)&blehostd_server_addr,
+              sizeof blehostd_server_addr);
     if (rc != 0) {
         return -1;
     }
 
-    mn_socket_set_cbs(blehostd_socket, NULL, &cbs);
+    rc = listen(blehostd_listen_fd, BLEHOSTD_MAX_CLIENTS);
+    if (rc != 0) {
+        return -1;
+    }
 
-    rc = mn_connect(blehostd_socket,
-                    (struct mn_sockaddr *)&blehostd_server_addr);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u32 = BLEHOSTD_IO_LISTEN;
+    rc = epoll_ctl(blehostd_epoll_fd, EPOLL_CTL_ADD, blehostd_listen_fd, &ev);
     if (rc != 0) {
-        return rc;
+        return -1;
     }
 
     return 0;
@@ -342,7 +2301,14 @@ blehostd_task_handler(void *arg)
 {
     int rc;
 
-    rc = blehostd_connect(blehostd_socket_filename);
+    rc = blehostd_io_init();
+    assert(rc == 0);
+
+    if (blehostd_listen_mode) {
+        rc = blehostd_listen(blehostd_socket_filename);
+    } else {
+        rc = blehostd_connect(blehostd_socket_filename);
+    }
     assert(rc == 0);
 
     while (1) {
@@ -350,43 +2316,136 @@ blehostd_task_handler(void *arg)
     }
 }
 
+/**
+ * Records the time from reading a request off the socket to finishing it.
+ */
+static void
+blehostd_count_req(const struct blehostd_client *client)
+{
+    uint32_t lat_us;
+
+    lat_us = blehostd_time_us() - client->rx_time_us;
+
+    STATS_INC(blehostd_stats, reqs);
+    STATS_INCN(blehostd_stats, req_lat_us_sum, lat_us);
+    if (lat_us > blehostd_stats.req_lat_us_max) {
+        blehostd_stats.req_lat_us_max = lat_us;
+    }
+}
+
+/**
+ * Decodes and executes a single request.  The buffer must have room for a
+ * null terminator after the request.
+ */
 static void
-blehostd_process_req(struct os_mbuf *om)
+blehostd_process_req_buf(struct blehostd_client *client, uint8_t *buf, int len)
 {
     struct bhd_rsp rsp = {{0}};
-    char *json;
     int send_rsp;
-    int rc;
 
-    json = malloc_success(OS_MBUF_PKTLEN(om) + 1);
+    BHD_LOG(DEBUG, "Received %d bytes\n", len);
 
-    BHD_LOG(DEBUG, "Received %d bytes\n", OS_MBUF_PKTLEN(om));
-    rc = os_mbuf_copydata(om, 0, OS_MBUF_PKTLEN(om), json);
-    if (rc != 0) {
-        BHD_LOG(ERROR, "os_mbuf_copydata() failed: rc=%d\n", rc);
-        goto done;
-    }
+    /* Null-terminate in case this is a JSON request. */
+    buf[len] = '\0';
 
-    json[OS_MBUF_PKTLEN(om)] = '\0';
-    BHD_LOG(DEBUG, "Received JSON request:\n%s\n", json);
+    blehostd_cur_client = client;
 
-    send_rsp = bhd_req_dec(json, &rsp);
+    send_rsp = bhd_req_dec(buf, len, &rsp);
     if (send_rsp) {
         bhd_rsp_send(&rsp);
     }
 
-done:
+    blehostd_cur_client = NULL;
+
+    blehostd_count_req(client);
+
+    /* Everything allocated while processing the request is now garbage. */
+    bhd_arena_reset();
+}
+
+static void
+blehostd_process_req(struct blehostd_client *client, struct os_mbuf *om)
+{
+    uint8_t *buf;
+    int len;
+    int rc;
+
+    len = OS_MBUF_PKTLEN(om);
+
+    if (len < sizeof blehostd_req_buf) {
+        buf = blehostd_req_buf;
+    } else {
+        /* Oversized request (no length header). */
+        buf = malloc_success(len + 1);
+    }
+
+    rc = os_mbuf_copydata(om, 0, len, buf);
+    if (rc != 0) {
+        BHD_LOG(ERROR, "os_mbuf_copydata() failed: rc=%d\n", rc);
+    } else {
+        blehostd_process_req_buf(client, buf, len);
+    }
+
     os_mbuf_free_chain(om);
-    free(json);
+    if (buf != blehostd_req_buf) {
+        free(buf);
+    }
+}
+
+/**
+ * Executes every queued urgent request, from all clients.
+ */
+static void
+blehostd_process_urgent_reqs(void)
+{
+    struct blehostd_client *client;
+    struct os_mbuf *om;
+    int i;
+
+    for (i = 0; i < BLEHOSTD_MAX_CLIENTS; i++) {
+        client = blehostd_clients + i;
+        while (client->id != 0 &&
+               (om = os_mqueue_get(&client->req_urgent_mq)) != NULL) {
+
+            blehostd_process_req(client, om);
+        }
+    }
 }
 
+/**
+ * Executes a client's queued requests.  Urgent requests from any client are
+ * executed first, and again before each normal request, so they never wait
+ * behind a long run of write_cmd or notify requests.  After
+ * BLEHOSTD_REQ_BURST normal requests, the rest are deferred to the back of
+ * the event queue so that newly received requests get classified too.
+ */
 static void
 blehostd_process_req_mq(struct os_event *ev)
 {
+    struct blehostd_client *client;
     struct os_mbuf *om;
+    int i;
+
+    client = ev->ev_arg;
+    for (i = 0; ; i++) {
+        blehostd_process_urgent_reqs();
+
+        if (client->id == 0) {
+            break;
+        }
+
+        if (i >= BLEHOSTD_REQ_BURST) {
+            if (STAILQ_FIRST(&client->req_mq.mq_head) != NULL) {
+                os_eventq_put(&blehostd_evq, &client->req_mq.mq_ev);
+            }
+            break;
+        }
 
-    while ((om = os_mqueue_get(&blehostd_req_mq)) != NULL) {
-        blehostd_process_req(om);
+        om = os_mqueue_get(&client->req_mq);
+        if (om == NULL) {
+            break;
+        }
+        blehostd_process_req(client, om);
     }
 }
 
@@ -411,7 +2470,12 @@ blehostd_on_reset(int reason)
 static void
 print_usage(FILE *stream)
 {
-    fprintf(stream, "usage: blehostd <controller-device> <socket-path>\n");
+    fprintf(stream,
+            "usage: blehostd [-l] [-p] <controller-device> <socket-path>\n"
+            "    -l: Listen for clients on <socket-path> rather than "
+            "connecting to it.\n"
+            "    -p: Use SOCK_SEQPACKET; one message per packet, without "
+            "length headers.\n");
 }
 
 static void
@@ -443,6 +2507,30 @@ bhd_handle_version_request(int argc, char **argv)
     }
 }
 
+/**
+ * Removes the -l and -p options from the argument list, so that they do not
+ * reach the simulator's own argument parser.
+ */
+static void
+bhd_handle_socket_options(int *argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            blehostd_listen_mode = 1;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            blehostd_packet_mode = 1;
+        } else {
+            continue;
+        }
+
+        memmove(argv + i, argv + i + 1, (*argc - i) * sizeof *argv);
+        (*argc)--;
+        i--;
+    }
+}
+
 int
 main(int argc, char **argv)
 {
@@ -452,6 +2540,7 @@ main(int argc, char **argv)
 
     if (!g_os_started) {
         bhd_handle_version_request(argc, argv);
+        bhd_handle_socket_options(&argc, argv);
 
         if (argc < 3) {
             print_usage(stderr);
@@ -463,8 +2552,10 @@ main(int argc, char **argv)
         blehostd_socket_filename = argv[2];
 
         BHD_LOG(INFO,
-                "*** Starting blehostd %s %s\n",
-                blehostd_dev_filename, blehostd_socket_filename);
+                "*** Starting blehostd %s %s%s%s\n",
+                blehostd_dev_filename, blehostd_socket_filename,
+                blehostd_listen_mode ? " (listening)" : "",
+                blehostd_packet_mode ? " (seqpacket)" : "");
 
 #ifdef ARCH_sim
         mcu_sim_parse_args(argc, argv);
@@ -493,17 +2584,25 @@ main(int argc, char **argv)
 
     sysinit();
 
-    cjson_hooks.malloc_fn = malloc_success;
-    cjson_hooks.free_fn = free;
+    rc = stats_init_and_reg(
+        STATS_HDR(blehostd_stats),
+        STATS_SIZE_INIT_PARMS(blehostd_stats, STATS_SIZE_32),
+        STATS_NAME_INIT_PARMS(blehostd_stats), "blehostd");
+    assert(rc == 0);
+
+    /* cJSON trees only live for the duration of a single request. */
+    cjson_hooks.malloc_fn = bhd_arena_alloc;
+    cjson_hooks.free_fn = bhd_arena_free;
     cJSON_InitHooks(&cjson_hooks);
 
-    os_eventq_init(&blehostd_evq);
+    bhd_kv_init();
 
-    rc = os_mqueue_init(&blehostd_req_mq, blehostd_process_req_mq, NULL);
-    assert(rc == 0);
+    os_eventq_init(&blehostd_evq);
 
     rc = os_mqueue_init(&blehostd_rsp_mq, blehostd_process_rsp_mq, NULL);
     assert(rc == 0);
+    rc = os_mqueue_init(&blehostd_prio_mq, blehostd_process_rsp_mq, NULL);
+    assert(rc == 0);
 
     os_task_init(&blehostd_task, "blehostd", blehostd_task_handler,
                  NULL, BLEHOSTD_TASK_PRIO, OS_WAIT_FOREVER,
@@ -0,0 +1,217 @@
+/**
+ * Microbenchmark for the byte string codecs used in blehostd messages.
+ *
+ * Compares the table-driven "0xaa:0xbb" codec in bhd_hex.c with the
+ * snprintf() encoder and strtoul()-based parser it replaced, and times the
+ * base64 codec in bhd_b64.c on the same payload.  The old encoder is
+ * reproduced below; the old decoder is parse_arg_byte_stream(), which is
+ * still the fallback for non-canonical input.
+ *
+ * Build:
+ *     cc -O2 -Wall -I../src -I<mynewt-core>/sys/defs/include \
+ *         -o bhd_hex_bench bhd_hex_bench.c \
+ *         ../src/bhd_hex.c ../src/bhd_b64.c ../src/parse.c
+ *
+ * Usage:
+ *     bhd_hex_bench [-n <iterations>] [-l <payload-len>]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bhd_hex.h"
+#include "bhd_b64.h"
+#include "parse.h"
+
+/** Prevents the compiler from discarding the results of a timed loop. */
+static volatile uint32_t sink;
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/** The encoder that bhd_hex_enc() replaced: one snprintf() per byte. */
+static int
+old_hex_enc(char *dst, int max_dst_len, const uint8_t *src, int src_len)
+{
+    int rem_len;
+    int off;
+    int rc;
+    int i;
+
+    off = 0;
+    rem_len = max_dst_len;
+
+    if (max_dst_len >= 1) {
+        *dst = '\0';
+    }
+
+    for (i = 0; i < src_len; i++) {
+        rc = snprintf(dst + off, rem_len, "%s0x%02x",
+                      i > 0 ? ":" : "", src[i]);
+        if (rc >= rem_len) {
+            break;
+        }
+        off += rc;
+        rem_len -= rc;
+    }
+
+    return off;
+}
+
+static void
+report(const char *name, double start_us, long iters)
+{
+    printf("%-14s %9.3f us per payload\n",
+           name, (now_us() - start_us) / iters);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint8_t *payload;
+    uint8_t *decoded;
+    double start_us;
+    char *hex_str;
+    char *b64_str;
+    char *scratch;
+    long iters;
+    long i;
+    int hex_len;
+    int b64_len;
+    int out_len;
+    int len;
+    int opt;
+    int rc;
+
+    iters = 100000;
+    len = 512;
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iters = strtol(optarg, NULL, 0);
+            break;
+        case 'l':
+            len = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: bhd_hex_bench [-n <iterations>] "
+                            "[-l <payload-len>]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (iters <= 0 || len <= 0) {
+        fprintf(stderr, "invalid iteration count or payload length\n");
+        return EXIT_FAILURE;
+    }
+
+    payload = malloc(len);
+    decoded = malloc(len);
+    hex_str = malloc(len * BHD_HEX_CHARS_PER_BYTE + 1);
+    b64_str = malloc(BHD_B64_ENC_LEN(len) + 1);
+    scratch = malloc(len * BHD_HEX_CHARS_PER_BYTE + 1);
+    if (payload == NULL || decoded == NULL || hex_str == NULL ||
+        b64_str == NULL || scratch == NULL) {
+
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+    for (i = 0; i < len; i++) {
+        payload[i] = rand();
+    }
+
+    /* Both hex encoders must produce the same string. */
+    hex_len = bhd_hex_enc(hex_str, payload, len);
+    hex_str[hex_len] = '\0';
+    old_hex_enc(scratch, len * BHD_HEX_CHARS_PER_BYTE + 1, payload, len);
+    if (strcmp(hex_str, scratch) != 0) {
+        fprintf(stderr, "hex encoders disagree\n");
+        return EXIT_FAILURE;
+    }
+
+    b64_len = bhd_b64_enc(b64_str, payload, len);
+    b64_str[b64_len] = '\0';
+
+    /* Every decoder must recover the payload. */
+    memcpy(scratch, hex_str, hex_len + 1);
+    rc = parse_arg_byte_stream(scratch, len, decoded, &out_len);
+    if (rc != 0 || out_len != len || memcmp(decoded, payload, len) != 0) {
+        fprintf(stderr, "old hex decoder failed\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(scratch, hex_str, hex_len + 1);
+    rc = bhd_hex_dec(scratch, len, decoded, &out_len);
+    if (rc != 0 || out_len != len || memcmp(decoded, payload, len) != 0) {
+        fprintf(stderr, "new hex decoder failed\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(scratch, b64_str, b64_len + 1);
+    rc = bhd_b64_dec(scratch, len, decoded, &out_len);
+    if (rc != 0 || out_len != len || memcmp(decoded, payload, len) != 0) {
+        fprintf(stderr, "base64 decoder failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("payload:       %d bytes, %ld iterations\n", len, iters);
+
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        payload[0] = i;
+        sink += old_hex_enc(scratch, len * BHD_HEX_CHARS_PER_BYTE + 1,
+                            payload, len);
+    }
+    report("hex enc (old)", start_us, iters);
+
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        payload[0] = i;
+        sink += bhd_hex_enc(scratch, payload, len);
+    }
+    report("hex enc (new)", start_us, iters);
+
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        payload[0] = i;
+        sink += bhd_b64_enc(scratch, payload, len);
+    }
+    report("base64 enc", start_us, iters);
+
+    /* The decoders may modify their input, so each pass gets a fresh copy. */
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        memcpy(scratch, hex_str, hex_len + 1);
+        rc = parse_arg_byte_stream(scratch, len, decoded, &out_len);
+        sink += rc + decoded[out_len - 1];
+    }
+    report("hex dec (old)", start_us, iters);
+
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        memcpy(scratch, hex_str, hex_len + 1);
+        rc = bhd_hex_dec(scratch, len, decoded, &out_len);
+        sink += rc + decoded[out_len - 1];
+    }
+    report("hex dec (new)", start_us, iters);
+
+    start_us = now_us();
+    for (i = 0; i < iters; i++) {
+        memcpy(scratch, b64_str, b64_len + 1);
+        rc = bhd_b64_dec(scratch, len, decoded, &out_len);
+        sink += rc + decoded[out_len - 1];
+    }
+    report("base64 dec", start_us, iters);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/**
+ * Unit test for the key-value map indices in bhd_kv.c.
+ *
+ * Checks that the fixed seed of every index places each key, and each value,
+ * of its map in a distinct slot, and that every entry round-trips through the
+ * forward and reverse lookups.  When a seed no longer works (e.g., after an
+ * entry was added to a map), the test searches for one that does and prints
+ * it, so that the constant in bhd_kv.c can be updated.
+ *
+ * Build and run with the app's headers (see Makefile):
+ *     make check
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blehostd.h"
+#include "bhd_kv.h"
+
+/** Number of seeds to try when looking for a replacement. */
+#define BHD_KV_TEST_MAX_SEED    1000000
+
+static int num_failures;
+
+static void
+fail(const struct bhd_kv_idx *idx, const char *fmt, ...)
+{
+    va_list ap;
+
+    printf("FAIL %s: ", idx->name);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+
+    num_failures++;
+}
+
+/**
+ * Verifies that the index's seed for one direction is collision-free.  If it
+ * is not, reports the smallest seed that is.
+ */
+static int
+check_seed(const struct bhd_kv_idx *idx, int by_val)
+{
+    const char *dir;
+    uint8_t *slots;
+    uint32_t seed;
+    int rc;
+
+    dir = by_val ? "val_seed" : "key_seed";
+    seed = by_val ? idx->val_seed : idx->key_seed;
+
+    slots = malloc(1 << idx->slot_bits);
+    if (slots == NULL) {
+        fail(idx, "out of memory");
+        return -1;
+    }
+
+    rc = bhd_kv_idx_place(idx, slots, seed, by_val);
+    if (rc != 0) {
+        for (seed = 0; seed < BHD_KV_TEST_MAX_SEED; seed++) {
+            if (bhd_kv_idx_place(idx, slots, seed, by_val) == 0) {
+                break;
+            }
+        }
+
+        if (seed < BHD_KV_TEST_MAX_SEED) {
+            fail(idx, "%s collides; use %lu", dir, (unsigned long)seed);
+        } else {
+            fail(idx, "%s collides and no replacement was found; "
+                      "check for duplicate entries or add slots", dir);
+        }
+        rc = -1;
+    }
+
+    free(slots);
+    return rc;
+}
+
+static void
+check_lookups(const struct bhd_kv_idx *idx)
+{
+    const struct bhd_kv_str_int *cur;
+    int absent;
+
+    for (cur = idx->map; cur->key != NULL; cur++) {
+        if (bhd_kv_idx_parse(idx, cur->key) != cur->val) {
+            fail(idx, "parse(\"%s\") failed", cur->key);
+        }
+        if (bhd_kv_idx_rev_parse(idx, cur->val) != cur->key) {
+            fail(idx, "rev_parse() of \"%s\" failed", cur->key);
+        }
+    }
+
+    if (bhd_kv_idx_parse(idx, "no_such_key") != -1) {
+        fail(idx, "parse(\"%s\") found an entry", "no_such_key");
+    }
+
+    /* One less than the smallest value is not in the map. */
+    absent = 0;
+    for (cur = idx->map; cur->key != NULL; cur++) {
+        if (cur->val <= absent) {
+            absent = cur->val - 1;
+        }
+    }
+    if (bhd_kv_idx_rev_parse(idx, absent) != NULL) {
+        fail(idx, "rev_parse(%d) found an entry", absent);
+    }
+}
+
+int
+main(void)
+{
+    const struct bhd_kv_idx *idx;
+    int seeds_ok;
+    int i;
+
+    seeds_ok = 1;
+    for (i = 0; i < bhd_kv_num_idxs; i++) {
+        idx = bhd_kv_idxs[i];
+        if (check_seed(idx, 0) != 0) {
+            seeds_ok = 0;
+        }
+        if (check_seed(idx, 1) != 0) {
+            seeds_ok = 0;
+        }
+    }
+
+    /* Lookups are only meaningful once every table is collision-free. */
+    if (seeds_ok) {
+        bhd_kv_init();
+        for (i = 0; i < bhd_kv_num_idxs; i++) {
+            check_lookups(bhd_kv_idxs[i]);
+        }
+    }
+
+    if (num_failures != 0) {
+        printf("%d failure(s)\n", num_failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("PASS: %d indices\n", bhd_kv_num_idxs);
+    return EXIT_SUCCESS;
+}
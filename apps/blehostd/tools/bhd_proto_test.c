@@ -0,0 +1,297 @@
+/**
+ * Protocol regression test for a running blehostd.
+ *
+ * Connects to a blehostd that is listening for clients (-l) and sends
+ * requests that must be rejected cleanly, each followed by a well-formed
+ * request that proves the daemon is still serving.  Covers:
+ *     o subscriptions requests whose handle lists fail to decode, alone and
+ *       as batch items.  These used to free the error message string.
+ *
+ * Build:
+ *     cc -O2 -Wall -o bhd_proto_test bhd_proto_test.c
+ *
+ * Usage:
+ *     bhd_proto_test [-p] <socket-path>
+ *         -p: The daemon was started with -p (SOCK_SEQPACKET).
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** How long to wait for each response. */
+#define RSP_TMO_MS          5000
+
+#define FRAME_MARKER        0xff
+
+struct test_case {
+    const char *name;
+    const char *req;
+
+    /** The response must contain each of these. */
+    const char *expect[3];
+};
+
+static const struct test_case test_cases[] = {
+    {
+        "subscriptions: handle out of range",
+        "{\"op\":\"request\",\"type\":\"subscriptions\",\"seq\":1,"
+        "\"conn_handles\":[70000]}",
+        { "\"type\":\"error\"", "\"seq\":1," },
+    },
+    {
+        "subscriptions: handles not an array",
+        "{\"op\":\"request\",\"type\":\"subscriptions\",\"seq\":2,"
+        "\"attr_handles\":\"all\"}",
+        { "\"type\":\"error\"", "\"seq\":2," },
+    },
+    {
+        "batch: malformed subscriptions item",
+        "{\"op\":\"request\",\"type\":\"batch\",\"seq\":3,\"reqs\":["
+        "{\"type\":\"subscriptions\",\"seq\":4,\"conn_handles\":{}},"
+        "{\"type\":\"subscriptions\",\"seq\":5,\"attr_handles\":[-1]}]}",
+        { "\"type\":\"batch\"", "\"seq\":3,", "\"type\":\"error\"" },
+    },
+    {
+        "subscriptions: well-formed",
+        "{\"op\":\"request\",\"type\":\"subscriptions\",\"seq\":6}",
+        { "\"type\":\"subscriptions\"", "\"seq\":6,", "\"status\":0" },
+    },
+};
+
+#define NUM_TEST_CASES  (sizeof test_cases / sizeof test_cases[0])
+
+static int seqpacket;
+
+static int
+connect_daemon(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+send_req(int sock, const char *req)
+{
+    uint8_t buf[1024];
+    uint16_t len16;
+    size_t len;
+
+    len = strlen(req);
+    if (len + sizeof len16 > sizeof buf) {
+        return -1;
+    }
+
+    if (seqpacket) {
+        return send(sock, req, len, 0) == (ssize_t)len ? 0 : -1;
+    }
+
+    len16 = htons(len);
+    memcpy(buf, &len16, sizeof len16);
+    memcpy(buf + sizeof len16, req, len);
+    len += sizeof len16;
+
+    return send(sock, buf, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/** Reads exactly len bytes, waiting at most RSP_TMO_MS for each read. */
+static int
+read_full(int sock, void *buf, size_t len)
+{
+    struct pollfd pfd;
+    size_t off;
+    ssize_t n;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    for (off = 0; off < len; off += n) {
+        if (poll(&pfd, 1, RSP_TMO_MS) <= 0) {
+            return -1;
+        }
+
+        n = recv(sock, (uint8_t *)buf + off, len - off, 0);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Receives one message into a null-terminated heap buffer.
+ *
+ * @return                      The message on success; NULL if the daemon
+ *                                  closed the connection or timed out.
+ */
+static char *
+recv_msg(int sock)
+{
+    struct pollfd pfd;
+    uint8_t hdr[6];
+    uint32_t len32;
+    uint16_t len16;
+    uint32_t len;
+    char *msg;
+    ssize_t n;
+
+    if (seqpacket) {
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, RSP_TMO_MS) <= 0) {
+            return NULL;
+        }
+
+        n = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+        if (n <= 0 || (msg = malloc(n + 1)) == NULL) {
+            return NULL;
+        }
+        if (recv(sock, msg, n, 0) != n) {
+            free(msg);
+            return NULL;
+        }
+        msg[n] = '\0';
+        return msg;
+    }
+
+    /* Legacy header: 16-bit length.  Extended: marker, version, 32-bit
+     * length.
+     */
+    if (read_full(sock, hdr, 2) != 0) {
+        return NULL;
+    }
+    if (hdr[0] == FRAME_MARKER) {
+        if (read_full(sock, hdr + 2, 4) != 0) {
+            return NULL;
+        }
+        memcpy(&len32, hdr + 2, sizeof len32);
+        len = ntohl(len32);
+    } else {
+        memcpy(&len16, hdr, sizeof len16);
+        len = ntohs(len16);
+    }
+
+    msg = malloc(len + 1);
+    if (msg == NULL) {
+        return NULL;
+    }
+    if (read_full(sock, msg, len) != 0) {
+        free(msg);
+        return NULL;
+    }
+    msg[len] = '\0';
+
+    return msg;
+}
+
+/** Sends a request and waits for its response, skipping any events. */
+static char *
+transact(int sock, const char *req)
+{
+    char *msg;
+
+    if (send_req(sock, req) != 0) {
+        return NULL;
+    }
+
+    while ((msg = recv_msg(sock)) != NULL) {
+        if (strstr(msg, "\"op\":\"response\"") != NULL) {
+            return msg;
+        }
+        free(msg);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct test_case *tc;
+    int num_failures;
+    char *rsp;
+    size_t i;
+    int sock;
+    int opt;
+    int j;
+
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+        case 'p':
+            seqpacket = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: bhd_proto_test [-p] <socket-path>\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: bhd_proto_test [-p] <socket-path>\n");
+        return EXIT_FAILURE;
+    }
+
+    sock = connect_daemon(argv[optind]);
+    if (sock < 0) {
+        perror("connect");
+        return EXIT_FAILURE;
+    }
+
+    num_failures = 0;
+    for (i = 0; i < NUM_TEST_CASES; i++) {
+        tc = test_cases + i;
+
+        rsp = transact(sock, tc->req);
+        if (rsp == NULL) {
+            /* The daemon is gone; nothing else can pass. */
+            printf("FAIL %s: no response\n", tc->name);
+            return EXIT_FAILURE;
+        }
+
+        for (j = 0; j < 3 && tc->expect[j] != NULL; j++) {
+            if (strstr(rsp, tc->expect[j]) == NULL) {
+                printf("FAIL %s: expected %s in %s\n",
+                       tc->name, tc->expect[j], rsp);
+                num_failures++;
+                break;
+            }
+        }
+        free(rsp);
+    }
+
+    close(sock);
+
+    if (num_failures != 0) {
+        printf("%d failure(s)\n", num_failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("PASS: %d cases\n", (int)NUM_TEST_CASES);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/**
+ * Throughput benchmark for the blehostd shared-memory event ring.
+ *
+ * Runs a producer thread that writes synthetic notify_rx records into a
+ * memfd-backed ring, exactly as blehostd does, and consumes them in the main
+ * thread the way bhd_ring_reader does.  When the ring is full the producer
+ * waits rather than dropping, so the result is the sustained lossless rate.
+ *
+ * Build:
+ *     cc -O2 -Wall -pthread -I../src -o bhd_ring_bench bhd_ring_bench.c
+ *
+ * Usage:
+ *     bhd_ring_bench [-n <records>] [-l <payload-len>] [-s <data-size>]
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "bhd_ring_shm.h"
+
+struct bench_cfg {
+    struct bhd_ring ring;
+    uint64_t num_recs;
+    int payload_len;
+
+    /** Number of times the producer found the ring full. */
+    uint64_t num_full;
+};
+
+static void *
+producer(void *arg)
+{
+    struct bhd_ring_rec *rec;
+    struct bench_cfg *cfg;
+    uint8_t payload[UINT16_MAX];
+    uint64_t i;
+
+    cfg = arg;
+    memset(payload, 0xa5, cfg->payload_len);
+
+    for (i = 0; i < cfg->num_recs; i++) {
+        while ((rec = bhd_ring_reserve(&cfg->ring, cfg->payload_len)) ==
+               NULL) {
+
+            cfg->num_full++;
+            sched_yield();
+        }
+
+        rec->type = BHD_RING_REC_NOTIFY_RX;
+        rec->notify_rx.conn_handle = i & 0x0fff;
+        rec->notify_rx.attr_handle = 0x0010;
+        rec->timestamp_us = bhd_ring_now_us();
+        memcpy(rec->data, payload, cfg->payload_len);
+        bhd_ring_commit(&cfg->ring);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct bhd_ring_rec *rec;
+    struct timespec tmo = { 0, 10 * 1000 * 1000 };
+    struct bench_cfg cfg;
+    struct bhd_ring ring;
+    pthread_t thread;
+    uint64_t max_lat_us;
+    uint64_t sum_lat_us;
+    uint64_t received;
+    uint64_t start_us;
+    uint64_t now_us;
+    double secs;
+    size_t data_sz;
+    size_t map_sz;
+    void *base;
+    int memfd;
+    int opt;
+
+    memset(&cfg, 0, sizeof cfg);
+    cfg.num_recs = 10000000;
+    cfg.payload_len = 20;
+    data_sz = 1 << 20;
+
+    while ((opt = getopt(argc, argv, "n:l:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            cfg.num_recs = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            cfg.payload_len = atoi(optarg);
+            break;
+        case 's':
+            data_sz = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: bhd_ring_bench [-n <records>] "
+                            "[-l <payload-len>] [-s <data-size>]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.payload_len < 0 || cfg.payload_len > UINT16_MAX) {
+        fprintf(stderr, "invalid payload length\n");
+        return EXIT_FAILURE;
+    }
+
+    map_sz = BHD_RING_DATA_OFF + data_sz;
+    memfd = memfd_create("bhd_ring_bench", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, map_sz) != 0) {
+        perror("memfd");
+        return EXIT_FAILURE;
+    }
+
+    /* Map the ring twice, as the daemon and a client would. */
+    base = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED || bhd_ring_init(&cfg.ring, base, map_sz) != 0) {
+        fprintf(stderr, "invalid ring size\n");
+        return EXIT_FAILURE;
+    }
+
+    base = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED || bhd_ring_attach(&ring, base, map_sz) != 0) {
+        fprintf(stderr, "failed to attach to ring\n");
+        return EXIT_FAILURE;
+    }
+
+    received = 0;
+    sum_lat_us = 0;
+    max_lat_us = 0;
+    start_us = bhd_ring_now_us();
+
+    pthread_create(&thread, NULL, producer, &cfg);
+
+    while (received < cfg.num_recs) {
+        rec = bhd_ring_peek(&ring);
+        if (rec == NULL) {
+            bhd_ring_wait(&ring, &tmo);
+            continue;
+        }
+
+        now_us = bhd_ring_now_us();
+        sum_lat_us += now_us - rec->timestamp_us;
+        if (now_us - rec->timestamp_us > max_lat_us) {
+            max_lat_us = now_us - rec->timestamp_us;
+        }
+
+        received++;
+        bhd_ring_consume(&ring, rec);
+    }
+
+    secs = (bhd_ring_now_us() - start_us) / 1e6;
+    pthread_join(thread, NULL);
+
+    printf("records:     %" PRIu64 " x %d bytes\n",
+           received, cfg.payload_len);
+    printf("elapsed:     %.3f s\n", secs);
+    printf("throughput:  %.0f records/s, %.1f MB/s of payload\n",
+           received / secs, received * cfg.payload_len / secs / 1e6);
+    printf("latency:     avg %.1f us, max %" PRIu64 " us\n",
+           (double)sum_lat_us / received, max_lat_us);
+    printf("ring full:   %" PRIu64 " times\n", cfg.num_full);
+
+    return EXIT_SUCCESS;
+}
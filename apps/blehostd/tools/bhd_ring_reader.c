@@ -0,0 +1,286 @@
+/**
+ * Reference consumer for the blehostd shared-memory event ring.
+ *
+ * Connects to a blehostd that is listening for clients (-l), hands it a
+ * memfd-backed ring with a ring_open request, and prints each notify_rx and
+ * scan record that arrives in the ring.  All other traffic stays on the
+ * socket; this reader simply discards it.
+ *
+ * Build:
+ *     cc -O2 -Wall -I../src -o bhd_ring_reader bhd_ring_reader.c
+ *
+ * Usage:
+ *     bhd_ring_reader [-p] [-q] [-s <data-size>] <socket-path>
+ *         -p: The daemon was started with -p (SOCK_SEQPACKET).
+ *         -q: Only print a summary once per second.
+ *         -s: Size of the ring's record buffer; a power of two (default
+ *             1048576).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bhd_ring_shm.h"
+
+static const char ring_open_req[] =
+    "{\"op\":\"request\",\"type\":\"ring_open\",\"seq\":1}";
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: bhd_ring_reader [-p] [-q] [-s <data-size>] "
+            "<socket-path>\n");
+    exit(EXIT_FAILURE);
+}
+
+static int
+connect_daemon(const char *path, int seqpacket)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Sends the ring_open request with the memfd attached.  In stream mode the
+ * request is preceded by its 16-bit length header.
+ */
+static int
+send_ring_open(int sock, int memfd, int seqpacket)
+{
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof (int))];
+    } cmsg_buf;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov[2];
+    uint16_t len;
+
+    len = htons(sizeof ring_open_req - 1);
+
+    memset(&msg, 0, sizeof msg);
+    if (seqpacket) {
+        iov[0].iov_base = (void *)ring_open_req;
+        iov[0].iov_len = sizeof ring_open_req - 1;
+        msg.msg_iovlen = 1;
+    } else {
+        iov[0].iov_base = &len;
+        iov[0].iov_len = sizeof len;
+        iov[1].iov_base = (void *)ring_open_req;
+        iov[1].iov_len = sizeof ring_open_req - 1;
+        msg.msg_iovlen = 2;
+    }
+    msg.msg_iov = iov;
+
+    msg.msg_control = cmsg_buf.buf;
+    msg.msg_controllen = sizeof cmsg_buf.buf;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof memfd);
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof memfd);
+
+    return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+/** Reads and discards whatever the daemon has sent on the socket. */
+static int
+drain_socket(int sock, int verbose)
+{
+    uint8_t buf[4096];
+    ssize_t n;
+
+    while (1) {
+        n = recv(sock, buf, sizeof buf, MSG_DONTWAIT);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (verbose) {
+            printf("socket: %.*s\n", (int)n, (const char *)buf);
+        }
+    }
+}
+
+static void
+print_rec(const struct bhd_ring_rec *rec)
+{
+    int i;
+
+    switch (rec->type) {
+    case BHD_RING_REC_NOTIFY_RX:
+        printf("%" PRIu64 " notify_rx conn=%u attr=%u%s len=%u:",
+               rec->timestamp_us,
+               rec->notify_rx.conn_handle, rec->notify_rx.attr_handle,
+               rec->flags & BHD_RING_F_INDICATION ? " (ind)" : "",
+               rec->data_len);
+        break;
+
+    case BHD_RING_REC_SCAN:
+        printf("%" PRIu64 " scan addr=%02x:%02x:%02x:%02x:%02x:%02x/%u "
+               "rssi=%d type=%u len=%u:",
+               rec->timestamp_us,
+               rec->scan.addr[5], rec->scan.addr[4], rec->scan.addr[3],
+               rec->scan.addr[2], rec->scan.addr[1], rec->scan.addr[0],
+               rec->scan.addr_type, rec->scan.rssi, rec->scan.event_type,
+               rec->data_len);
+        break;
+
+    default:
+        printf("unknown record type %u\n", rec->type);
+        return;
+    }
+
+    for (i = 0; i < rec->data_len; i++) {
+        printf(" %02x", rec->data[i]);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct bhd_ring_rec *rec;
+    struct timespec tmo = { 0, 100 * 1000 * 1000 };
+    struct bhd_ring ring;
+    uint64_t num_recs;
+    uint64_t num_bytes;
+    uint64_t last_report;
+    uint64_t now;
+    size_t data_sz;
+    size_t map_sz;
+    void *base;
+    int seqpacket;
+    int quiet;
+    int memfd;
+    int sock;
+    int opt;
+
+    seqpacket = 0;
+    quiet = 0;
+    data_sz = 1 << 20;
+
+    while ((opt = getopt(argc, argv, "pqs:")) != -1) {
+        switch (opt) {
+        case 'p':
+            seqpacket = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 's':
+            data_sz = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+    }
+
+    map_sz = BHD_RING_DATA_OFF + data_sz;
+
+    sock = connect_daemon(argv[optind], seqpacket);
+    if (sock < 0) {
+        perror("connect");
+        return EXIT_FAILURE;
+    }
+
+    memfd = memfd_create("bhd_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, map_sz) != 0) {
+        perror("memfd");
+        return EXIT_FAILURE;
+    }
+
+    /* blehostd only maps a ring whose size cannot change under it. */
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+
+    base = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    if (send_ring_open(sock, memfd, seqpacket) != 0) {
+        perror("sendmsg");
+        return EXIT_FAILURE;
+    }
+    close(memfd);
+
+    /* The daemon initializes the ring before it responds. */
+    while (bhd_ring_attach(&ring, base, map_sz) != 0) {
+        if (poll(&(struct pollfd){ .fd = sock, .events = POLLIN }, 1,
+                 5000) <= 0 || drain_socket(sock, 1) != 0) {
+
+            fprintf(stderr, "ring_open failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    num_recs = 0;
+    num_bytes = 0;
+    last_report = bhd_ring_now_us();
+
+    while (1) {
+        while ((rec = bhd_ring_peek(&ring)) != NULL) {
+            if (!quiet) {
+                print_rec(rec);
+            }
+            num_recs++;
+            num_bytes += rec->data_len;
+            bhd_ring_consume(&ring, rec);
+        }
+
+        if (drain_socket(sock, !quiet) != 0) {
+            fprintf(stderr, "daemon closed the connection\n");
+            return EXIT_SUCCESS;
+        }
+
+        now = bhd_ring_now_us();
+        if (quiet && now - last_report >= 1000000) {
+            printf("records=%" PRIu64 " bytes=%" PRIu64 " dropped=%" PRIu64
+                   "\n", num_recs, num_bytes,
+                   __atomic_load_n(&ring.hdr->num_dropped, __ATOMIC_RELAXED));
+            fflush(stdout);
+            last_report = now;
+        }
+
+        bhd_ring_wait(&ring, &tmo);
+    }
+}